@@ -0,0 +1,774 @@
+#include "../src/Infinario.h"
+#include "../src/InfinarioJson.h"
+#include "Benchmark.h"
+#include "Loopback.h"
+
+#include "s3e.h"
+#include "s3eMemory.h"
+#include "s3eThread.h"
+#include "s3eTimer.h"
+
+#include <deque>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+BenchmarkState::BenchmarkState(const uint64 iterations)
+: _iterations(iterations)
+, _startTime(0)
+, _elapsedTime(0)
+, _isRunning(false)
+, _itemsProcessed(0)
+, _bytesProcessed(0)
+, _counters()
+{}
+
+uint64 BenchmarkState::GetIterations() const
+{
+	return this->_iterations;
+}
+
+void BenchmarkState::PauseTiming()
+{
+	this->Stop();
+}
+
+void BenchmarkState::ResumeTiming()
+{
+	this->Start();
+}
+
+void BenchmarkState::SetItemsProcessed(const uint64 itemsProcessed)
+{
+	this->_itemsProcessed = itemsProcessed;
+}
+
+void BenchmarkState::SetBytesProcessed(const uint64 bytesProcessed)
+{
+	this->_bytesProcessed = bytesProcessed;
+}
+
+void BenchmarkState::SetCounter(const std::string &name, const double value)
+{
+	this->_counters.push_back(std::make_pair(name, value));
+}
+
+int64 BenchmarkState::GetElapsedTime() const
+{
+	return this->_elapsedTime;
+}
+
+uint64 BenchmarkState::GetItemsProcessed() const
+{
+	return this->_itemsProcessed;
+}
+
+uint64 BenchmarkState::GetBytesProcessed() const
+{
+	return this->_bytesProcessed;
+}
+
+const std::vector<std::pair<std::string, double> > &BenchmarkState::GetCounters() const
+{
+	return this->_counters;
+}
+
+void BenchmarkState::Start()
+{
+	if (!this->_isRunning) {
+		this->_isRunning = true;
+		this->_startTime = s3eTimerGetUST();
+	}
+}
+
+void BenchmarkState::Stop()
+{
+	if (this->_isRunning) {
+		this->_isRunning = false;
+		this->_elapsedTime += s3eTimerGetUST() - this->_startTime;
+	}
+}
+
+const int64 Benchmark::_minTime = 500;
+
+Benchmark::Benchmark(const std::string &name, BenchmarkFunction function, const uint64 iterations)
+: _name(name)
+, _function(function)
+, _iterations(iterations)
+{}
+
+void Benchmark::Run(std::stringstream &jsonStream) const
+{
+	uint64 iterations = (this->_iterations > 0) ? this->_iterations : 1;
+	for (;;) {
+		BenchmarkState state(iterations);
+
+		state.Start();
+		this->_function(state);
+		state.Stop();
+
+		// Repeat with more iterations until the measured time is long enough, unless the iterations are fixed.
+		if ((this->_iterations == 0) && (state.GetElapsedTime() < Benchmark::_minTime) && (iterations < 1000000000)) {
+			iterations *= 10;
+			continue;
+		}
+
+		// Times are reported in nanoseconds per iteration, as Google Benchmark does.
+		const double elapsedSeconds = static_cast<double>(state.GetElapsedTime()) / 1000.0;
+		jsonStream << std::fixed << std::setprecision(3) <<
+			"    {\n"
+			"      \"name\": \"" << Infinario::EscapeJson(this->_name) << "\",\n"
+			"      \"iterations\": " << iterations << ",\n"
+			"      \"real_time\": " << (elapsedSeconds * 1e9 / static_cast<double>(iterations)) << ",\n"
+			"      \"time_unit\": \"ns\"";
+		if ((state.GetItemsProcessed() > 0) && (elapsedSeconds > 0.0)) {
+			jsonStream << ",\n      \"items_per_second\": "
+				<< (static_cast<double>(state.GetItemsProcessed()) / elapsedSeconds);
+		}
+		if ((state.GetBytesProcessed() > 0) && (elapsedSeconds > 0.0)) {
+			jsonStream << ",\n      \"bytes_per_second\": "
+				<< (static_cast<double>(state.GetBytesProcessed()) / elapsedSeconds);
+		}
+		for (std::vector<std::pair<std::string, double> >::const_iterator it = state.GetCounters().begin(),
+			end = state.GetCounters().end(); it != end; ++it)
+		{
+			jsonStream << ",\n      \"" << Infinario::EscapeJson(it->first) << "\": " << it->second;
+		}
+		jsonStream << "\n    }";
+		return;
+	}
+}
+
+const std::string &Benchmark::GetName() const
+{
+	return this->_name;
+}
+
+// Benchmark Parameters.
+
+#define BENCHMARK_PROJECT_TOKEN "benchmark_project_token"
+#define BENCHMARK_CUSTOMER_ID "benchmark@example.com"
+
+// A latency long enough for the first request to stay in flight while the benchmark fills up the queue behind it.
+#define BENCHMARK_STALLED_LATENCY 3600000
+
+// A latency long enough for the first request to stay in flight while a backlog is queued, but which still ends.
+#define BENCHMARK_BACKLOG_LATENCY 2000
+
+const std::string benchmarkProjectToken(BENCHMARK_PROJECT_TOKEN);
+const std::string benchmarkCustomerId(BENCHMARK_CUSTOMER_ID);
+
+const std::string shortAttributes("{ \"level\": 11, \"experience_points\": 1500 }");
+const std::string longAttributes("{ \"quest\": \"dragon\", \"loot\": [\"sword\", \"shield\", \"potion\"], "
+	"\"location\": { \"zone\": \"Green Hill\", \"x\": 1021.5, \"y\": -44.25 }, \"party\": 4, \"hardcore\": false, "
+	"\"description\": \"At vero eos et accusamus et iusto odio dignissimos ducimus qui blanditiis praesentium\" }");
+
+// Helper functions.
+
+void SetFlagCallback(void *userData)
+{
+	*(reinterpret_cast<bool *>(userData)) = true;
+}
+
+void ResumeTimingCallback(const CIwHTTP *httpClient, const std::string &request,
+	const Infinario::ResponseStatus responseStatus, const std::string &response, void *userData)
+{
+	reinterpret_cast<BenchmarkState *>(userData)->ResumeTiming();
+}
+
+// Builds a queued track request laid out the way Infinario::TrackAt builds it.
+Infinario::Request MakeTrackRequest(const std::string &attributes, const int64 timestamp)
+{
+	char formattedTimestamp[Infinario::TimestampSource::_maxFormattedLength + 1];
+	const uint32 formattedTimestampLength = Infinario::TimestampSource::Format(timestamp, formattedTimestamp);
+
+	std::string command("{ \"name\": \"crm/events\", \"data\": { ");
+	const uint32 identityOffset = static_cast<uint32>(command.size());
+	command.append("\"customer_ids\": { \"registered\": \"").append(benchmarkCustomerId).append("\"  }, "
+		"\"project_id\": \"").append(benchmarkProjectToken).append("\"");
+	const uint32 identityLength = static_cast<uint32>(command.size()) - identityOffset;
+	command.append(", \"timestamp\": ").append(formattedTimestamp, formattedTimestampLength).append(", ");
+	const uint32 eventOffset = static_cast<uint32>(command.size());
+	command.append("\"type\": \"encode\", \"properties\": ").append(attributes).append("}}");
+
+	Infinario::Request request("/bulk", command, NULL, NULL);
+	request._identityOffset = identityOffset;
+	request._identityLength = identityLength;
+	request._eventOffset = eventOffset;
+	request._timestamp = timestamp;
+	return request;
+}
+
+// Processes Marmalade timers and callbacks until the flag is set.
+void YieldUntil(const bool &flag)
+{
+	while (!flag) {
+		s3eDeviceYield(0);
+	}
+}
+
+// Benchmarks.
+
+void BenchmarkEscapeJsonShort(BenchmarkState &state)
+{
+	const std::string input("player_died");
+	for (uint64 i = 0, count = state.GetIterations(); i < count; ++i) {
+		Infinario::EscapeJson(input);
+	}
+	state.SetBytesProcessed(state.GetIterations() * input.size());
+}
+
+void BenchmarkEscapeJsonLong(BenchmarkState &state)
+{
+	for (uint64 i = 0, count = state.GetIterations(); i < count; ++i) {
+		Infinario::EscapeJson(longAttributes);
+	}
+	state.SetBytesProcessed(state.GetIterations() * longAttributes.size());
+}
+
+void BenchmarkValidateJsonShort(BenchmarkState &state)
+{
+	for (uint64 i = 0, count = state.GetIterations(); i < count; ++i) {
+		Infinario::ValidateJsonObject(shortAttributes.data(), static_cast<uint32>(shortAttributes.size()));
+	}
+	state.SetBytesProcessed(state.GetIterations() * shortAttributes.size());
+}
+
+void BenchmarkValidateJsonLong(BenchmarkState &state)
+{
+	for (uint64 i = 0, count = state.GetIterations(); i < count; ++i) {
+		Infinario::ValidateJsonObject(longAttributes.data(), static_cast<uint32>(longAttributes.size()));
+	}
+	state.SetBytesProcessed(state.GetIterations() * longAttributes.size());
+}
+
+void BenchmarkTimestampUtcStream(BenchmarkState &state)
+{
+	// The way event times were obtained and written before the timestamp source was introduced, for comparison.
+	for (uint64 i = 0, count = state.GetIterations(); i < count; ++i) {
+		std::stringstream timestampStream;
+		timestampStream << std::setprecision(3) << std::fixed << (static_cast<double>(s3eTimerGetUTC()) / 1000.0);
+		timestampStream.str();
+	}
+	state.SetItemsProcessed(state.GetIterations());
+}
+
+void BenchmarkTimestampSource(BenchmarkState &state)
+{
+	Infinario::TimestampSource timestampSource;
+	char formattedTimestamp[Infinario::TimestampSource::_maxFormattedLength + 1];
+
+	for (uint64 i = 0, count = state.GetIterations(); i < count; ++i) {
+		Infinario::TimestampSource::Format(timestampSource.GetTime(), formattedTimestamp);
+	}
+	state.SetItemsProcessed(state.GetIterations());
+}
+
+void BenchmarkConstruct(BenchmarkState &state)
+{
+	LoopbackServer server;
+
+	// Measures constructing an instance for an anonymous player, the customer cookie is prepared in the background by
+	// the first instance only.
+	for (uint64 i = 0, count = state.GetIterations(); i < count; ++i) {
+		Infinario::Infinario infinario(benchmarkProjectToken, std::string(), new LoopbackTransport(server));
+	}
+}
+
+void BenchmarkTrack(BenchmarkState &state)
+{
+	LoopbackServer server;
+	server.SetLatency(BENCHMARK_STALLED_LATENCY);
+	Infinario::Infinario infinario(benchmarkProjectToken, benchmarkCustomerId, new LoopbackTransport(server));
+
+	// Measures building the command body and queueing it while a request is in flight.
+	for (uint64 i = 0, count = state.GetIterations(); i < count; ++i) {
+		infinario.Track("player_died", shortAttributes, 1449008100.0);
+	}
+	state.SetItemsProcessed(state.GetIterations());
+
+	state.PauseTiming();
+}
+
+void BenchmarkTrackInternedName(BenchmarkState &state)
+{
+	LoopbackServer server;
+	server.SetLatency(BENCHMARK_STALLED_LATENCY);
+	Infinario::Infinario infinario(benchmarkProjectToken, benchmarkCustomerId, new LoopbackTransport(server));
+
+	const Infinario::NameHandle eventName = infinario.RegisterName("player_died");
+	for (uint64 i = 0, count = state.GetIterations(); i < count; ++i) {
+		infinario.Track(eventName, shortAttributes, 1449008100.0);
+	}
+	state.SetItemsProcessed(state.GetIterations());
+
+	state.PauseTiming();
+}
+
+void BenchmarkTrackWithoutTimestamp(BenchmarkState &state)
+{
+	LoopbackServer server;
+	server.SetLatency(BENCHMARK_STALLED_LATENCY);
+	Infinario::Infinario infinario(benchmarkProjectToken, benchmarkCustomerId, new LoopbackTransport(server));
+
+	for (uint64 i = 0, count = state.GetIterations(); i < count; ++i) {
+		infinario.Track("player_died", shortAttributes);
+	}
+	state.SetItemsProcessed(state.GetIterations());
+
+	state.PauseTiming();
+}
+
+void BenchmarkTrackSampledOut(BenchmarkState &state)
+{
+	LoopbackServer server;
+	server.SetLatency(BENCHMARK_STALLED_LATENCY);
+	Infinario::Infinario infinario(benchmarkProjectToken, benchmarkCustomerId, new LoopbackTransport(server));
+	infinario.SetEventSampling("frame_time", 0);
+
+	// Measures dropping an event by its name passed as a string, which is neither escaped nor timestamped.
+	for (uint64 i = 0, count = state.GetIterations(); i < count; ++i) {
+		infinario.Track("frame_time", shortAttributes);
+	}
+	state.SetItemsProcessed(state.GetIterations());
+
+	state.PauseTiming();
+}
+
+typedef struct ContentionThreadData
+{
+	Infinario::Infinario *infinario;
+	uint64 eventCount;
+	volatile bool isDone;
+	uint64 statsCount;
+} ContentionThreadData;
+
+void *ContentionThread(void *userData)
+{
+	ContentionThreadData *data = reinterpret_cast<ContentionThreadData *>(userData);
+	for (uint64 i = 0; i < data->eventCount; ++i) {
+		data->infinario->Track("contended", shortAttributes, 1449008100.0);
+	}
+	return NULL;
+}
+
+void *StatsPollingThread(void *userData)
+{
+	ContentionThreadData *data = reinterpret_cast<ContentionThreadData *>(userData);
+	while (!data->isDone) {
+		data->infinario->GetStats();
+		++data->statsCount;
+	}
+	return NULL;
+}
+
+void BenchmarkTrackContended(BenchmarkState &state, const uint32 threadCount, const bool isPollingStats)
+{
+	state.PauseTiming();
+
+	LoopbackServer server;
+	server.SetLatency(BENCHMARK_STALLED_LATENCY);
+	Infinario::Infinario infinario(benchmarkProjectToken, benchmarkCustomerId, new LoopbackTransport(server));
+
+	// Put a request in flight from the main thread, so the worker threads only enqueue.
+	infinario.Track("contended", shortAttributes, 1449008100.0);
+
+	ContentionThreadData data;
+	data.infinario = &infinario;
+	data.eventCount = state.GetIterations() / threadCount + 1;
+	data.isDone = false;
+	data.statsCount = 0;
+
+	std::vector<s3eThread *> threads;
+
+	// Optionally a monitoring thread reads the statistics as fast as it can while the events are tracked.
+	s3eThread *statsThread = isPollingStats
+		? s3eThreadCreate(StatsPollingThread, reinterpret_cast<void *>(&data)) : NULL;
+
+	state.ResumeTiming();
+
+	for (uint32 i = 0; i < threadCount; ++i) {
+		threads.push_back(s3eThreadCreate(ContentionThread, reinterpret_cast<void *>(&data)));
+	}
+	for (std::vector<s3eThread *>::iterator it = threads.begin(), end = threads.end(); it != end; ++it) {
+		s3eThreadJoin(*it);
+	}
+
+	state.PauseTiming();
+
+	data.isDone = true;
+	if (statsThread != NULL) {
+		s3eThreadJoin(statsThread);
+		state.SetCounter("stats_reads", static_cast<double>(data.statsCount));
+	}
+
+	state.SetItemsProcessed(data.eventCount * threadCount);
+}
+
+void BenchmarkTrackContended2(BenchmarkState &state)
+{
+	BenchmarkTrackContended(state, 2, false);
+}
+
+void BenchmarkTrackContended4(BenchmarkState &state)
+{
+	BenchmarkTrackContended(state, 4, false);
+}
+
+void BenchmarkTrackContendedPollingStats(BenchmarkState &state)
+{
+	BenchmarkTrackContended(state, 2, true);
+}
+
+void BenchmarkEndToEnd(BenchmarkState &state, const uint32 latency, const uint32 lossRate)
+{
+	state.PauseTiming();
+
+	LoopbackServer server;
+	server.SetLatency(latency);
+	server.SetLossRate(lossRate);
+	Infinario::Infinario infinario(benchmarkProjectToken, benchmarkCustomerId, new LoopbackTransport(server));
+
+	bool isQueueEmpty = false;
+	infinario.SetEmptyRequestQueueCallback(SetFlagCallback, reinterpret_cast<void *>(&isQueueEmpty));
+
+	state.ResumeTiming();
+
+	for (uint64 i = 0, count = state.GetIterations(); i < count; ++i) {
+		infinario.Track("end_to_end", shortAttributes, 1449008100.0);
+	}
+	YieldUntil(isQueueEmpty);
+
+	state.PauseTiming();
+
+	infinario.ClearEmptyRequestQueueCallback();
+
+	state.SetItemsProcessed(state.GetIterations());
+	state.SetBytesProcessed(server.GetRecievedByteCount());
+	state.SetCounter("requests", static_cast<double>(server.GetRequestCount()));
+	state.SetCounter("delivered_events", static_cast<double>(server.GetCommandCount()));
+	state.SetCounter("final_batch_size", static_cast<double>(infinario.GetBatchEstimates()._batchSize));
+
+	const Infinario::Statistics statistics(infinario.GetStats());
+	state.SetCounter("latency_p50_ms", static_cast<double>(statistics._enqueueToAckLatency.GetPercentile(50.0)));
+	state.SetCounter("latency_p99_ms", static_cast<double>(statistics._enqueueToAckLatency.GetPercentile(99.0)));
+	state.SetCounter("queue_high_water_mark", static_cast<double>(statistics._queueHighWaterMark));
+}
+
+void BenchmarkEndToEndLowLatency(BenchmarkState &state)
+{
+	BenchmarkEndToEnd(state, 5, 0);
+}
+
+void BenchmarkEndToEndHighLatency(BenchmarkState &state)
+{
+	BenchmarkEndToEnd(state, 500, 0);
+}
+
+void BenchmarkEndToEndLossy(BenchmarkState &state)
+{
+	BenchmarkEndToEnd(state, 100, 10);
+}
+
+void BenchmarkDrain(BenchmarkState &state, const uint32 threadCount)
+{
+	state.PauseTiming();
+
+	LoopbackServer server;
+	Infinario::Infinario infinario(benchmarkProjectToken, benchmarkCustomerId, new LoopbackTransport(server));
+	if (threadCount != 1) {
+		infinario.SetParallelDrain(threadCount);
+	}
+
+	bool isQueueEmpty = false;
+	infinario.SetEmptyRequestQueueCallback(SetFlagCallback, reinterpret_cast<void *>(&isQueueEmpty));
+
+	// Build up a backlog behind a slow request, as if the device was offline, then drain it without latency. The
+	// timing starts when the slow request's response arrives.
+	server.SetLatency(BENCHMARK_BACKLOG_LATENCY);
+	infinario.Track("drain", longAttributes, 1449008100.0, ResumeTimingCallback, reinterpret_cast<void *>(&state));
+	for (uint64 i = 1, count = state.GetIterations(); i < count; ++i) {
+		infinario.Track("drain", longAttributes, 1449008100.0);
+	}
+	server.SetLatency(0);
+
+	YieldUntil(isQueueEmpty);
+
+	state.PauseTiming();
+
+	infinario.ClearEmptyRequestQueueCallback();
+
+	state.SetItemsProcessed(state.GetIterations());
+	state.SetBytesProcessed(server.GetRecievedByteCount());
+	state.SetCounter("threads", static_cast<double>((threadCount > 0) ? threadCount
+		: s3eDeviceGetInt(S3E_DEVICE_NUM_CPU_CORES)));
+	state.SetCounter("requests", static_cast<double>(server.GetRequestCount()));
+}
+
+void BenchmarkDrainSerial(BenchmarkState &state)
+{
+	BenchmarkDrain(state, 1);
+}
+
+void BenchmarkDrain2(BenchmarkState &state)
+{
+	BenchmarkDrain(state, 2);
+}
+
+void BenchmarkDrain4(BenchmarkState &state)
+{
+	BenchmarkDrain(state, 4);
+}
+
+void BenchmarkDrainAllCores(BenchmarkState &state)
+{
+	BenchmarkDrain(state, 0);
+}
+
+void BenchmarkEnvelope(BenchmarkState &state, const Infinario::BulkFormat format, const std::string &attributes)
+{
+	state.PauseTiming();
+
+	LoopbackServer server;
+	server.SetLatency(5);
+	Infinario::Infinario infinario(benchmarkProjectToken, benchmarkCustomerId, new LoopbackTransport(server));
+	infinario.SetBulkFormat(format);
+
+	bool isQueueEmpty = false;
+	infinario.SetEmptyRequestQueueCallback(SetFlagCallback, reinterpret_cast<void *>(&isQueueEmpty));
+
+	state.ResumeTiming();
+
+	// Events are a few hundred milliseconds apart, as a game tracks them.
+	for (uint64 i = 0, count = state.GetIterations(); i < count; ++i) {
+		infinario.Track("envelope", attributes, 1449008100.0 + static_cast<double>(i) * 0.237);
+	}
+	YieldUntil(isQueueEmpty);
+
+	state.PauseTiming();
+
+	infinario.ClearEmptyRequestQueueCallback();
+
+	state.SetItemsProcessed(state.GetIterations());
+	state.SetBytesProcessed(server.GetRecievedByteCount());
+	state.SetCounter("bytes_per_event",
+		static_cast<double>(server.GetRecievedByteCount()) / static_cast<double>(server.GetCommandCount()));
+	state.SetCounter("requests", static_cast<double>(server.GetRequestCount()));
+}
+
+void BenchmarkEnvelopeJsonShort(BenchmarkState &state)
+{
+	BenchmarkEnvelope(state, Infinario::BulkFormat::Json, shortAttributes);
+}
+
+void BenchmarkEnvelopeCompactShort(BenchmarkState &state)
+{
+	BenchmarkEnvelope(state, Infinario::BulkFormat::Compact, shortAttributes);
+}
+
+void BenchmarkEnvelopeJsonLong(BenchmarkState &state)
+{
+	BenchmarkEnvelope(state, Infinario::BulkFormat::Json, longAttributes);
+}
+
+void BenchmarkEnvelopeCompactLong(BenchmarkState &state)
+{
+	BenchmarkEnvelope(state, Infinario::BulkFormat::Compact, longAttributes);
+}
+
+void BenchmarkEncode(BenchmarkState &state, const Infinario::BulkFormat format, const std::string &attributes)
+{
+	// A full batch of events a few hundred milliseconds apart.
+	static const uint32 batchSize = 64;
+	Infinario::RequestQueue requests;
+	for (uint32 i = 0; i < batchSize; ++i) {
+		requests.PushBack(MakeTrackRequest(attributes, 1449008100000ll + i * 237), 0);
+	}
+
+	std::string body;
+	for (uint64 i = 0, count = state.GetIterations(); i < count; ++i) {
+		Infinario::BulkEncoder::Encode(format, requests, 0, batchSize, body);
+	}
+
+	state.SetItemsProcessed(state.GetIterations() * batchSize);
+	state.SetBytesProcessed(state.GetIterations() * body.size());
+	state.SetCounter("bytes_per_event", static_cast<double>(body.size()) / batchSize);
+}
+
+void BenchmarkEncodeJsonShort(BenchmarkState &state)
+{
+	BenchmarkEncode(state, Infinario::BulkFormat::Json, shortAttributes);
+}
+
+void BenchmarkEncodeCompactShort(BenchmarkState &state)
+{
+	BenchmarkEncode(state, Infinario::BulkFormat::Compact, shortAttributes);
+}
+
+void BenchmarkEncodeMessagePackShort(BenchmarkState &state)
+{
+	BenchmarkEncode(state, Infinario::BulkFormat::MessagePack, shortAttributes);
+}
+
+void BenchmarkEncodeJsonLong(BenchmarkState &state)
+{
+	BenchmarkEncode(state, Infinario::BulkFormat::Json, longAttributes);
+}
+
+void BenchmarkEncodeCompactLong(BenchmarkState &state)
+{
+	BenchmarkEncode(state, Infinario::BulkFormat::Compact, longAttributes);
+}
+
+void BenchmarkEncodeMessagePackLong(BenchmarkState &state)
+{
+	BenchmarkEncode(state, Infinario::BulkFormat::MessagePack, longAttributes);
+}
+
+// The number of events a device stays offline with, the scans touch all of them.
+const uint32 queueScanEventCount = 100000;
+
+void BenchmarkQueueExpireScanDeque(BenchmarkState &state)
+{
+	state.PauseTiming();
+
+	// The layout the queue had before it was stored by columns.
+	std::deque<Infinario::Request> requests;
+	for (uint32 i = 0; i < queueScanEventCount; ++i) {
+		requests.push_back(MakeTrackRequest(shortAttributes, 1449008100000ll + i * 237));
+		requests.back()._timeToLive = 60000;
+		requests.back()._enqueueTime = i;
+	}
+
+	state.ResumeTiming();
+
+	uint32 expiredCount = 0;
+	for (uint64 i = 0, count = state.GetIterations(); i < count; ++i) {
+		const int64 now = static_cast<int64>(i % 1000);
+		for (std::deque<Infinario::Request>::const_iterator it = requests.begin(), end = requests.end(); it != end;
+			++it)
+		{
+			if ((it->_timeToLive != 0) && ((now - it->_enqueueTime) >= it->_timeToLive)) {
+				++expiredCount;
+				break;
+			}
+		}
+	}
+
+	state.PauseTiming();
+
+	state.SetItemsProcessed(state.GetIterations() * queueScanEventCount);
+	state.SetCounter("expired_scans", static_cast<double>(expiredCount));
+}
+
+void BenchmarkQueueExpireScanColumnar(BenchmarkState &state)
+{
+	state.PauseTiming();
+
+	Infinario::RequestQueue requests;
+	for (uint32 i = 0; i < queueScanEventCount; ++i) {
+		Infinario::Request request(MakeTrackRequest(shortAttributes, 1449008100000ll + i * 237));
+		request._timeToLive = 60000;
+		requests.PushBack(request, i);
+	}
+
+	state.ResumeTiming();
+
+	uint32 expiredCount = 0;
+	for (uint64 i = 0, count = state.GetIterations(); i < count; ++i) {
+		if (requests.FindExpired(0, queueScanEventCount, static_cast<int64>(i % 1000)) != queueScanEventCount) {
+			++expiredCount;
+		}
+	}
+
+	state.PauseTiming();
+
+	state.SetItemsProcessed(state.GetIterations() * queueScanEventCount);
+	state.SetCounter("expired_scans", static_cast<double>(expiredCount));
+}
+
+void BenchmarkQueuedEventMemory(BenchmarkState &state)
+{
+	state.PauseTiming();
+
+	LoopbackServer server;
+	server.SetLatency(BENCHMARK_STALLED_LATENCY);
+	Infinario::Infinario infinario(benchmarkProjectToken, benchmarkCustomerId, new LoopbackTransport(server));
+
+	// Put a request in flight, so all the following events stay queued.
+	infinario.Track("memory", shortAttributes, 1449008100.0);
+
+	const int32 memoryBefore = s3eMemoryGetInt(S3E_MEMORY_USED);
+	const uint64 queueBytesBefore = infinario.GetStats()._queueBytes;
+
+	state.ResumeTiming();
+
+	for (uint64 i = 0, count = state.GetIterations(); i < count; ++i) {
+		infinario.Track("memory", shortAttributes, 1449008100.0);
+	}
+
+	state.PauseTiming();
+
+	const int32 memoryAfter = s3eMemoryGetInt(S3E_MEMORY_USED);
+	const uint64 queueBytesAfter = infinario.GetStats()._queueBytes;
+
+	// The overhead is the memory taken on top of the commands themselves.
+	state.SetItemsProcessed(state.GetIterations());
+	state.SetCounter("bytes_per_queued_event",
+		static_cast<double>(memoryAfter - memoryBefore) / static_cast<double>(state.GetIterations()));
+	state.SetCounter("overhead_per_queued_event",
+		(static_cast<double>(memoryAfter - memoryBefore) - static_cast<double>(queueBytesAfter - queueBytesBefore))
+		/ static_cast<double>(state.GetIterations()));
+}
+
+void CreateBenchmarks(std::vector<Benchmark *> &benchmarks)
+{
+	benchmarks.push_back(new Benchmark("EscapeJson/short", BenchmarkEscapeJsonShort));
+	benchmarks.push_back(new Benchmark("EscapeJson/long", BenchmarkEscapeJsonLong));
+	benchmarks.push_back(new Benchmark("ValidateJson/short", BenchmarkValidateJsonShort));
+	benchmarks.push_back(new Benchmark("ValidateJson/long", BenchmarkValidateJsonLong));
+	benchmarks.push_back(new Benchmark("Timestamp/utc_iostream", BenchmarkTimestampUtcStream));
+	benchmarks.push_back(new Benchmark("Timestamp/cached_integer", BenchmarkTimestampSource));
+	benchmarks.push_back(new Benchmark("Infinario/construct", BenchmarkConstruct));
+	benchmarks.push_back(new Benchmark("Track/explicit_timestamp", BenchmarkTrack, 10000));
+	benchmarks.push_back(new Benchmark("Track/interned_name", BenchmarkTrackInternedName, 10000));
+	benchmarks.push_back(new Benchmark("Track/current_timestamp", BenchmarkTrackWithoutTimestamp, 10000));
+	benchmarks.push_back(new Benchmark("Track/sampled_out", BenchmarkTrackSampledOut, 10000));
+	if (s3eThreadAvailable()) {
+		benchmarks.push_back(new Benchmark("Enqueue/contended/threads:2", BenchmarkTrackContended2, 10000));
+		benchmarks.push_back(new Benchmark("Enqueue/contended/threads:4", BenchmarkTrackContended4, 10000));
+		benchmarks.push_back(new Benchmark("Enqueue/contended/threads:2/polling_stats",
+			BenchmarkTrackContendedPollingStats, 10000));
+	}
+	benchmarks.push_back(new Benchmark("EndToEnd/latency:5ms", BenchmarkEndToEndLowLatency, 2000));
+	benchmarks.push_back(new Benchmark("EndToEnd/latency:500ms", BenchmarkEndToEndHighLatency, 2000));
+	benchmarks.push_back(new Benchmark("EndToEnd/latency:100ms/loss:10%", BenchmarkEndToEndLossy, 2000));
+	benchmarks.push_back(new Benchmark("Drain/threads:1", BenchmarkDrainSerial, 20000));
+	if (s3eThreadAvailable()) {
+		benchmarks.push_back(new Benchmark("Drain/threads:2", BenchmarkDrain2, 20000));
+		benchmarks.push_back(new Benchmark("Drain/threads:4", BenchmarkDrain4, 20000));
+		benchmarks.push_back(new Benchmark("Drain/threads:cores", BenchmarkDrainAllCores, 20000));
+	}
+	benchmarks.push_back(new Benchmark("Envelope/json/short", BenchmarkEnvelopeJsonShort, 2000));
+	benchmarks.push_back(new Benchmark("Envelope/compact/short", BenchmarkEnvelopeCompactShort, 2000));
+	benchmarks.push_back(new Benchmark("Envelope/json/long", BenchmarkEnvelopeJsonLong, 2000));
+	benchmarks.push_back(new Benchmark("Envelope/compact/long", BenchmarkEnvelopeCompactLong, 2000));
+	benchmarks.push_back(new Benchmark("Encode/json/short", BenchmarkEncodeJsonShort));
+	benchmarks.push_back(new Benchmark("Encode/compact/short", BenchmarkEncodeCompactShort));
+	benchmarks.push_back(new Benchmark("Encode/messagepack/short", BenchmarkEncodeMessagePackShort));
+	benchmarks.push_back(new Benchmark("Encode/json/long", BenchmarkEncodeJsonLong));
+	benchmarks.push_back(new Benchmark("Encode/compact/long", BenchmarkEncodeCompactLong));
+	benchmarks.push_back(new Benchmark("Encode/messagepack/long", BenchmarkEncodeMessagePackLong));
+	benchmarks.push_back(new Benchmark("Queue/expire_scan/deque", BenchmarkQueueExpireScanDeque));
+	benchmarks.push_back(new Benchmark("Queue/expire_scan/columnar", BenchmarkQueueExpireScanColumnar));
+	benchmarks.push_back(new Benchmark("Memory/queued_event", BenchmarkQueuedEventMemory, 10000));
+}
+
+void DestroyBenchmarks(std::vector<Benchmark *> &benchmarks)
+{
+	for (std::vector<Benchmark *>::iterator it = benchmarks.begin(), end = benchmarks.end(); it != end; ++it) {
+		delete *it;
+	}
+}
@@ -0,0 +1,79 @@
+#ifndef INFINARIO_BENCHMARK_H
+#define INFINARIO_BENCHMARK_H
+
+#include "s3e.h"
+
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * State passed to a benchmark function. The function must perform GetIterations() iterations of the measured
+ * operation, the time spent between its start and end (excluding paused periods) is attributed to them.
+ */
+class BenchmarkState
+{
+public:
+	BenchmarkState(const uint64 iterations);
+
+	uint64 GetIterations() const;
+
+	void PauseTiming();
+	void ResumeTiming();
+
+	void SetItemsProcessed(const uint64 itemsProcessed);
+	void SetBytesProcessed(const uint64 bytesProcessed);
+
+	/**
+	 * Adds a user defined value to the benchmark's results (e.g. bytes per event).
+	 */
+	void SetCounter(const std::string &name, const double value);
+
+	int64 GetElapsedTime() const;
+	uint64 GetItemsProcessed() const;
+	uint64 GetBytesProcessed() const;
+	const std::vector<std::pair<std::string, double> > &GetCounters() const;
+private:
+	friend class Benchmark;
+
+	void Start();
+	void Stop();
+
+	uint64 _iterations;
+
+	int64 _startTime;
+	int64 _elapsedTime;
+	bool _isRunning;
+
+	uint64 _itemsProcessed;
+	uint64 _bytesProcessed;
+	std::vector<std::pair<std::string, double> > _counters;
+};
+
+typedef void(*BenchmarkFunction)(BenchmarkState &state);
+
+/**
+ * A single named benchmark. Unless a fixed number of iterations is given, the number of iterations is increased until
+ * the measured time is long enough to be reliable.
+ */
+class Benchmark
+{
+public:
+	Benchmark(const std::string &name, BenchmarkFunction function, const uint64 iterations = 0);
+
+	/**
+	 * Runs the benchmark and appends its results as a JSON object to the given stream.
+	 */
+	void Run(std::stringstream &jsonStream) const;
+
+	const std::string &GetName() const;
+private:
+	static const int64 _minTime;
+
+	std::string _name;
+	BenchmarkFunction _function;
+	uint64 _iterations;
+};
+
+#endif // INFINARIO_BENCHMARK_H
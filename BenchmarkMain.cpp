@@ -0,0 +1,61 @@
+#include "Benchmark.h"
+
+#include "s3e.h"
+#include "s3eDevice.h"
+#include "s3eFile.h"
+#include "s3eTimer.h"
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define BENCHMARK_OUTPUT_FILE "benchmark.json"
+
+void CreateBenchmarks(std::vector<Benchmark *> &benchmarks);
+void DestroyBenchmarks(std::vector<Benchmark *> &benchmarks);
+
+// Runs all benchmarks and writes the results in Google Benchmark's JSON format, so that results of different releases
+// can be compared using the same tools.
+int main()
+{
+	std::vector<Benchmark *> *benchmarks = new std::vector<Benchmark *>();
+	CreateBenchmarks(*benchmarks);
+
+	std::stringstream jsonStream;
+	jsonStream <<
+		"{\n"
+		"  \"context\": {\n"
+		"    \"date\": " << s3eTimerGetUTC() << ",\n"
+		"    \"num_cpus\": " << s3eDeviceGetInt(S3E_DEVICE_NUM_CPU_CORES) << ",\n"
+		"    \"os\": \"" << s3eDeviceGetString(S3E_DEVICE_OS) << " "
+			<< s3eDeviceGetString(S3E_DEVICE_OS_VERSION) << "\",\n"
+		"    \"architecture\": \"" << s3eDeviceGetString(S3E_DEVICE_ARCHITECTURE) << "\"\n"
+		"  },\n"
+		"  \"benchmarks\": [\n";
+
+	for (std::vector<Benchmark *>::iterator it = benchmarks->begin(), end = benchmarks->end(); it != end; ++it) {
+		if (it != benchmarks->begin()) {
+			jsonStream << ",\n";
+		}
+		(*it)->Run(jsonStream);
+
+		if (s3eDeviceCheckQuitRequest()) {
+			break;
+		}
+	}
+
+	jsonStream << "\n  ]\n}\n";
+
+	// Output results.
+	s3eFile* outputFile = s3eFileOpen(BENCHMARK_OUTPUT_FILE, "w");
+
+	std::string outputString(jsonStream.str());
+	s3eFileWrite(reinterpret_cast<const void *>(outputString.c_str()), outputString.size(), 1, outputFile);
+
+	s3eFileClose(outputFile);
+
+	DestroyBenchmarks(*benchmarks);
+	delete benchmarks;
+
+	return 0;
+}
@@ -0,0 +1,977 @@
+#include "Loopback.h"
+#include "../src/Infinario.h"
+
+#include "IwRandom.h"
+
+#include "s3e.h"
+#include "s3eTimer.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+LoopbackServer::LoopbackServer()
+: _latency(0)
+, _lossRate(0)
+, _stallRate(0)
+, _throttleRate(0)
+, _retryAfter(0)
+, _requestCount(0)
+, _commandCount(0)
+, _lostRequestCount(0)
+, _stalledRequestCount(0)
+, _throttledRequestCount(0)
+, _malformedRequestCount(0)
+, _unsupportedRequestCount(0)
+, _refusedRequestCount(0)
+, _duplicateCommandCount(0)
+, _recievedByteCount(0)
+, _isMessagePackSupported(true)
+, _isReachable(true)
+, _deduplicationWindow(65536)
+, _seenCommandIds()
+, _seenCommandIdOrder()
+{}
+
+LoopbackServer::~LoopbackServer()
+{}
+
+void LoopbackServer::SetLatency(const uint32 latency)
+{
+	this->_latency = latency;
+}
+
+uint32 LoopbackServer::GetLatency() const
+{
+	return this->_latency;
+}
+
+void LoopbackServer::SetLossRate(const uint32 lossRate)
+{
+	this->_lossRate = lossRate;
+}
+
+void LoopbackServer::SetReachable(const bool isReachable)
+{
+	this->_isReachable = isReachable;
+}
+
+bool LoopbackServer::Refuse()
+{
+	if (!this->_isReachable) {
+		++this->_refusedRequestCount;
+		return true;
+	}
+	return false;
+}
+
+void LoopbackServer::SetStallRate(const uint32 stallRate)
+{
+	this->_stallRate = stallRate;
+}
+
+bool LoopbackServer::Stall()
+{
+	if ((this->_stallRate > 0) && (IwRandMinMax(0, 100) < static_cast<int32>(this->_stallRate))) {
+		++this->_stalledRequestCount;
+		return true;
+	}
+	return false;
+}
+
+void LoopbackServer::SetThrottleRate(const uint32 throttleRate, const uint32 retryAfter)
+{
+	this->_throttleRate = throttleRate;
+	this->_retryAfter = retryAfter;
+}
+
+uint32 LoopbackServer::GetRetryAfter() const
+{
+	return this->_retryAfter;
+}
+
+bool LoopbackServer::Throttle()
+{
+	if ((this->_throttleRate > 0) && (IwRandMinMax(0, 100) < static_cast<int32>(this->_throttleRate))) {
+		++this->_throttledRequestCount;
+		return true;
+	}
+	return false;
+}
+
+void LoopbackServer::SetMessagePackSupport(const bool isSupported)
+{
+	this->_isMessagePackSupported = isSupported;
+}
+
+bool LoopbackServer::RejectFormat(const std::string &requestBody)
+{
+	if (!this->_isMessagePackSupported && LoopbackServer::IsMessagePack(requestBody)) {
+		++this->_unsupportedRequestCount;
+		return true;
+	}
+	return false;
+}
+
+void LoopbackServer::SetDeduplicationWindow(const uint32 deduplicationWindow)
+{
+	this->_deduplicationWindow = deduplicationWindow;
+	while (this->_seenCommandIdOrder.size() > deduplicationWindow) {
+		this->_seenCommandIds.erase(this->_seenCommandIdOrder.front());
+		this->_seenCommandIdOrder.pop_front();
+	}
+}
+
+bool LoopbackServer::HandleRequest(const std::string &uri, const std::string &requestBody, std::string &responseBody)
+{
+	++this->_requestCount;
+	this->_recievedByteCount += requestBody.size();
+
+	if ((this->_lossRate > 0) && (IwRandMinMax(0, 100) < static_cast<int32>(this->_lossRate))) {
+		++this->_lostRequestCount;
+		return false;
+	}
+
+	if ((uri.size() < 5) || (uri.compare(uri.size() - 5, 5, "/bulk") != 0)) {
+		responseBody.assign("{ \"errors\": [\"not found\"], \"success\": false }");
+		return true;
+	}
+
+	std::string decodedBody;
+	if (!LoopbackServer::Decode(requestBody, decodedBody)) {
+		++this->_malformedRequestCount;
+		responseBody.assign("{ \"errors\": [\"malformed request\"], \"success\": false }");
+		return true;
+	}
+
+	// Duplicates are acknowledged like the original commands, the SDK can't tell that its retry was unnecessary.
+	const uint32 commandCount = LoopbackServer::CountCommands(decodedBody);
+	const uint32 duplicateCommandCount = this->Deduplicate(decodedBody);
+	this->_commandCount += commandCount - duplicateCommandCount;
+	this->_duplicateCommandCount += duplicateCommandCount;
+
+	std::stringstream responseStream;
+	responseStream << "{ \"results\": [";
+	for (uint32 i = 0; i < commandCount; ++i) {
+		responseStream << ((i == 0) ? "" : ", ") << "{ \"status\": \"ok\" }";
+	}
+	responseStream << "], \"success\": true }";
+	responseBody = responseStream.str();
+	return true;
+}
+
+uint32 LoopbackServer::GetRequestCount() const
+{
+	return this->_requestCount;
+}
+
+uint32 LoopbackServer::GetCommandCount() const
+{
+	return this->_commandCount;
+}
+
+uint32 LoopbackServer::GetLostRequestCount() const
+{
+	return this->_lostRequestCount;
+}
+
+uint32 LoopbackServer::GetStalledRequestCount() const
+{
+	return this->_stalledRequestCount;
+}
+
+uint32 LoopbackServer::GetThrottledRequestCount() const
+{
+	return this->_throttledRequestCount;
+}
+
+uint32 LoopbackServer::GetMalformedRequestCount() const
+{
+	return this->_malformedRequestCount;
+}
+
+uint32 LoopbackServer::GetUnsupportedRequestCount() const
+{
+	return this->_unsupportedRequestCount;
+}
+
+uint32 LoopbackServer::GetRefusedRequestCount() const
+{
+	return this->_refusedRequestCount;
+}
+
+uint32 LoopbackServer::GetDuplicateCommandCount() const
+{
+	return this->_duplicateCommandCount;
+}
+
+uint64 LoopbackServer::GetRecievedByteCount() const
+{
+	return this->_recievedByteCount;
+}
+
+uint32 LoopbackServer::CountCommands(const std::string &requestBody)
+{
+	const std::string::size_type start = requestBody.find("\"commands\"");
+	if (start == std::string::npos) {
+		return 0;
+	}
+
+	// Count the values at depth 2 (inside the commands array), skipping string contents.
+	uint32 count = 0;
+	int32 depth = 0;
+	bool isInString = false;
+	for (std::string::size_type i = requestBody.find('[', start), size = requestBody.size(); i < size; ++i) {
+		const char character = requestBody[i];
+		if (isInString) {
+			if (character == '\\') {
+				++i;
+			} else if (character == '"') {
+				isInString = false;
+			}
+		} else if (character == '"') {
+			isInString = true;
+		} else if ((character == '[') || (character == '{')) {
+			if (++depth == 2) {
+				++count;
+			}
+		} else if ((character == ']') || (character == '}')) {
+			if (--depth == 0) {
+				break;
+			}
+		}
+	}
+	return count;
+}
+
+uint32 LoopbackServer::Deduplicate(const std::string &decodedBody)
+{
+	// Bodies are only parsed when there is an id to look for.
+	if ((this->_deduplicationWindow == 0) || (decodedBody.find("\"command_id\"") == std::string::npos)) {
+		return 0;
+	}
+
+	std::map<std::string, Span> members;
+	std::vector<Span> commands;
+	if (!LoopbackServer::ParseObject(decodedBody, Span(LoopbackServer::SkipWhitespace(decodedBody, 0),
+		decodedBody.size()), members) || (members.find("commands") == members.end())
+		|| !LoopbackServer::ParseArray(decodedBody, members["commands"], commands))
+	{
+		return 0;
+	}
+
+	uint32 duplicateCount = 0;
+	for (std::vector<Span>::const_iterator it = commands.begin(), end = commands.end(); it != end; ++it) {
+		std::map<std::string, Span> command;
+		if (!LoopbackServer::ParseObject(decodedBody, *it, command) || (command.find("command_id") == command.end())) {
+			continue;
+		}
+
+		const Span &commandIdSpan(command["command_id"]);
+		const std::string commandId(decodedBody, commandIdSpan.first, commandIdSpan.second - commandIdSpan.first);
+		if (!this->_seenCommandIds.insert(commandId).second) {
+			++duplicateCount;
+			continue;
+		}
+		this->_seenCommandIdOrder.push_back(commandId);
+		if (this->_seenCommandIdOrder.size() > this->_deduplicationWindow) {
+			this->_seenCommandIds.erase(this->_seenCommandIdOrder.front());
+			this->_seenCommandIdOrder.pop_front();
+		}
+	}
+	return duplicateCount;
+}
+
+bool LoopbackServer::Decode(const std::string &requestBody, std::string &decodedBody)
+{
+	if (LoopbackServer::IsMessagePack(requestBody)) {
+		std::string::size_type position = 0;
+		decodedBody.clear();
+		return LoopbackServer::DecodeMessagePack(requestBody, position, 0, decodedBody)
+			&& (position == requestBody.size());
+	}
+
+	std::map<std::string, Span> members;
+	if (!LoopbackServer::ParseObject(requestBody, Span(LoopbackServer::SkipWhitespace(requestBody, 0),
+		requestBody.size()), members) || (members.find("format") == members.end()))
+	{
+		decodedBody = requestBody;
+		return true;
+	}
+
+	const Span &format(members["format"]);
+	if (requestBody.compare(format.first, format.second - format.first, "\"compact\"") != 0) {
+		return false;
+	}
+
+	// Each identity is stored as its two members, which are written out in every command referring to it.
+	std::vector<Span> identities;
+	int64 baseTimestamp = 0;
+	if ((members.find("identities") == members.end()) || (members.find("base_timestamp") == members.end())
+		|| !LoopbackServer::ParseArray(requestBody, members["identities"], identities)
+		|| !LoopbackServer::ParseMilliseconds(requestBody, members["base_timestamp"], true, baseTimestamp))
+	{
+		return false;
+	}
+	std::vector<std::pair<Span, Span> > identityMembers;
+	for (std::vector<Span>::const_iterator it = identities.begin(), end = identities.end(); it != end; ++it) {
+		std::map<std::string, Span> identity;
+		if (!LoopbackServer::ParseObject(requestBody, *it, identity)
+			|| (identity.find("customer_ids") == identity.end()) || (identity.find("project_id") == identity.end()))
+		{
+			return false;
+		}
+		identityMembers.push_back(std::make_pair(identity["customer_ids"], identity["project_id"]));
+	}
+
+	std::vector<Span> commands;
+	if ((members.find("commands") == members.end())
+		|| !LoopbackServer::ParseArray(requestBody, members["commands"], commands))
+	{
+		return false;
+	}
+
+	decodedBody.assign("{ \"commands\": [");
+	for (std::vector<Span>::const_iterator it = commands.begin(), end = commands.end(); it != end; ++it) {
+		if (it != commands.begin()) {
+			decodedBody.append(", ");
+		}
+
+		std::map<std::string, Span> command;
+		if (!LoopbackServer::ParseObject(requestBody, *it, command) || (command.find("i") == command.end())) {
+			decodedBody.append(requestBody, it->first, it->second - it->first);
+			continue;
+		}
+
+		int64 identityIndex = 0;
+		int64 timestampDelta = 0;
+		if ((command.find("t") == command.end()) || (command.find("type") == command.end())
+			|| (command.find("properties") == command.end())
+			|| !LoopbackServer::ParseMilliseconds(requestBody, command["i"], false, identityIndex)
+			|| !LoopbackServer::ParseMilliseconds(requestBody, command["t"], false, timestampDelta)
+			|| (identityIndex < 0) || (identityIndex >= static_cast<int64>(identityMembers.size())))
+		{
+			return false;
+		}
+
+		const std::pair<Span, Span> &identity(identityMembers[static_cast<uint32>(identityIndex)]);
+		const Span &type(command["type"]);
+		const Span &properties(command["properties"]);
+		char formattedTimestamp[Infinario::TimestampSource::_maxFormattedLength + 1];
+		const uint32 formattedTimestampLength = Infinario::TimestampSource::Format(baseTimestamp + timestampDelta,
+			formattedTimestamp);
+
+		decodedBody.append("{ \"name\": \"crm/events\", ");
+		if (command.find("c") != command.end()) {
+			const Span &commandId(command["c"]);
+			decodedBody.append("\"command_id\": ");
+			decodedBody.append(requestBody, commandId.first, commandId.second - commandId.first);
+			decodedBody.append(", ");
+		}
+		decodedBody.append("\"data\": { \"customer_ids\": ");
+		decodedBody.append(requestBody, identity.first.first, identity.first.second - identity.first.first);
+		decodedBody.append(", \"project_id\": ");
+		decodedBody.append(requestBody, identity.second.first, identity.second.second - identity.second.first);
+		decodedBody.append(", \"timestamp\": ");
+		decodedBody.append(formattedTimestamp, formattedTimestampLength);
+		decodedBody.append(", \"type\": ");
+		decodedBody.append(requestBody, type.first, type.second - type.first);
+		decodedBody.append(", \"properties\": ");
+		decodedBody.append(requestBody, properties.first, properties.second - properties.first);
+		decodedBody.append("}}");
+	}
+	decodedBody.append("]}");
+	return true;
+}
+
+bool LoopbackServer::IsMessagePack(const std::string &requestBody)
+{
+	const uint8 first = requestBody.empty() ? 0 : static_cast<uint8>(requestBody[0]);
+	return ((first & 0xf0) == 0x80) || (first == 0xde) || (first == 0xdf);
+}
+
+std::string::size_type LoopbackServer::SkipWhitespace(const std::string &json, std::string::size_type position)
+{
+	while ((position < json.size()) && ((json[position] == ' ') || (json[position] == '\t')
+		|| (json[position] == '\r') || (json[position] == '\n')))
+	{
+		++position;
+	}
+	return position;
+}
+
+std::string::size_type LoopbackServer::SkipValue(const std::string &json, std::string::size_type position)
+{
+	const std::string::size_type size = json.size();
+	if (position >= size) {
+		return std::string::npos;
+	}
+
+	// Containers are skipped by counting their brackets, skipping string contents.
+	int32 depth = 0;
+	bool isInString = false;
+	const std::string::size_type start = position;
+	for (; position < size; ++position) {
+		const char character = json[position];
+		if (isInString) {
+			if (character == '\\') {
+				++position;
+			} else if (character == '"') {
+				isInString = false;
+				if (depth == 0) {
+					return position + 1;
+				}
+			}
+		} else if (character == '"') {
+			isInString = true;
+		} else if ((character == '[') || (character == '{')) {
+			++depth;
+		} else if ((character == ']') || (character == '}')) {
+			if (depth == 0) {
+				break;
+			}
+			if (--depth == 0) {
+				return position + 1;
+			}
+		} else if ((depth == 0) && ((character == ',') || (character == ' ') || (character == '\t')
+			|| (character == '\r') || (character == '\n')))
+		{
+			break;
+		}
+	}
+	return ((depth == 0) && !isInString && (position > start)) ? position : std::string::npos;
+}
+
+bool LoopbackServer::ParseObject(const std::string &json, const Span &span, std::map<std::string, Span> &members)
+{
+	std::string::size_type position = span.first;
+	if ((position >= span.second) || (json[position] != '{')) {
+		return false;
+	}
+
+	position = LoopbackServer::SkipWhitespace(json, position + 1);
+	if ((position < span.second) && (json[position] == '}')) {
+		return position + 1 == span.second;
+	}
+	while (position < span.second) {
+		const std::string::size_type nameEnd = LoopbackServer::SkipValue(json, position);
+		if ((json[position] != '"') || (nameEnd == std::string::npos) || (nameEnd > span.second)) {
+			return false;
+		}
+		const std::string name(json, position + 1, nameEnd - position - 2);
+
+		position = LoopbackServer::SkipWhitespace(json, nameEnd);
+		if ((position >= span.second) || (json[position] != ':')) {
+			return false;
+		}
+		position = LoopbackServer::SkipWhitespace(json, position + 1);
+		const std::string::size_type valueEnd = LoopbackServer::SkipValue(json, position);
+		if ((valueEnd == std::string::npos) || (valueEnd > span.second)) {
+			return false;
+		}
+		members[name] = Span(position, valueEnd);
+
+		position = LoopbackServer::SkipWhitespace(json, valueEnd);
+		if ((position < span.second) && (json[position] == '}')) {
+			return position + 1 == span.second;
+		}
+		if ((position >= span.second) || (json[position] != ',')) {
+			return false;
+		}
+		position = LoopbackServer::SkipWhitespace(json, position + 1);
+	}
+	return false;
+}
+
+bool LoopbackServer::ParseArray(const std::string &json, const Span &span, std::vector<Span> &elements)
+{
+	std::string::size_type position = span.first;
+	if ((position >= span.second) || (json[position] != '[')) {
+		return false;
+	}
+
+	position = LoopbackServer::SkipWhitespace(json, position + 1);
+	if ((position < span.second) && (json[position] == ']')) {
+		return position + 1 == span.second;
+	}
+	while (position < span.second) {
+		const std::string::size_type valueEnd = LoopbackServer::SkipValue(json, position);
+		if ((valueEnd == std::string::npos) || (valueEnd > span.second)) {
+			return false;
+		}
+		elements.push_back(Span(position, valueEnd));
+
+		position = LoopbackServer::SkipWhitespace(json, valueEnd);
+		if ((position < span.second) && (json[position] == ']')) {
+			return position + 1 == span.second;
+		}
+		if ((position >= span.second) || (json[position] != ',')) {
+			return false;
+		}
+		position = LoopbackServer::SkipWhitespace(json, position + 1);
+	}
+	return false;
+}
+
+bool LoopbackServer::ParseMilliseconds(const std::string &json, const Span &span, const bool isSeconds,
+	int64 &milliseconds)
+{
+	std::string::size_type position = span.first;
+	const bool isNegative = (position < span.second) && (json[position] == '-');
+	if (isNegative) {
+		++position;
+	}
+
+	int64 value = 0;
+	uint32 digitCount = 0;
+	for (; (position < span.second) && ('0' <= json[position]) && (json[position] <= '9'); ++position, ++digitCount) {
+		value = value * 10 + (json[position] - '0');
+	}
+	if (digitCount == 0) {
+		return false;
+	}
+
+	if (isSeconds) {
+		uint32 decimalCount = 0;
+		if ((position < span.second) && (json[position] == '.')) {
+			for (++position; (position < span.second) && (decimalCount < 3) && ('0' <= json[position])
+				&& (json[position] <= '9'); ++position, ++decimalCount)
+			{
+				value = value * 10 + (json[position] - '0');
+			}
+		}
+		for (; decimalCount < 3; ++decimalCount) {
+			value *= 10;
+		}
+	}
+	if (position != span.second) {
+		return false;
+	}
+
+	milliseconds = isNegative ? -value : value;
+	return true;
+}
+
+bool LoopbackServer::DecodeMessagePack(const std::string &messagePack, std::string::size_type &position,
+	const uint32 depth, std::string &json)
+{
+	if ((position >= messagePack.size()) || (depth > 256)) {
+		return false;
+	}
+
+	const uint8 type = static_cast<uint8>(messagePack[position++]);
+	uint64 value = 0;
+	uint64 length = 0;
+	bool isMap = false;
+
+	// Containers and strings only differ in how their length is stored, they are written out after the switch.
+	if ((type <= 0x7f) || (type >= 0xe0)) {
+		std::stringstream valueStream;
+		valueStream << static_cast<int32>(static_cast<int8>(type));
+		json.append(valueStream.str());
+		return true;
+	} else if ((type & 0xf0) == 0x80) {
+		isMap = true;
+		length = type & 0x0f;
+	} else if ((type & 0xf0) == 0x90) {
+		length = type & 0x0f;
+	} else if ((type & 0xe0) == 0xa0) {
+		length = type & 0x1f;
+	} else {
+		switch (type) {
+		case 0xc0:
+			json.append("null");
+			return true;
+		case 0xc2:
+			json.append("false");
+			return true;
+		case 0xc3:
+			json.append("true");
+			return true;
+		case 0xca:
+			{
+				if (!LoopbackServer::ReadBigEndian(messagePack, position, 4, value)) {
+					return false;
+				}
+				const uint32 bits = static_cast<uint32>(value);
+				float singleValue;
+				std::memcpy(&singleValue, &bits, 4);
+				LoopbackServer::AppendJsonDouble(json, singleValue);
+			}
+			return true;
+		case 0xcb:
+			{
+				if (!LoopbackServer::ReadBigEndian(messagePack, position, 8, value)) {
+					return false;
+				}
+				double doubleValue;
+				std::memcpy(&doubleValue, &value, 8);
+				LoopbackServer::AppendJsonDouble(json, doubleValue);
+			}
+			return true;
+		case 0xcc:
+		case 0xcd:
+		case 0xce:
+		case 0xcf:
+			{
+				if (!LoopbackServer::ReadBigEndian(messagePack, position, 1 << (type - 0xcc), value)) {
+					return false;
+				}
+				std::stringstream valueStream;
+				valueStream << value;
+				json.append(valueStream.str());
+			}
+			return true;
+		case 0xd0:
+		case 0xd1:
+		case 0xd2:
+		case 0xd3:
+			{
+				const uint32 byteCount = 1 << (type - 0xd0);
+				if (!LoopbackServer::ReadBigEndian(messagePack, position, byteCount, value)) {
+					return false;
+				}
+				// Sign extend the value read.
+				const uint32 unusedBits = 64 - 8 * byteCount;
+				std::stringstream valueStream;
+				valueStream << (static_cast<int64>(value << unusedBits) >> unusedBits);
+				json.append(valueStream.str());
+			}
+			return true;
+		case 0xd6:
+		case 0xd7:
+		case 0xc7:
+			{
+				// Only the timestamp extension type is expected.
+				int64 seconds = 0;
+				uint64 nanoseconds = 0;
+				if ((type == 0xc7) && (!LoopbackServer::ReadBigEndian(messagePack, position, 1, length)
+					|| (length != 12)))
+				{
+					return false;
+				}
+				if ((position >= messagePack.size()) || (static_cast<uint8>(messagePack[position++]) != 0xff)) {
+					return false;
+				}
+				if (type == 0xd6) {
+					if (!LoopbackServer::ReadBigEndian(messagePack, position, 4, value)) {
+						return false;
+					}
+					seconds = static_cast<int64>(value);
+				} else if (type == 0xd7) {
+					if (!LoopbackServer::ReadBigEndian(messagePack, position, 8, value)) {
+						return false;
+					}
+					nanoseconds = value >> 34;
+					seconds = static_cast<int64>(value & 0x3ffffffffull);
+				} else {
+					if (!LoopbackServer::ReadBigEndian(messagePack, position, 4, nanoseconds)
+						|| !LoopbackServer::ReadBigEndian(messagePack, position, 8, value))
+					{
+						return false;
+					}
+					seconds = static_cast<int64>(value);
+				}
+
+				char formattedTimestamp[Infinario::TimestampSource::_maxFormattedLength + 1];
+				const uint32 formattedTimestampLength = Infinario::TimestampSource::Format(
+					seconds * 1000 + static_cast<int64>(nanoseconds / 1000000), formattedTimestamp);
+				json.append(formattedTimestamp, formattedTimestampLength);
+			}
+			return true;
+		case 0xd9:
+		case 0xda:
+		case 0xdb:
+			if (!LoopbackServer::ReadBigEndian(messagePack, position, 1 << (type - 0xd9), length)) {
+				return false;
+			}
+			break;
+		case 0xdc:
+		case 0xdd:
+			if (!LoopbackServer::ReadBigEndian(messagePack, position, (type == 0xdc) ? 2 : 4, length)) {
+				return false;
+			}
+			break;
+		case 0xde:
+		case 0xdf:
+			isMap = true;
+			if (!LoopbackServer::ReadBigEndian(messagePack, position, (type == 0xde) ? 2 : 4, length)) {
+				return false;
+			}
+			break;
+		default:
+			return false;
+		}
+	}
+
+	if (((type & 0xe0) == 0xa0) || ((type >= 0xd9) && (type <= 0xdb))) {
+		if (length > messagePack.size() - position) {
+			return false;
+		}
+		LoopbackServer::AppendJsonString(json, messagePack.data() + position,
+			static_cast<std::string::size_type>(length));
+		position += static_cast<std::string::size_type>(length);
+		return true;
+	}
+
+	// Map keys must be strings.
+	json.push_back(isMap ? '{' : '[');
+	for (uint64 i = 0; i < length; ++i) {
+		if (i > 0) {
+			json.push_back(',');
+		}
+		if (isMap) {
+			const uint8 keyType = (position < messagePack.size()) ? static_cast<uint8>(messagePack[position]) : 0;
+			if ((((keyType & 0xe0) != 0xa0) && ((keyType < 0xd9) || (keyType > 0xdb)))
+				|| !LoopbackServer::DecodeMessagePack(messagePack, position, depth + 1, json))
+			{
+				return false;
+			}
+			json.push_back(':');
+		}
+		if (!LoopbackServer::DecodeMessagePack(messagePack, position, depth + 1, json)) {
+			return false;
+		}
+	}
+	json.push_back(isMap ? '}' : ']');
+	return true;
+}
+
+bool LoopbackServer::ReadBigEndian(const std::string &messagePack, std::string::size_type &position,
+	const uint32 byteCount, uint64 &value)
+{
+	if (messagePack.size() - position < byteCount) {
+		return false;
+	}
+
+	value = 0;
+	for (uint32 i = 0; i < byteCount; ++i) {
+		value = (value << 8) | static_cast<uint8>(messagePack[position++]);
+	}
+	return true;
+}
+
+void LoopbackServer::AppendJsonString(std::string &json, const char *value, const std::string::size_type length)
+{
+	json.push_back('"');
+	for (std::string::size_type i = 0; i < length; ++i) {
+		const char character = value[i];
+		switch (character) {
+		case '"':
+			json.append("\\\"");
+			break;
+		case '\\':
+			json.append("\\\\");
+			break;
+		case '\b':
+			json.append("\\b");
+			break;
+		case '\f':
+			json.append("\\f");
+			break;
+		case '\n':
+			json.append("\\n");
+			break;
+		case '\r':
+			json.append("\\r");
+			break;
+		case '\t':
+			json.append("\\t");
+			break;
+		default:
+			if (static_cast<uint8>(character) < 0x20) {
+				char escaped[8];
+				std::sprintf(escaped, "\\u%04x", static_cast<uint32>(character));
+				json.append(escaped);
+			} else {
+				json.push_back(character);
+			}
+		}
+	}
+	json.push_back('"');
+}
+
+void LoopbackServer::AppendJsonDouble(std::string &json, const double value)
+{
+	// JSON has no representation of infinities and NaN.
+	if ((value != value) || (value - value != 0.0)) {
+		json.append("null");
+		return;
+	}
+
+	// The shortest precision which reads back as the same double.
+	char formatted[32];
+	for (int32 precision = 1; precision <= 17; ++precision) {
+		std::sprintf(formatted, "%.*g", precision, value);
+		if (std::strtod(formatted, NULL) == value) {
+			break;
+		}
+	}
+	json.append(formatted);
+}
+
+LoopbackTransport::LoopbackTransport(LoopbackServer &server)
+: _defaultServer(server)
+, _servers()
+, _server(&server)
+, _status(S3E_RESULT_SUCCESS)
+, _responseCode(0)
+, _responseBody()
+, _readOffset(0)
+, _isTimerSet(false)
+, _callback(NULL)
+, _callbackUserData(NULL)
+{}
+
+LoopbackTransport::~LoopbackTransport()
+{
+	this->Cancel();
+}
+
+void LoopbackTransport::AddServer(const std::string &uriPrefix, LoopbackServer &server)
+{
+	this->_servers.push_back(std::make_pair(uriPrefix, &server));
+}
+
+s3eResult LoopbackTransport::Post(const char *uri, const char *body, int32 bodyLength, s3eCallback callback,
+	void *userData)
+{
+	if (this->_isTimerSet) {
+		return S3E_RESULT_ERROR;
+	}
+
+	this->_server = &this->_defaultServer;
+	for (std::vector<std::pair<std::string, LoopbackServer *> >::const_iterator it = this->_servers.begin(),
+		end = this->_servers.end(); it != end; ++it)
+	{
+		if (std::strncmp(uri, it->first.c_str(), it->first.size()) == 0) {
+			this->_server = it->second;
+			break;
+		}
+	}
+	if (this->_server->Refuse()) {
+		return S3E_RESULT_ERROR;
+	}
+
+	this->_responseBody.clear();
+	this->_readOffset = 0;
+	if (this->_server->Throttle()) {
+		this->_status = S3E_RESULT_SUCCESS;
+		this->_responseCode = 429;
+		this->_responseBody.assign("{ \"errors\": [\"too many requests\"], \"success\": false }");
+	} else if (this->_server->RejectFormat(std::string(body, bodyLength))) {
+		this->_status = S3E_RESULT_SUCCESS;
+		this->_responseCode = 415;
+		this->_responseBody.assign("{ \"errors\": [\"unsupported media type\"], \"success\": false }");
+	} else {
+		this->_status = this->_server->HandleRequest(std::string(uri), std::string(body, bodyLength),
+			this->_responseBody) ? S3E_RESULT_SUCCESS : S3E_RESULT_ERROR;
+		this->_responseCode = 200;
+	}
+
+	// A stalled request is accepted, but its callback is never called.
+	if (!this->_server->Stall()) {
+		this->Schedule(this->_server->GetLatency(), callback, userData);
+	}
+	return S3E_RESULT_SUCCESS;
+}
+
+int32 LoopbackTransport::ReadDataAsync(char *buffer, uint32 bufferLength, uint32 timeout, s3eCallback callback,
+	void *userData)
+{
+	uint32 length = static_cast<uint32>(this->_responseBody.size()) - this->_readOffset;
+	if (length > bufferLength) {
+		length = bufferLength;
+	}
+
+	std::memcpy(buffer, this->_responseBody.data() + this->_readOffset, length);
+	if (length < bufferLength) {
+		buffer[length] = 0;
+	}
+	this->_readOffset += length;
+
+	this->Schedule(0, callback, userData);
+	return static_cast<int32>(length);
+}
+
+uint32 LoopbackTransport::ContentExpected()
+{
+	return static_cast<uint32>(this->_responseBody.size());
+}
+
+uint32 LoopbackTransport::ContentReceived()
+{
+	return this->_readOffset;
+}
+
+bool LoopbackTransport::ContentFinished()
+{
+	return this->_readOffset == this->_responseBody.size();
+}
+
+s3eResult LoopbackTransport::GetStatus()
+{
+	return this->_status;
+}
+
+uint32 LoopbackTransport::GetResponseCode()
+{
+	return this->_responseCode;
+}
+
+void LoopbackTransport::SetProxy(const char *proxy)
+{}
+
+void LoopbackTransport::SetRequestHeader(const char *headerName, const std::string &value)
+{}
+
+bool LoopbackTransport::GetHeader(const char *headerName, std::string &value)
+{
+	if (std::strcmp(headerName, "Connection") == 0) {
+		value.assign("keep-alive");
+		return true;
+	}
+	if ((std::strcmp(headerName, "Retry-After") == 0) && (this->_responseCode == 429)
+		&& (this->_server->GetRetryAfter() > 0))
+	{
+		std::stringstream valueStream;
+		valueStream << this->_server->GetRetryAfter();
+		value = valueStream.str();
+		return true;
+	}
+	return false;
+}
+
+void LoopbackTransport::Cancel()
+{
+	if (this->_isTimerSet) {
+		s3eTimerCancelTimer(LoopbackTransport::TimerElapsed, reinterpret_cast<void *>(this));
+		this->_isTimerSet = false;
+	}
+}
+
+const CIwHTTP *LoopbackTransport::GetHttpClient() const
+{
+	return NULL;
+}
+
+int32 LoopbackTransport::TimerElapsed(void *systemData, void *userData)
+{
+	LoopbackTransport &transport = *(reinterpret_cast<LoopbackTransport *>(userData));
+
+	transport._isTimerSet = false;
+	transport._callback(NULL, transport._callbackUserData);
+	return 0;
+}
+
+void LoopbackTransport::Schedule(const uint32 delay, s3eCallback callback, void *userData)
+{
+	this->_callback = callback;
+	this->_callbackUserData = userData;
+	this->_isTimerSet = true;
+	s3eTimerSetTimer(delay, LoopbackTransport::TimerElapsed, reinterpret_cast<void *>(this));
+}
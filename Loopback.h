@@ -0,0 +1,229 @@
+#ifndef INFINARIO_LOOPBACK_H
+#define INFINARIO_LOOPBACK_H
+
+#include "../src/InfinarioTransport.h"
+
+#include "s3e.h"
+
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * In-process stand-in for the Infinario server's /bulk endpoint. It acknowledges every command of a bulk request,
+ * so that the SDK's whole pipeline can be exercised without network access. Latency, request loss, stalls and
+ * throttling can be injected. Bodies in the compact envelope or in MessagePack are decoded before their commands are
+ * counted. Commands carrying an idempotency id which was already seen are acknowledged without being counted again.
+ */
+class LoopbackServer
+{
+public:
+	LoopbackServer();
+	virtual ~LoopbackServer();
+
+	/**
+	 * Sets the number of milliseconds between recieving a request and sending back its response header.
+	 */
+	void SetLatency(const uint32 latency);
+	uint32 GetLatency() const;
+
+	/**
+	 * Sets the percentage (0 - 100) of requests which fail without a response being sent.
+	 */
+	void SetLossRate(const uint32 lossRate);
+
+	/**
+	 * Sets whether the server accepts connections, requests to an unreachable server fail without being sent. It is
+	 * reachable by default.
+	 */
+	void SetReachable(const bool isReachable);
+
+	/**
+	 * Decides whether the request being processed is refused because the server is unreachable.
+	 */
+	bool Refuse();
+
+	/**
+	 * Sets the percentage (0 - 100) of requests which are never answered, neither with a response nor with an error.
+	 */
+	void SetStallRate(const uint32 stallRate);
+
+	/**
+	 * Decides whether the request being processed stalls.
+	 */
+	bool Stall();
+
+	/**
+	 * Sets the percentage (0 - 100) of requests rejected with 429 Too Many Requests, and the Retry-After value in
+	 * seconds sent with them (zero sends no Retry-After header).
+	 */
+	void SetThrottleRate(const uint32 throttleRate, const uint32 retryAfter = 0);
+	uint32 GetRetryAfter() const;
+
+	/**
+	 * Decides whether the request being processed is rejected as throttled.
+	 */
+	bool Throttle();
+
+	/**
+	 * Sets whether MessagePack bodies are accepted, otherwise they are rejected with 415 Unsupported Media Type as an
+	 * older server would. They are accepted by default.
+	 */
+	void SetMessagePackSupport(const bool isSupported);
+
+	/**
+	 * Decides whether the request being processed is rejected as being in an unsupported format.
+	 */
+	bool RejectFormat(const std::string &requestBody);
+
+	/**
+	 * Sets the number of the most recently seen idempotency ids ("command_id") remembered for deduplication, zero
+	 * disables it. The default is 65536.
+	 */
+	void SetDeduplicationWindow(const uint32 deduplicationWindow);
+
+	/**
+	 * Processes a request. Returns false if the request was lost, otherwise the response is stored in responseBody.
+	 */
+	virtual bool HandleRequest(const std::string &uri, const std::string &requestBody, std::string &responseBody);
+
+	uint32 GetRequestCount() const;
+	uint32 GetCommandCount() const;
+	uint32 GetLostRequestCount() const;
+	uint32 GetStalledRequestCount() const;
+	uint32 GetThrottledRequestCount() const;
+	uint32 GetMalformedRequestCount() const;
+	uint32 GetUnsupportedRequestCount() const;
+	uint32 GetRefusedRequestCount() const;
+	uint32 GetDuplicateCommandCount() const;
+	uint64 GetRecievedByteCount() const;
+
+	/**
+	 * Returns the number of top level values in the "commands" array of a bulk request body.
+	 */
+	static uint32 CountCommands(const std::string &requestBody);
+
+	/**
+	 * Stores the bulk request body with every command written out in full into decodedBody. Bodies in the compact
+	 * envelope are expanded to exactly what the SDK sends in the JSON format. MessagePack bodies are converted to JSON
+	 * without any whitespace, timestamps are written with three decimal places and doubles with the fewest digits
+	 * that read back the same. Other bodies are copied. Returns false if a compact or MessagePack body is malformed.
+	 */
+	static bool Decode(const std::string &requestBody, std::string &decodedBody);
+
+	/**
+	 * Returns true if the body starts with a MessagePack map rather than a JSON object.
+	 */
+	static bool IsMessagePack(const std::string &requestBody);
+protected:
+	uint32 _latency;
+	uint32 _lossRate;
+	uint32 _stallRate;
+	uint32 _throttleRate;
+	uint32 _retryAfter;
+
+	uint32 _requestCount;
+	uint32 _commandCount;
+	uint32 _lostRequestCount;
+	uint32 _stalledRequestCount;
+	uint32 _throttledRequestCount;
+	uint32 _malformedRequestCount;
+	uint32 _unsupportedRequestCount;
+	uint32 _refusedRequestCount;
+	uint32 _duplicateCommandCount;
+	uint64 _recievedByteCount;
+	bool _isMessagePackSupported;
+	bool _isReachable;
+
+	uint32 _deduplicationWindow;
+	std::set<std::string> _seenCommandIds;
+	std::deque<std::string> _seenCommandIdOrder;
+
+	/**
+	 * Remembers the idempotency ids of the decoded body's commands and returns the number of commands whose id had
+	 * already been seen.
+	 */
+	uint32 Deduplicate(const std::string &decodedBody);
+private:
+	// The position of a JSON value within a body and the position just after it.
+	typedef std::pair<std::string::size_type, std::string::size_type> Span;
+
+	static std::string::size_type SkipWhitespace(const std::string &json, std::string::size_type position);
+
+	// Returns the position just after the value starting at the given position, std::string::npos if there is none.
+	static std::string::size_type SkipValue(const std::string &json, std::string::size_type position);
+
+	// Member names are stored as they are written, without the quotes.
+	static bool ParseObject(const std::string &json, const Span &span, std::map<std::string, Span> &members);
+	static bool ParseArray(const std::string &json, const Span &span, std::vector<Span> &elements);
+
+	// Parses an integer, or a number of seconds with up to three decimal places if isSeconds is set, as milliseconds.
+	static bool ParseMilliseconds(const std::string &json, const Span &span, const bool isSeconds,
+		int64 &milliseconds);
+
+	// Converts the MessagePack value at the position to JSON and moves the position past it.
+	static bool DecodeMessagePack(const std::string &messagePack, std::string::size_type &position,
+		const uint32 depth, std::string &json);
+	static bool ReadBigEndian(const std::string &messagePack, std::string::size_type &position,
+		const uint32 byteCount, uint64 &value);
+	static void AppendJsonString(std::string &json, const char *value, const std::string::size_type length);
+	static void AppendJsonDouble(std::string &json, const double value);
+};
+
+/**
+ * Transport delivering requests to LoopbackServers instead of the network. Callbacks are called from Marmalade timers,
+ * so the application must keep yielding (s3eDeviceYield) for requests to be processed.
+ */
+class LoopbackTransport : public Infinario::Transport
+{
+public:
+	LoopbackTransport(LoopbackServer &server);
+	virtual ~LoopbackTransport();
+
+	/**
+	 * Delivers requests whose uri starts with the prefix to the given server, so that several endpoints can be
+	 * simulated. Requests matching no prefix are delivered to the server passed to the constructor.
+	 */
+	void AddServer(const std::string &uriPrefix, LoopbackServer &server);
+
+	virtual s3eResult Post(const char *uri, const char *body, int32 bodyLength, s3eCallback callback,
+		void *userData);
+	virtual int32 ReadDataAsync(char *buffer, uint32 bufferLength, uint32 timeout, s3eCallback callback,
+		void *userData);
+
+	virtual uint32 ContentExpected();
+	virtual uint32 ContentReceived();
+	virtual bool ContentFinished();
+	virtual s3eResult GetStatus();
+	virtual uint32 GetResponseCode();
+
+	virtual void SetProxy(const char *proxy);
+	virtual void SetRequestHeader(const char *headerName, const std::string &value);
+	virtual bool GetHeader(const char *headerName, std::string &value);
+
+	virtual void Cancel();
+
+	virtual const CIwHTTP *GetHttpClient() const;
+private:
+	static int32 TimerElapsed(void *systemData, void *userData);
+
+	void Schedule(const uint32 delay, s3eCallback callback, void *userData);
+
+	LoopbackServer &_defaultServer;
+	std::vector<std::pair<std::string, LoopbackServer *> > _servers;
+	LoopbackServer *_server; // The server which handled the last request.
+
+	s3eResult _status;
+	uint32 _responseCode;
+	std::string _responseBody;
+	uint32 _readOffset;
+
+	bool _isTimerSet;
+	s3eCallback _callback;
+	void *_callbackUserData;
+};
+
+#endif // INFINARIO_LOOPBACK_H
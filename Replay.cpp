@@ -0,0 +1,355 @@
+#include "../src/Infinario.h"
+#include "Loopback.h"
+#include "Replay.h"
+
+#include "s3e.h"
+#include "s3eConfig.h"
+#include "s3eDevice.h"
+#include "s3eFile.h"
+#include "s3eMemory.h"
+#include "s3eThread.h"
+#include "s3eTimer.h"
+
+#include <cstdlib>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define REPLAY_CONFIG_GROUP "Replay"
+
+const std::string replayProjectToken("replay_project_token");
+
+ReplaySettings::ReplaySettings()
+: _logFilename("replay.log")
+, _speed(1.0)
+, _concurrency(1)
+, _latency(50)
+, _lossRate(0)
+{}
+
+void ReplaySettings::Load()
+{
+	char value[S3E_CONFIG_STRING_MAX];
+	int intValue = 0;
+
+	if (s3eConfigGetString(REPLAY_CONFIG_GROUP, "LogFile", value) == S3E_RESULT_SUCCESS) {
+		this->_logFilename = value;
+	}
+	if (s3eConfigGetString(REPLAY_CONFIG_GROUP, "Speed", value) == S3E_RESULT_SUCCESS) {
+		this->_speed = std::atof(value);
+	}
+	if ((s3eConfigGetInt(REPLAY_CONFIG_GROUP, "Concurrency", &intValue) == S3E_RESULT_SUCCESS) && (intValue > 0)) {
+		this->_concurrency = static_cast<uint32>(intValue);
+	}
+	if ((s3eConfigGetInt(REPLAY_CONFIG_GROUP, "Latency", &intValue) == S3E_RESULT_SUCCESS) && (intValue >= 0)) {
+		this->_latency = static_cast<uint32>(intValue);
+	}
+	if ((s3eConfigGetInt(REPLAY_CONFIG_GROUP, "LossRate", &intValue) == S3E_RESULT_SUCCESS) && (intValue >= 0)) {
+		this->_lossRate = static_cast<uint32>(intValue);
+	}
+
+	// Threads issue the commands, without them everything is issued by the main thread.
+	if (!s3eThreadAvailable()) {
+		this->_concurrency = 1;
+	}
+}
+
+Replayer::Replayer(const ReplaySettings &settings)
+: _settings(settings)
+, _commands()
+, _infinarios()
+, _server()
+, _requestManager(NULL)
+, _lock(s3eThreadLockCreate())
+, _startTime(0)
+, _endTime(0)
+, _finalizedCount(0)
+, _failedCount(0)
+, _memoryBefore(0)
+, _memoryPeak(0)
+, _memoryAfter(0)
+{
+	this->_server.SetLatency(settings._latency);
+	this->_server.SetLossRate(settings._lossRate);
+	this->_requestManager = new Infinario::RequestManager(new LoopbackTransport(this->_server));
+	this->_requestManager->SetBatchCallback(Replayer::CommandsFinalized, reinterpret_cast<void *>(this));
+}
+
+Replayer::~Replayer()
+{
+	for (std::map<std::string, Infinario::Infinario *>::iterator it = this->_infinarios.begin(),
+		end = this->_infinarios.end(); it != end; ++it)
+	{
+		delete it->second;
+	}
+	this->_requestManager->ClearBatchCallback();
+	delete this->_requestManager;
+
+	s3eThreadLockDestroy(this->_lock);
+}
+
+bool Replayer::Load()
+{
+	s3eFile *logFile = s3eFileOpen(this->_settings._logFilename.c_str(), "r");
+	if (logFile == NULL) {
+		return false;
+	}
+
+	const int32 size = s3eFileGetSize(logFile);
+	std::string content(static_cast<std::string::size_type>((size > 0) ? size : 0), '\0');
+	if ((size > 0) && (s3eFileRead(&content[0], size, 1, logFile) != 1)) {
+		s3eFileClose(logFile);
+		return false;
+	}
+	s3eFileClose(logFile);
+
+	std::string::size_type lineStart = 0;
+	while (lineStart < content.size()) {
+		std::string::size_type lineEnd = content.find('\n', lineStart);
+		if (lineEnd == std::string::npos) {
+			lineEnd = content.size();
+		}
+
+		ReplayCommand command;
+		if (Replayer::ParseLine(content.substr(lineStart, lineEnd - lineStart), command)) {
+			this->_commands.push_back(command);
+		}
+		lineStart = lineEnd + 1;
+	}
+
+	// Customers get their instances up front, so that creating them is not measured.
+	for (std::vector<ReplayCommand>::const_iterator it = this->_commands.begin(), end = this->_commands.end();
+		it != end; ++it)
+	{
+		if (this->_infinarios.find(it->_customerId) == this->_infinarios.end()) {
+			this->_infinarios[it->_customerId] = new Infinario::Infinario(replayProjectToken, it->_customerId,
+				*(this->_requestManager));
+		}
+	}
+
+	return true;
+}
+
+bool Replayer::ParseLine(const std::string &line, ReplayCommand &command)
+{
+	std::string::size_type length = line.size();
+	if ((length > 0) && (line[length - 1] == '\r')) {
+		--length;
+	}
+	if ((length == 0) || (line[0] == '#')) {
+		return false;
+	}
+
+	std::vector<std::string> fields;
+	std::string::size_type fieldStart = 0;
+	while (fields.size() < 4) {
+		const std::string::size_type fieldEnd = line.find('\t', fieldStart);
+		if ((fieldEnd == std::string::npos) || (fieldEnd >= length)) {
+			return false;
+		}
+		fields.push_back(line.substr(fieldStart, fieldEnd - fieldStart));
+		fieldStart = fieldEnd + 1;
+	}
+
+	command._timestamp = std::atof(fields[0].c_str());
+	command._customerId = fields[1];
+	if (fields[2] == "track") {
+		command._type = ReplayCommandType::Track;
+	} else if (fields[2] == "update") {
+		command._type = ReplayCommandType::Update;
+	} else if (fields[2] == "identify") {
+		command._type = ReplayCommandType::Identify;
+	} else {
+		return false;
+	}
+	command._eventName = fields[3];
+	command._attributes = line.substr(fieldStart, length - fieldStart);
+	if (command._attributes.empty()) {
+		command._attributes = "{}";
+	}
+
+	return true;
+}
+
+void Replayer::Run()
+{
+	if (this->_commands.empty()) {
+		return;
+	}
+
+	std::vector<Worker> workers(this->_settings._concurrency);
+
+	this->_memoryBefore = s3eMemoryGetInt(S3E_MEMORY_USED);
+	this->_memoryPeak = this->_memoryBefore;
+	this->_startTime = s3eTimerGetMs();
+
+	for (uint32 i = 0; i < workers.size(); ++i) {
+		workers[i]._replayer = this;
+		workers[i]._index = i;
+		workers[i]._thread = NULL;
+		workers[i]._sleepSemaphore = NULL;
+		workers[i]._isFinished = false;
+	}
+	if (workers.size() == 1) {
+		this->RunWorker(workers[0]);
+	} else {
+		for (uint32 i = 0; i < workers.size(); ++i) {
+			workers[i]._sleepSemaphore = s3eThreadSemCreate(0);
+			workers[i]._thread = s3eThreadCreate(Replayer::WorkerThread, reinterpret_cast<void *>(&workers[i]));
+		}
+	}
+
+	// Requests are processed by timers and callbacks dispatched while the main thread yields.
+	while (!s3eDeviceCheckQuitRequest()) {
+		const int32 memoryUsed = s3eMemoryGetInt(S3E_MEMORY_USED);
+		if (memoryUsed > this->_memoryPeak) {
+			this->_memoryPeak = memoryUsed;
+		}
+
+		bool isFinished = this->_finalizedCount == this->_commands.size();
+		for (uint32 i = 0; i < workers.size(); ++i) {
+			isFinished = isFinished && workers[i]._isFinished;
+		}
+		if (isFinished) {
+			break;
+		}
+
+		s3eDeviceYield(0);
+	}
+
+	this->_endTime = s3eTimerGetMs();
+
+	for (uint32 i = 0; i < workers.size(); ++i) {
+		if (workers[i]._thread != NULL) {
+			s3eThreadJoin(workers[i]._thread);
+			s3eThreadSemDestroy(workers[i]._sleepSemaphore);
+		}
+	}
+
+	this->_memoryAfter = s3eMemoryGetInt(S3E_MEMORY_USED);
+}
+
+void *Replayer::WorkerThread(void *worker)
+{
+	Worker &currentWorker = *(reinterpret_cast<Worker *>(worker));
+	currentWorker._replayer->RunWorker(currentWorker);
+	return NULL;
+}
+
+void Replayer::RunWorker(Worker &worker)
+{
+	const double firstTimestamp = this->_commands.front()._timestamp;
+	const uint32 workerCount = this->_settings._concurrency;
+
+	for (std::vector<ReplayCommand>::const_iterator it = this->_commands.begin(), end = this->_commands.end();
+		it != end; ++it)
+	{
+		// Commands are distributed by customer, so each customer's commands are issued in order by a single thread.
+		const std::string &customerId(it->_customerId);
+		uint32 hash = 2166136261u;
+		for (std::string::size_type i = 0; i < customerId.size(); ++i) {
+			hash = (hash ^ static_cast<uint8>(customerId[i])) * 16777619u;
+		}
+		if ((hash % workerCount) != worker._index) {
+			continue;
+		}
+
+		// Wait until the command is due, the recorded gaps are shortened by the speed multiplier.
+		if (this->_settings._speed > 0.0) {
+			const int64 dueTime = this->_startTime
+				+ static_cast<int64>((it->_timestamp - firstTimestamp) * 1000.0 / this->_settings._speed);
+			for (int64 now = s3eTimerGetMs(); now < dueTime; now = s3eTimerGetMs()) {
+				if (worker._sleepSemaphore != NULL) {
+					s3eThreadSemWait(worker._sleepSemaphore, static_cast<int>(dueTime - now));
+				} else {
+					s3eDeviceYield(static_cast<int32>(dueTime - now));
+				}
+				if (s3eDeviceCheckQuitRequest()) {
+					worker._isFinished = true;
+					return;
+				}
+			}
+		}
+
+		this->Issue(*it);
+	}
+
+	worker._isFinished = true;
+}
+
+void Replayer::Issue(const ReplayCommand &command)
+{
+	// The map is only read while replaying, so it can be searched from several threads.
+	Infinario::Infinario &infinario = *(this->_infinarios.find(command._customerId)->second);
+
+	switch (command._type)
+	{
+	case ReplayCommandType::Track:
+		infinario.Track(command._eventName, command._attributes, command._timestamp);
+		break;
+	case ReplayCommandType::Update:
+		infinario.Update(command._attributes);
+		break;
+	case ReplayCommandType::Identify:
+		infinario.Identify(command._customerId);
+		break;
+	}
+}
+
+void Replayer::CommandsFinalized(const Infinario::CommandResult *results, const uint32 resultCount,
+	const char *responseBody, const uint32 responseBodyLength, void *replayer)
+{
+	Replayer &currentReplayer = *(reinterpret_cast<Replayer *>(replayer));
+
+	s3eThreadLockAcquire(currentReplayer._lock);
+	for (uint32 i = 0; i < resultCount; ++i) {
+		if (results[i]._responseStatus != Infinario::ResponseStatus::Success) {
+			++currentReplayer._failedCount;
+		}
+	}
+	currentReplayer._finalizedCount = currentReplayer._finalizedCount + resultCount;
+	s3eThreadLockRelease(currentReplayer._lock);
+}
+
+std::string Replayer::GetReport() const
+{
+	const Infinario::Statistics statistics(this->_requestManager->GetStats());
+	const Infinario::ConnectionStatistics connectionStatistics(this->_requestManager->GetConnectionStatistics());
+	const double elapsedSeconds = static_cast<double>(this->_endTime - this->_startTime) / 1000.0;
+
+	std::stringstream reportStream;
+	reportStream << std::fixed << std::setprecision(3) <<
+		"{\n"
+		"  \"settings\": {\n"
+		"    \"log_file\": \"" << Infinario::EscapeJson(this->_settings._logFilename) << "\",\n"
+		"    \"speed\": " << this->_settings._speed << ",\n"
+		"    \"concurrency\": " << this->_settings._concurrency << ",\n"
+		"    \"latency_ms\": " << this->_settings._latency << ",\n"
+		"    \"loss_rate\": " << this->_settings._lossRate << "\n"
+		"  },\n"
+		"  \"results\": {\n"
+		"    \"commands\": " << this->_commands.size() << ",\n"
+		"    \"customers\": " << this->_infinarios.size() << ",\n"
+		"    \"finalized_commands\": " << this->_finalizedCount << ",\n"
+		"    \"failed_commands\": " << this->_failedCount << ",\n"
+		"    \"elapsed_s\": " << elapsedSeconds << ",\n"
+		"    \"throughput_per_s\": "
+			<< ((elapsedSeconds > 0.0) ? (static_cast<double>(this->_finalizedCount) / elapsedSeconds) : 0.0) << ",\n"
+		"    \"requests\": " << this->_server.GetRequestCount() << ",\n"
+		"    \"lost_requests\": " << this->_server.GetLostRequestCount() << ",\n"
+		"    \"recieved_bytes\": " << this->_server.GetRecievedByteCount() << ",\n"
+		"    \"kept_alive_requests\": " << connectionStatistics._keptAliveRequestCount << ",\n"
+		"    \"latency_p50_ms\": " << statistics._enqueueToAckLatency.GetPercentile(50.0) << ",\n"
+		"    \"latency_p90_ms\": " << statistics._enqueueToAckLatency.GetPercentile(90.0) << ",\n"
+		"    \"latency_p99_ms\": " << statistics._enqueueToAckLatency.GetPercentile(99.0) << ",\n"
+		"    \"latency_max_ms\": " << statistics._enqueueToAckLatency.GetMax() << ",\n"
+		"    \"queue_high_water_mark\": " << statistics._queueHighWaterMark << ",\n"
+		"    \"memory_peak_bytes\": " << (this->_memoryPeak - this->_memoryBefore) << ",\n"
+		"    \"memory_retained_bytes\": " << (this->_memoryAfter - this->_memoryBefore) << "\n"
+		"  }\n"
+		"}\n";
+
+	return reportStream.str();
+}
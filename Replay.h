@@ -0,0 +1,123 @@
+#ifndef INFINARIO_REPLAY_H
+#define INFINARIO_REPLAY_H
+
+#include "../src/Infinario.h"
+#include "Loopback.h"
+
+#include "s3e.h"
+#include "s3eThread.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * The kind of SDK call a recorded command is replayed as.
+ */
+enum class ReplayCommandType : char
+{
+	Track = 0,
+	Update = 1,
+	Identify = 2
+};
+
+/**
+ * A single command of a recorded event log. Logs are text files with one command per line, the fields are separated
+ * by tabs:
+ *
+ *   <timestamp> <customer id> <track|update|identify> <event name> <attributes>
+ *
+ * The timestamp is a double UNIX timestamp in seconds. The event name is only used by track commands, the attributes
+ * must be a valid JSON string (empty lines and lines starting with # are skipped).
+ */
+class ReplayCommand
+{
+public:
+	double _timestamp;
+	std::string _customerId;
+	ReplayCommandType _type;
+	std::string _eventName;
+	std::string _attributes;
+};
+
+/**
+ * The settings of a replay, read from the [Replay] group of the application's configuration.
+ */
+class ReplaySettings
+{
+public:
+	ReplaySettings();
+
+	void Load();
+
+	std::string _logFilename;
+	double _speed; // How many times faster than recorded the commands are replayed, zero replays them at once.
+	uint32 _concurrency; // The number of threads issuing the commands.
+	uint32 _latency; // The stand-in server's latency in milliseconds.
+	uint32 _lossRate; // The percentage of requests lost by the stand-in server.
+};
+
+/**
+ * Replays a recorded event log through the Infinario class against the stand-in server and measures how the SDK
+ * copes with it. Each customer gets an Infinario class instance, all of them share one request manager. Commands of a
+ * customer are always issued by the same thread, so their order is preserved.
+ */
+class Replayer
+{
+public:
+	Replayer(const ReplaySettings &settings);
+	~Replayer();
+
+	/**
+	 * Parses the log, returns false if it could not be read.
+	 */
+	bool Load();
+
+	/**
+	 * Replays the loaded commands and waits until all of them are finalized or the application is quitting.
+	 */
+	void Run();
+
+	/**
+	 * Returns the results of the last run as a JSON document.
+	 */
+	std::string GetReport() const;
+private:
+	class Worker
+	{
+	public:
+		Replayer *_replayer;
+		uint32 _index;
+		s3eThread *_thread;
+		s3eThreadSem *_sleepSemaphore;
+		volatile bool _isFinished;
+	};
+
+	static void *WorkerThread(void *worker);
+	static void CommandsFinalized(const Infinario::CommandResult *results, const uint32 resultCount,
+		const char *responseBody, const uint32 responseBodyLength, void *replayer);
+
+	static bool ParseLine(const std::string &line, ReplayCommand &command);
+
+	void Issue(const ReplayCommand &command);
+	void RunWorker(Worker &worker);
+
+	const ReplaySettings _settings;
+
+	std::vector<ReplayCommand> _commands;
+	std::map<std::string, Infinario::Infinario *> _infinarios;
+
+	LoopbackServer _server;
+	Infinario::RequestManager *_requestManager;
+
+	s3eThreadLock *_lock;
+	int64 _startTime;
+	int64 _endTime;
+	volatile uint32 _finalizedCount;
+	uint32 _failedCount;
+	int32 _memoryBefore;
+	int32 _memoryPeak;
+	int32 _memoryAfter;
+};
+
+#endif // INFINARIO_REPLAY_H
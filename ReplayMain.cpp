@@ -0,0 +1,36 @@
+#include "Replay.h"
+
+#include "s3e.h"
+#include "s3eFile.h"
+
+#include <string>
+
+#define REPLAY_OUTPUT_FILE "replay.json"
+
+// Replays the configured event log against the stand-in server and writes a report of how the SDK coped with it.
+int main()
+{
+	ReplaySettings settings;
+	settings.Load();
+
+	Replayer *replayer = new Replayer(settings);
+
+	std::string outputString;
+	if (replayer->Load()) {
+		replayer->Run();
+		outputString = replayer->GetReport();
+	} else {
+		outputString = "{\n  \"error\": \"The event log could not be read.\"\n}\n";
+	}
+
+	// Output results.
+	s3eFile* outputFile = s3eFileOpen(REPLAY_OUTPUT_FILE, "w");
+
+	s3eFileWrite(reinterpret_cast<const void *>(outputString.c_str()), outputString.size(), 1, outputFile);
+
+	s3eFileClose(outputFile);
+
+	delete replayer;
+
+	return 0;
+}
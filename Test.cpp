@@ -1,11 +1,15 @@
 #include "../src/Infinario.h"
+#include "../src/InfinarioTracing.h"
+#include "Loopback.h"
 #include "Test.h"
 
 #include "IwGx.h"
 
 #include "s3e.h"
 #include "s3eFile.h"
+#include "s3eTimer.h"
 
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <string>
@@ -149,6 +153,18 @@ void TestResponseCallback(const CIwHTTP *httpClient, const std::string &requestB
 	case Infinario::ResponseStatus::KilledError:
 		*(data->log) << "KilledError";
 		break;
+	case Infinario::ResponseStatus::ExpiredError:
+		*(data->log) << "ExpiredError";
+		break;
+	case Infinario::ResponseStatus::TimeoutError:
+		*(data->log) << "TimeoutError";
+		break;
+	case Infinario::ResponseStatus::RejectedError:
+		*(data->log) << "RejectedError";
+		break;
+	case Infinario::ResponseStatus::InvalidError:
+		*(data->log) << "InvalidError";
+		break;
 	default:
 		*(data->log) << "UnknownStatus";
 		break;
@@ -539,6 +555,1550 @@ protected:
 	}
 };
 
+class Test6 : public CallbackTest
+{
+public:
+	virtual void Init()
+	{
+		// Test the whole pipeline against the in-process stand-in server, so no network access is needed.
+		Infinario::Tracer::GetInstance().SetEnabled(true);
+		this->_server.SetLatency(50);
+		this->_infinario = new Infinario::Infinario(projectToken, customerId, new LoopbackTransport(this->_server));
+
+		// The flag iterators held by the callback data must not be invalidated by reallocation.
+		this->_callbackFlags.reserve(Test6::_eventCount);
+		this->_successFlags.reserve(Test6::_eventCount);
+
+		// Testing batching of many queued events, using both plain and registered event names.
+		const Infinario::NameHandle eventName = this->_infinario->RegisterName("loopback");
+		std::string eventAttributes("{ ");
+		eventAttributes.append(this->_infinario->GetQuotedName(this->_infinario->RegisterName("batched")));
+		eventAttributes.append(": true }");
+		for (uint32 i = 0; i < Test6::_eventCount; ++i) {
+			if (i % 2 == 0) {
+				this->_infinario->Track("loopback", eventAttributes, 1449008100.0 + i,
+					TestResponseCallback, reinterpret_cast<void *>(this->CreateTestResponseUserData()));
+			} else {
+				this->_infinario->Track(eventName, eventAttributes, 1449008100.0 + i,
+					TestResponseCallback, reinterpret_cast<void *>(this->CreateTestResponseUserData()));
+			}
+		}
+	}
+
+	virtual void Update()
+	{}
+
+	virtual void Terminate()
+	{
+		Infinario::BatchEstimates estimates = this->_infinario->GetBatchEstimates();
+		this->log << "--Batch Estimates--" << std::endl << "Batch size: " << estimates._batchSize
+			<< ", linger time: " << estimates._lingerTime << ", round trip time: " << estimates._roundTripTime
+			<< ", throughput: " << estimates._throughput << std::endl;
+		this->log << "--Stand-in Server--" << std::endl << "Requests: " << this->_server.GetRequestCount()
+			<< ", commands: " << this->_server.GetCommandCount() << std::endl;
+		Infinario::Statistics statistics = this->_infinario->GetStats();
+		this->log << "--Statistics--" << std::endl << "Enqueued: " << statistics._enqueuedCount
+			<< ", sent: " << statistics._sentCount << ", queue high water mark: " << statistics._queueHighWaterMark
+			<< ", latency p50: " << statistics._enqueueToAckLatency.GetPercentile(50.0)
+			<< ", latency p99: " << statistics._enqueueToAckLatency.GetPercentile(99.0) << std::endl;
+
+		delete this->_infinario;
+
+		// Testing the trace export, the trace can be viewed in chrome://tracing.
+		Infinario::Tracer::GetInstance().ExportChromeTrace("trace.json");
+		Infinario::Tracer::GetInstance().SetEnabled(false);
+	}
+protected:
+	virtual State GetState() const
+	{
+		State state = CallbackTest::GetState();
+		if ((state == State::Succeeded) && (this->_server.GetCommandCount() != Test6::_eventCount)) {
+			return State::Failed;
+		}
+		return state;
+	}
+private:
+	static const uint32 _eventCount = 20;
+
+	LoopbackServer _server;
+	Infinario::Infinario *_infinario;
+};
+
+class Test7 : public CallbackTest
+{
+public:
+	virtual void Init()
+	{
+		// Test two projects sharing a single request manager.
+		this->_server.SetLatency(100);
+		this->_requestManager = new Infinario::RequestManager(new LoopbackTransport(this->_server));
+		this->_gameInfinario = new Infinario::Infinario(projectToken, customerId, *(this->_requestManager));
+		this->_platformInfinario = new Infinario::Infinario("platform_project_token", customerId,
+			*(this->_requestManager));
+
+		this->_callbackFlags.reserve(2 * Test7::_eventCount);
+		this->_successFlags.reserve(2 * Test7::_eventCount);
+
+		// Testing multiplexing of both instances' commands into shared bulk requests.
+		for (uint32 i = 0; i < Test7::_eventCount; ++i) {
+			this->_gameInfinario->Track("game_event", "{}", 1449008100.0 + i,
+				TestResponseCallback, reinterpret_cast<void *>(this->CreateTestResponseUserData()));
+			this->_platformInfinario->Track("platform_event", "{}", 1449008100.0 + i,
+				TestResponseCallback, reinterpret_cast<void *>(this->CreateTestResponseUserData()));
+		}
+	}
+
+	virtual void Update()
+	{}
+
+	virtual void Terminate()
+	{
+		this->log << "--Stand-in Server--" << std::endl << "Requests: " << this->_server.GetRequestCount()
+			<< ", commands: " << this->_server.GetCommandCount() << std::endl;
+
+		delete this->_platformInfinario;
+		delete this->_gameInfinario;
+		delete this->_requestManager;
+	}
+protected:
+	virtual State GetState() const
+	{
+		State state = CallbackTest::GetState();
+		if ((state == State::Succeeded) && ((this->_server.GetCommandCount() != 2 * Test7::_eventCount)
+			|| (this->_server.GetRequestCount() >= 2 * Test7::_eventCount)))
+		{
+			return State::Failed;
+		}
+		return state;
+	}
+private:
+	static const uint32 _eventCount = 10;
+
+	LoopbackServer _server;
+	Infinario::RequestManager *_requestManager;
+	Infinario::Infinario *_gameInfinario;
+	Infinario::Infinario *_platformInfinario;
+};
+
+class Test8 : public CallbackTest
+{
+public:
+	virtual void Init()
+	{
+		// Test that samples waiting behind a slow request expire and do not delay the other events.
+		this->_server.SetLatency(500);
+		this->_infinario = new Infinario::Infinario(projectToken, customerId,
+			new LoopbackTransport(this->_server));
+		this->_infinario->SetEventTimeToLive("fps_sample", 100);
+
+		this->_callbackFlags.reserve(Test8::_eventCount);
+		this->_successFlags.reserve(Test8::_eventCount);
+
+		this->_infinario->Track("level_started", "{}",
+			TestResponseCallback, reinterpret_cast<void *>(this->CreateTestResponseUserData()));
+		for (uint32 i = 0; i < Test8::_sampleCount; ++i) {
+			this->_infinario->Track("fps_sample", "{ \"fps\": 60 }");
+		}
+		for (uint32 i = 1; i < Test8::_eventCount; ++i) {
+			this->_infinario->Track("level_progress", "{}",
+				TestResponseCallback, reinterpret_cast<void *>(this->CreateTestResponseUserData()));
+		}
+	}
+
+	virtual void Update()
+	{}
+
+	virtual void Terminate()
+	{
+		this->log << "--Stand-in Server--" << std::endl << "Requests: " << this->_server.GetRequestCount()
+			<< ", commands: " << this->_server.GetCommandCount() << std::endl;
+
+		delete this->_infinario;
+	}
+protected:
+	virtual State GetState() const
+	{
+		State state = CallbackTest::GetState();
+		if ((state == State::Succeeded) && ((this->_server.GetCommandCount() != Test8::_eventCount)
+			|| (this->_infinario->GetStats()._responseStatusCounts[
+				static_cast<uint32>(Infinario::ResponseStatus::ExpiredError)] != Test8::_sampleCount)))
+		{
+			return State::Failed;
+		}
+		return state;
+	}
+private:
+	static const uint32 _eventCount = 5;
+	static const uint32 _sampleCount = 10;
+
+	LoopbackServer _server;
+	Infinario::Infinario *_infinario;
+};
+
+class Test9 : public Test
+{
+public:
+	virtual void Init()
+	{
+		// Test polling futures instead of allocating callback data for every request.
+		this->_server.SetLatency(50);
+		this->_infinario = new Infinario::Infinario(projectToken, customerId,
+			new LoopbackTransport(this->_server));
+
+		this->_futures.reserve(Test9::_eventCount + 1);
+		this->_futures.push_back(this->_infinario->UpdateAsync("{ \"level\": 1 }"));
+		for (uint32 i = 0; i < Test9::_eventCount; ++i) {
+			this->_futures.push_back(this->_infinario->TrackAsync("future_event", "{}", 1449008100.0 + i));
+		}
+	}
+
+	virtual void Update()
+	{}
+
+	virtual void Terminate()
+	{
+		for (std::vector<Infinario::RequestFuture>::size_type i = 0; i < this->_futures.size(); ++i) {
+			this->log << "Future " << i << ": " << (this->_futures[i].IsReady() ? "ready" : "pending");
+			if (this->_futures[i].IsReady()) {
+				this->log << ", status " << static_cast<uint32>(this->_futures[i].GetStatus());
+			}
+			this->log << std::endl;
+		}
+
+		delete this->_infinario;
+	}
+protected:
+	virtual State GetState() const
+	{
+		for (std::vector<Infinario::RequestFuture>::size_type i = 0; i < this->_futures.size(); ++i) {
+			if (!this->_futures[i].IsReady()) {
+				return State::Running;
+			}
+			if (this->_futures[i].GetStatus() != Infinario::ResponseStatus::Success) {
+				return State::Failed;
+			}
+		}
+		return State::Succeeded;
+	}
+private:
+	static const uint32 _eventCount = 10;
+
+	LoopbackServer _server;
+	Infinario::Infinario *_infinario;
+	std::vector<Infinario::RequestFuture> _futures;
+};
+
+class Test10 : public Test
+{
+public:
+	virtual void Init()
+	{
+		// Test accounting for many events with a single callback per bulk request, tagged by their userData.
+		this->_server.SetLatency(20);
+		this->_infinario = new Infinario::Infinario(projectToken, customerId,
+			new LoopbackTransport(this->_server));
+		this->_infinario->SetBatchCallback(Test10::BatchCallback, reinterpret_cast<void *>(this));
+
+		this->_successCount = 0;
+		this->_failureCount = 0;
+		this->_callCount = 0;
+		this->_tagSum = 0;
+
+		// Identify wraps the userData in its own, the batch callback must still get the caller's.
+		this->_infinario->Identify(customerId, NULL, reinterpret_cast<void *>(Test10::_eventCount + 1));
+		for (uint32 i = 1; i <= Test10::_eventCount; ++i) {
+			this->_infinario->Track("batched_event", "{}", NULL, reinterpret_cast<void *>(i));
+		}
+		// The future's state is not passed as the tag.
+		this->_future = this->_infinario->TrackAsync("batched_event", "{}");
+	}
+
+	virtual void Update()
+	{}
+
+	virtual void Terminate()
+	{
+		this->log << "--Batch Callback--" << std::endl << "Calls: " << this->_callCount << ", succeeded: "
+			<< this->_successCount << ", failed: " << this->_failureCount << std::endl;
+
+		this->_infinario->ClearBatchCallback();
+		delete this->_infinario;
+	}
+protected:
+	virtual State GetState() const
+	{
+		if ((this->_successCount + this->_failureCount) < (Test10::_eventCount + 2)) {
+			return State::Running;
+		}
+		if ((this->_failureCount != 0)
+			|| (this->_tagSum != ((Test10::_eventCount + 1) * (Test10::_eventCount + 2)) / 2)
+			|| (this->_callCount >= Test10::_eventCount))
+		{
+			return State::Failed;
+		}
+		return State::Succeeded;
+	}
+private:
+	static void BatchCallback(const Infinario::CommandResult *results, const uint32 resultCount,
+		const char *responseBody, const uint32 responseBodyLength, void *userData)
+	{
+		Test10 *test = reinterpret_cast<Test10 *>(userData);
+
+		++test->_callCount;
+		for (uint32 i = 0; i < resultCount; ++i) {
+			if (results[i]._responseStatus == Infinario::ResponseStatus::Success) {
+				++test->_successCount;
+			} else {
+				++test->_failureCount;
+			}
+			test->_tagSum += static_cast<uint32>(reinterpret_cast<uintptr_t>(results[i]._tag));
+		}
+	}
+
+	static const uint32 _eventCount = 100;
+
+	LoopbackServer _server;
+	Infinario::Infinario *_infinario;
+	uint32 _successCount;
+	uint32 _failureCount;
+	uint32 _callCount;
+	uint32 _tagSum;
+	Infinario::RequestFuture _future;
+};
+
+class Test11 : public Test
+{
+public:
+	virtual void Init()
+	{
+		// Test callbacks receiving views of the bodies next to the string callbacks they replace.
+		this->_server.SetLatency(20);
+		this->_infinario = new Infinario::Infinario(projectToken, customerId,
+			new LoopbackTransport(this->_server));
+
+		this->_viewCallCount = 0;
+		this->_viewSuccessCount = 0;
+
+		this->_infinario->Update("{ \"level\": 2 }", Test11::ViewCallback, reinterpret_cast<void *>(this));
+		for (uint32 i = 0; i < Test11::_eventCount; ++i) {
+			this->_infinario->Track("viewed_event", "{}", 1449008100.0 + i, Test11::ViewCallback,
+				reinterpret_cast<void *>(this));
+		}
+	}
+
+	virtual void Update()
+	{}
+
+	virtual void Terminate()
+	{
+		this->log << "--View Callbacks--" << std::endl << "Calls: " << this->_viewCallCount << ", succeeded: "
+			<< this->_viewSuccessCount << std::endl;
+
+		delete this->_infinario;
+	}
+protected:
+	virtual State GetState() const
+	{
+		if (this->_viewCallCount < Test11::_eventCount + 1) {
+			return State::Running;
+		}
+		return (this->_viewSuccessCount == this->_viewCallCount) ? State::Succeeded : State::Failed;
+	}
+private:
+	static void ViewCallback(const CIwHTTP *httpClient, const char *requestBody, const uint32 requestBodyLength,
+		const Infinario::ResponseStatus responseStatus, const char *responseBody, const uint32 responseBodyLength,
+		void *userData)
+	{
+		Test11 *test = reinterpret_cast<Test11 *>(userData);
+
+		static const char okStatus[] = "\"status\": \"ok\"";
+		++test->_viewCallCount;
+		const char *responseBodyEnd = responseBody + responseBodyLength;
+		if ((responseStatus == Infinario::ResponseStatus::Success) && (std::search(responseBody, responseBodyEnd,
+			okStatus, okStatus + sizeof(okStatus) - 1) != responseBodyEnd))
+		{
+			++test->_viewSuccessCount;
+		}
+	}
+
+	static const uint32 _eventCount = 10;
+
+	LoopbackServer _server;
+	Infinario::Infinario *_infinario;
+	uint32 _viewCallCount;
+	uint32 _viewSuccessCount;
+};
+
+class Test12 : public Test
+{
+public:
+	virtual void Init()
+	{
+		// Test that stalled requests are canceled by the watchdog and do not block the queue.
+		this->_server.SetLatency(20);
+		this->_server.SetStallRate(100);
+		this->_infinario = new Infinario::Infinario(projectToken, customerId,
+			new LoopbackTransport(this->_server));
+		this->_infinario->SetTimeouts(300, 300);
+
+		for (uint32 i = 0; i < Test12::_eventCount; ++i) {
+			this->_infinario->Track("stalled_event", "{}", 1449008100.0 + i);
+		}
+	}
+
+	virtual void Update()
+	{}
+
+	virtual void Terminate()
+	{
+		const Infinario::ConnectionStatistics connectionStatistics(this->_infinario->GetConnectionStatistics());
+		this->log << "--Watchdog--" << std::endl << "Stalled requests: " << this->_server.GetStalledRequestCount()
+			<< ", header timeouts: " << connectionStatistics._headerTimeoutCount << ", stalled time: "
+			<< connectionStatistics._stalledTime << " ms" << std::endl;
+
+		delete this->_infinario;
+	}
+protected:
+	virtual State GetState() const
+	{
+		const Infinario::Statistics statistics(this->_infinario->GetStats());
+		const uint32 timedOutCount =
+			statistics._responseStatusCounts[static_cast<uint32>(Infinario::ResponseStatus::TimeoutError)];
+		if (timedOutCount < Test12::_eventCount) {
+			return State::Running;
+		}
+		return (this->_infinario->GetConnectionStatistics()._headerTimeoutCount
+			== this->_server.GetStalledRequestCount()) ? State::Succeeded : State::Failed;
+	}
+private:
+	static const uint32 _eventCount = 5;
+
+	LoopbackServer _server;
+	Infinario::Infinario *_infinario;
+};
+
+class Test13 : public Test
+{
+public:
+	virtual void Init()
+	{
+		// Test that throttled requests are queued again and sent after the pause requested by the server.
+		this->_server.SetLatency(20);
+		this->_server.SetThrottleRate(100, 1);
+		this->_infinario = new Infinario::Infinario(projectToken, customerId,
+			new LoopbackTransport(this->_server));
+
+		for (uint32 i = 0; i < Test13::_eventCount; ++i) {
+			this->_infinario->Track("throttled_event", "{}", 1449008100.0 + i);
+		}
+	}
+
+	virtual void Update()
+	{
+		// Only the first request is rejected.
+		if (this->_server.GetThrottledRequestCount() > 0) {
+			this->_server.SetThrottleRate(0);
+		}
+	}
+
+	virtual void Terminate()
+	{
+		const Infinario::ConnectionStatistics connectionStatistics(this->_infinario->GetConnectionStatistics());
+		this->log << "--Throttling--" << std::endl << "Throttled requests: " << connectionStatistics._throttledCount
+			<< ", paused time: " << connectionStatistics._pausedTime << " ms" << std::endl;
+
+		delete this->_infinario;
+	}
+protected:
+	virtual State GetState() const
+	{
+		const Infinario::Statistics statistics(this->_infinario->GetStats());
+		const uint32 successCount =
+			statistics._responseStatusCounts[static_cast<uint32>(Infinario::ResponseStatus::Success)];
+		if (successCount < Test13::_eventCount) {
+			return State::Running;
+		}
+
+		// The Retry-After header asked for a pause of one second.
+		const Infinario::ConnectionStatistics connectionStatistics(this->_infinario->GetConnectionStatistics());
+		return ((connectionStatistics._throttledCount == this->_server.GetThrottledRequestCount())
+			&& (connectionStatistics._pausedTime >= 900)) ? State::Succeeded : State::Failed;
+	}
+private:
+	static const uint32 _eventCount = 5;
+
+	LoopbackServer _server;
+	Infinario::Infinario *_infinario;
+};
+
+class Test14 : public Test
+{
+public:
+	virtual void Init()
+	{
+		// Test that sampled out and rate limited events are rejected, and that sampling is consistent for a player.
+		this->_server.SetLatency(20);
+		this->_infinario = new Infinario::Infinario(projectToken, customerId,
+			new LoopbackTransport(this->_server));
+		this->_infinario->SetEventSampling("sampled_out_event", 0);
+		this->_infinario->SetEventSampling("sampled_event", 50);
+		this->_infinario->SetEventRateLimit("limited_event", 1, 3);
+
+		for (uint32 i = 0; i < Test14::_eventCount; ++i) {
+			this->_infinario->Track("sampled_out_event", "{}", 1449008100.0 + i);
+			this->_infinario->Track("sampled_event", "{}", 1449008100.0 + i);
+			this->_infinario->Track("limited_event", "{}", 1449008100.0 + i);
+		}
+	}
+
+	virtual void Update()
+	{}
+
+	virtual void Terminate()
+	{
+		const Infinario::Statistics statistics(this->_infinario->GetStats());
+		this->log << "--Sampling and Rate Limits--" << std::endl << "Succeeded: "
+			<< statistics._responseStatusCounts[static_cast<uint32>(Infinario::ResponseStatus::Success)]
+			<< ", rejected: "
+			<< statistics._responseStatusCounts[static_cast<uint32>(Infinario::ResponseStatus::RejectedError)]
+			<< std::endl;
+
+		delete this->_infinario;
+	}
+protected:
+	virtual State GetState() const
+	{
+		const Infinario::Statistics statistics(this->_infinario->GetStats());
+		const uint64 successCount =
+			statistics._responseStatusCounts[static_cast<uint32>(Infinario::ResponseStatus::Success)];
+		const uint64 rejectedCount =
+			statistics._responseStatusCounts[static_cast<uint32>(Infinario::ResponseStatus::RejectedError)];
+		if (successCount + rejectedCount < 3 * Test14::_eventCount) {
+			return State::Running;
+		}
+
+		// All sampled out events and the limited events over the burst are rejected. The sampled events are either
+		// all tracked or all rejected, depending on the customerId.
+		const uint64 expectedRejectedCount = Test14::_eventCount + (Test14::_eventCount - 3);
+		return ((successCount + rejectedCount == 3 * Test14::_eventCount) && ((rejectedCount == expectedRejectedCount)
+			|| (rejectedCount == expectedRejectedCount + Test14::_eventCount))) ? State::Succeeded : State::Failed;
+	}
+private:
+	static const uint32 _eventCount = 10;
+
+	LoopbackServer _server;
+	Infinario::Infinario *_infinario;
+};
+
+class Test15 : public Test
+{
+public:
+	virtual void Init()
+	{
+		// Test that malformed attributes are rejected and do not spoil the bulk request of the valid ones.
+		this->_server.SetLatency(20);
+		this->_infinario = new Infinario::Infinario(projectToken, customerId,
+			new LoopbackTransport(this->_server));
+		this->_infinario->SetAttributeValidation(true);
+
+		const char *validAttributes[] = { "{}", " { \"a\": [1, -2.5e3, true, null, { \"b\": \"\\u00e9\\n\" }] } " };
+		const char *invalidAttributes[] = { "", "[]", "{ \"a\": 1, }", "{ \"a\": \"unterminated }",
+			"{ \"a\": 01 }", "{ \"a\": 1 } {}" };
+
+		for (uint32 i = 0; i < 2; ++i) {
+			this->_infinario->Track("valid_event", validAttributes[i], 1449008100.0 + i);
+		}
+		for (uint32 i = 0; i < 6; ++i) {
+			this->_infinario->Track("invalid_event", invalidAttributes[i], 1449008100.0 + i);
+		}
+		this->_infinario->Update("{ \"level\": ");
+	}
+
+	virtual void Update()
+	{}
+
+	virtual void Terminate()
+	{
+		const Infinario::Statistics statistics(this->_infinario->GetStats());
+		this->log << "--Attribute Validation--" << std::endl << "Succeeded: "
+			<< statistics._responseStatusCounts[static_cast<uint32>(Infinario::ResponseStatus::Success)]
+			<< ", invalid: "
+			<< statistics._responseStatusCounts[static_cast<uint32>(Infinario::ResponseStatus::InvalidError)]
+			<< std::endl;
+
+		delete this->_infinario;
+	}
+protected:
+	virtual State GetState() const
+	{
+		const Infinario::Statistics statistics(this->_infinario->GetStats());
+		if (statistics._responseStatusCounts[static_cast<uint32>(Infinario::ResponseStatus::Success)] < 2) {
+			return State::Running;
+		}
+		return (statistics._responseStatusCounts[static_cast<uint32>(Infinario::ResponseStatus::InvalidError)] == 7)
+			? State::Succeeded : State::Failed;
+	}
+private:
+	LoopbackServer _server;
+	Infinario::Infinario *_infinario;
+};
+
+class Test16 : public Test
+{
+public:
+	virtual void Init()
+	{
+		// Test that a backlog drained in parallel is delivered completely, intact and in order, while the commands the
+		// workers read are being sent and removed from the queue.
+		this->_server.SetLatency(500);
+		this->_infinario = new Infinario::Infinario(projectToken, customerId,
+			new LoopbackTransport(this->_server));
+		this->_infinario->SetParallelDrain(4);
+		this->_infinario->SetBatchCallback(Test16::BatchCallback, reinterpret_cast<void *>(this));
+
+		this->_finalizedCount = 0;
+		this->_outOfOrderCount = 0;
+		this->_failureCount = 0;
+
+		for (uint32 i = 1; i <= Test16::_eventCount; ++i) {
+			std::stringstream attributes;
+			attributes << "{ \"index\": " << i << " }";
+			this->_infinario->Track("drained_event", attributes.str(), NULL, reinterpret_cast<void *>(i));
+		}
+		this->_server.SetLatency(0);
+	}
+
+	virtual void Update()
+	{}
+
+	virtual void Terminate()
+	{
+		this->log << "--Parallel Drain--" << std::endl << "Finalized: " << this->_finalizedCount << ", out of order: "
+			<< this->_outOfOrderCount << ", failed: " << this->_failureCount << ", requests: "
+			<< this->_server.GetRequestCount() << std::endl;
+
+		this->_infinario->ClearBatchCallback();
+		delete this->_infinario;
+	}
+protected:
+	virtual State GetState() const
+	{
+		if (this->_finalizedCount < Test16::_eventCount) {
+			return State::Running;
+		}
+		return ((this->_outOfOrderCount == 0) && (this->_failureCount == 0)
+			&& (this->_server.GetCommandCount() == Test16::_eventCount)
+			&& (this->_server.GetMalformedRequestCount() == 0)) ? State::Succeeded : State::Failed;
+	}
+private:
+	static void BatchCallback(const Infinario::CommandResult *results, const uint32 resultCount,
+		const char *responseBody, const uint32 responseBodyLength, void *userData)
+	{
+		Test16 *test = reinterpret_cast<Test16 *>(userData);
+
+		for (uint32 i = 0; i < resultCount; ++i) {
+			if (static_cast<uint32>(reinterpret_cast<uintptr_t>(results[i]._tag)) != test->_finalizedCount + 1) {
+				++test->_outOfOrderCount;
+			}
+			if (results[i]._responseStatus != Infinario::ResponseStatus::Success) {
+				++test->_failureCount;
+			}
+			++test->_finalizedCount;
+		}
+	}
+
+	static const uint32 _eventCount = 3000;
+
+	LoopbackServer _server;
+	Infinario::Infinario *_infinario;
+	uint32 _finalizedCount;
+	uint32 _outOfOrderCount;
+	uint32 _failureCount;
+};
+
+// Collects the decoded commands of all requests, regardless of how they were split into batches.
+class CommandRecordingServer : public LoopbackServer
+{
+public:
+	virtual bool HandleRequest(const std::string &uri, const std::string &requestBody, std::string &responseBody)
+	{
+		static const std::string prefix("{ \"commands\": [");
+
+		std::string decodedBody;
+		if (LoopbackServer::Decode(requestBody, decodedBody) && (decodedBody.size() > prefix.size() + 2)) {
+			this->_commands.append(this->_commands.empty() ? "" : ", ");
+			this->_commands.append(decodedBody, prefix.size(), decodedBody.size() - prefix.size() - 2);
+		}
+		return LoopbackServer::HandleRequest(uri, requestBody, responseBody);
+	}
+
+	const std::string &GetCommands() const
+	{
+		return this->_commands;
+	}
+private:
+	std::string _commands;
+};
+
+class Test17 : public Test
+{
+public:
+	virtual void Init()
+	{
+		// Test that the compact envelope carries exactly the commands the JSON format does, in fewer bytes.
+		this->_jsonRequestManager = new Infinario::RequestManager(new LoopbackTransport(this->_jsonServer));
+		this->_compactRequestManager = new Infinario::RequestManager(new LoopbackTransport(this->_compactServer));
+		this->_compactRequestManager->SetBulkFormat(Infinario::BulkFormat::Compact);
+
+		Infinario::RequestManager *requestManagers[] = { this->_jsonRequestManager, this->_compactRequestManager };
+		for (uint32 i = 0; i < 2; ++i) {
+			this->_infinarios[i][0] = new Infinario::Infinario(projectToken, customerId, *requestManagers[i]);
+			this->_infinarios[i][1] = new Infinario::Infinario(projectToken, "", *requestManagers[i]);
+		}
+
+		for (uint32 i = 0; i < Test17::_eventCount; ++i) {
+			for (uint32 j = 0; j < 2; ++j) {
+				Infinario::Infinario &infinario(*this->_infinarios[j][i % 2]);
+				infinario.Track("compact_event", "{ \"index\": 1, \"name\": \"a \\\"quoted\\\" }\" }",
+					1449008100.0 + (i % 5) * 0.25 - (i % 3) * 1.5);
+				if (i % 7 == 0) {
+					infinario.Update("{ \"level\": 3 }");
+				}
+			}
+		}
+	}
+
+	virtual void Update()
+	{}
+
+	virtual void Terminate()
+	{
+		this->log << "--Compact Envelope--" << std::endl << "JSON bytes: " << this->_jsonServer.GetRecievedByteCount()
+			<< ", compact bytes: " << this->_compactServer.GetRecievedByteCount() << ", malformed: "
+			<< this->_compactServer.GetMalformedRequestCount() << std::endl;
+
+		for (uint32 i = 0; i < 2; ++i) {
+			delete this->_infinarios[i][0];
+			delete this->_infinarios[i][1];
+		}
+		delete this->_jsonRequestManager;
+		delete this->_compactRequestManager;
+	}
+protected:
+	virtual State GetState() const
+	{
+		const uint32 commandCount = Test17::_eventCount + (Test17::_eventCount + 6) / 7;
+		if ((this->_jsonServer.GetCommandCount() < commandCount)
+			|| (this->_compactServer.GetCommandCount() + this->_compactServer.GetMalformedRequestCount()
+			< commandCount))
+		{
+			return State::Running;
+		}
+		return ((this->_compactServer.GetMalformedRequestCount() == 0)
+			&& (this->_compactServer.GetCommands() == this->_jsonServer.GetCommands())
+			&& (this->_compactServer.GetRecievedByteCount() < this->_jsonServer.GetRecievedByteCount()))
+			? State::Succeeded : State::Failed;
+	}
+private:
+	static const uint32 _eventCount = 100;
+
+	CommandRecordingServer _jsonServer;
+	CommandRecordingServer _compactServer;
+	Infinario::RequestManager *_jsonRequestManager;
+	Infinario::RequestManager *_compactRequestManager;
+	Infinario::Infinario *_infinarios[2][2];
+};
+
+class Test18 : public Test
+{
+public:
+	virtual void Init()
+	{
+		// Test that MessagePack bodies carry the same commands as JSON ones and that a server which does not accept
+		// them is sent JSON instead.
+		this->_legacyServer.SetMessagePackSupport(false);
+
+		LoopbackServer *servers[] = { &this->_jsonServer, &this->_messagePackServer, &this->_legacyServer };
+		for (uint32 i = 0; i < 3; ++i) {
+			this->_infinarios[i] = new Infinario::Infinario(projectToken, customerId,
+				new LoopbackTransport(*servers[i]));
+		}
+		this->_infinarios[1]->SetBulkFormat(Infinario::BulkFormat::MessagePack);
+		this->_infinarios[2]->SetBulkFormat(Infinario::BulkFormat::MessagePack);
+
+		for (uint32 i = 0; i < Test18::_eventCount; ++i) {
+			for (uint32 j = 0; j < 3; ++j) {
+				this->_infinarios[j]->Track("binary_event", "{ \"index\": 1, \"ratio\": 2.5, \"offset\": -44.25, "
+					"\"big\": 12345678901, \"tags\": [\"a\", \"b\", []], \"nested\": { \"ok\": true, \"none\": null }, "
+					"\"name\": \"a \\\"quoted\\\"\\n }\" }", 1449008100.0 + (i % 5) * 0.25 - (i % 3) * 1.5);
+				if (i % 7 == 0) {
+					this->_infinarios[j]->Update("{ \"level\": 3, \"score\": -129 }");
+				}
+			}
+		}
+	}
+
+	virtual void Update()
+	{}
+
+	virtual void Terminate()
+	{
+		this->log << "--MessagePack--" << std::endl << "JSON bytes: " << this->_jsonServer.GetRecievedByteCount()
+			<< ", MessagePack bytes: " << this->_messagePackServer.GetRecievedByteCount() << ", malformed: "
+			<< this->_messagePackServer.GetMalformedRequestCount() << ", rejected by the legacy server: "
+			<< this->_legacyServer.GetUnsupportedRequestCount() << std::endl;
+
+		for (uint32 i = 0; i < 3; ++i) {
+			delete this->_infinarios[i];
+		}
+	}
+protected:
+	virtual State GetState() const
+	{
+		const uint32 commandCount = Test18::_eventCount + (Test18::_eventCount + 6) / 7;
+		for (uint32 i = 0; i < 3; ++i) {
+			const Infinario::Statistics statistics(this->_infinarios[i]->GetStats());
+			if (statistics._responseStatusCounts[static_cast<uint32>(Infinario::ResponseStatus::Success)]
+				< commandCount)
+			{
+				return State::Running;
+			}
+		}
+		return ((this->_messagePackServer.GetMalformedRequestCount() == 0)
+			&& (this->_messagePackServer.GetCommands() == this->_jsonServer.GetCommands())
+			&& (this->_messagePackServer.GetRecievedByteCount() < this->_jsonServer.GetRecievedByteCount())
+			&& (this->_legacyServer.GetUnsupportedRequestCount() == 1)
+			&& (this->_legacyServer.GetCommandCount() == commandCount)
+			&& (this->_infinarios[2]->GetBulkFormat() == Infinario::BulkFormat::Json)) ? State::Succeeded
+			: State::Failed;
+	}
+private:
+	// Collects the decoded commands of all requests without whitespace outside strings, so that JSON and MessagePack
+	// bodies can be compared.
+	class RecordingServer : public LoopbackServer
+	{
+	public:
+		virtual bool HandleRequest(const std::string &uri, const std::string &requestBody, std::string &responseBody)
+		{
+			static const std::string prefix("{\"commands\":[");
+
+			std::string decodedBody;
+			if (LoopbackServer::Decode(requestBody, decodedBody)) {
+				const std::string strippedBody(RecordingServer::StripWhitespace(decodedBody));
+				if (strippedBody.size() > prefix.size() + 2) {
+					this->_commands.append(this->_commands.empty() ? "" : ",");
+					this->_commands.append(strippedBody, prefix.size(), strippedBody.size() - prefix.size() - 2);
+				}
+			}
+			return LoopbackServer::HandleRequest(uri, requestBody, responseBody);
+		}
+
+		const std::string &GetCommands() const
+		{
+			return this->_commands;
+		}
+	private:
+		static std::string StripWhitespace(const std::string &json)
+		{
+			std::string result;
+			bool isInString = false;
+			for (std::string::size_type i = 0, size = json.size(); i < size; ++i) {
+				const char character = json[i];
+				if (isInString) {
+					if (character == '\\') {
+						result.push_back(character);
+						++i;
+					} else if (character == '"') {
+						isInString = false;
+					}
+				} else if (character == '"') {
+					isInString = true;
+				} else if ((character == ' ') || (character == '\n') || (character == '\r') || (character == '\t')) {
+					continue;
+				}
+				if (i < size) {
+					result.push_back(json[i]);
+				}
+			}
+			return result;
+		}
+
+		std::string _commands;
+	};
+
+	static const uint32 _eventCount = 100;
+
+	RecordingServer _jsonServer;
+	RecordingServer _messagePackServer;
+	LoopbackServer _legacyServer;
+	Infinario::Infinario *_infinarios[3];
+};
+
+class Test19 : public Test
+{
+public:
+	virtual void Init()
+	{
+		// Test that a long queue stays intact while expired samples and the commands of a destroyed instance are
+		// removed from its middle.
+		this->_server.SetLatency(300);
+		this->_requestManager = new Infinario::RequestManager(new LoopbackTransport(this->_server));
+		this->_requestManager->SetBatchCallback(Test19::BatchCallback, reinterpret_cast<void *>(this));
+		this->_gameInfinario = new Infinario::Infinario(projectToken, customerId, *(this->_requestManager));
+		this->_gameInfinario->SetEventTimeToLive("fps_sample", 100);
+		Infinario::Infinario *platformInfinario = new Infinario::Infinario("platform_project_token", customerId,
+			*(this->_requestManager));
+
+		this->_progressCount = 0;
+		this->_outOfOrderCount = 0;
+		this->_failureCount = 0;
+		this->_expiredCount = 0;
+		this->_platformCount = 0;
+
+		// The queued commands span many blocks of the arena, one of them is larger than a block.
+		std::string largeAttributes("{ \"log\": \"");
+		largeAttributes.append(100000, 'x');
+		largeAttributes.append("\" }");
+		for (uint32 i = 1; i <= Test19::_eventCount; ++i) {
+			this->_gameInfinario->Track("level_progress", (i == Test19::_eventCount / 2) ? largeAttributes
+				: std::string("{ \"index\": 1 }"), NULL, reinterpret_cast<void *>(i));
+			this->_gameInfinario->Track("fps_sample", "{ \"fps\": 60 }");
+			platformInfinario->Track("platform_event", "{}", NULL, reinterpret_cast<void *>(Test19::_platformTag));
+		}
+
+		// The first bulk request is still being sent, the platform's other commands are removed from the queue.
+		delete platformInfinario;
+		this->_server.SetLatency(0);
+	}
+
+	virtual void Update()
+	{}
+
+	virtual void Terminate()
+	{
+		this->log << "--Columnar Queue--" << std::endl << "Progress events: " << this->_progressCount
+			<< ", out of order: " << this->_outOfOrderCount << ", failed: " << this->_failureCount << ", expired: "
+			<< this->_expiredCount << ", platform events: " << this->_platformCount << ", malformed requests: "
+			<< this->_server.GetMalformedRequestCount() << std::endl;
+
+		delete this->_gameInfinario;
+		this->_requestManager->ClearBatchCallback();
+		delete this->_requestManager;
+	}
+protected:
+	virtual State GetState() const
+	{
+		if ((this->_progressCount < Test19::_eventCount) || (this->_platformCount < Test19::_eventCount)
+			|| (this->_requestManager->GetStats()._queueDepth > 0))
+		{
+			return State::Running;
+		}
+		return ((this->_outOfOrderCount == 0) && (this->_failureCount == 0) && (this->_expiredCount > 0)
+			&& (this->_server.GetMalformedRequestCount() == 0)
+			&& (this->_server.GetRecievedByteCount() > 100000)
+			&& (this->_requestManager->GetStats()._queueBytes == 0)) ? State::Succeeded : State::Failed;
+	}
+private:
+	static void BatchCallback(const Infinario::CommandResult *results, const uint32 resultCount,
+		const char *responseBody, const uint32 responseBodyLength, void *userData)
+	{
+		Test19 *test = reinterpret_cast<Test19 *>(userData);
+
+		for (uint32 i = 0; i < resultCount; ++i) {
+			const uint32 tag = static_cast<uint32>(reinterpret_cast<uintptr_t>(results[i]._tag));
+			const Infinario::ResponseStatus responseStatus = results[i]._responseStatus;
+			if (tag == Test19::_platformTag) {
+				// The platform's commands are killed, unless they were being sent when it was destroyed.
+				++test->_platformCount;
+				if ((responseStatus != Infinario::ResponseStatus::KilledError)
+					&& (responseStatus != Infinario::ResponseStatus::Success))
+				{
+					++test->_failureCount;
+				}
+			} else if (tag == 0) {
+				if (responseStatus == Infinario::ResponseStatus::ExpiredError) {
+					++test->_expiredCount;
+				} else if (responseStatus != Infinario::ResponseStatus::Success) {
+					++test->_failureCount;
+				}
+			} else {
+				if (tag != test->_progressCount + 1) {
+					++test->_outOfOrderCount;
+				}
+				if (responseStatus != Infinario::ResponseStatus::Success) {
+					++test->_failureCount;
+				}
+				++test->_progressCount;
+			}
+		}
+	}
+
+	static const uint32 _eventCount = 3000;
+	static const uint32 _platformTag = 0xFFFFFFFF;
+
+	LoopbackServer _server;
+	Infinario::RequestManager *_requestManager;
+	Infinario::Infinario *_gameInfinario;
+	uint32 _progressCount;
+	uint32 _outOfOrderCount;
+	uint32 _failureCount;
+	uint32 _expiredCount;
+	uint32 _platformCount;
+};
+
+class Test20 : public Test
+{
+public:
+	virtual void Init()
+	{
+		// Test that batches whose responses were lost are resent in every bulk format, and that the server counts each
+		// of their commands once thanks to the idempotency ids.
+		const Infinario::BulkFormat formats[] = { Infinario::BulkFormat::Json, Infinario::BulkFormat::Compact,
+			Infinario::BulkFormat::MessagePack };
+		for (uint32 i = 0; i < Test20::_formatCount; ++i) {
+			this->_requestManagers[i] = new Infinario::RequestManager(new LoopbackTransport(this->_servers[i]));
+			this->_requestManagers[i]->SetBulkFormat(formats[i]);
+			this->_infinarios[i] = new Infinario::Infinario(projectToken, customerId, *this->_requestManagers[i]);
+			this->_infinarios[i]->SetIdempotencyIds(true);
+		}
+
+		for (uint32 i = 0; i < Test20::_eventCount; ++i) {
+			for (uint32 j = 0; j < Test20::_formatCount; ++j) {
+				this->_infinarios[j]->Track("idempotent_event", "{ \"index\": 1 }");
+				if (i % 7 == 0) {
+					this->_infinarios[j]->Update("{ \"level\": 3 }");
+				}
+			}
+		}
+	}
+
+	virtual void Update()
+	{}
+
+	virtual void Terminate()
+	{
+		this->log << "--Idempotency Ids--" << std::endl;
+		for (uint32 i = 0; i < Test20::_formatCount; ++i) {
+			this->log << "Commands: " << this->_servers[i].GetCommandCount() << ", duplicates: "
+				<< this->_servers[i].GetDuplicateCommandCount() << ", successful: "
+				<< this->_requestManagers[i]->GetStats()._responseStatusCounts[
+				static_cast<uint32>(Infinario::ResponseStatus::Success)] << ", lost response retries: "
+				<< this->_requestManagers[i]->GetConnectionStatistics()._lostResponseRetryCount << std::endl;
+
+			delete this->_infinarios[i];
+			delete this->_requestManagers[i];
+		}
+	}
+protected:
+	virtual State GetState() const
+	{
+		const uint32 commandCount = Test20::_eventCount + (Test20::_eventCount + 6) / 7;
+		for (uint32 i = 0; i < Test20::_formatCount; ++i) {
+			if (this->_requestManagers[i]->GetStats()._queueDepth > 0) {
+				return State::Running;
+			}
+		}
+		for (uint32 i = 0; i < Test20::_formatCount; ++i) {
+			const Infinario::RequestManager &requestManager(*this->_requestManagers[i]);
+			if ((this->_servers[i].GetCommandCount() != commandCount)
+				|| (this->_servers[i].GetDuplicateCommandCount() == 0)
+				|| (this->_servers[i].GetMalformedRequestCount() > 0)
+				|| (requestManager.GetStats()._responseStatusCounts[
+				static_cast<uint32>(Infinario::ResponseStatus::Success)] != commandCount)
+				|| (requestManager.GetConnectionStatistics()._lostResponseRetryCount == 0))
+			{
+				return State::Failed;
+			}
+		}
+		return State::Succeeded;
+	}
+private:
+	// Processes every request, but loses the responses of two out of three, so that a batch is first resent over a new
+	// connection and then as a lost response.
+	class ForgetfulServer : public LoopbackServer
+	{
+	public:
+		ForgetfulServer()
+		: _handledCount(0)
+		{}
+
+		virtual bool HandleRequest(const std::string &uri, const std::string &requestBody, std::string &responseBody)
+		{
+			LoopbackServer::HandleRequest(uri, requestBody, responseBody);
+			return (++this->_handledCount % 3) == 0;
+		}
+	private:
+		uint32 _handledCount;
+	};
+
+	static const uint32 _formatCount = 3;
+	static const uint32 _eventCount = 200;
+
+	ForgetfulServer _servers[Test20::_formatCount];
+	Infinario::RequestManager *_requestManagers[Test20::_formatCount];
+	Infinario::Infinario *_infinarios[Test20::_formatCount];
+};
+
+class Test21 : public Test
+{
+public:
+	virtual void Init()
+	{
+		// Test that batches go to the fastest of several endpoints and fail over to the next fastest one when it
+		// becomes unreachable.
+		this->_slowServer.SetLatency(200);
+		this->_fastServer.SetLatency(20);
+		this->_backupServer.SetLatency(60);
+		LoopbackTransport *transport = new LoopbackTransport(this->_slowServer);
+		transport->AddServer("http://fast.", this->_fastServer);
+		transport->AddServer("http://backup.", this->_backupServer);
+		this->_infinario = new Infinario::Infinario(projectToken, customerId, transport);
+
+		std::vector<std::string> endpoints;
+		endpoints.push_back("http://slow.loopback/bulk");
+		endpoints.push_back("http://fast.loopback/bulk");
+		endpoints.push_back("http://backup.loopback/bulk");
+		this->_infinario->SetEndpoints(endpoints);
+
+		this->_trackedCount = 0;
+		this->_nextTrackTime = s3eTimerGetMs();
+	}
+
+	virtual void Update()
+	{
+		// Events are tracked at a steady pace, halfway through the fast endpoint goes down.
+		const int64 now = s3eTimerGetMs();
+		if ((this->_trackedCount < Test21::_eventCount) && (now >= this->_nextTrackTime)) {
+			this->_infinario->Track("endpoint_event", "{ \"index\": 1 }");
+			++this->_trackedCount;
+			this->_nextTrackTime = now + 10;
+			if (this->_trackedCount == Test21::_eventCount / 2) {
+				this->_fastServer.SetReachable(false);
+			}
+		}
+	}
+
+	virtual void Terminate()
+	{
+		const std::vector<Infinario::EndpointStatistics> endpoints(this->_infinario->GetEndpointStatistics());
+		this->log << "--Endpoint Selection--" << std::endl;
+		for (std::vector<Infinario::EndpointStatistics>::const_iterator it = endpoints.begin(), end = endpoints.end();
+			it != end; ++it)
+		{
+			this->log << it->_uri << ": requests: " << it->_requestCount << ", failures: " << it->_failureCount
+				<< ", round trip time: " << it->_roundTripTime << ", error rate: " << it->_errorRate << ", healthy: "
+				<< it->_isHealthy << std::endl;
+		}
+		this->log << "Commands (slow, fast, backup): " << this->_slowServer.GetCommandCount() << ", "
+			<< this->_fastServer.GetCommandCount() << ", " << this->_backupServer.GetCommandCount() << ", refused: "
+			<< this->_fastServer.GetRefusedRequestCount() << ", failovers: "
+			<< this->_infinario->GetConnectionStatistics()._failoverCount << std::endl;
+
+		delete this->_infinario;
+	}
+protected:
+	virtual State GetState() const
+	{
+		const Infinario::Statistics statistics(this->_infinario->GetStats());
+		if ((this->_trackedCount < Test21::_eventCount) || (statistics._queueDepth > 0)) {
+			return State::Running;
+		}
+
+		// Before the outage most commands go to the fast endpoint, after it to the backup one.
+		const std::vector<Infinario::EndpointStatistics> endpoints(this->_infinario->GetEndpointStatistics());
+		return ((statistics._responseStatusCounts[static_cast<uint32>(Infinario::ResponseStatus::Success)]
+			== Test21::_eventCount)
+			&& (this->_slowServer.GetCommandCount() + this->_fastServer.GetCommandCount()
+			+ this->_backupServer.GetCommandCount() == Test21::_eventCount)
+			&& (this->_slowServer.GetCommandCount() > 0)
+			&& (this->_fastServer.GetCommandCount() > this->_slowServer.GetCommandCount())
+			&& (this->_backupServer.GetCommandCount() > this->_slowServer.GetCommandCount())
+			&& (this->_fastServer.GetRefusedRequestCount() > 0)
+			&& (this->_infinario->GetConnectionStatistics()._failoverCount > 0)
+			&& (endpoints.size() == 3) && (endpoints[1]._failureCount > 0)
+			&& (endpoints[1]._roundTripTime < endpoints[0]._roundTripTime)) ? State::Succeeded : State::Failed;
+	}
+private:
+	static const uint32 _eventCount = 400;
+
+	LoopbackServer _slowServer;
+	LoopbackServer _fastServer;
+	LoopbackServer _backupServer;
+	Infinario::Infinario *_infinario;
+	uint32 _trackedCount;
+	int64 _nextTrackTime;
+};
+
+class Test22 : public Test
+{
+public:
+	virtual void Init()
+	{
+		// Test that the compact envelope keeps the distinct timestamps of a single customer's events.
+		this->_infinarios[0] = new Infinario::Infinario(projectToken, customerId,
+			new LoopbackTransport(this->_jsonServer));
+		this->_infinarios[1] = new Infinario::Infinario(projectToken, customerId,
+			new LoopbackTransport(this->_compactServer));
+		this->_infinarios[1]->SetBulkFormat(Infinario::BulkFormat::Compact);
+
+		for (uint32 i = 0; i < Test22::_eventCount; ++i) {
+			for (uint32 j = 0; j < 2; ++j) {
+				this->_infinarios[j]->Track("timed_event", "{ \"index\": 1 }", 1449008100.0 + i * 1.25 - (i % 4) * 3.5);
+			}
+		}
+	}
+
+	virtual void Update()
+	{}
+
+	virtual void Terminate()
+	{
+		this->log << "--Compact Timestamps--" << std::endl << "JSON commands: " << this->_jsonServer.GetCommandCount()
+			<< ", compact commands: " << this->_compactServer.GetCommandCount() << ", malformed: "
+			<< this->_compactServer.GetMalformedRequestCount() << std::endl;
+
+		delete this->_infinarios[0];
+		delete this->_infinarios[1];
+	}
+protected:
+	virtual State GetState() const
+	{
+		if ((this->_jsonServer.GetCommandCount() < Test22::_eventCount) || (this->_compactServer.GetCommandCount()
+			+ this->_compactServer.GetMalformedRequestCount() < Test22::_eventCount))
+		{
+			return State::Running;
+		}
+		return ((this->_compactServer.GetMalformedRequestCount() == 0)
+			&& (this->_compactServer.GetCommands() == this->_jsonServer.GetCommands())) ? State::Succeeded
+			: State::Failed;
+	}
+private:
+	static const uint32 _eventCount = 50;
+
+	CommandRecordingServer _jsonServer;
+	CommandRecordingServer _compactServer;
+	Infinario::Infinario *_infinarios[2];
+};
+
+class Test23 : public Test
+{
+public:
+	virtual void Init()
+	{
+		// Test that the batch size grows while full batches succeed and both estimates halve when a batch fails.
+		this->_isControllerValid = this->TestController();
+
+		this->_server.SetLatency(100);
+		this->_infinario = new Infinario::Infinario(projectToken, customerId, new LoopbackTransport(this->_server));
+		for (uint32 i = 0; i < Test23::_eventCount; ++i) {
+			this->_infinario->Track("aimd_event", "{}", 1449008100.0 + i);
+		}
+
+		this->_phase = 0;
+		this->_grownEstimates = Infinario::BatchEstimates();
+		this->_failedEstimates = Infinario::BatchEstimates();
+	}
+
+	virtual void Update()
+	{
+		const Infinario::BatchEstimates estimates(this->_infinario->GetBatchEstimates());
+		if ((this->_phase == 0) && (this->_server.GetCommandCount() == Test23::_eventCount)
+			&& (this->_infinario->GetStats()._queueDepth == 0))
+		{
+			// Every batch went through, the next one is lost.
+			this->_grownEstimates = estimates;
+			this->_server.SetLossRate(100);
+			this->_infinario->Track("aimd_event", "{}", 1449008100.0 + Test23::_eventCount);
+			this->_phase = 1;
+		} else if ((this->_phase == 1) && (estimates._batchSize < this->_grownEstimates._batchSize)) {
+			this->_failedEstimates = estimates;
+			this->_server.SetLossRate(0);
+			this->_phase = 2;
+		}
+	}
+
+	virtual void Terminate()
+	{
+		this->log << "--Batch Estimates--" << std::endl << "Grown: batch size: " << this->_grownEstimates._batchSize
+			<< ", linger time: " << this->_grownEstimates._lingerTime << ", round trip time: "
+			<< this->_grownEstimates._roundTripTime << std::endl << "After failure: batch size: "
+			<< this->_failedEstimates._batchSize << ", linger time: " << this->_failedEstimates._lingerTime
+			<< std::endl << "Lost requests: " << this->_server.GetLostRequestCount() << std::endl;
+
+		delete this->_infinario;
+	}
+protected:
+	virtual State GetState() const
+	{
+		if (!this->_isControllerValid) {
+			return State::Failed;
+		}
+		if ((this->_phase < 2) || (this->_infinario->GetStats()._queueDepth > 0)) {
+			return State::Running;
+		}
+
+		// The first batches of the burst were full, so the batch size grew past one, and the linger time settled on
+		// a quarter of the round trip time. A lost batch halves both.
+		const Infinario::BatchEstimates &grown = this->_grownEstimates;
+		const Infinario::BatchEstimates &failed = this->_failedEstimates;
+		return ((grown._batchSize >= 4) && (grown._batchSize <= 64) && (grown._roundTripTime >= 100)
+			&& (grown._lingerTime == grown._roundTripTime / 4)
+			&& (failed._batchSize == grown._batchSize / 2)
+			&& (failed._lingerTime == grown._lingerTime / 2))
+			? State::Succeeded
+			: State::Failed;
+	}
+private:
+	static const uint32 _eventCount = 100;
+
+	bool TestController()
+	{
+		Infinario::BatchController controller;
+		const Infinario::BatchEstimates &estimates = controller.GetEstimates();
+		if ((estimates._batchSize != 1) || (estimates._lingerTime != 0)) {
+			this->log << "Unexpected initial estimates" << std::endl;
+			return false;
+		}
+
+		// The batch size never drops below one.
+		controller.OnFailure();
+		if ((estimates._batchSize != 1) || (controller.GetProjectedBatchSize(10) != 11)
+			|| (controller.GetProjectedBatchSize(100) != 64))
+		{
+			this->log << "Unexpected estimates after a failure at the minimum" << std::endl;
+			return false;
+		}
+
+		// Only a full batch grows the batch size, the linger time steps towards a quarter of the round trip time.
+		controller.OnSuccess(0, 100, 400, 400);
+		if ((estimates._batchSize != 1) || (estimates._roundTripTime != 400) || (estimates._lingerTime != 50)) {
+			this->log << "Unexpected estimates after an empty batch" << std::endl;
+			return false;
+		}
+		controller.OnSuccess(1, 100, 400, 400);
+		if ((estimates._batchSize != 2) || (estimates._lingerTime != 100)) {
+			this->log << "Unexpected estimates after a full batch" << std::endl;
+			return false;
+		}
+
+		// The batch size stops at 64.
+		for (uint32 i = 0; i < 100; ++i) {
+			controller.OnSuccess(64, 100, 400, 400);
+			if ((estimates._batchSize > 64) || (estimates._lingerTime != 100)) {
+				this->log << "Unexpected estimates while growing" << std::endl;
+				return false;
+			}
+		}
+		if ((estimates._batchSize != 64) || (controller.GetProjectedBatchSize(5) != 64)) {
+			this->log << "Batch size did not reach the maximum" << std::endl;
+			return false;
+		}
+
+		// The linger time stops at 5 seconds however slow the link is.
+		for (uint32 i = 0; i < 200; ++i) {
+			controller.OnSuccess(64, 100, 100000, 100000);
+			if (estimates._lingerTime > 5000) {
+				this->log << "Linger time exceeded the maximum" << std::endl;
+				return false;
+			}
+		}
+		if (estimates._lingerTime != 5000) {
+			this->log << "Linger time did not reach the maximum" << std::endl;
+			return false;
+		}
+
+		// A failure halves both estimates.
+		controller.OnFailure();
+		if ((estimates._batchSize != 32) || (estimates._lingerTime != 2500)
+			|| (controller.GetProjectedBatchSize(10) != 42))
+		{
+			this->log << "Unexpected estimates after a failure" << std::endl;
+			return false;
+		}
+		for (uint32 i = 0; i < 10; ++i) {
+			controller.OnFailure();
+		}
+		if ((estimates._batchSize != 1) || (estimates._lingerTime != 2)) {
+			this->log << "Unexpected estimates after repeated failures" << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	LoopbackServer _server;
+	Infinario::Infinario *_infinario;
+	bool _isControllerValid;
+	uint32 _phase;
+	Infinario::BatchEstimates _grownEstimates;
+	Infinario::BatchEstimates _failedEstimates;
+};
+
+class Test24 : public Test
+{
+public:
+	virtual void Init()
+	{
+		// Test that a malformed event in a MessagePack body is sent as nil without spoiling the following event of the
+		// same customer, whose identity conversion would otherwise be copied from the discarded one.
+		this->_server.SetLatency(50);
+		this->_infinario = new Infinario::Infinario(projectToken, customerId, new LoopbackTransport(this->_server));
+		this->_infinario->SetBulkFormat(Infinario::BulkFormat::MessagePack);
+
+		// The first event is sent alone, the others are queued behind it and share the next bodies.
+		this->_infinario->Track("binary_event", "{ \"index\": 0 }", 1449008100.0);
+		this->_infinario->Track("binary_event", "{ \"index\": }", 1449008101.0);
+		this->_infinario->Track("binary_event", "{ \"index\": 2 }", 1449008102.0);
+		this->_infinario->Track("binary_event", "{ \"index\": 3 }", 1449008103.0);
+	}
+
+	virtual void Update()
+	{}
+
+	virtual void Terminate()
+	{
+		this->log << "--Malformed MessagePack Event--" << std::endl << "Commands: " << this->_server.GetCommands()
+			<< std::endl << "Malformed requests: " << this->_server.GetMalformedRequestCount() << std::endl;
+
+		delete this->_infinario;
+	}
+protected:
+	virtual State GetState() const
+	{
+		const Infinario::Statistics statistics(this->_infinario->GetStats());
+		uint64 finalizedCount = 0;
+		for (uint32 i = 0; i < Infinario::ResponseStatusCount; ++i) {
+			finalizedCount += statistics._responseStatusCounts[i];
+		}
+		if (finalizedCount < Test24::_eventCount) {
+			return State::Running;
+		}
+
+		const std::string &commands(this->_server.GetCommands());
+		return ((this->_server.GetMalformedRequestCount() == 0)
+			&& (Test24::CountOccurrences(commands, "null") == 1)
+			&& (Test24::CountOccurrences(commands, "\"customer_ids\"") == Test24::_eventCount - 1)
+			&& (commands.find("\"index\":2") != std::string::npos)
+			&& (commands.find("\"index\":3") != std::string::npos))
+			? State::Succeeded
+			: State::Failed;
+	}
+private:
+	static const uint32 _eventCount = 4;
+
+	static uint32 CountOccurrences(const std::string &text, const std::string &pattern)
+	{
+		uint32 count = 0;
+		for (std::string::size_type position = text.find(pattern); position != std::string::npos;
+			position = text.find(pattern, position + pattern.size()))
+		{
+			++count;
+		}
+		return count;
+	}
+
+	// Collects the decoded bodies of all requests.
+	class RecordingServer : public LoopbackServer
+	{
+	public:
+		virtual bool HandleRequest(const std::string &uri, const std::string &requestBody, std::string &responseBody)
+		{
+			std::string decodedBody;
+			if (LoopbackServer::Decode(requestBody, decodedBody)) {
+				this->_commands.append(decodedBody);
+			}
+			return LoopbackServer::HandleRequest(uri, requestBody, responseBody);
+		}
+
+		const std::string &GetCommands() const
+		{
+			return this->_commands;
+		}
+	private:
+		std::string _commands;
+	};
+
+	RecordingServer _server;
+	Infinario::Infinario *_infinario;
+};
+
+class Test25 : public Test
+{
+public:
+	virtual void Init()
+	{
+		// Test that threads started one after another reuse the tracer's ring buffers instead of running out of them,
+		// and that the export reports the events overwritten in a full ring buffer. The tracer is shared with the
+		// other tests, which keep recording on the main thread while this one waits for them.
+		Infinario::Tracer &tracer(Infinario::Tracer::GetInstance());
+		const bool isEnabled = tracer.IsEnabled();
+		tracer.SetEnabled(true);
+
+		for (uint32 i = 0; i < Test25::_mainEventCount; ++i) {
+			tracer.Record("main_event", 'X', Infinario::Tracer::GetTimestamp(), 0);
+		}
+		for (uint32 i = 0; i < Test25::_threadCount; ++i) {
+			s3eThreadJoin(s3eThreadCreate(Test25::RecordingThread, NULL));
+		}
+
+		this->_trace = tracer.ExportChromeTrace();
+		tracer.SetEnabled(isEnabled);
+	}
+
+	virtual void Update()
+	{}
+
+	virtual void Terminate()
+	{
+		const std::string::size_type otherData = this->_trace.find("\"otherData\"");
+		this->log << "--Tracer--" << std::endl << "Thread events: " << Test25::CountOccurrences(this->_trace,
+			"thread_event") << ", main events: " << Test25::CountOccurrences(this->_trace, "main_event") << ", "
+			<< ((otherData != std::string::npos) ? this->_trace.substr(otherData) : "no otherData\n");
+	}
+protected:
+	virtual State GetState() const
+	{
+		// The main thread's ring also holds the other tests' events, at least the extra main events were overwritten.
+		const std::string overwrittenKey("\"overwritten_events\": ");
+		const std::string::size_type overwrittenPosition = this->_trace.find(overwrittenKey);
+		uint32 overwrittenCount = 0;
+		if (overwrittenPosition != std::string::npos) {
+			std::istringstream(this->_trace.substr(overwrittenPosition + overwrittenKey.size())) >> overwrittenCount;
+		}
+
+		return ((Test25::CountOccurrences(this->_trace, "thread_event") == Test25::_threadCount)
+			&& (Test25::CountOccurrences(this->_trace, "main_event") == Test25::_ringSize)
+			&& (this->_trace.find("\"dropped_events\": 0,") != std::string::npos)
+			&& (overwrittenCount >= Test25::_mainEventCount - Test25::_ringSize))
+			? State::Succeeded
+			: State::Failed;
+	}
+private:
+	// More threads than the tracer has ring buffers, and ten more events than fit into one.
+	static const uint32 _threadCount = 12;
+	static const uint32 _ringSize = 2048;
+	static const uint32 _mainEventCount = Test25::_ringSize + 10;
+
+	static void *RecordingThread(void *userData)
+	{
+		Infinario::Tracer::GetInstance().Record("thread_event", 'X', Infinario::Tracer::GetTimestamp(), 0);
+		Infinario::Tracer::GetInstance().ReleaseThread();
+		return NULL;
+	}
+
+	static uint32 CountOccurrences(const std::string &text, const std::string &pattern)
+	{
+		uint32 count = 0;
+		for (std::string::size_type position = text.find(pattern); position != std::string::npos;
+			position = text.find(pattern, position + pattern.size()))
+		{
+			++count;
+		}
+		return count;
+	}
+
+	std::string _trace;
+};
+
 void CreateTests(std::vector<Test *> &tests)
 {
 	tests.push_back(new Test1());
@@ -546,6 +2106,26 @@ void CreateTests(std::vector<Test *> &tests)
 	tests.push_back(new Test3());
 	tests.push_back(new Test4());
 	tests.push_back(new Test5());
+	tests.push_back(new Test6());
+	tests.push_back(new Test7());
+	tests.push_back(new Test8());
+	tests.push_back(new Test9());
+	tests.push_back(new Test10());
+	tests.push_back(new Test11());
+	tests.push_back(new Test12());
+	tests.push_back(new Test13());
+	tests.push_back(new Test14());
+	tests.push_back(new Test15());
+	tests.push_back(new Test16());
+	tests.push_back(new Test17());
+	tests.push_back(new Test18());
+	tests.push_back(new Test19());
+	tests.push_back(new Test20());
+	tests.push_back(new Test21());
+	tests.push_back(new Test22());
+	tests.push_back(new Test23());
+	tests.push_back(new Test24());
+	tests.push_back(new Test25());
 }
 
 void DestroyTests(std::vector<Test *> &tests)
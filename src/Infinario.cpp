@@ -1,4 +1,8 @@
 #include "Infinario.h"
+#include "InfinarioJson.h"
+#include "InfinarioMessagePack.h"
+#include "InfinarioTracing.h"
+#include "InfinarioTransport.h"
 
 #include "IwHTTP.h"
 
@@ -6,14 +10,18 @@
 #include "IwRandom.h"
 
 #include "s3eDevice.h"
+#include "s3eFile.h"
 #include "s3eMemory.h"
 #include "s3eThread.h"
 #include "s3eTimer.h"
 
+#include <algorithm>
+#include <cstring>
 #include <iomanip>
-#include <queue>
+#include <deque>
 #include <string>
 #include <sstream>
+#include <vector>
 
 std::string Infinario::EscapeJson(const std::string &jsonString) {
 	std::stringstream sstream;
@@ -27,435 +35,3271 @@ std::string Infinario::EscapeJson(const std::string &jsonString) {
 	return sstream.str();
 }
 
-Infinario::Request::Request(const std::string &uri, const std::string &body, ResponseCallback callback, void *userData)
+Infinario::ResponseViewHandler::ResponseViewHandler(ResponseViewCallback callback)
+: _callback(callback)
+{}
+
+Infinario::Request::Request(const std::string &uri, const std::string &command, ResponseCallback callback,
+	void *userData, const void *owner, const uint32 timeToLive, ResponseViewCallback viewCallback)
 : _uri(uri)
-, _body(body)
+, _command(command)
 , _callback(callback)
+, _viewCallback(viewCallback)
 , _userData(userData)
+, _tag(userData)
+, _owner(owner)
+, _timeToLive(timeToLive)
+, _enqueueTime(0)
+, _identityOffset(0)
+, _identityLength(0)
+, _eventOffset(0)
+, _timestamp(0)
+, _commandIdOffset(0)
 {}
 
-const uint32 Infinario::RequestManager::_bufferSize = 1024;
-
-Infinario::RequestManager::RequestManager()
-: _httpClient(new CIwHTTP())
-, _externalLock(s3eThreadLockCreate())
-, _internalLock(s3eThreadLockCreate())
-, _emptyRequestQueueCallback(NULL)
-, _emptyRequestQueueUserData(NULL)
-, _isRequestBeingProcessed(false)
-, _requestsQueue()
-, _buffer(reinterpret_cast<char *>(s3eMalloc(RequestManager::_bufferSize + 1)))
-, _accumulatedBodyLength(0)
-, _accumulatedBodyContent()
+const uint32 Infinario::RequestQueue::_minCompactedSize = 256;
+const uint32 Infinario::RequestQueue::_arenaBlockSize = 65536;
+const int64 Infinario::RequestQueue::_neverExpires = 0x7FFFFFFFFFFFFFFFll;
+
+Infinario::RequestQueue::RequestQueue()
+: _head(0)
+, _expireTimes()
+, _enqueueTimes()
+, _timestamps()
+, _commandBlocks()
+, _commandOffsets()
+, _commandLengths()
+, _identityOffsets()
+, _identityLengths()
+, _eventOffsets()
+, _commandIdOffsets()
+, _uriIndices()
+, _callbacks()
+, _arenaBlocks()
+, _firstArenaBlock(0)
+, _commandBytes(0)
+, _uris()
+, _pinCount(0)
+, _isView(false)
 {}
 
-Infinario::RequestManager::~RequestManager()
+Infinario::RequestQueue::~RequestQueue()
 {
-	s3eThreadLockAcquire(this->_externalLock);
+	this->Clear();
+}
 
-	s3eThreadLockAcquire(this->_internalLock);
+uint32 Infinario::RequestQueue::GetSize() const
+{
+	return static_cast<uint32>(this->_expireTimes.size()) - this->_head;
+}
 
-	// By destroying this instance all queued callbacks have been canceled.
-	delete this->_httpClient;
-	this->_httpClient = NULL;
+bool Infinario::RequestQueue::IsEmpty() const
+{
+	return this->_expireTimes.size() == this->_head;
+}
 
-	// Prepare data for empty request queue callback.
-	bool wasQueueEmptyAtStart = this->_requestsQueue.empty();
-	EmptyRequestQueueCallback emptyRequestQueueCallback = this->_emptyRequestQueueCallback;
-	void *emptyRequestQueueUserData = this->_emptyRequestQueueUserData;
+uint64 Infinario::RequestQueue::GetCommandBytes() const
+{
+	return this->_commandBytes;
+}
 
-	s3eThreadLockRelease(this->_internalLock);	
+void Infinario::RequestQueue::PushBack(const Request &request, const int64 enqueueTime)
+{
+	const uint32 index = static_cast<uint32>(this->_expireTimes.size());
+	this->_expireTimes.push_back((request._timeToLive != 0) ? enqueueTime + request._timeToLive
+		: RequestQueue::_neverExpires);
+	this->_enqueueTimes.push_back(enqueueTime);
+	this->_timestamps.push_back(request._timestamp);
+	this->_commandBlocks.push_back(0);
+	this->_commandOffsets.push_back(0);
+	this->_commandLengths.push_back(static_cast<uint32>(request._command.size()));
+	this->_identityOffsets.push_back(request._identityOffset);
+	this->_identityLengths.push_back(request._identityLength);
+	this->_eventOffsets.push_back(request._eventOffset);
+	this->_commandIdOffsets.push_back(request._commandIdOffset);
+	this->_uriIndices.push_back(this->InternUri(request._uri));
+
+	Callbacks callbacks;
+	callbacks._callback = request._callback;
+	callbacks._viewCallback = request._viewCallback;
+	callbacks._userData = request._userData;
+	callbacks._tag = request._tag;
+	callbacks._owner = request._owner;
+	this->_callbacks.push_back(callbacks);
+
+	this->StoreCommand(index, request._command);
+}
+
+void Infinario::RequestQueue::PopFront(const uint32 count)
+{
+	for (uint32 i = this->_head, end = this->_head + count; i < end; ++i) {
+		this->ReleaseCommand(i);
+	}
+	this->_head += count;
+	this->Compact();
+}
+
+void Infinario::RequestQueue::Erase(const std::vector<uint32> &positions)
+{
+	if (positions.empty()) {
+		return;
+	}
+
+	// The requests in front of the last removed one are moved backwards over the removed ones, so the front of the
+	// queue, where requests are usually removed from, is moved instead of its back.
+	uint32 removedIndex = static_cast<uint32>(positions.size());
+	uint32 target = this->_head + positions.back();
+	for (uint32 source = target + 1; source-- > this->_head; ) {
+		if ((removedIndex > 0) && (source == this->_head + positions[removedIndex - 1])) {
+			this->ReleaseCommand(source);
+			--removedIndex;
+			continue;
+		}
+		if (source != target) {
+			this->Move(source, target);
+		}
+		--target;
+	}
+	this->_head += static_cast<uint32>(positions.size());
+	this->Compact();
+}
+
+void Infinario::RequestQueue::Clear()
+{
+	for (std::deque<ArenaBlock>::iterator it = this->_arenaBlocks.begin(), end = this->_arenaBlocks.end();
+		!this->_isView && (it != end); ++it)
+	{
+		s3eFree(reinterpret_cast<void *>(it->_data));
+	}
+	this->_arenaBlocks.clear();
+	this->_firstArenaBlock = 0;
+	this->_commandBytes = 0;
+	this->_uris.clear();
+
+	this->_head = static_cast<uint32>(this->_expireTimes.size());
+	this->Compact();
+}
+
+Infinario::Request Infinario::RequestQueue::Get(const uint32 position, const bool isCommandCopied) const
+{
+	const uint32 index = this->_head + position;
+	const Callbacks &callbacks(this->_callbacks[index]);
+	Request request(isCommandCopied ? this->_uris[this->_uriIndices[index]] : std::string(),
+		isCommandCopied ? std::string(this->GetCommand(position), this->_commandLengths[index]) : std::string(),
+		callbacks._callback, callbacks._userData, callbacks._owner,
+		(this->_expireTimes[index] != RequestQueue::_neverExpires)
+		? static_cast<uint32>(this->_expireTimes[index] - this->_enqueueTimes[index]) : 0,
+		callbacks._viewCallback);
+	request._tag = callbacks._tag;
+	request._enqueueTime = this->_enqueueTimes[index];
+	request._identityOffset = this->_identityOffsets[index];
+	request._identityLength = this->_identityLengths[index];
+	request._eventOffset = this->_eventOffsets[index];
+	request._commandIdOffset = this->_commandIdOffsets[index];
+	request._timestamp = this->_timestamps[index];
+	return request;
+}
+
+const std::string &Infinario::RequestQueue::GetUri(const uint32 position) const
+{
+	return this->_uris[this->_uriIndices[this->_head + position]];
+}
+
+const char *Infinario::RequestQueue::GetCommand(const uint32 position) const
+{
+	const uint32 index = this->_head + position;
+	return this->_arenaBlocks[this->_commandBlocks[index] - this->_firstArenaBlock]._data
+		+ this->_commandOffsets[index];
+}
+
+uint32 Infinario::RequestQueue::GetCommandLength(const uint32 position) const
+{
+	return this->_commandLengths[this->_head + position];
+}
+
+uint32 Infinario::RequestQueue::GetIdentityOffset(const uint32 position) const
+{
+	return this->_identityOffsets[this->_head + position];
+}
+
+uint32 Infinario::RequestQueue::GetIdentityLength(const uint32 position) const
+{
+	return this->_identityLengths[this->_head + position];
+}
+
+uint32 Infinario::RequestQueue::GetEventOffset(const uint32 position) const
+{
+	return this->_eventOffsets[this->_head + position];
+}
+
+uint32 Infinario::RequestQueue::GetCommandIdOffset(const uint32 position) const
+{
+	return this->_commandIdOffsets[this->_head + position];
+}
+
+int64 Infinario::RequestQueue::GetTimestamp(const uint32 position) const
+{
+	return this->_timestamps[this->_head + position];
+}
+
+int64 Infinario::RequestQueue::GetEnqueueTime(const uint32 position) const
+{
+	return this->_enqueueTimes[this->_head + position];
+}
+
+const void *Infinario::RequestQueue::GetOwner(const uint32 position) const
+{
+	return this->_callbacks[this->_head + position]._owner;
+}
 
-	// Call the first queued request callback.
-	if (!wasQueueEmptyAtStart) {
-		const Request &currentRequest(this->_requestsQueue.front());
+bool Infinario::RequestQueue::IsExpired(const uint32 position, const int64 now) const
+{
+	return this->_expireTimes[this->_head + position] <= now;
+}
+
+bool Infinario::RequestQueue::IsSameUri(const uint32 position, const uint32 otherPosition) const
+{
+	return this->_uriIndices[this->_head + position] == this->_uriIndices[this->_head + otherPosition];
+}
+
+void Infinario::RequestQueue::ClearCallbacks(const uint32 position)
+{
+	this->_callbacks[this->_head + position]._callback = NULL;
+	this->_callbacks[this->_head + position]._viewCallback = NULL;
+}
 
-		if (currentRequest._callback != NULL) {
-			currentRequest._callback(NULL, currentRequest._body, ResponseStatus::KilledError,
-				this->_accumulatedBodyContent.str(), currentRequest._userData);
+uint32 Infinario::RequestQueue::FindExpired(const uint32 begin, const uint32 end, const int64 now) const
+{
+	if (begin >= end) {
+		return end;
+	}
+
+	const int64 *expireTimes = &this->_expireTimes[this->_head];
+	uint32 position = begin;
+	while ((position < end) && (expireTimes[position] > now)) {
+		++position;
+	}
+	return position;
+}
+
+bool Infinario::RequestQueue::HasCommandIds(const uint32 begin, const uint32 end) const
+{
+	for (uint32 i = this->_head + begin, last = this->_head + end; i < last; ++i) {
+		if (this->_commandIdOffsets[i] == 0) {
+			return false;
 		}
+	}
+	return begin < end;
+}
+
+void Infinario::RequestQueue::AssignView(const RequestQueue &source, const uint32 begin, const uint32 end)
+{
+	this->Clear();
+
+	// The columns are copied with their index, the block sequence numbers stay valid with a copy of the block list.
+	const uint32 first = source._head + begin;
+	const uint32 last = source._head + end;
+	this->_head = 0;
+	this->_expireTimes.assign(source._expireTimes.begin() + first, source._expireTimes.begin() + last);
+	this->_enqueueTimes.assign(source._enqueueTimes.begin() + first, source._enqueueTimes.begin() + last);
+	this->_timestamps.assign(source._timestamps.begin() + first, source._timestamps.begin() + last);
+	this->_commandBlocks.assign(source._commandBlocks.begin() + first, source._commandBlocks.begin() + last);
+	this->_commandOffsets.assign(source._commandOffsets.begin() + first, source._commandOffsets.begin() + last);
+	this->_commandLengths.assign(source._commandLengths.begin() + first, source._commandLengths.begin() + last);
+	this->_identityOffsets.assign(source._identityOffsets.begin() + first, source._identityOffsets.begin() + last);
+	this->_identityLengths.assign(source._identityLengths.begin() + first, source._identityLengths.begin() + last);
+	this->_eventOffsets.assign(source._eventOffsets.begin() + first, source._eventOffsets.begin() + last);
+	this->_commandIdOffsets.assign(source._commandIdOffsets.begin() + first,
+		source._commandIdOffsets.begin() + last);
+	this->_uriIndices.assign(source._uriIndices.begin() + first, source._uriIndices.begin() + last);
+	this->_callbacks.assign(source._callbacks.begin() + first, source._callbacks.begin() + last);
+	this->_arenaBlocks = source._arenaBlocks;
+	this->_firstArenaBlock = source._firstArenaBlock;
+	this->_commandBytes = 0;
+	this->_uris = source._uris;
+	this->_isView = true;
+}
 
-		this->_requestsQueue.pop();
+void Infinario::RequestQueue::Pin()
+{
+	++this->_pinCount;
+}
+
+void Infinario::RequestQueue::Unpin()
+{
+	if (--this->_pinCount == 0) {
+		this->ReleaseEmptyBlocks();
 	}
+}
 
-	// Call the remaining queued request callbacks.
-	while (!this->_requestsQueue.empty()) {
-		const Request &currentRequest(this->_requestsQueue.front());
+uint32 Infinario::RequestQueue::InternUri(const std::string &uri)
+{
+	// Requests almost always share a single uri, the last one is checked first.
+	const uint32 uriCount = static_cast<uint32>(this->_uris.size());
+	if ((uriCount > 0) && (this->_uris[uriCount - 1] == uri)) {
+		return uriCount - 1;
+	}
+	for (uint32 i = 0; i < uriCount; ++i) {
+		if (this->_uris[i] == uri) {
+			return i;
+		}
+	}
+	this->_uris.push_back(uri);
+	return uriCount;
+}
 
-		if (currentRequest._callback != NULL) {
-			currentRequest._callback(NULL, currentRequest._body, ResponseStatus::KilledError,
-				std::string(), currentRequest._userData);
+void Infinario::RequestQueue::StoreCommand(const uint32 index, const std::string &command)
+{
+	const uint32 length = static_cast<uint32>(command.size());
+	if (this->_arenaBlocks.empty()
+		|| (this->_arenaBlocks.back()._capacity - this->_arenaBlocks.back()._size < length))
+	{
+		// The last block is only ever empty if it was kept for the following commands, or if the queue is pinned.
+		if (!this->_arenaBlocks.empty() && (this->_arenaBlocks.back()._commandCount == 0) && (this->_pinCount == 0)) {
+			s3eFree(reinterpret_cast<void *>(this->_arenaBlocks.back()._data));
+			this->_arenaBlocks.pop_back();
 		}
 
-		this->_requestsQueue.pop();
+		// A command larger than a block gets a block of its own.
+		ArenaBlock block;
+		block._capacity = (length > RequestQueue::_arenaBlockSize) ? length : RequestQueue::_arenaBlockSize;
+		block._data = reinterpret_cast<char *>(s3eMalloc(block._capacity));
+		block._size = 0;
+		block._commandCount = 0;
+		this->_arenaBlocks.push_back(block);
 	}
 
-	s3eFree(reinterpret_cast<void *>(this->_buffer));
+	ArenaBlock &block(this->_arenaBlocks.back());
+	command.copy(block._data + block._size, length);
+	this->_commandBlocks[index] = this->_firstArenaBlock + static_cast<uint32>(this->_arenaBlocks.size()) - 1;
+	this->_commandOffsets[index] = block._size;
+	block._size += length;
+	++block._commandCount;
+	this->_commandBytes += length;
+}
 
-	s3eThreadLockRelease(this->_externalLock);
+void Infinario::RequestQueue::ReleaseCommand(const uint32 index)
+{
+	this->_commandBytes -= this->_commandLengths[index];
 
-	s3eThreadLockDestroy(this->_internalLock);
-	s3eThreadLockDestroy(this->_externalLock);
+	const uint32 blockIndex = this->_commandBlocks[index] - this->_firstArenaBlock;
+	ArenaBlock &block(this->_arenaBlocks[blockIndex]);
+	if ((--block._commandCount > 0) || (this->_pinCount > 0)) {
+		return;
+	}
 
-	// Call the empty request queue function if it was supplied.
-	if (!wasQueueEmptyAtStart && (emptyRequestQueueCallback != NULL)) {
-		emptyRequestQueueCallback(emptyRequestQueueUserData);
+	// The last block is kept for the following commands, the other empty ones are freed. Their places are only
+	// dropped from the front, so that the sequence numbers of the remaining blocks stay valid.
+	if (blockIndex + 1 == this->_arenaBlocks.size()) {
+		block._size = 0;
+		return;
+	}
+	s3eFree(reinterpret_cast<void *>(block._data));
+	block._data = NULL;
+	while (this->_arenaBlocks.front()._data == NULL) {
+		this->_arenaBlocks.pop_front();
+		++this->_firstArenaBlock;
 	}
 }
 
-void Infinario::RequestManager::SetProxy(const std::string &proxy)
+void Infinario::RequestQueue::ReleaseEmptyBlocks()
 {
-	s3eThreadLockAcquire(this->_externalLock);
+	for (uint32 i = 0, count = static_cast<uint32>(this->_arenaBlocks.size()); i < count; ++i) {
+		ArenaBlock &block(this->_arenaBlocks[i]);
+		if ((block._data == NULL) || (block._commandCount > 0)) {
+			continue;
+		}
+		if (i + 1 == count) {
+			block._size = 0;
+		} else {
+			s3eFree(reinterpret_cast<void *>(block._data));
+			block._data = NULL;
+		}
+	}
+	while (!this->_arenaBlocks.empty() && (this->_arenaBlocks.front()._data == NULL)) {
+		this->_arenaBlocks.pop_front();
+		++this->_firstArenaBlock;
+	}
+}
 
-	s3eThreadLockAcquire(this->_internalLock);
+void Infinario::RequestQueue::Move(const uint32 sourceIndex, const uint32 targetIndex)
+{
+	this->_expireTimes[targetIndex] = this->_expireTimes[sourceIndex];
+	this->_enqueueTimes[targetIndex] = this->_enqueueTimes[sourceIndex];
+	this->_timestamps[targetIndex] = this->_timestamps[sourceIndex];
+	this->_commandBlocks[targetIndex] = this->_commandBlocks[sourceIndex];
+	this->_commandOffsets[targetIndex] = this->_commandOffsets[sourceIndex];
+	this->_commandLengths[targetIndex] = this->_commandLengths[sourceIndex];
+	this->_identityOffsets[targetIndex] = this->_identityOffsets[sourceIndex];
+	this->_identityLengths[targetIndex] = this->_identityLengths[sourceIndex];
+	this->_eventOffsets[targetIndex] = this->_eventOffsets[sourceIndex];
+	this->_commandIdOffsets[targetIndex] = this->_commandIdOffsets[sourceIndex];
+	this->_uriIndices[targetIndex] = this->_uriIndices[sourceIndex];
+	this->_callbacks[targetIndex] = this->_callbacks[sourceIndex];
+}
 
-	this->_httpClient->SetProxy(proxy.c_str());
+void Infinario::RequestQueue::Compact()
+{
+	const uint32 size = static_cast<uint32>(this->_expireTimes.size());
+	if ((this->_head < size) && ((this->_head < RequestQueue::_minCompactedSize) || (this->_head < size / 2))) {
+		return;
+	}
 
-	s3eThreadLockRelease(this->_internalLock);
+	// An empty queue keeps the capacity of its columns.
+	this->_expireTimes.erase(this->_expireTimes.begin(), this->_expireTimes.begin() + this->_head);
+	this->_enqueueTimes.erase(this->_enqueueTimes.begin(), this->_enqueueTimes.begin() + this->_head);
+	this->_timestamps.erase(this->_timestamps.begin(), this->_timestamps.begin() + this->_head);
+	this->_commandBlocks.erase(this->_commandBlocks.begin(), this->_commandBlocks.begin() + this->_head);
+	this->_commandOffsets.erase(this->_commandOffsets.begin(), this->_commandOffsets.begin() + this->_head);
+	this->_commandLengths.erase(this->_commandLengths.begin(), this->_commandLengths.begin() + this->_head);
+	this->_identityOffsets.erase(this->_identityOffsets.begin(), this->_identityOffsets.begin() + this->_head);
+	this->_identityLengths.erase(this->_identityLengths.begin(), this->_identityLengths.begin() + this->_head);
+	this->_eventOffsets.erase(this->_eventOffsets.begin(), this->_eventOffsets.begin() + this->_head);
+	this->_commandIdOffsets.erase(this->_commandIdOffsets.begin(), this->_commandIdOffsets.begin() + this->_head);
+	this->_uriIndices.erase(this->_uriIndices.begin(), this->_uriIndices.begin() + this->_head);
+	this->_callbacks.erase(this->_callbacks.begin(), this->_callbacks.begin() + this->_head);
+	this->_head = 0;
+}
 
-	s3eThreadLockRelease(this->_externalLock);
+Infinario::Histogram::Histogram()
+: _count(0)
+, _sum(0)
+, _min(0)
+, _max(0)
+{
+	for (uint32 i = 0; i < Histogram::_bucketCount; ++i) {
+		this->_buckets[i] = 0;
+	}
 }
 
-void Infinario::RequestManager::ClearProxy()
+void Infinario::Histogram::Record(const uint32 value)
 {
-	s3eThreadLockAcquire(this->_externalLock);
+	++this->_buckets[Histogram::GetBucketIndex(value)];
+	if ((this->_count == 0) || (value < this->_min)) {
+		this->_min = value;
+	}
+	if (value > this->_max) {
+		this->_max = value;
+	}
+	++this->_count;
+	this->_sum += value;
+}
 
-	s3eThreadLockAcquire(this->_internalLock);
+uint64 Infinario::Histogram::GetCount() const
+{
+	return this->_count;
+}
 
-	this->_httpClient->SetProxy(NULL);
+uint32 Infinario::Histogram::GetMin() const
+{
+	return this->_min;
+}
 
-	s3eThreadLockRelease(this->_internalLock);
+uint32 Infinario::Histogram::GetMax() const
+{
+	return this->_max;
+}
 
-	s3eThreadLockRelease(this->_externalLock);
+double Infinario::Histogram::GetMean() const
+{
+	return (this->_count == 0) ? 0.0 : (static_cast<double>(this->_sum) / static_cast<double>(this->_count));
 }
 
-void Infinario::RequestManager::SetEmptyRequestQueueCallback(EmptyRequestQueueCallback callback, void *userData)
+uint32 Infinario::Histogram::GetPercentile(const double percentile) const
 {
-	s3eThreadLockAcquire(this->_externalLock);
-	
-	s3eThreadLockAcquire(this->_internalLock);
+	if (this->_count == 0) {
+		return 0;
+	}
 
-	this->_emptyRequestQueueCallback = callback;
-	this->_emptyRequestQueueUserData = userData;
+	uint64 threshold = static_cast<uint64>((percentile / 100.0) * static_cast<double>(this->_count) + 0.5);
+	if (threshold == 0) {
+		threshold = 1;
+	}
 
-	s3eThreadLockRelease(this->_internalLock);
-	
-	s3eThreadLockRelease(this->_externalLock);
+	uint64 count = 0;
+	for (uint32 i = 0; i < Histogram::_bucketCount; ++i) {
+		count += this->_buckets[i];
+		if (count >= threshold) {
+			const uint32 value = Histogram::GetBucketValue(i);
+			return (value < this->_max) ? value : this->_max;
+		}
+	}
+	return this->_max;
 }
 
-void Infinario::RequestManager::ClearEmptyRequestQueueCallback()
+uint32 Infinario::Histogram::GetBucketIndex(const uint32 value)
 {
-	s3eThreadLockAcquire(this->_externalLock);
-	
-	s3eThreadLockAcquire(this->_internalLock);
+	if (value < Histogram::_subBucketCount) {
+		return value;
+	}
 
-	this->_emptyRequestQueueCallback = NULL;
-	this->_emptyRequestQueueUserData = NULL;
+	// The bucket is given by the position of the highest set bit, the sub-bucket by the bits following it.
+	uint32 exponent = 0;
+	for (uint32 remainder = value; remainder >= 2; remainder >>= 1) {
+		++exponent;
+	}
+	const uint32 shift = exponent - Histogram::_subBucketBits;
+	return Histogram::_subBucketCount + shift * Histogram::_subBucketCount
+		+ ((value >> shift) & (Histogram::_subBucketCount - 1));
+}
 
-	s3eThreadLockRelease(this->_internalLock);
+uint32 Infinario::Histogram::GetBucketValue(const uint32 bucketIndex)
+{
+	if (bucketIndex < Histogram::_subBucketCount) {
+		return bucketIndex;
+	}
 
-	s3eThreadLockRelease(this->_externalLock);
+	// Returns the highest value falling into the bucket.
+	const uint32 shift = (bucketIndex - Histogram::_subBucketCount) / Histogram::_subBucketCount;
+	const uint32 subBucket = (bucketIndex - Histogram::_subBucketCount) % Histogram::_subBucketCount;
+	const uint64 lowest = static_cast<uint64>(Histogram::_subBucketCount + subBucket) << shift;
+	return static_cast<uint32>(lowest + (static_cast<uint64>(1) << shift) - 1);
 }
 
-void Infinario::RequestManager::Enqueue(const Request &request)
+Infinario::Statistics::Statistics()
+: _enqueuedCount(0)
+, _sentCount(0)
+, _queueDepth(0)
+, _queueHighWaterMark(0)
+, _queueBytes(0)
+, _oldestQueuedAge(0)
+, _requestCount(0)
+, _requestBytes(0)
+, _responseBytes(0)
+, _enqueueToAckLatency()
+, _roundTripTime()
 {
-	s3eThreadLockAcquire(this->_externalLock);
-	
-	s3eThreadLockAcquire(this->_internalLock);
+	for (uint32 i = 0; i < ResponseStatusCount; ++i) {
+		this->_responseStatusCounts[i] = 0;
+	}
+}
 
-	if (this->_httpClient == NULL) {
-		s3eThreadLockRelease(this->_internalLock);
-		s3eThreadLockRelease(this->_externalLock);
-		return;
+Infinario::BatchEstimates::BatchEstimates()
+: _batchSize(0)
+, _lingerTime(0)
+, _roundTripTime(0)
+, _throughput(0)
+{}
+
+Infinario::ConnectionStatistics::ConnectionStatistics()
+: _requestCount(0)
+, _keptAliveRequestCount(0)
+, _newConnectionCount(0)
+, _idleCloseCount(0)
+, _retryCount(0)
+, _lostResponseRetryCount(0)
+, _failoverCount(0)
+, _headerTimeoutCount(0)
+, _bodyTimeoutCount(0)
+, _stalledTime(0)
+, _throttledCount(0)
+, _pausedTime(0)
+{}
+
+const uint32 Infinario::BatchController::_minBatchSize = 1;
+const uint32 Infinario::BatchController::_maxBatchSize = 64;
+const uint32 Infinario::BatchController::_maxLingerTime = 5000;
+const uint32 Infinario::BatchController::_lingerTimeStep = 50;
+
+Infinario::BatchController::BatchController()
+: _estimates()
+{
+	this->_estimates._batchSize = BatchController::_minBatchSize;
+}
+
+void Infinario::BatchController::OnSuccess(const uint32 commandCount, const uint32 byteCount,
+	const uint32 roundTripTime, const uint32 totalTime)
+{
+	// Smooth the measurements using an exponentially weighted moving average with a weight of 1/8 (as TCP does).
+	const uint32 throughput = static_cast<uint32>((static_cast<uint64>(byteCount) * 1000) / (totalTime + 1));
+	if (this->_estimates._roundTripTime == 0) {
+		this->_estimates._roundTripTime = roundTripTime;
+		this->_estimates._throughput = throughput;
+	} else {
+		this->_estimates._roundTripTime = (7 * this->_estimates._roundTripTime + roundTripTime) / 8;
+		this->_estimates._throughput = static_cast<uint32>(
+			(7 * static_cast<uint64>(this->_estimates._throughput) + throughput) / 8);
 	}
 
-	this->_requestsQueue.push(request);
+	// Additive increase of the batch size, but only if the batch was full so a trickle of commands can't inflate it.
+	if ((commandCount >= this->_estimates._batchSize)
+		&& (this->_estimates._batchSize < BatchController::_maxBatchSize))
+	{
+		++this->_estimates._batchSize;
+	}
 
-	s3eThreadLockRelease(this->_internalLock);
+	// The linger time approaches a quarter of the round trip time, the slower the link the longer we wait for more
+	// commands to share the cost of a single round trip.
+	uint32 lingerTarget = this->_estimates._roundTripTime / 4;
+	if (lingerTarget > BatchController::_maxLingerTime) {
+		lingerTarget = BatchController::_maxLingerTime;
+	}
+	if (this->_estimates._lingerTime + BatchController::_lingerTimeStep < lingerTarget) {
+		this->_estimates._lingerTime += BatchController::_lingerTimeStep;
+	} else {
+		this->_estimates._lingerTime = lingerTarget;
+	}
+}
 
-	// If the manager is in request processing mode the call chain will execute all queued requests.
-	if (!this->_isRequestBeingProcessed) {
-		// Initialize the execute call chain.
-		this->Execute();
+void Infinario::BatchController::OnFailure()
+{
+	// Multiplicative decrease, a failed request should not take too many commands down with it.
+	this->_estimates._batchSize /= 2;
+	if (this->_estimates._batchSize < BatchController::_minBatchSize) {
+		this->_estimates._batchSize = BatchController::_minBatchSize;
 	}
+	this->_estimates._lingerTime /= 2;
+}
 
-	s3eThreadLockRelease(this->_externalLock);
+const Infinario::BatchEstimates &Infinario::BatchController::GetEstimates() const
+{
+	return this->_estimates;
 }
 
-// This is the callback indicating that a Post call has completed. Depending on how the server is communicating the
-// content length, we may actually know the length of the content, or we may know the length of the first part of it,
-// or we may know nothing. ContentExpected always returns the smallest possible size of the content, so allocate that
-// much space for now if it's non-zero. If it is of zero size, the server has given no indication, we use the maximum
-// size.
-int32 Infinario::RequestManager::RecieveHeader(void *systenData, void *userData)
+uint32 Infinario::BatchController::GetProjectedBatchSize(const uint32 successCount) const
 {
-	// Initializing passed reference.
-	RequestManager &requestManager = *(reinterpret_cast<RequestManager *>(userData));
+	const uint32 batchSize = this->_estimates._batchSize + successCount;
+	return (batchSize < BatchController::_maxBatchSize) ? batchSize : BatchController::_maxBatchSize;
+}
 
-	s3eThreadLockAcquire(requestManager._internalLock);
+Infinario::EndpointStatistics::EndpointStatistics()
+: _uri()
+, _requestCount(0)
+, _failureCount(0)
+, _roundTripTime(0)
+, _errorRate(0)
+, _isHealthy(true)
+{}
 
-	const Request currentRequest(requestManager._requestsQueue.front());
+const uint32 Infinario::EndpointSelector::_probeInterval = 16;
+const uint32 Infinario::EndpointSelector::_minBackoff = 1000;
+const uint32 Infinario::EndpointSelector::_maxBackoff = 60000;
 
-	// Test for error.
-	if (requestManager._httpClient->GetStatus() == S3E_RESULT_ERROR) {
-		s3eThreadLockRelease(requestManager._internalLock);
+Infinario::EndpointSelector::Endpoint::Endpoint(const std::string &uri)
+: _statistics()
+, _isMeasured(false)
+, _consecutiveFailureCount(0)
+, _avoidedUntil(0)
+, _lastSelection(0)
+{
+	this->_statistics._uri = uri;
+}
 
-		// Call callback function if it was supplied.
-		if (currentRequest._callback != NULL) {
-			currentRequest._callback(requestManager._httpClient, currentRequest._body, ResponseStatus::ReceiveHeaderError,
-				requestManager._accumulatedBodyContent.str(), currentRequest._userData);
-		}
+Infinario::EndpointSelector::EndpointSelector()
+: _endpoints()
+, _selectionCount(0)
+{}
+
+void Infinario::EndpointSelector::SetEndpoints(const std::vector<std::string> &uris)
+{
+	this->_endpoints.clear();
+	for (std::vector<std::string>::const_iterator it = uris.begin(), end = uris.end(); it != end; ++it) {
+		this->_endpoints.push_back(Endpoint(*it));
+	}
+	this->_selectionCount = 0;
+}
 
-		s3eThreadLockAcquire(requestManager._internalLock);
-		
-		// Remove current request from queue.
-		requestManager._requestsQueue.pop();
+uint32 Infinario::EndpointSelector::Select(const int64 now)
+{
+	const uint32 endpointCount = static_cast<uint32>(this->_endpoints.size());
+	if (endpointCount == 0) {
+		return EndpointSelector::_noEndpoint;
+	}
+	++this->_selectionCount;
+
+	// An endpoint which was never measured is tried first, otherwise the cheapest and the least recently used healthy
+	// endpoints are found. If all endpoints are avoided, the one whose backoff ends first is tried.
+	uint32 cheapest = EndpointSelector::_noEndpoint;
+	uint32 leastRecent = EndpointSelector::_noEndpoint;
+	uint32 firstRecovering = 0;
+	uint64 cheapestCost = 0;
+	for (uint32 i = 0; i < endpointCount; ++i) {
+		const Endpoint &endpoint(this->_endpoints[i]);
+		if (endpoint._avoidedUntil > now) {
+			if (endpoint._avoidedUntil < this->_endpoints[firstRecovering]._avoidedUntil) {
+				firstRecovering = i;
+			}
+			continue;
+		}
+		if (!endpoint._isMeasured) {
+			cheapest = i;
+			break;
+		}
 
-		s3eThreadLockRelease(requestManager._internalLock);		
+		const uint64 cost = EndpointSelector::GetCost(endpoint);
+		if ((cheapest == EndpointSelector::_noEndpoint) || (cost < cheapestCost)) {
+			cheapest = i;
+			cheapestCost = cost;
+		}
+		if ((leastRecent == EndpointSelector::_noEndpoint)
+			|| (endpoint._lastSelection < this->_endpoints[leastRecent]._lastSelection))
+		{
+			leastRecent = i;
+		}
+	}
 
-		// Continue in the request execution chain.
-		requestManager.Execute();
-		return 0;
+	uint32 selected = cheapest;
+	if (selected == EndpointSelector::_noEndpoint) {
+		selected = firstRecovering;
+	} else if ((this->_selectionCount % EndpointSelector::_probeInterval == 0) && this->_endpoints[cheapest]._isMeasured
+		&& (leastRecent != EndpointSelector::_noEndpoint))
+	{
+		selected = leastRecent;
 	}
 
-	// Set estimated buffer length.
-	requestManager._accumulatedBodyLength = requestManager._httpClient->ContentExpected();
-	if (requestManager._accumulatedBodyLength == 0) {
-		requestManager._accumulatedBodyLength = RequestManager::_bufferSize;
+	this->_endpoints[selected]._lastSelection = this->_selectionCount;
+	++this->_endpoints[selected]._statistics._requestCount;
+	return selected;
+}
+
+const std::string &Infinario::EndpointSelector::GetUri(const uint32 index) const
+{
+	return this->_endpoints[index]._statistics._uri;
+}
+
+bool Infinario::EndpointSelector::HasHealthyAlternative(const uint32 index, const int64 now) const
+{
+	for (uint32 i = 0, endpointCount = static_cast<uint32>(this->_endpoints.size()); i < endpointCount; ++i) {
+		if ((i != index) && (this->_endpoints[i]._avoidedUntil <= now)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void Infinario::EndpointSelector::OnSuccess(const uint32 index, const uint32 roundTripTime)
+{
+	// The measurements are smoothed the same way as the batch controller's.
+	Endpoint &endpoint(this->_endpoints[index]);
+	EndpointStatistics &statistics(endpoint._statistics);
+	if (!endpoint._isMeasured) {
+		statistics._roundTripTime = roundTripTime;
+		endpoint._isMeasured = true;
+	} else {
+		statistics._roundTripTime = (7 * statistics._roundTripTime + roundTripTime) / 8;
+	}
+	statistics._errorRate = (7 * statistics._errorRate) / 8;
+	endpoint._consecutiveFailureCount = 0;
+	endpoint._avoidedUntil = 0;
+}
+
+void Infinario::EndpointSelector::OnFailure(const uint32 index, const int64 now)
+{
+	Endpoint &endpoint(this->_endpoints[index]);
+	EndpointStatistics &statistics(endpoint._statistics);
+	++statistics._failureCount;
+	statistics._errorRate = (7 * statistics._errorRate + 1000) / 8;
+
+	// The backoff doubles with every consecutive failure.
+	uint32 backoff = EndpointSelector::_maxBackoff;
+	if (endpoint._consecutiveFailureCount < 16) {
+		backoff = EndpointSelector::_minBackoff << endpoint._consecutiveFailureCount;
+		if (backoff > EndpointSelector::_maxBackoff) {
+			backoff = EndpointSelector::_maxBackoff;
+		}
+	}
+	++endpoint._consecutiveFailureCount;
+	endpoint._avoidedUntil = now + backoff;
+}
+
+void Infinario::EndpointSelector::GetStatistics(const int64 now, std::vector<EndpointStatistics> &statistics) const
+{
+	statistics.clear();
+	for (std::vector<Endpoint>::const_iterator it = this->_endpoints.begin(), end = this->_endpoints.end(); it != end;
+		++it)
+	{
+		statistics.push_back(it->_statistics);
+		statistics.back()._isHealthy = it->_avoidedUntil <= now;
+	}
+}
+
+uint64 Infinario::EndpointSelector::GetCost(const Endpoint &endpoint)
+{
+	// One is added so that the error rate also orders endpoints which respond instantly.
+	return (static_cast<uint64>(endpoint._statistics._roundTripTime) + 1) * (400 + endpoint._statistics._errorRate);
+}
+
+const uint32 Infinario::Pacer::_minInterval = 1000;
+const uint32 Infinario::Pacer::_maxInterval = 300000;
+const uint32 Infinario::Pacer::_maxRetryAfter = 3600000;
+
+Infinario::Pacer &Infinario::Pacer::GetInstance()
+{
+	static Pacer pacer;
+	return pacer;
+}
+
+Infinario::Pacer::Pacer()
+: _lock(s3eThreadLockCreate())
+, _resumeTime(0)
+, _lastSendTime(0)
+, _interval(0)
+{}
+
+uint32 Infinario::Pacer::GetDelay(const int64 now) const
+{
+	s3eThreadLockAcquire(this->_lock);
+
+	int64 sendTime = this->_resumeTime;
+	if ((this->_interval > 0) && (this->_lastSendTime + this->_interval > sendTime)) {
+		sendTime = this->_lastSendTime + this->_interval;
+	}
+
+	s3eThreadLockRelease(this->_lock);
+
+	return (sendTime > now) ? static_cast<uint32>(sendTime - now) : 0;
+}
+
+void Infinario::Pacer::OnSend(const int64 now)
+{
+	s3eThreadLockAcquire(this->_lock);
+
+	this->_lastSendTime = now;
+
+	s3eThreadLockRelease(this->_lock);
+}
+
+void Infinario::Pacer::OnSuccess()
+{
+	s3eThreadLockAcquire(this->_lock);
+
+	// Return to the full rate gradually, so that a recovering server is not flooded by the backlog at once.
+	this->_interval -= this->_interval / 4;
+	if (this->_interval < Pacer::_minInterval) {
+		this->_interval = 0;
+	}
+
+	s3eThreadLockRelease(this->_lock);
+}
+
+void Infinario::Pacer::OnThrottled(const int64 now, const std::string &retryAfter)
+{
+	s3eThreadLockAcquire(this->_lock);
+
+	if (this->_interval == 0) {
+		this->_interval = Pacer::_minInterval;
+	} else if (this->_interval < Pacer::_maxInterval / 2) {
+		this->_interval *= 2;
+	} else {
+		this->_interval = Pacer::_maxInterval;
+	}
+
+	// Only the delay-seconds form of Retry-After is honored, a HTTP date falls back to the backoff. Without a hint
+	// from the server the pause is randomized, so that the clients rejected together do not come back together.
+	uint32 pause = 0;
+	bool isRetryAfterValid = !retryAfter.empty() && (retryAfter.size() <= 9);
+	for (std::string::size_type i = 0, size = retryAfter.size(); isRetryAfterValid && (i < size); ++i) {
+		if ((retryAfter[i] < '0') || (retryAfter[i] > '9')) {
+			isRetryAfterValid = false;
+		} else {
+			pause = pause * 10 + static_cast<uint32>(retryAfter[i] - '0');
+		}
+	}
+	if (isRetryAfterValid) {
+		pause = (pause < Pacer::_maxRetryAfter / 1000) ? pause * 1000 : Pacer::_maxRetryAfter;
+	} else {
+		pause = this->_interval / 2 + static_cast<uint32>(IwRandMinMax(0, static_cast<int32>(this->_interval / 2)));
+	}
+
+	if (now + pause > this->_resumeTime) {
+		this->_resumeTime = now + pause;
+	}
+
+	s3eThreadLockRelease(this->_lock);
+}
+
+bool Infinario::Pacer::IsThrottled(const uint32 responseCode)
+{
+	return (responseCode == 429) || (responseCode == 503);
+}
+
+void Infinario::BulkEncoder::Encode(const BulkFormat format, const RequestQueue &requests, const uint32 begin,
+	const uint32 count, std::string &body)
+{
+	if (format == BulkFormat::Compact) {
+		BulkEncoder::EncodeCompact(requests, begin, count, body);
+	} else if (format == BulkFormat::MessagePack) {
+		BulkEncoder::EncodeMessagePack(requests, begin, count, body);
+	} else {
+		BulkEncoder::EncodeJson(requests, begin, count, body);
+	}
+}
+
+void Infinario::BulkEncoder::EncodeJson(const RequestQueue &requests, const uint32 begin, const uint32 count,
+	std::string &body)
+{
+	size_t length = 32;
+	for (uint32 i = begin, end = begin + count; i < end; ++i) {
+		length += requests.GetCommandLength(i) + 2;
+	}
+
+	body.reserve(length);
+	body.assign("{ \"commands\": [");
+	for (uint32 i = begin, end = begin + count; i < end; ++i) {
+		if (i != begin) {
+			body.append(", ");
+		}
+		body.append(requests.GetCommand(i), requests.GetCommandLength(i));
+	}
+	body.append("]}");
+}
+
+void Infinario::BulkEncoder::EncodeCompact(const RequestQueue &requests, const uint32 begin, const uint32 count,
+	std::string &body)
+{
+	size_t length = 128;
+	for (uint32 i = begin, end = begin + count; i < end; ++i) {
+		length += requests.GetCommandLength(i) + 2;
+	}
+
+	// Track commands are cut into their identity, which is listed once per batch, and the event members, which are
+	// preceded by the identity's index, the timestamp's difference from the first event's one and the idempotency id if
+	// there is one. Other commands are sent as they are. A batch usually holds the commands of just a few customers, so
+	// identities are searched for linearly, each stored as the position of the first request carrying it.
+	std::vector<uint32> identities;
+	int64 baseTimestamp = 0;
+	body.reserve(length);
+	body.assign("{ \"commands\": [");
+	for (uint32 i = begin, end = begin + count; i < end; ++i) {
+		const char *command = requests.GetCommand(i);
+		const uint32 commandLength = requests.GetCommandLength(i);
+		const uint32 identityLength = requests.GetIdentityLength(i);
+		if (i != begin) {
+			body.append(", ");
+		}
+		if (identityLength == 0) {
+			body.append(command, commandLength);
+			continue;
+		}
+
+		const char *identity = command + requests.GetIdentityOffset(i);
+		uint32 identityIndex = 0;
+		for (const uint32 identityCount = static_cast<uint32>(identities.size()); identityIndex < identityCount;
+			++identityIndex)
+		{
+			const uint32 identityPosition = identities[identityIndex];
+			if ((requests.GetIdentityLength(identityPosition) == identityLength)
+				&& (std::memcmp(requests.GetCommand(identityPosition) + requests.GetIdentityOffset(identityPosition),
+				identity, identityLength) == 0))
+			{
+				break;
+			}
+		}
+		if (identities.empty()) {
+			baseTimestamp = requests.GetTimestamp(i);
+		}
+		if (identityIndex == identities.size()) {
+			identities.push_back(i);
+		}
+
+		const uint32 eventOffset = requests.GetEventOffset(i);
+		body.append("{ \"i\": ");
+		BulkEncoder::AppendInteger(body, identityIndex);
+		body.append(", \"t\": ");
+		BulkEncoder::AppendInteger(body, requests.GetTimestamp(i) - baseTimestamp);
+		body.append(", ");
+		const uint32 commandIdOffset = requests.GetCommandIdOffset(i);
+		if (commandIdOffset != 0) {
+			body.append("\"c\": \"").append(command + commandIdOffset, CommandIdSource::_length).append("\", ");
+		}
+		body.append(command + eventOffset, commandLength - eventOffset - 1);
+	}
+
+	char formattedTimestamp[TimestampSource::_maxFormattedLength + 1];
+	const uint32 formattedTimestampLength = TimestampSource::Format(baseTimestamp, formattedTimestamp);
+	body.append("], \"format\": \"compact\", \"base_timestamp\": ");
+	body.append(formattedTimestamp, formattedTimestampLength);
+	body.append(", \"identities\": [");
+	for (std::vector<uint32>::const_iterator it = identities.begin(), end = identities.end(); it != end; ++it) {
+		if (it != identities.begin()) {
+			body.append(", ");
+		}
+		body.append("{ ");
+		body.append(requests.GetCommand(*it) + requests.GetIdentityOffset(*it), requests.GetIdentityLength(*it));
+		body.append(" }");
+	}
+	body.append("]}");
+}
+
+void Infinario::BulkEncoder::EncodeMessagePack(const RequestQueue &requests, const uint32 begin, const uint32 count,
+	std::string &body)
+{
+	size_t length = 16;
+	for (uint32 i = begin, end = begin + count; i < end; ++i) {
+		length += requests.GetCommandLength(i);
+	}
+
+	// The body has the same structure as a JSON one. The members of track commands are converted separately, so that
+	// their timestamp is written natively instead of being parsed back from its text. A command whose JSON turns out
+	// to be malformed is sent as nil, so that the server rejects only that command. The events of a batch usually share
+	// a single identity, so its conversion is copied from the previous event when they do.
+	const char *cachedIdentity = NULL;
+	uint32 cachedIdentityLength = 0;
+	size_t identityPosition = 0;
+	size_t identitySize = 0;
+	body.reserve(length);
+	body.clear();
+	MessagePackWriter::AppendMapHeader(body, 1);
+	MessagePackWriter::AppendString(body, "commands");
+	MessagePackWriter::AppendArrayHeader(body, count);
+	for (uint32 i = begin, end = begin + count; i < end; ++i) {
+		const char *command = requests.GetCommand(i);
+		const uint32 commandLength = requests.GetCommandLength(i);
+		const uint32 identityLength = requests.GetIdentityLength(i);
+		const size_t commandPosition = body.size();
+		if (identityLength == 0) {
+			if (!MessagePackWriter::AppendJson(body, command, commandLength)) {
+				MessagePackWriter::AppendNil(body);
+			}
+			continue;
+		}
+
+		const uint32 commandIdOffset = requests.GetCommandIdOffset(i);
+		MessagePackWriter::AppendMapHeader(body, (commandIdOffset != 0) ? 3 : 2);
+		MessagePackWriter::AppendString(body, "name");
+		MessagePackWriter::AppendString(body, "crm/events");
+		if (commandIdOffset != 0) {
+			MessagePackWriter::AppendString(body, "command_id");
+			MessagePackWriter::AppendString(body, command + commandIdOffset, CommandIdSource::_length);
+		}
+		MessagePackWriter::AppendString(body, "data");
+		MessagePackWriter::AppendMapHeader(body, 5);
+
+		const char *identity = command + requests.GetIdentityOffset(i);
+		const uint32 eventOffset = requests.GetEventOffset(i);
+		uint32 identityMemberCount = 0;
+		uint32 eventMemberCount = 0;
+		if ((cachedIdentity != NULL) && (cachedIdentityLength == identityLength)
+			&& (std::memcmp(cachedIdentity, identity, identityLength) == 0))
+		{
+			// Reserving first keeps the copied bytes in place.
+			body.reserve(body.size() + identitySize);
+			body.append(body, identityPosition, identitySize);
+			identityMemberCount = 2;
+		} else {
+			identityPosition = body.size();
+			if (!MessagePackWriter::AppendJsonMembers(body, identity, identityLength, identityMemberCount)) {
+				identityMemberCount = 0;
+			}
+			identitySize = body.size() - identityPosition;
+			cachedIdentity = (identityMemberCount == 2) ? identity : NULL;
+			cachedIdentityLength = identityLength;
+		}
+		MessagePackWriter::AppendString(body, "timestamp");
+		MessagePackWriter::AppendTimestamp(body, requests.GetTimestamp(i));
+		if (!MessagePackWriter::AppendJsonMembers(body, command + eventOffset, commandLength - eventOffset - 2,
+			eventMemberCount))
+		{
+			eventMemberCount = 0;
+		}
+
+		if ((identityMemberCount != 2) || (eventMemberCount != 2)) {
+			// An identity converted for this command is discarded with it, so it can't be copied any more.
+			if (identityPosition >= commandPosition) {
+				cachedIdentity = NULL;
+			}
+			body.resize(commandPosition);
+			MessagePackWriter::AppendNil(body);
+		}
+	}
+}
+
+void Infinario::BulkEncoder::AppendInteger(std::string &body, const int64 value)
+{
+	// Digits are written backwards from the end of a temporary buffer.
+	char digits[24];
+	char *digit = digits + sizeof(digits);
+
+	uint64 magnitude = static_cast<uint64>((value < 0) ? -value : value);
+	do {
+		*(--digit) = static_cast<char>('0' + (magnitude % 10));
+		magnitude /= 10;
+	} while (magnitude > 0);
+	if (value < 0) {
+		*(--digit) = '-';
+	}
+	body.append(digit, digits + sizeof(digits));
+}
+
+Infinario::PreparedBatch::PreparedBatch()
+: _begin(0)
+, _count(0)
+, _body()
+{}
+
+const uint32 Infinario::DrainPool::_maxThreadCount = 8;
+
+Infinario::DrainPool::DrainPool(const uint32 threadCount)
+: _threadCount((threadCount > 0) ? threadCount : static_cast<uint32>(s3eDeviceGetInt(S3E_DEVICE_NUM_CPU_CORES)))
+, _threads()
+, _lock(s3eThreadLockCreate())
+, _startSemaphore(s3eThreadSemCreate(0))
+, _doneSemaphore(s3eThreadSemCreate(0))
+, _isTerminating(false)
+, _format(BulkFormat::Json)
+, _requests(NULL)
+, _batches(NULL)
+, _nextShare(0)
+{
+	if ((this->_threadCount == 0) || !s3eThreadAvailable()) {
+		this->_threadCount = 1;
+	} else if (this->_threadCount > DrainPool::_maxThreadCount) {
+		this->_threadCount = DrainPool::_maxThreadCount;
+	}
+
+	for (uint32 i = 1; i < this->_threadCount; ++i) {
+		this->_threads.push_back(s3eThreadCreate(DrainPool::WorkerThread, reinterpret_cast<void *>(this)));
+	}
+}
+
+Infinario::DrainPool::~DrainPool()
+{
+	this->_isTerminating = true;
+	for (uint32 i = 0, count = static_cast<uint32>(this->_threads.size()); i < count; ++i) {
+		s3eThreadSemPost(this->_startSemaphore);
+	}
+	for (std::vector<s3eThread *>::iterator it = this->_threads.begin(), end = this->_threads.end(); it != end; ++it) {
+		s3eThreadJoin(*it);
+	}
+
+	s3eThreadSemDestroy(this->_doneSemaphore);
+	s3eThreadSemDestroy(this->_startSemaphore);
+	s3eThreadLockDestroy(this->_lock);
+}
+
+uint32 Infinario::DrainPool::GetThreadCount() const
+{
+	return this->_threadCount;
+}
+
+void Infinario::DrainPool::Build(const BulkFormat format, const RequestQueue &requests,
+	std::vector<PreparedBatch> &batches)
+{
+	INFINARIO_TRACE_SCOPE("DrainPool.Build");
+
+	this->_format = format;
+	this->_requests = &requests;
+	this->_batches = &batches;
+	this->_nextShare = 0;
+
+	// The semaphores order the job's setup before the workers read it and their results before the caller does.
+	const uint32 workerCount = static_cast<uint32>(this->_threads.size());
+	for (uint32 i = 0; i < workerCount; ++i) {
+		s3eThreadSemPost(this->_startSemaphore);
+	}
+	this->BuildShares();
+	for (uint32 i = 0; i < workerCount; ++i) {
+		s3eThreadSemWait(this->_doneSemaphore);
+	}
+
+	this->_requests = NULL;
+	this->_batches = NULL;
+}
+
+void *Infinario::DrainPool::WorkerThread(void *pool)
+{
+	DrainPool &drainPool = *(reinterpret_cast<DrainPool *>(pool));
+
+	for (;;) {
+		s3eThreadSemWait(drainPool._startSemaphore);
+		if (drainPool._isTerminating) {
+			break;
+		}
+
+		drainPool.BuildShares();
+		s3eThreadSemPost(drainPool._doneSemaphore);
+	}
+
+	INFINARIO_TRACE_RELEASE_THREAD();
+	return NULL;
+}
+
+void Infinario::DrainPool::BuildShares()
+{
+	// Each thread takes a contiguous share of the batches, so that a thread hand-off is paid per share, not per batch.
+	const uint32 batchCount = static_cast<uint32>(this->_batches->size());
+	for (;;) {
+		s3eThreadLockAcquire(this->_lock);
+		const uint32 share = this->_nextShare;
+		if (share < this->_threadCount) {
+			++this->_nextShare;
+		}
+		s3eThreadLockRelease(this->_lock);
+
+		if (share >= this->_threadCount) {
+			return;
+		}
+
+		for (uint32 i = share * batchCount / this->_threadCount, end = (share + 1) * batchCount / this->_threadCount;
+			i < end; ++i)
+		{
+			PreparedBatch &batch((*this->_batches)[i]);
+			BulkEncoder::Encode(this->_format, *this->_requests, batch._begin, batch._count, batch._body);
+		}
+	}
+}
+
+const uint32 Infinario::RequestManager::_bufferSize = 1024;
+const uint32 Infinario::RequestManager::_connectionIdleTimeout = 15000;
+const uint32 Infinario::RequestManager::_defaultHeaderTimeout = 30000;
+const uint32 Infinario::RequestManager::_defaultBodyTimeout = 30000;
+const uint32 Infinario::RequestManager::_drainThreshold = 512;
+const uint32 Infinario::RequestManager::_maxPreparedBatches = 32;
+const uint32 Infinario::RequestManager::_maxLostResponseRetryCount = 2;
+
+Infinario::RequestManager::RequestManager(Transport *transport)
+: _transport((transport != NULL) ? transport : new IwHttpTransport())
+, _externalLock(s3eThreadLockCreate())
+, _internalLock(s3eThreadLockCreate())
+, _emptyRequestQueueCallback(NULL)
+, _emptyRequestQueueUserData(NULL)
+, _batchCallback(NULL)
+, _batchCallbackUserData(NULL)
+, _isRequestBeingProcessed(false)
+, _isLingering(false)
+, _isPaused(false)
+, _pauseStartTime(0)
+, _requestsQueue()
+, _statistics()
+, _histogramLock(s3eThreadLockCreate())
+, _batchController()
+, _bulkFormat(BulkFormat::Json)
+, _batchCount(0)
+, _batchBody()
+, _batchSendTime(0)
+, _batchHeaderTime(0)
+, _isBatchRetried(false)
+, _lostResponseRetryCount(0)
+, _isBatchFailedOver(false)
+, _endpointSelector()
+, _batchEndpoint(EndpointSelector::_noEndpoint)
+, _connectedUri()
+, _drainLock(s3eThreadLockCreate())
+, _drainPool(NULL)
+, _preparedBatches()
+, _preparedBatchesGeneration(0)
+, _headerTimeout(RequestManager::_defaultHeaderTimeout)
+, _bodyTimeout(RequestManager::_defaultBodyTimeout)
+, _isWatchdogSet(false)
+, _isReceivingBody(false)
+, _isConnectionOpen(false)
+, _isConnectionReused(false)
+, _isConnectionCloseRequested(false)
+, _lastActivityTime(0)
+, _connectionStatistics()
+, _buffer(reinterpret_cast<char *>(s3eMalloc(RequestManager::_bufferSize)))
+, _bufferCapacity(RequestManager::_bufferSize)
+, _accumulatedBodyLength(0)
+, _receivedBodyLength(0)
+{}
+
+Infinario::RequestManager::~RequestManager()
+{
+	s3eThreadLockAcquire(this->_externalLock);
+
+	s3eThreadLockAcquire(this->_drainLock);
+
+	s3eThreadLockAcquire(this->_internalLock);
+
+	// By destroying this instance all queued callbacks have been canceled.
+	delete this->_transport;
+	this->_transport = NULL;
+
+	if (this->_isLingering) {
+		s3eTimerCancelTimer(RequestManager::LingerElapsed, reinterpret_cast<void *>(this));
+		this->_isLingering = false;
+	}
+	if (this->_isPaused) {
+		s3eTimerCancelTimer(RequestManager::PauseElapsed, reinterpret_cast<void *>(this));
+		this->_isPaused = false;
+	}
+	this->CancelWatchdog();
+
+	// Prepare data for empty request queue callback.
+	bool wasQueueEmptyAtStart = this->_requestsQueue.IsEmpty();
+	EmptyRequestQueueCallback emptyRequestQueueCallback = this->_emptyRequestQueueCallback;
+	void *emptyRequestQueueUserData = this->_emptyRequestQueueUserData;
+
+	s3eThreadLockRelease(this->_internalLock);	
+
+	// Call the callbacks of the batch currently being sent and of the remaining queued requests.
+	std::vector<Request> killedRequests;
+	killedRequests.reserve(this->_requestsQueue.GetSize());
+	for (uint32 i = 0, count = this->_requestsQueue.GetSize(); i < count; ++i) {
+		killedRequests.push_back(this->_requestsQueue.Get(i, i >= this->_batchCount));
+	}
+	this->CallResponseCallbacks(killedRequests, this->_batchCount, NULL, ResponseStatus::KilledError, this->_buffer,
+		this->_receivedBodyLength);
+	this->CallBatchCallback(killedRequests, ResponseStatus::KilledError, this->_buffer, this->_receivedBodyLength);
+	this->_requestsQueue.Clear();
+	this->_batchCount = 0;
+
+	s3eFree(reinterpret_cast<void *>(this->_buffer));
+	delete this->_drainPool;
+	this->ClearPreparedBatches();
+
+	s3eThreadLockRelease(this->_drainLock);
+
+	s3eThreadLockRelease(this->_externalLock);
+
+	s3eThreadLockDestroy(this->_histogramLock);
+	s3eThreadLockDestroy(this->_internalLock);
+	s3eThreadLockDestroy(this->_drainLock);
+	s3eThreadLockDestroy(this->_externalLock);
+
+	// Call the empty request queue function if it was supplied.
+	if (!wasQueueEmptyAtStart && (emptyRequestQueueCallback != NULL)) {
+		emptyRequestQueueCallback(emptyRequestQueueUserData);
+	}
+}
+
+void Infinario::RequestManager::SetProxy(const std::string &proxy)
+{
+	s3eThreadLockAcquire(this->_externalLock);
+
+	s3eThreadLockAcquire(this->_internalLock);
+
+	this->_transport->SetProxy(proxy.c_str());
+
+	s3eThreadLockRelease(this->_internalLock);
+
+	s3eThreadLockRelease(this->_externalLock);
+}
+
+void Infinario::RequestManager::ClearProxy()
+{
+	s3eThreadLockAcquire(this->_externalLock);
+
+	s3eThreadLockAcquire(this->_internalLock);
+
+	this->_transport->SetProxy(NULL);
+
+	s3eThreadLockRelease(this->_internalLock);
+
+	s3eThreadLockRelease(this->_externalLock);
+}
+
+void Infinario::RequestManager::SetEmptyRequestQueueCallback(EmptyRequestQueueCallback callback, void *userData)
+{
+	s3eThreadLockAcquire(this->_externalLock);
+	
+	s3eThreadLockAcquire(this->_internalLock);
+
+	this->_emptyRequestQueueCallback = callback;
+	this->_emptyRequestQueueUserData = userData;
+
+	s3eThreadLockRelease(this->_internalLock);
+	
+	s3eThreadLockRelease(this->_externalLock);
+}
+
+void Infinario::RequestManager::ClearEmptyRequestQueueCallback()
+{
+	s3eThreadLockAcquire(this->_externalLock);
+	
+	s3eThreadLockAcquire(this->_internalLock);
+
+	this->_emptyRequestQueueCallback = NULL;
+	this->_emptyRequestQueueUserData = NULL;
+
+	s3eThreadLockRelease(this->_internalLock);
+
+	s3eThreadLockRelease(this->_externalLock);
+}
+
+void Infinario::RequestManager::SetBatchCallback(BatchCallback callback, void *userData)
+{
+	s3eThreadLockAcquire(this->_externalLock);
+
+	s3eThreadLockAcquire(this->_internalLock);
+
+	this->_batchCallback = callback;
+	this->_batchCallbackUserData = userData;
+
+	s3eThreadLockRelease(this->_internalLock);
+
+	s3eThreadLockRelease(this->_externalLock);
+}
+
+void Infinario::RequestManager::ClearBatchCallback()
+{
+	s3eThreadLockAcquire(this->_externalLock);
+
+	s3eThreadLockAcquire(this->_internalLock);
+
+	this->_batchCallback = NULL;
+	this->_batchCallbackUserData = NULL;
+
+	s3eThreadLockRelease(this->_internalLock);
+
+	s3eThreadLockRelease(this->_externalLock);
+}
+
+void Infinario::RequestManager::SetTimeouts(const uint32 headerTimeout, const uint32 bodyTimeout)
+{
+	s3eThreadLockAcquire(this->_externalLock);
+
+	s3eThreadLockAcquire(this->_internalLock);
+
+	this->_headerTimeout = headerTimeout;
+	this->_bodyTimeout = bodyTimeout;
+
+	s3eThreadLockRelease(this->_internalLock);
+
+	s3eThreadLockRelease(this->_externalLock);
+}
+
+void Infinario::RequestManager::SetParallelDrain(const uint32 threadCount)
+{
+	s3eThreadLockAcquire(this->_externalLock);
+
+	s3eThreadLockAcquire(this->_drainLock);
+
+	s3eThreadLockAcquire(this->_internalLock);
+
+	// The pool is only used while the drain lock is held, so it is idle.
+	delete this->_drainPool;
+	this->_drainPool = new DrainPool(threadCount);
+
+	s3eThreadLockRelease(this->_internalLock);
+
+	s3eThreadLockRelease(this->_drainLock);
+
+	s3eThreadLockRelease(this->_externalLock);
+}
+
+void Infinario::RequestManager::ClearParallelDrain()
+{
+	s3eThreadLockAcquire(this->_externalLock);
+
+	s3eThreadLockAcquire(this->_drainLock);
+
+	s3eThreadLockAcquire(this->_internalLock);
+
+	delete this->_drainPool;
+	this->_drainPool = NULL;
+
+	s3eThreadLockRelease(this->_internalLock);
+
+	s3eThreadLockRelease(this->_drainLock);
+
+	s3eThreadLockRelease(this->_externalLock);
+}
+
+void Infinario::RequestManager::SetBulkFormat(const BulkFormat format)
+{
+	s3eThreadLockAcquire(this->_externalLock);
+
+	s3eThreadLockAcquire(this->_internalLock);
+
+	// Bodies prepared in the previous format are built again.
+	this->_bulkFormat = format;
+	this->ClearPreparedBatches();
+
+	s3eThreadLockRelease(this->_internalLock);
+
+	s3eThreadLockRelease(this->_externalLock);
+}
+
+Infinario::BulkFormat Infinario::RequestManager::GetBulkFormat() const
+{
+	s3eThreadLockAcquire(this->_internalLock);
+
+	const BulkFormat result = this->_bulkFormat;
+
+	s3eThreadLockRelease(this->_internalLock);
+
+	return result;
+}
+
+Infinario::BatchEstimates Infinario::RequestManager::GetBatchEstimates() const
+{
+	s3eThreadLockAcquire(this->_internalLock);
+
+	BatchEstimates result(this->_batchController.GetEstimates());
+
+	s3eThreadLockRelease(this->_internalLock);
+
+	return result;
+}
+
+void Infinario::RequestManager::SetEndpoints(const std::vector<std::string> &uris)
+{
+	s3eThreadLockAcquire(this->_externalLock);
+
+	s3eThreadLockAcquire(this->_internalLock);
+
+	// The result of a batch being sent is not attributed to the new endpoints. The connection is closed by the next
+	// call to Execute, since its uri differs from the chosen one.
+	this->_endpointSelector.SetEndpoints(uris);
+	this->_batchEndpoint = EndpointSelector::_noEndpoint;
+
+	s3eThreadLockRelease(this->_internalLock);
+
+	s3eThreadLockRelease(this->_externalLock);
+}
+
+std::vector<Infinario::EndpointStatistics> Infinario::RequestManager::GetEndpointStatistics() const
+{
+	std::vector<EndpointStatistics> result;
+
+	s3eThreadLockAcquire(this->_internalLock);
+
+	this->_endpointSelector.GetStatistics(s3eTimerGetMs(), result);
+
+	s3eThreadLockRelease(this->_internalLock);
+
+	return result;
+}
+
+Infinario::ConnectionStatistics Infinario::RequestManager::GetConnectionStatistics() const
+{
+	s3eThreadLockAcquire(this->_internalLock);
+
+	ConnectionStatistics result(this->_connectionStatistics);
+
+	s3eThreadLockRelease(this->_internalLock);
+
+	return result;
+}
+
+Infinario::Statistics Infinario::RequestManager::GetStats() const
+{
+	Statistics result;
+
+	// Only the counters are copied while holding the lock queueing events contends for, the histograms take
+	// a kilobyte each and are copied under their own lock.
+	s3eThreadLockAcquire(this->_internalLock);
+
+	result._enqueuedCount = this->_statistics._enqueuedCount;
+	result._sentCount = this->_statistics._sentCount;
+	for (uint32 i = 0; i < ResponseStatusCount; ++i) {
+		result._responseStatusCounts[i] = this->_statistics._responseStatusCounts[i];
+	}
+	result._queueDepth = this->_statistics._queueDepth;
+	result._queueHighWaterMark = this->_statistics._queueHighWaterMark;
+	result._queueBytes = this->_statistics._queueBytes;
+	if (!this->_requestsQueue.IsEmpty()) {
+		result._oldestQueuedAge = static_cast<uint32>(s3eTimerGetMs() - this->_requestsQueue.GetEnqueueTime(0));
+	}
+	result._requestCount = this->_statistics._requestCount;
+	result._requestBytes = this->_statistics._requestBytes;
+	result._responseBytes = this->_statistics._responseBytes;
+
+	s3eThreadLockRelease(this->_internalLock);
+
+	s3eThreadLockAcquire(this->_histogramLock);
+
+	result._enqueueToAckLatency = this->_statistics._enqueueToAckLatency;
+	result._roundTripTime = this->_statistics._roundTripTime;
+
+	s3eThreadLockRelease(this->_histogramLock);
+
+	return result;
+}
+
+void Infinario::RequestManager::Enqueue(const Request &request)
+{
+	{
+		INFINARIO_TRACE_SCOPE("Enqueue.LockWait");
+
+		s3eThreadLockAcquire(this->_externalLock);
+
+		s3eThreadLockAcquire(this->_internalLock);
+	}
+
+	if (this->_transport == NULL) {
+		s3eThreadLockRelease(this->_internalLock);
+		s3eThreadLockRelease(this->_externalLock);
+		return;
+	}
+
+	this->_requestsQueue.PushBack(request, s3eTimerGetMs());
+
+	++this->_statistics._enqueuedCount;
+	this->_statistics._queueDepth = this->_requestsQueue.GetSize();
+	if (this->_statistics._queueDepth > this->_statistics._queueHighWaterMark) {
+		this->_statistics._queueHighWaterMark = this->_statistics._queueDepth;
+	}
+	this->_statistics._queueBytes = this->_requestsQueue.GetCommandBytes();
+
+	// Determine whether a batch should be sent right away or whether we should wait for it to fill up.
+	const BatchEstimates &estimates(this->_batchController.GetEstimates());
+	const bool isBatchFull = this->_requestsQueue.GetSize() >= estimates._batchSize;
+	bool execute = false;
+	if (!this->_isRequestBeingProcessed) {
+		if (isBatchFull || (estimates._lingerTime == 0)) {
+			execute = true;
+		} else {
+			this->_isRequestBeingProcessed = true;
+			this->_isLingering = true;
+			s3eTimerSetTimer(estimates._lingerTime, RequestManager::LingerElapsed, reinterpret_cast<void *>(this));
+		}
+	} else if (this->_isLingering && isBatchFull) {
+		s3eTimerCancelTimer(RequestManager::LingerElapsed, reinterpret_cast<void *>(this));
+		this->_isLingering = false;
+		execute = true;
+	}
+
+	s3eThreadLockRelease(this->_internalLock);
+
+	// If the manager is in request processing mode the call chain will execute all queued requests.
+	if (execute) {
+		// Initialize the execute call chain.
+		this->Execute(false);
+	}
+
+	s3eThreadLockRelease(this->_externalLock);
+
+	// The following batches are prepared without blocking the other threads queueing requests.
+	if (execute) {
+		this->PrepareBatches();
+	}
+}
+
+void Infinario::RequestManager::Reject(const ResponseStatus responseStatus, ResponseCallback callback,
+	ResponseViewCallback viewCallback, void *userData, void *tag, const void *owner)
+{
+	s3eThreadLockAcquire(this->_externalLock);
+
+	s3eThreadLockAcquire(this->_internalLock);
+
+	++this->_statistics._responseStatusCounts[static_cast<uint32>(responseStatus)];
+	const bool hasCallbacks = (callback != NULL) || (viewCallback != NULL) || (this->_batchCallback != NULL);
+
+	s3eThreadLockRelease(this->_internalLock);
+
+	// Most rejected commands have no callback, they do not pay for building a request.
+	if (hasCallbacks) {
+		std::vector<Request> rejectedRequests(1,
+			Request(std::string(), std::string(), callback, userData, owner, 0, viewCallback));
+		rejectedRequests[0]._tag = tag;
+		this->CallResponseCallbacks(rejectedRequests, 0, NULL, responseStatus, NULL, 0);
+		this->CallBatchCallback(rejectedRequests, responseStatus, NULL, 0);
+	}
+
+	s3eThreadLockRelease(this->_externalLock);
+}
+
+void Infinario::RequestManager::Detach(const void *owner)
+{
+	s3eThreadLockAcquire(this->_externalLock);
+
+	s3eThreadLockAcquire(this->_internalLock);
+
+	// Requests being sent can't be removed, only their callbacks are cleared and they are reported to the batch
+	// callback once they are finalized. The remaining requests are removed.
+	std::vector<Request> killedRequests;
+	std::vector<Request> removedRequests;
+	std::vector<uint32> removedPositions;
+	for (uint32 i = 0, count = this->_requestsQueue.GetSize(); i < count; ++i) {
+		if (this->_requestsQueue.GetOwner(i) != owner) {
+			continue;
+		}
+
+		killedRequests.push_back(this->_requestsQueue.Get(i));
+		if (i < this->_batchCount) {
+			this->_requestsQueue.ClearCallbacks(i);
+		} else {
+			removedRequests.push_back(killedRequests.back());
+			removedPositions.push_back(i);
+			++this->_statistics._responseStatusCounts[static_cast<uint32>(ResponseStatus::KilledError)];
+		}
+	}
+	this->_requestsQueue.Erase(removedPositions);
+	this->_statistics._queueDepth = this->_requestsQueue.GetSize();
+	this->_statistics._queueBytes = this->_requestsQueue.GetCommandBytes();
+	if (!removedRequests.empty()) {
+		this->ClearPreparedBatches();
+	}
+
+	s3eThreadLockRelease(this->_internalLock);
+
+	// Call callback functions if they were supplied.
+	this->CallResponseCallbacks(killedRequests, 0, NULL, ResponseStatus::KilledError, NULL, 0);
+	this->CallBatchCallback(removedRequests, ResponseStatus::KilledError, NULL, 0);
+
+	s3eThreadLockRelease(this->_externalLock);
+}
+
+// This is the callback indicating that a Post call has completed. Depending on how the server is communicating the
+// content length, we may actually know the length of the content, or we may know the length of the first part of it,
+// or we may know nothing. ContentExpected always returns the smallest possible size of the content, so allocate that
+// much space for now if it's non-zero. If it is of zero size, the server has given no indication, we use the maximum
+// size.
+int32 Infinario::RequestManager::RecieveHeader(void *systenData, void *userData)
+{
+	INFINARIO_TRACE_SCOPE("RecieveHeader");
+
+	// Initializing passed reference.
+	RequestManager &requestManager = *(reinterpret_cast<RequestManager *>(userData));
+
+	s3eThreadLockAcquire(requestManager._internalLock);
+
+	// Test for error.
+	if (requestManager._transport->GetStatus() == S3E_RESULT_ERROR) {
+		s3eThreadLockRelease(requestManager._internalLock);
+
+		requestManager.FinalizeBatch(ResponseStatus::ReceiveHeaderError);
+		return 0;
+	}
+
+	// The server is overloaded, the batch is queued again and sent once the pacer allows it.
+	if (Pacer::IsThrottled(requestManager._transport->GetResponseCode())) {
+		std::string retryAfter;
+		requestManager._transport->GetHeader("Retry-After", retryAfter);
+		Pacer::GetInstance().OnThrottled(s3eTimerGetMs(), retryAfter);
+		++requestManager._connectionStatistics._throttledCount;
+
+		s3eThreadLockRelease(requestManager._internalLock);
+
+		requestManager.RequeueBatch(true);
+		return 0;
+	}
+
+	// The server does not understand the body's format, the batch is sent again as JSON and so are all later ones.
+	if ((requestManager._transport->GetResponseCode() == 415) && (requestManager._bulkFormat != BulkFormat::Json)) {
+		requestManager._bulkFormat = BulkFormat::Json;
+
+		s3eThreadLockRelease(requestManager._internalLock);
+
+		requestManager.RequeueBatch(false);
+		return 0;
+	}
+
+	requestManager._batchHeaderTime = s3eTimerGetMs();
+	requestManager._isReceivingBody = true;
+	requestManager.SetWatchdog(requestManager._bodyTimeout);
+
+	// Check whether the server intends to close the connection after this response.
+	std::string connectionHeader;
+	requestManager._isConnectionCloseRequested = requestManager._transport->GetHeader("Connection", connectionHeader)
+		&& ((connectionHeader.find("close") != std::string::npos)
+		|| (connectionHeader.find("Close") != std::string::npos));
+
+	// Set estimated buffer length.
+	requestManager._accumulatedBodyLength = requestManager._transport->ContentExpected();
+	if (requestManager._accumulatedBodyLength == 0) {
+		requestManager._accumulatedBodyLength = RequestManager::_bufferSize;
+	}
+	if (!requestManager.ReserveBuffer(requestManager._accumulatedBodyLength)) {
+		s3eThreadLockRelease(requestManager._internalLock);
+
+		requestManager.FinalizeBatch(ResponseStatus::RecieveBodyError);
+		return 0;
+	}
+
+	// Start reading recieved data to the buffer.
+	requestManager._transport->ReadDataAsync(requestManager._buffer, requestManager._accumulatedBodyLength,
+		0, RequestManager::RecieveBody, userData);
+
+	s3eThreadLockRelease(requestManager._internalLock);
+	return 0;
+}
+
+// This is the callback indicating that a ReadDataAsync call has completed. Either we've finished, or more data
+// has been recieved. If the correct ammount of data was supplied initially, then this will only be called once.
+// However, it may well be called several times when using chunked encoding.
+int32 Infinario::RequestManager::RecieveBody(void *systenData, void *userData)
+{
+	INFINARIO_TRACE_SCOPE("RecieveBody");
+
+	// Initializing passed reference.
+	RequestManager &requestManager = *(reinterpret_cast<RequestManager *>(userData));
+
+	s3eThreadLockAcquire(requestManager._internalLock);
+
+	// Test for error.
+	if (requestManager._transport->GetStatus() == S3E_RESULT_ERROR) {
+		s3eThreadLockRelease(requestManager._internalLock);
+
+		requestManager.FinalizeBatch(ResponseStatus::RecieveBodyError);
+		return 0;
+	}
+
+	// Test if more data was recieved. The last read may have filled the requested space only partially.
+	if (requestManager._transport->ContentFinished()) {
+		requestManager._receivedBodyLength = requestManager._transport->ContentReceived();
+		if (requestManager._receivedBodyLength > requestManager._accumulatedBodyLength) {
+			requestManager._receivedBodyLength = requestManager._accumulatedBodyLength;
+		}
+
+		s3eThreadLockRelease(requestManager._internalLock);
+
+		requestManager.FinalizeBatch(ResponseStatus::Success);
+		return 0;
+	}
+	requestManager._receivedBodyLength = requestManager._accumulatedBodyLength;
+
+	// Determine current recieved data size and grow the buffer to fit it.
+	if (requestManager._accumulatedBodyLength < requestManager._transport->ContentExpected()) {
+		requestManager._accumulatedBodyLength = requestManager._transport->ContentExpected();
+	} else {
+		requestManager._accumulatedBodyLength += RequestManager::_bufferSize;
+	}
+	if (!requestManager.ReserveBuffer(requestManager._accumulatedBodyLength)) {
+		s3eThreadLockRelease(requestManager._internalLock);
+
+		requestManager.FinalizeBatch(ResponseStatus::RecieveBodyError);
+		return 0;
+	}
+
+	// Every part of the body gives the next one a full body timeout.
+	requestManager.SetWatchdog(requestManager._bodyTimeout);
+
+	// Start reading newly recieved data after the data read so far.
+	requestManager._transport->ReadDataAsync(requestManager._buffer + requestManager._receivedBodyLength,
+		requestManager._accumulatedBodyLength - requestManager._receivedBodyLength, 0, RequestManager::RecieveBody,
+		userData);
+
+	s3eThreadLockRelease(requestManager._internalLock);
+	return 0;
+}
+
+// This is the timer callback indicating that the linger time has passed without the batch filling up, so whatever has
+// been queued until now is sent.
+int32 Infinario::RequestManager::LingerElapsed(void *systemData, void *userData)
+{
+	// Initializing passed reference.
+	RequestManager &requestManager = *(reinterpret_cast<RequestManager *>(userData));
+
+	s3eThreadLockAcquire(requestManager._internalLock);
+
+	// The batch may have already been sent by Enqueue if it filled up in the meantime.
+	const bool isLingering = requestManager._isLingering;
+	requestManager._isLingering = false;
+
+	s3eThreadLockRelease(requestManager._internalLock);
+
+	if (isLingering) {
+		requestManager.Execute();
+	}
+	return 0;
+}
+
+// This is the timer callback indicating that the pause requested by the pacer is over.
+int32 Infinario::RequestManager::PauseElapsed(void *systemData, void *userData)
+{
+	// Initializing passed reference.
+	RequestManager &requestManager = *(reinterpret_cast<RequestManager *>(userData));
+
+	s3eThreadLockAcquire(requestManager._internalLock);
+
+	const bool isPaused = requestManager._isPaused;
+	requestManager._isPaused = false;
+	if (isPaused) {
+		requestManager._connectionStatistics._pausedTime += s3eTimerGetMs() - requestManager._pauseStartTime;
+	}
+
+	s3eThreadLockRelease(requestManager._internalLock);
+
+	// Another rejection may have extended the pause in the meantime, Execute checks the pacer again.
+	if (isPaused) {
+		requestManager.Execute();
+	}
+	return 0;
+}
+
+void Infinario::RequestManager::Execute(const bool isPreparationAllowed)
+{
+	INFINARIO_TRACE_SCOPE("Execute");
+
+	s3eThreadLockAcquire(this->_internalLock);
+
+	// Expired requests are only evicted here, when they reach the front of the queue or the batch being built.
+	const int64 now = s3eTimerGetMs();
+	std::vector<Request> expiredRequests;
+	uint32 expiredAtFrontCount = 0;
+	for (const uint32 queueSize = this->_requestsQueue.GetSize();
+		(expiredAtFrontCount < queueSize) && this->_requestsQueue.IsExpired(expiredAtFrontCount, now);
+		++expiredAtFrontCount)
+	{
+		expiredRequests.push_back(this->_requestsQueue.Get(expiredAtFrontCount));
+	}
+	this->_requestsQueue.PopFront(expiredAtFrontCount);
+
+	// Check if a request is available for execution, if it is set the manager to request processing mode.
+	this->_isRequestBeingProcessed = !this->_requestsQueue.IsEmpty();
+	if (!this->_isRequestBeingProcessed) {
+		this->RemoveExpired(expiredRequests);
+
+		EmptyRequestQueueCallback emptyRequestQueueCallback = this->_emptyRequestQueueCallback;
+		void *emptyRequestQueueUserData = this->_emptyRequestQueueUserData;
+
+		s3eThreadLockRelease(this->_internalLock);
+
+		this->CallExpiredCallbacks(expiredRequests);
+
+		// Call callback function if it was supplied.
+		if (emptyRequestQueueCallback != NULL) {
+			INFINARIO_TRACE_SCOPE("EmptyRequestQueueCallback");
+			emptyRequestQueueCallback(emptyRequestQueueUserData);
+		}
+
+		return;
+	}
+
+	// Hold the queue back while the server is throttling the SDK, the manager stays in request processing mode.
+	const uint32 pause = Pacer::GetInstance().GetDelay(now);
+	if (pause > 0) {
+		this->RemoveExpired(expiredRequests);
+		this->_isPaused = true;
+		this->_pauseStartTime = now;
+		s3eTimerSetTimer(pause, RequestManager::PauseElapsed, reinterpret_cast<void *>(this));
+
+		s3eThreadLockRelease(this->_internalLock);
+
+		this->CallExpiredCallbacks(expiredRequests);
+		return;
+	}
+
+	// Reset recieved data accumulation stream.
+	this->_accumulatedBodyLength = 0;
+	this->_receivedBodyLength = 0;
+
+	// Expired requests at the front may have belonged to a prepared batch.
+	if (!expiredRequests.empty()) {
+		this->ClearPreparedBatches();
+	}
+
+	// A prepared batch is sent as it is, unless some of its requests expired since it was built.
+	const bool isPreparedBatchValid = !this->_preparedBatches.empty() && (this->_requestsQueue.FindExpired(0,
+		this->_preparedBatches.front()._count, now) == this->_preparedBatches.front()._count);
+
+	// Build the bulk request body from the queued commands sharing the uri of the first one. Expired requests
+	// within the batch are evicted and the remaining ones are moved to the front of the queue.
+	const std::string uri(this->_requestsQueue.GetUri(0));
+	if (isPreparedBatchValid) {
+		this->_batchBody.swap(this->_preparedBatches.front()._body);
+		this->_batchCount = this->_preparedBatches.front()._count;
+		this->_preparedBatches.pop_front();
+	} else {
+		this->ClearPreparedBatches();
+
+		const uint32 batchSize = this->_batchController.GetEstimates()._batchSize;
+		const uint32 queueSize = this->_requestsQueue.GetSize();
+		std::vector<uint32> expiredPositions;
+		uint32 position = 0;
+		for (this->_batchCount = 0; (this->_batchCount < batchSize) && (position < queueSize); ++position) {
+			if (this->_requestsQueue.IsExpired(position, now)) {
+				expiredRequests.push_back(this->_requestsQueue.Get(position));
+				expiredPositions.push_back(position);
+				continue;
+			}
+			if (!this->_requestsQueue.IsSameUri(position, 0)) {
+				break;
+			}
+			++this->_batchCount;
+		}
+		this->_requestsQueue.Erase(expiredPositions);
+		BulkEncoder::Encode(this->_bulkFormat, this->_requestsQueue, 0, this->_batchCount, this->_batchBody);
+	}
+	this->RemoveExpired(expiredRequests);
+
+	// Send the batch to the chosen endpoint, if there are any, a connection kept alive to another one can't be reused.
+	this->_batchEndpoint = this->_endpointSelector.Select(now);
+	const std::string &targetUri((this->_batchEndpoint != EndpointSelector::_noEndpoint)
+		? this->_endpointSelector.GetUri(this->_batchEndpoint) : uri);
+	if (this->_isConnectionOpen && (targetUri != this->_connectedUri)) {
+		this->CloseConnection();
+	}
+	this->_connectedUri = targetUri;
+
+	// Close a connection that was idle for longer than the server is likely to keep it open, reusing it would fail.
+	if (this->_isConnectionOpen && ((now - this->_lastActivityTime) > RequestManager::_connectionIdleTimeout)) {
+		this->CloseConnection();
+		++this->_connectionStatistics._idleCloseCount;
+	}
+
+	this->_isConnectionReused = this->_isConnectionOpen;
+	++this->_connectionStatistics._requestCount;
+	if (this->_isConnectionReused) {
+		++this->_connectionStatistics._keptAliveRequestCount;
+	} else {
+		++this->_connectionStatistics._newConnectionCount;
+	}
+	this->_isConnectionOpen = true;
+	this->_isConnectionCloseRequested = false;
+
+	// Set request headers.
+	this->_transport->SetRequestHeader("Content-Type",
+		(this->_bulkFormat == BulkFormat::MessagePack) ? "application/x-msgpack" : "application/json");
+	this->_transport->SetRequestHeader("Connection", "keep-alive");
+
+	++this->_statistics._requestCount;
+	this->_statistics._sentCount += this->_batchCount;
+	this->_statistics._requestBytes += this->_batchBody.size();
+
+	// Send request.
+	this->_batchSendTime = now;
+	this->_batchHeaderTime = this->_batchSendTime;
+	this->_isReceivingBody = false;
+	this->SetWatchdog(this->_headerTimeout);
+	Pacer::GetInstance().OnSend(now);
+	INFINARIO_TRACE_ASYNC_BEGIN("Request", static_cast<uint32>(this->_statistics._requestCount));
+	if (this->_transport->Post(targetUri.c_str(), this->_batchBody.c_str(),
+		static_cast<int32>(this->_batchBody.size()), RequestManager::RecieveHeader,
+		reinterpret_cast<void *>(this)) == S3E_RESULT_ERROR)
+	{
+		s3eThreadLockRelease(this->_internalLock);
+
+		this->CallExpiredCallbacks(expiredRequests);
+		this->FinalizeBatch(ResponseStatus::SendRequestError);
+		return;
+	}
+
+	s3eThreadLockRelease(this->_internalLock);
+
+	this->CallExpiredCallbacks(expiredRequests);
+
+	// When a large backlog is queued, the bodies of the following batches are built while this one is being sent.
+	if (isPreparationAllowed) {
+		this->PrepareBatches();
+	}
+}
+
+void Infinario::RequestManager::PrepareBatches()
+{
+	INFINARIO_TRACE_SCOPE("PrepareBatches");
+
+	// A single thread prepares batches at a time, the others don't wait for it.
+	if (s3eThreadLockAcquire(this->_drainLock, 0) == S3E_RESULT_ERROR) {
+		return;
+	}
+
+	s3eThreadLockAcquire(this->_internalLock);
+
+	// Split the queue behind the batch being sent into batches the same way Execute would, assuming the batch size
+	// keeps growing as the batches succeed. Planning stops at the first expired request, and a trailing batch which is
+	// not full is left to Execute, as more commands may still be queued.
+	const int64 now = s3eTimerGetMs();
+	const uint32 begin = this->_batchCount;
+	const uint32 queueSize = this->_requestsQueue.GetSize();
+	std::vector<PreparedBatch> batches;
+	if ((this->_drainPool != NULL) && this->_preparedBatches.empty()
+		&& (queueSize >= begin + RequestManager::_drainThreshold))
+	{
+		const uint32 sentCount = (begin > 0) ? 1 : 0;
+		uint32 position = begin;
+		bool isExpiredFound = false;
+		while (!isExpiredFound && (batches.size() < RequestManager::_maxPreparedBatches) && (position < queueSize)) {
+			const uint32 batchSize = this->_batchController.GetProjectedBatchSize(
+				sentCount + static_cast<uint32>(batches.size()));
+			uint32 count = 0;
+			for (; (count < batchSize) && (position + count < queueSize); ++count) {
+				if (!this->_requestsQueue.IsSameUri(position + count, position)) {
+					break;
+				}
+				if (this->_requestsQueue.IsExpired(position + count, now)) {
+					isExpiredFound = true;
+					break;
+				}
+			}
+			if ((count == 0) || ((count < batchSize) && (position + count == queueSize))) {
+				break;
+			}
+
+			batches.push_back(PreparedBatch());
+			batches.back()._begin = position - begin;
+			batches.back()._count = count;
+			position += count;
+		}
+	}
+	if (batches.empty()) {
+		s3eThreadLockRelease(this->_internalLock);
+		s3eThreadLockRelease(this->_drainLock);
+		return;
+	}
+
+	// The bodies are built from a view of the planned requests without holding the lock, only their fields are copied.
+	// The queue is pinned meanwhile, so the commands stay in place even if they are sent and removed.
+	RequestQueue requests;
+	requests.AssignView(this->_requestsQueue, begin, begin + batches.back()._begin + batches.back()._count);
+	this->_requestsQueue.Pin();
+	const BulkFormat format = this->_bulkFormat;
+	const uint32 generation = this->_preparedBatchesGeneration;
+
+	s3eThreadLockRelease(this->_internalLock);
+
+	this->_drainPool->Build(format, requests, batches);
+
+	s3eThreadLockAcquire(this->_internalLock);
+
+	this->_requestsQueue.Unpin();
+
+	// The batches are published only if they still follow the batch being sent, the requests at the front of the queue
+	// did not change in the meantime.
+	if (this->_preparedBatchesGeneration == generation) {
+		for (std::vector<PreparedBatch>::iterator it = batches.begin(), end = batches.end(); it != end; ++it) {
+			this->_preparedBatches.push_back(PreparedBatch());
+			this->_preparedBatches.back()._count = it->_count;
+			this->_preparedBatches.back()._body.swap(it->_body);
+		}
+	}
+
+	s3eThreadLockRelease(this->_internalLock);
+
+	s3eThreadLockRelease(this->_drainLock);
+}
+
+void Infinario::RequestManager::ClearPreparedBatches()
+{
+	this->_preparedBatches.clear();
+	++this->_preparedBatchesGeneration;
+}
+
+void Infinario::RequestManager::RemoveExpired(const std::vector<Request> &expiredRequests)
+{
+	this->_statistics._responseStatusCounts[static_cast<uint32>(ResponseStatus::ExpiredError)] +=
+		expiredRequests.size();
+	this->_statistics._queueDepth = this->_requestsQueue.GetSize();
+	this->_statistics._queueBytes = this->_requestsQueue.GetCommandBytes();
+}
+
+void Infinario::RequestManager::CallExpiredCallbacks(const std::vector<Request> &expiredRequests)
+{
+	this->CallResponseCallbacks(expiredRequests, 0, NULL, ResponseStatus::ExpiredError, NULL, 0);
+	this->CallBatchCallback(expiredRequests, ResponseStatus::ExpiredError, NULL, 0);
+}
+
+void Infinario::RequestManager::CallResponseCallbacks(const std::vector<Request> &requests, const uint32 sentCount,
+	const CIwHTTP *httpClient, const ResponseStatus responseStatus, const char *responseBody,
+	const uint32 responseBodyLength) const
+{
+	// Callbacks taking strings are supported by copying the response only once for all of them.
+	const std::string emptyBody;
+	std::string responseBodyString;
+	bool isResponseBodyStringSet = false;
+
+	for (uint32 i = 0, count = static_cast<uint32>(requests.size()); i < count; ++i) {
+		const Request &currentRequest(requests[i]);
+		const bool isSent = i < sentCount;
+		const std::string *requestBody = isSent ? &this->_batchBody : &currentRequest._command;
+
+		if (currentRequest._viewCallback != NULL) {
+			INFINARIO_TRACE_SCOPE("ResponseCallback");
+			currentRequest._viewCallback(httpClient, requestBody->data(), static_cast<uint32>(requestBody->size()),
+				responseStatus, isSent ? responseBody : emptyBody.data(), isSent ? responseBodyLength : 0,
+				currentRequest._userData);
+		} else if (currentRequest._callback != NULL) {
+			if (isSent && !isResponseBodyStringSet) {
+				responseBodyString.assign(responseBody, responseBodyLength);
+				isResponseBodyStringSet = true;
+			}
+
+			INFINARIO_TRACE_SCOPE("ResponseCallback");
+			currentRequest._callback(httpClient, *requestBody, responseStatus, isSent ? responseBodyString : emptyBody,
+				currentRequest._userData);
+		}
+	}
+}
+
+void Infinario::RequestManager::CallBatchCallback(const std::vector<Request> &requests,
+	const ResponseStatus responseStatus, const char *responseBody, const uint32 responseBodyLength)
+{
+	if (requests.empty()) {
+		return;
+	}
+
+	s3eThreadLockAcquire(this->_internalLock);
+	BatchCallback batchCallback = this->_batchCallback;
+	void *batchCallbackUserData = this->_batchCallbackUserData;
+	s3eThreadLockRelease(this->_internalLock);
+
+	if (batchCallback == NULL) {
+		return;
+	}
+
+	std::vector<CommandResult> results(requests.size());
+	for (uint32 i = 0, count = static_cast<uint32>(requests.size()); i < count; ++i) {
+		results[i]._tag = requests[i]._tag;
+		results[i]._responseStatus = responseStatus;
+	}
+
+	INFINARIO_TRACE_SCOPE("BatchCallback");
+	batchCallback(&results[0], static_cast<uint32>(results.size()), (responseBody != NULL) ? responseBody : "",
+		responseBodyLength, batchCallbackUserData);
+}
+
+void Infinario::RequestManager::FinalizeBatch(const ResponseStatus responseStatus)
+{
+	s3eThreadLockAcquire(this->_internalLock);
+
+	INFINARIO_TRACE_ASYNC_END("Request", static_cast<uint32>(this->_statistics._requestCount));
+
+	this->CancelWatchdog();
+
+	const int64 now = s3eTimerGetMs();
+	const uint32 responseLength = this->_transport->ContentReceived();
+	const uint32 byteCount = static_cast<uint32>(this->_batchBody.size()) + responseLength;
+	if (responseStatus == ResponseStatus::Success) {
+		Pacer::GetInstance().OnSuccess();
+		if (this->_batchEndpoint != EndpointSelector::_noEndpoint) {
+			this->_endpointSelector.OnSuccess(this->_batchEndpoint,
+				static_cast<uint32>(this->_batchHeaderTime - this->_batchSendTime));
+		}
+		this->_lastActivityTime = now;
+		if (this->_isConnectionCloseRequested) {
+			this->CloseConnection();
+		}
+	} else {
+		this->CloseConnection();
+
+		// The server may have closed a reused connection while it was idle, in that case the batch is resent once over
+		// a new connection. If it failed only after being sent, the server may have processed it, so it is resent only
+		// if its commands carry idempotency ids.
+		if (this->_isConnectionReused && !this->_isBatchRetried && ((responseStatus == ResponseStatus::SendRequestError)
+			|| ((responseStatus == ResponseStatus::ReceiveHeaderError)
+			&& this->_requestsQueue.HasCommandIds(0, this->_batchCount))))
+		{
+			this->_isBatchRetried = true;
+			++this->_connectionStatistics._retryCount;
+			this->ClearPreparedBatches();
+
+			s3eThreadLockRelease(this->_internalLock);
+
+			this->Execute();
+			return;
+		}
+
+		// The endpoint failed to deliver the batch, the following ones avoid it for a while. A batch which could not
+		// be sent at all is resent to another endpoint right away.
+		if (this->_batchEndpoint != EndpointSelector::_noEndpoint) {
+			this->_endpointSelector.OnFailure(this->_batchEndpoint, now);
+
+			if ((responseStatus == ResponseStatus::SendRequestError) && !this->_isBatchFailedOver
+				&& this->_endpointSelector.HasHealthyAlternative(this->_batchEndpoint, now))
+			{
+				this->_isBatchFailedOver = true;
+				++this->_connectionStatistics._failoverCount;
+				this->ClearPreparedBatches();
+
+				s3eThreadLockRelease(this->_internalLock);
+
+				this->Execute();
+				return;
+			}
+		}
+
+		// The server may have processed a batch whose response was lost. It drops commands with an idempotency id it
+		// has already seen, so a batch consisting only of such commands is resent a limited number of times.
+		if ((this->_lostResponseRetryCount < RequestManager::_maxLostResponseRetryCount)
+			&& ((responseStatus == ResponseStatus::ReceiveHeaderError)
+			|| (responseStatus == ResponseStatus::RecieveBodyError) || (responseStatus == ResponseStatus::TimeoutError))
+			&& this->_requestsQueue.HasCommandIds(0, this->_batchCount))
+		{
+			++this->_lostResponseRetryCount;
+			++this->_connectionStatistics._lostResponseRetryCount;
+			this->ClearPreparedBatches();
+
+			s3eThreadLockRelease(this->_internalLock);
+
+			this->Execute();
+			return;
+		}
+	}
+	this->_isBatchRetried = false;
+	this->_lostResponseRetryCount = 0;
+	this->_isBatchFailedOver = false;
+
+	this->_statistics._responseBytes += responseLength;
+	const uint32 roundTripTime = static_cast<uint32>(this->_batchHeaderTime - this->_batchSendTime);
+
+	// Feed the measurements of the finished request to the batch controller.
+	if (responseStatus == ResponseStatus::Success) {
+		this->_batchController.OnSuccess(this->_batchCount, byteCount, roundTripTime,
+			static_cast<uint32>(now - this->_batchSendTime));
+	} else {
+		// The prepared batches were sized for requests that succeed.
+		this->_batchController.OnFailure();
+		this->ClearPreparedBatches();
+	}
+
+	// Update the queue statistics.
+	this->_statistics._responseStatusCounts[static_cast<uint32>(responseStatus)] += this->_batchCount;
+
+	// Remove the batch's requests from the queue. Their commands are not copied, the callbacks are passed the body
+	// of the bulk request instead.
+	std::vector<Request> batch;
+	batch.reserve(this->_batchCount);
+	for (uint32 i = 0; i < this->_batchCount; ++i) {
+		batch.push_back(this->_requestsQueue.Get(i, false));
+	}
+	this->_requestsQueue.PopFront(this->_batchCount);
+	this->_batchCount = 0;
+	this->_statistics._queueDepth = this->_requestsQueue.GetSize();
+	this->_statistics._queueBytes = this->_requestsQueue.GetCommandBytes();
+
+	s3eThreadLockRelease(this->_internalLock);
+
+	// The histograms are recorded under their own lock, so that reading them does not block queueing events.
+	s3eThreadLockAcquire(this->_histogramLock);
+	if (responseStatus != ResponseStatus::SendRequestError) {
+		this->_statistics._roundTripTime.Record(roundTripTime);
+	}
+	if (responseStatus == ResponseStatus::Success) {
+		for (std::vector<Request>::const_iterator it = batch.begin(), end = batch.end(); it != end; ++it) {
+			this->_statistics._enqueueToAckLatency.Record(static_cast<uint32>(now - it->_enqueueTime));
+		}
+	}
+	s3eThreadLockRelease(this->_histogramLock);
+
+	// Call callback functions if they were supplied.
+	this->CallResponseCallbacks(batch, static_cast<uint32>(batch.size()), this->_transport->GetHttpClient(),
+		responseStatus, this->_buffer, this->_receivedBodyLength);
+	this->CallBatchCallback(batch, responseStatus, this->_buffer, this->_receivedBodyLength);
+
+	// Continue in the request execution chain.
+	this->Execute();
+}
+
+void Infinario::RequestManager::RequeueBatch(const bool isThrottled)
+{
+	s3eThreadLockAcquire(this->_internalLock);
+
+	INFINARIO_TRACE_ASYNC_END("Request", static_cast<uint32>(this->_statistics._requestCount));
+
+	this->CancelWatchdog();
+
+	// The response body is not read, so the connection can't be reused.
+	this->CloseConnection();
+	this->_isBatchRetried = false;
+	this->_lostResponseRetryCount = 0;
+	this->_isBatchFailedOver = false;
+	// Only an overloaded server says anything about the network, a rejected format does not.
+	if (isThrottled) {
+		this->_batchController.OnFailure();
+	}
+
+	// The batch's requests stay at the front of the queue and are sent again by the next call to Execute.
+	this->_batchCount = 0;
+	this->ClearPreparedBatches();
+
+	s3eThreadLockRelease(this->_internalLock);
+
+	this->Execute();
+}
+
+// This is the timer callback indicating that the response did not arrive in time. The request is finalized as timed
+// out, which cancels the transport, so that the queue can move on.
+int32 Infinario::RequestManager::WatchdogElapsed(void *systemData, void *userData)
+{
+	// Initializing passed reference.
+	RequestManager &requestManager = *(reinterpret_cast<RequestManager *>(userData));
+
+	s3eThreadLockAcquire(requestManager._internalLock);
+
+	// The request may have been finalized in the meantime.
+	if (!requestManager._isWatchdogSet) {
+		s3eThreadLockRelease(requestManager._internalLock);
+		return 0;
+	}
+	requestManager._isWatchdogSet = false;
+
+	if (requestManager._isReceivingBody) {
+		++requestManager._connectionStatistics._bodyTimeoutCount;
+	} else {
+		++requestManager._connectionStatistics._headerTimeoutCount;
+	}
+	requestManager._connectionStatistics._stalledTime += s3eTimerGetMs() - requestManager._batchSendTime;
+
+	s3eThreadLockRelease(requestManager._internalLock);
+
+	requestManager.FinalizeBatch(ResponseStatus::TimeoutError);
+	return 0;
+}
+
+void Infinario::RequestManager::SetWatchdog(const uint32 timeout)
+{
+	this->CancelWatchdog();
+	if (timeout > 0) {
+		this->_isWatchdogSet = true;
+		s3eTimerSetTimer(timeout, RequestManager::WatchdogElapsed, reinterpret_cast<void *>(this));
+	}
+}
+
+void Infinario::RequestManager::CancelWatchdog()
+{
+	if (this->_isWatchdogSet) {
+		s3eTimerCancelTimer(RequestManager::WatchdogElapsed, reinterpret_cast<void *>(this));
+		this->_isWatchdogSet = false;
+	}
+}
+
+bool Infinario::RequestManager::ReserveBuffer(const uint32 capacity)
+{
+	if (capacity > this->_bufferCapacity) {
+		// If the buffer can't be grown, it is left as it is, so the body read so far stays valid.
+		char *buffer = reinterpret_cast<char *>(s3eRealloc(reinterpret_cast<void *>(this->_buffer), capacity));
+		if (buffer == NULL) {
+			return false;
+		}
+		this->_buffer = buffer;
+		this->_bufferCapacity = capacity;
+	}
+	return true;
+}
+
+void Infinario::RequestManager::CloseConnection()
+{
+	// Canceling the client drops its socket, so the next request opens a new connection.
+	if (this->_isConnectionOpen) {
+		this->_transport->Cancel();
+		this->_isConnectionOpen = false;
+	}
+}
+
+const std::string Infinario::Infinario::_requestUri("http://api.infinario.com/bulk");
+
+const char *Infinario::CustomerCookie::_filename = "infinario_cookie.txt";
+const uint32 Infinario::CustomerCookie::_maxLength = 64;
+
+Infinario::CustomerCookie &Infinario::CustomerCookie::GetInstance()
+{
+	static CustomerCookie customerCookie;
+	return customerCookie;
+}
+
+Infinario::CustomerCookie::CustomerCookie()
+: _lock(s3eThreadLockCreate())
+, _thread(NULL)
+, _isReady(false)
+, _value()
+{}
+
+Infinario::CustomerCookie::~CustomerCookie()
+{
+	if (this->_thread != NULL) {
+		s3eThreadJoin(this->_thread);
+	}
+	s3eThreadLockDestroy(this->_lock);
+}
+
+void Infinario::CustomerCookie::Prepare()
+{
+	if (this->_isReady.load(std::memory_order_acquire)) {
+		return;
+	}
+
+	s3eThreadLockAcquire(this->_lock);
+
+	if (!this->_isReady.load(std::memory_order_acquire) && (this->_thread == NULL) && s3eThreadAvailable()) {
+		this->_thread = s3eThreadCreate(CustomerCookie::PrepareThread, reinterpret_cast<void *>(this));
+	}
+
+	s3eThreadLockRelease(this->_lock);
+}
+
+const std::string &Infinario::CustomerCookie::Get()
+{
+	// The value is never changed once the flag is set.
+	if (this->_isReady.load(std::memory_order_acquire)) {
+		return this->_value;
+	}
+
+	s3eThreadLockAcquire(this->_lock);
+
+	// Only the first caller waits for the worker or loads or generates the cookie itself, the others wait for it.
+	if (this->_thread != NULL) {
+		s3eThreadJoin(this->_thread);
+		this->_thread = NULL;
+	}
+	if (!this->_isReady.load(std::memory_order_acquire)) {
+		if (!this->Load()) {
+			this->Generate();
+		}
+		this->_isReady.store(true, std::memory_order_release);
+	}
+
+	s3eThreadLockRelease(this->_lock);
+
+	return this->_value;
+}
+
+void *Infinario::CustomerCookie::PrepareThread(void *customerCookie)
+{
+	CustomerCookie &cookie = *(reinterpret_cast<CustomerCookie *>(customerCookie));
+	if (!cookie.Load()) {
+		cookie.Generate();
+	}
+	cookie._isReady.store(true, std::memory_order_release);
+	return NULL;
+}
+
+bool Infinario::CustomerCookie::Load()
+{
+	if (!s3eFileCheckExists(CustomerCookie::_filename)) {
+		return false;
+	}
+
+	s3eFile *file = s3eFileOpen(CustomerCookie::_filename, "rb");
+	if (file == NULL) {
+		return false;
+	}
+
+	char buffer[CustomerCookie::_maxLength + 1];
+	const uint32 length = s3eFileRead(reinterpret_cast<void *>(buffer), 1, CustomerCookie::_maxLength, file);
+	s3eFileClose(file);
+
+	if ((length == 0) || (length == CustomerCookie::_maxLength)) {
+		return false;
+	}
+
+	this->_value.assign(buffer, length);
+	return true;
+}
+
+void Infinario::CustomerCookie::Generate()
+{
+	std::stringstream sstream;
+	sstream << s3eDeviceGetInt(S3E_DEVICE_PPI_LOGICAL) << " "
+		<< s3eDeviceGetInt(S3E_DEVICE_PPI) << " "
+		<< s3eDeviceGetInt(S3E_DEVICE_SUPPORTS_SUSPEND_RESUME) << " "
+		<< s3eDeviceGetInt(S3E_DEVICE_NUM_CPU_CORES) << " "
+		<< s3eDeviceGetString(S3E_DEVICE_LOCALE) << " "
+		<< s3eDeviceGetInt(S3E_DEVICE_LANGUAGE) << " "
+		<< s3eDeviceGetString(S3E_DEVICE_LANGUAGE) << " "
+		<< s3eDeviceGetInt(S3E_DEVICE_MEM_FREE) << " "
+		<< s3eDeviceGetInt(S3E_DEVICE_MEM_TOTAL) << " "
+		<< s3eDeviceGetInt(S3E_DEVICE_BATTERY_LEVEL) << " "
+		<< s3eDeviceGetInt(S3E_DEVICE_MAINS_POWER) << " "
+		<< s3eDeviceGetString(S3E_DEVICE_CHIPSET) << " "
+		<< s3eDeviceGetString(S3E_DEVICE_IMSI) << " "
+		<< s3eDeviceGetString(S3E_DEVICE_PHONE_NUMBER) << " "
+		<< s3eDeviceGetString(S3E_DEVICE_NAME) << " "
+		<< s3eDeviceGetString(S3E_DEVICE_UNIQUE_ID) << " "
+		<< s3eDeviceGetString(S3E_DEVICE_ID) << " "
+		<< s3eDeviceGetString(S3E_DEVICE_ARCHITECTURE) << " "
+		<< s3eDeviceGetString(S3E_DEVICE_OS_VERSION) << " "
+		<< s3eDeviceGetString(S3E_DEVICE_OS);
+
+	std::stringstream hashstream;
+	// The factor is taken from the timer rather than IwRand, whose global state the worker must not touch.
+	hashstream << (IwHashString(sstream.str().c_str()) * static_cast<uint32>(s3eTimerGetUSTNanoseconds() % 1000 + 1));
+	this->_value = EscapeJson(hashstream.str());
+
+	this->Store();
+}
+
+void Infinario::CustomerCookie::Store() const
+{
+	s3eFile *file = s3eFileOpen(CustomerCookie::_filename, "wb");
+	if (file == NULL) {
+		return;
+	}
+
+	s3eFileWrite(reinterpret_cast<const void *>(this->_value.c_str()), this->_value.size(), 1, file);
+	s3eFileClose(file);
+}
+
+const int64 Infinario::TimestampSource::_resyncPeriod = 60000;
+
+uint32 Infinario::TimestampSource::_instanceCount = 0;
+volatile uint32 Infinario::TimestampSource::_resumeCount = 0;
+
+Infinario::TimestampSource::TimestampSource()
+: _lock(s3eThreadLockCreate())
+, _baseUtcTime(0)
+, _baseSystemTime(0)
+, _lastTime(0)
+, _syncedResumeCount(0)
+{
+	// A single callback registration serves all instances, which may be created and destroyed on any thread.
+	s3eThreadLock *registrationLock = TimestampSource::GetRegistrationLock();
+	s3eThreadLockAcquire(registrationLock);
+	if (TimestampSource::_instanceCount++ == 0) {
+		s3eDeviceRegister(S3E_DEVICE_UNPAUSE, TimestampSource::Resumed, NULL);
+	}
+	s3eThreadLockRelease(registrationLock);
+
+	this->Resync();
+}
+
+Infinario::TimestampSource::~TimestampSource()
+{
+	s3eThreadLock *registrationLock = TimestampSource::GetRegistrationLock();
+	s3eThreadLockAcquire(registrationLock);
+	if (--TimestampSource::_instanceCount == 0) {
+		s3eDeviceUnRegister(S3E_DEVICE_UNPAUSE, TimestampSource::Resumed);
+	}
+	s3eThreadLockRelease(registrationLock);
+
+	s3eThreadLockDestroy(this->_lock);
+}
+
+int64 Infinario::TimestampSource::GetTime()
+{
+	s3eThreadLockAcquire(this->_lock);
+
+	int64 elapsed = s3eTimerGetUST() - this->_baseSystemTime;
+	if ((elapsed < 0) || (elapsed >= TimestampSource::_resyncPeriod)
+		|| (this->_syncedResumeCount != TimestampSource::_resumeCount))
+	{
+		this->Resync();
+		elapsed = 0;
+	}
+
+	// Resyncing may move the time backwards slightly, the events' order is preserved nevertheless.
+	int64 result = this->_baseUtcTime + elapsed;
+	if (result < this->_lastTime) {
+		result = this->_lastTime;
+	}
+	this->_lastTime = result;
+
+	s3eThreadLockRelease(this->_lock);
+
+	return result;
+}
+
+uint32 Infinario::TimestampSource::Format(const int64 milliseconds, char *buffer)
+{
+	// Digits are written backwards from the end of a temporary buffer.
+	char digits[TimestampSource::_maxFormattedLength];
+	char *digit = digits + TimestampSource::_maxFormattedLength;
+
+	uint64 value = static_cast<uint64>((milliseconds < 0) ? -milliseconds : milliseconds);
+	for (uint32 i = 0; (i < 4) || (value > 0); ++i) {
+		if (i == 3) {
+			*(--digit) = '.';
+		}
+		*(--digit) = static_cast<char>('0' + (value % 10));
+		value /= 10;
+	}
+	if (milliseconds < 0) {
+		*(--digit) = '-';
+	}
+
+	const uint32 length = static_cast<uint32>(digits + TimestampSource::_maxFormattedLength - digit);
+	for (uint32 i = 0; i < length; ++i) {
+		buffer[i] = digit[i];
+	}
+	buffer[length] = 0;
+	return length;
+}
+
+s3eThreadLock *Infinario::TimestampSource::GetRegistrationLock()
+{
+	// The lock lives as long as the process, a function-local static is created only once even if threads race for it.
+	static s3eThreadLock *registrationLock = s3eThreadLockCreate();
+	return registrationLock;
+}
+
+int32 Infinario::TimestampSource::Resumed(void *systemData, void *userData)
+{
+	TimestampSource::_resumeCount = TimestampSource::_resumeCount + 1;
+	return 0;
+}
+
+void Infinario::TimestampSource::Resync()
+{
+	this->_syncedResumeCount = TimestampSource::_resumeCount;
+	this->_baseUtcTime = static_cast<int64>(s3eTimerGetUTC());
+	this->_baseSystemTime = s3eTimerGetUST();
+}
+
+Infinario::CommandIdSource::CommandIdSource(const std::string &projectToken)
+: _lock(s3eThreadLockCreate())
+, _seed(2166136261u)
+, _sequence(0)
+{
+	// The project, the time of the instance's creation and its address make the ids of every instance differ, so the
+	// sequence does not have to be stored between application runs.
+	for (std::string::size_type i = 0, size = projectToken.size(); i < size; ++i) {
+		this->_seed = (this->_seed ^ static_cast<uint8>(projectToken[i])) * 16777619u;
+	}
+	const uint64 creation = static_cast<uint64>(s3eTimerGetUTC())
+		^ static_cast<uint64>(reinterpret_cast<uintptr_t>(this));
+	for (uint32 i = 0; i < 8; ++i) {
+		this->_seed = (this->_seed ^ static_cast<uint8>(creation >> (i * 8))) * 16777619u;
+	}
+}
+
+Infinario::CommandIdSource::~CommandIdSource()
+{
+	s3eThreadLockDestroy(this->_lock);
+}
+
+void Infinario::CommandIdSource::Next(const std::string &customerId, char *buffer)
+{
+	static const char hexDigits[] = "0123456789abcdef";
+
+	// FNV-1a continued from the seed, followed by a finalizer mixing the bits.
+	uint32 hash = this->_seed;
+	for (std::string::size_type i = 0, size = customerId.size(); i < size; ++i) {
+		hash = (hash ^ static_cast<uint8>(customerId[i])) * 16777619u;
+	}
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+
+	s3eThreadLockAcquire(this->_lock);
+	const uint32 sequence = this->_sequence++;
+	s3eThreadLockRelease(this->_lock);
+
+	for (uint32 i = 0; i < 8; ++i) {
+		buffer[i] = hexDigits[(hash >> (28 - i * 4)) & 0xF];
+		buffer[8 + i] = hexDigits[(sequence >> (28 - i * 4)) & 0xF];
+	}
+}
+
+Infinario::NameTable::NameTable()
+: _lock(s3eThreadLockCreate())
+, _count(0)
+, _hasPolicies(false)
+, _emptyName("\"\"")
+{
+	for (uint32 i = 0; i < NameTable::_slotCount; ++i) {
+		this->_slots[i] = 0;
+	}
+}
+
+Infinario::NameTable::~NameTable()
+{
+	for (uint32 i = 0; i < this->_count; ++i) {
+		delete this->_names[i];
+		delete this->_unquotedNames[i];
+	}
+	s3eThreadLockDestroy(this->_lock);
+}
+
+Infinario::NameHandle Infinario::NameTable::Register(const std::string &name)
+{
+	s3eThreadLockAcquire(this->_lock);
+
+	const uint32 slot = this->FindSlot(name);
+	const NameHandle handle = (this->_slots[slot] != 0) ? this->_slots[slot] - 1 : this->_count;
+
+	// The name is stored before the count is increased and the slot is filled, so lookups never see a missing name.
+	if ((handle == this->_count) && (handle < NameTable::_capacity)) {
+		std::string *quotedName = new std::string();
+		quotedName->reserve(name.size() + 2);
+		quotedName->append("\"").append(EscapeJson(name)).append("\"");
+		this->_names[handle] = quotedName;
+		this->_unquotedNames[handle] = new std::string(name);
+		this->_timesToLive[handle] = 0;
+		this->_sampleRates[handle] = 100;
+		this->_isRateLimited[handle] = false;
+		this->_count = this->_count + 1;
+		this->_slots[slot] = handle + 1;
+	}
+
+	s3eThreadLockRelease(this->_lock);
+
+	return handle;
+}
+
+const std::string &Infinario::NameTable::Get(const NameHandle handle) const
+{
+	return (handle < this->_count) ? *(this->_names[handle]) : this->_emptyName;
+}
+
+void Infinario::NameTable::SetTimeToLive(const NameHandle handle, const uint32 timeToLive)
+{
+	if (handle < this->_count) {
+		this->_timesToLive[handle] = timeToLive;
+		this->_hasPolicies = true;
+	}
+}
+
+uint32 Infinario::NameTable::GetTimeToLive(const NameHandle handle) const
+{
+	return (handle < this->_count) ? this->_timesToLive[handle] : 0;
+}
+
+void Infinario::NameTable::SetSampleRate(const NameHandle handle, const uint32 sampleRate)
+{
+	if (handle < this->_count) {
+		this->_sampleRates[handle] = (sampleRate < 100) ? sampleRate : 100;
+		this->_hasPolicies = true;
+	}
+}
+
+void Infinario::NameTable::SetRateLimit(const NameHandle handle, const uint32 rate, const uint32 burst)
+{
+	if (handle < this->_count) {
+		s3eThreadLockAcquire(this->_lock);
+		this->_buckets[handle].Set(rate, burst, s3eTimerGetMs());
+		this->_isRateLimited[handle] = this->_buckets[handle].IsLimited();
+		s3eThreadLockRelease(this->_lock);
+
+		this->_hasPolicies = true;
+	}
+}
+
+bool Infinario::NameTable::Admit(const NameHandle handle, const std::string &customerId)
+{
+	if (handle >= this->_count) {
+		return true;
+	}
+
+	const uint32 sampleRate = this->_sampleRates[handle];
+	if ((sampleRate < 100) && ((NameTable::Hash(customerId) % 100) >= sampleRate)) {
+		return false;
+	}
+
+	if (!this->_isRateLimited[handle]) {
+		return true;
+	}
+
+	s3eThreadLockAcquire(this->_lock);
+	const bool isAdmitted = this->_buckets[handle].Take(s3eTimerGetMs());
+	s3eThreadLockRelease(this->_lock);
+
+	return isAdmitted;
+}
+
+Infinario::NameHandle Infinario::NameTable::Find(const std::string &name) const
+{
+	// Most applications never set a policy for a name, they do not pay for the lookup.
+	if (!this->_hasPolicies) {
+		return NameTable::_capacity;
+	}
+
+	const uint32 entry = this->_slots[this->FindSlot(name)];
+	return (entry != 0) ? entry - 1 : NameTable::_capacity;
+}
+
+uint32 Infinario::NameTable::FindSlot(const std::string &name) const
+{
+	uint32 slot = NameTable::Hash(name) & (NameTable::_slotCount - 1);
+	for (;;) {
+		const uint32 entry = this->_slots[slot];
+		if ((entry == 0) || (*(this->_unquotedNames[entry - 1]) == name)) {
+			return slot;
+		}
+		slot = (slot + 1) & (NameTable::_slotCount - 1);
+	}
+}
+
+uint32 Infinario::NameTable::Hash(const std::string &value)
+{
+	// The finalizer keeps similar ids from ending up in neighbouring buckets.
+	uint32 hash = 2166136261u;
+	for (std::string::size_type i = 0, size = value.size(); i < size; ++i) {
+		hash = (hash ^ static_cast<uint8>(value[i])) * 16777619u;
+	}
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+Infinario::TokenBucket::TokenBucket()
+: _rate(0)
+, _capacity(0)
+, _tokens(0)
+, _updateTime(0)
+{}
+
+void Infinario::TokenBucket::Set(const uint32 rate, const uint32 capacity, const int64 now)
+{
+	this->_rate = rate;
+	this->_capacity = (capacity > 0) ? capacity : 1;
+	this->_tokens = static_cast<uint64>(this->_capacity) * 1000;
+	this->_updateTime = now;
+}
+
+bool Infinario::TokenBucket::IsLimited() const
+{
+	return this->_rate > 0;
+}
+
+bool Infinario::TokenBucket::Take(const int64 now)
+{
+	// A rate of one event per second refills one thousandth of a token every millisecond.
+	const uint64 capacity = static_cast<uint64>(this->_capacity) * 1000;
+	if (now > this->_updateTime) {
+		this->_tokens += static_cast<uint64>(now - this->_updateTime) * this->_rate;
+		if (this->_tokens > capacity) {
+			this->_tokens = capacity;
+		}
+		this->_updateTime = now;
+	}
+
+	if (this->_tokens < 1000) {
+		return false;
+	}
+	this->_tokens -= 1000;
+	return true;
+}
+
+Infinario::RequestFuturePool &Infinario::RequestFuturePool::GetInstance()
+{
+	static RequestFuturePool pool;
+	return pool;
+}
+
+Infinario::RequestFuturePool::RequestFuturePool()
+: _lock(s3eThreadLockCreate())
+, _freeStates(NULL)
+{}
+
+Infinario::RequestFutureState *Infinario::RequestFuturePool::Acquire()
+{
+	s3eThreadLockAcquire(this->_lock);
+
+	if (this->_freeStates == NULL) {
+		RequestFutureState *block = new RequestFutureState[RequestFuturePool::_blockSize];
+		for (uint32 i = 0; i < RequestFuturePool::_blockSize; ++i) {
+			block[i]._next = this->_freeStates;
+			this->_freeStates = block + i;
+		}
+	}
+
+	RequestFutureState *state = this->_freeStates;
+	this->_freeStates = state->_next;
+
+	s3eThreadLockRelease(this->_lock);
+
+	state->_isCompleted = false;
+	state->_responseStatus = ResponseStatus::Success;
+	state->_referenceCount = 2;
+	state->_next = NULL;
+
+	return state;
+}
+
+void Infinario::RequestFuturePool::AddReference(RequestFutureState *state)
+{
+	s3eThreadLockAcquire(this->_lock);
+	++state->_referenceCount;
+	s3eThreadLockRelease(this->_lock);
+}
+
+void Infinario::RequestFuturePool::Release(RequestFutureState *state)
+{
+	s3eThreadLockAcquire(this->_lock);
+	if (--state->_referenceCount == 0) {
+		state->_next = this->_freeStates;
+		this->_freeStates = state;
+	}
+	s3eThreadLockRelease(this->_lock);
+}
+
+Infinario::RequestFuture::RequestFuture()
+: _state(NULL)
+{}
+
+Infinario::RequestFuture::RequestFuture(RequestFutureState *state)
+: _state(state)
+{}
+
+Infinario::RequestFuture::RequestFuture(const RequestFuture &other)
+: _state(other._state)
+{
+	if (this->_state != NULL) {
+		RequestFuturePool::GetInstance().AddReference(this->_state);
+	}
+}
+
+Infinario::RequestFuture &Infinario::RequestFuture::operator=(const RequestFuture &other)
+{
+	if (other._state != NULL) {
+		RequestFuturePool::GetInstance().AddReference(other._state);
+	}
+	if (this->_state != NULL) {
+		RequestFuturePool::GetInstance().Release(this->_state);
 	}
+	this->_state = other._state;
+	return *this;
+}
 
-	// Set buffer suffix and start reading recieved data to it.
-	requestManager._buffer[requestManager._accumulatedBodyLength] = 0;
-	requestManager._httpClient->ReadDataAsync(requestManager._buffer, requestManager._accumulatedBodyLength,
-		0, RequestManager::RecieveBody, userData);
-
-	s3eThreadLockRelease(requestManager._internalLock);
-	return 0;
+Infinario::RequestFuture::~RequestFuture()
+{
+	if (this->_state != NULL) {
+		RequestFuturePool::GetInstance().Release(this->_state);
+	}
 }
 
-// This is the callback indicating that a ReadDataAsync call has completed. Either we've finished, or more data
-// has been recieved. If the correct ammount of data was supplied initially, then this will only be called once.
-// However, it may well be called several times when using chunked encoding.
-int32 Infinario::RequestManager::RecieveBody(void *systenData, void *userData)
+bool Infinario::RequestFuture::IsValid() const
 {
-	// Initializing passed reference.
-	RequestManager &requestManager = *(reinterpret_cast<RequestManager *>(userData));
+	return this->_state != NULL;
+}
 
-	s3eThreadLockAcquire(requestManager._internalLock);
+bool Infinario::RequestFuture::IsReady() const
+{
+	return (this->_state != NULL) && this->_state->_isCompleted;
+}
 
-	const Request currentRequest(requestManager._requestsQueue.front());
+Infinario::ResponseStatus Infinario::RequestFuture::GetStatus() const
+{
+	return this->_state->_responseStatus;
+}
 
-	// Test for error.
-	if (requestManager._httpClient->GetStatus() == S3E_RESULT_ERROR) {
-		s3eThreadLockRelease(requestManager._internalLock);
+bool Infinario::RequestFuture::Wait() const
+{
+	return RequestFuture::WaitAll(this, 1);
+}
 
-		// Call callback function if it was supplied.
-		if (currentRequest._callback != NULL) {
-			currentRequest._callback(requestManager._httpClient, currentRequest._body, ResponseStatus::RecieveBodyError,
-				requestManager._accumulatedBodyContent.str(), currentRequest._userData);
+bool Infinario::RequestFuture::WaitAll(const RequestFuture *futures, const uint32 count)
+{
+	// Requests are finalized by callbacks dispatched while yielding, so the waiting thread has to keep yielding.
+	for (uint32 i = 0; i < count; ++i) {
+		if (!futures[i].IsValid()) {
+			return false;
 		}
+		while (!futures[i].IsReady()) {
+			if (s3eDeviceCheckQuitRequest()) {
+				return false;
+			}
+			s3eDeviceYield(0);
+		}
+	}
+	return true;
+}
 
-		s3eThreadLockAcquire(requestManager._internalLock);
-
-		// Remove current request from queue.
-		requestManager._requestsQueue.pop();
-
-		s3eThreadLockRelease(requestManager._internalLock);
-
-		// Continue in the request execution chain.
-		requestManager.Execute();
-		return 0;
+uint32 Infinario::RequestFuture::WaitAny(const RequestFuture *futures, const uint32 count)
+{
+	bool isAnyValid = false;
+	for (uint32 i = 0; i < count; ++i) {
+		isAnyValid = isAnyValid || futures[i].IsValid();
+	}
+	if (!isAnyValid) {
+		return count;
 	}
 
-	// Store recieved data buffer content.
-	requestManager._accumulatedBodyContent << std::string(requestManager._buffer);
+	while (!s3eDeviceCheckQuitRequest()) {
+		for (uint32 i = 0; i < count; ++i) {
+			if (futures[i].IsReady()) {
+				return i;
+			}
+		}
+		s3eDeviceYield(0);
+	}
+	return count;
+}
 
-	// Test if more data was recieved.
-	if (requestManager._httpClient->ContentFinished()) {
-		s3eThreadLockRelease(requestManager._internalLock);
+void Infinario::RequestFuture::Complete(const CIwHTTP *httpClient, const char *requestBody,
+	const uint32 requestBodyLength, const ResponseStatus responseStatus, const char *responseBody,
+	const uint32 responseBodyLength, void *state)
+{
+	RequestFutureState *futureState = reinterpret_cast<RequestFutureState *>(state);
 
-		// Call callback function if it was supplied.
-		if (currentRequest._callback != NULL) {
-			currentRequest._callback(requestManager._httpClient, currentRequest._body, ResponseStatus::Success,
-				requestManager._accumulatedBodyContent.str(), currentRequest._userData);
-		}
-		
-		s3eThreadLockAcquire(requestManager._internalLock);
+	// The status is written before the flag, pollers only read it after seeing the flag set.
+	futureState->_responseStatus = responseStatus;
+	futureState->_isCompleted = true;
 
-		// Remove current request from queue.
-		requestManager._requestsQueue.pop();
+	RequestFuturePool::GetInstance().Release(futureState);
+}
 
-		s3eThreadLockRelease(requestManager._internalLock);
+Infinario::Infinario::Infinario(const std::string &projectToken, const std::string &customerId,
+	Transport *transport)
+: _requestManager(new RequestManager(transport))
+, _isRequestManagerShared(false)
+, _projectToken(EscapeJson(projectToken))
+, _customerId(EscapeJson(customerId))
+, _timestampSource()
+, _nameTable()
+, _commandIdSource(projectToken)
+, _isValidatingAttributes(false)
+, _isAttachingCommandIds(false)
+{
+	// Anonymous players need the customer cookie, which is prepared in the background until the first command.
+	if (this->_customerId.empty()) {
+		CustomerCookie::GetInstance().Prepare();
+	}
+}
 
-		// Continue in the request execution chain.
-		requestManager.Execute();
-		return 0;
+Infinario::Infinario::Infinario(const std::string &projectToken, const std::string &customerId,
+	RequestManager &requestManager)
+: _requestManager(&requestManager)
+, _isRequestManagerShared(true)
+, _projectToken(EscapeJson(projectToken))
+, _customerId(EscapeJson(customerId))
+, _timestampSource()
+, _nameTable()
+, _commandIdSource(projectToken)
+, _isValidatingAttributes(false)
+, _isAttachingCommandIds(false)
+{
+	// See the other constructor.
+	if (this->_customerId.empty()) {
+		CustomerCookie::GetInstance().Prepare();
 	}
+}
 
-	// Determine current recieved data size.
-	uint32 bufferLength = requestManager._accumulatedBodyLength;
-	if (requestManager._accumulatedBodyLength < requestManager._httpClient->ContentExpected()) {
-		requestManager._accumulatedBodyLength = requestManager._httpClient->ContentExpected();
+Infinario::Infinario::~Infinario()
+{
+	if (this->_isRequestManagerShared) {
+		this->_requestManager->Detach(reinterpret_cast<const void *>(this));
 	} else {
-		requestManager._accumulatedBodyLength += RequestManager::_bufferSize;
+		delete this->_requestManager;
 	}
-	bufferLength = requestManager._accumulatedBodyLength - bufferLength;
-
-	// Set buffer suffix and start reading newly recieved data to it.	
-	requestManager._buffer[bufferLength] = 0;
-	requestManager._httpClient->ReadDataAsync(requestManager._buffer,
-		bufferLength, 0, RequestManager::RecieveBody, userData);
-
-	s3eThreadLockRelease(requestManager._internalLock);
-	return 0;
 }
 
-void Infinario::RequestManager::Execute()
+void Infinario::Infinario::SetProxy(const std::string &proxy)
 {
-	s3eThreadLockAcquire(this->_internalLock);
+	this->_requestManager->SetProxy(proxy);
+}
 
-	// Check if a request is available for execution, if it is set the manager to request processing mode.
-	this->_isRequestBeingProcessed = !this->_requestsQueue.empty();
-	if (!this->_isRequestBeingProcessed) {
-		EmptyRequestQueueCallback emptyRequestQueueCallback = this->_emptyRequestQueueCallback;
-		void *emptyRequestQueueUserData = this->_emptyRequestQueueUserData;
+void Infinario::Infinario::ClearProxy()
+{
+	this->_requestManager->ClearProxy();
+}
 
-		s3eThreadLockRelease(this->_internalLock);
+void Infinario::Infinario::SetEmptyRequestQueueCallback(EmptyRequestQueueCallback callback, void *userData)
+{
+	this->_requestManager->SetEmptyRequestQueueCallback(callback, userData);
+}
 
-		// Call callback function if it was supplied.
-		if (emptyRequestQueueCallback != NULL) {
-			emptyRequestQueueCallback(emptyRequestQueueUserData);
-		}
+void Infinario::Infinario::ClearEmptyRequestQueueCallback()
+{
+	this->_requestManager->ClearEmptyRequestQueueCallback();
+}
 
-		return;
-	}
+void Infinario::Infinario::SetTimeouts(const uint32 headerTimeout, const uint32 bodyTimeout)
+{
+	this->_requestManager->SetTimeouts(headerTimeout, bodyTimeout);
+}
 
-	// Reset recieved data accumulation stream.
-	this->_accumulatedBodyContent.str(std::string());
-	this->_accumulatedBodyContent.clear();
+void Infinario::Infinario::SetParallelDrain(const uint32 threadCount)
+{
+	this->_requestManager->SetParallelDrain(threadCount);
+}
 
-	const Request &currentRequest(this->_requestsQueue.front());
+void Infinario::Infinario::ClearParallelDrain()
+{
+	this->_requestManager->ClearParallelDrain();
+}
 
-	// Set request headers.
-	this->_httpClient->SetRequestHeader("Content-Type", "application/json");
+void Infinario::Infinario::SetBulkFormat(const BulkFormat format)
+{
+	this->_requestManager->SetBulkFormat(format);
+}
 
-	// Send request.
-	if (this->_httpClient->Post(currentRequest._uri.c_str(), currentRequest._body.c_str(),
-		static_cast<int32>(currentRequest._body.size()), RequestManager::RecieveHeader,
-		reinterpret_cast<void *>(this)) == S3E_RESULT_ERROR)
-	{
-		s3eThreadLockRelease(this->_internalLock);
-		
-		// Call callback function if it was supplied.
-		if (currentRequest._callback != NULL) {
-			currentRequest._callback(this->_httpClient, currentRequest._body,
-				ResponseStatus::SendRequestError, this->_accumulatedBodyContent.str(), currentRequest._userData);
-		}
-		
-		s3eThreadLockAcquire(this->_internalLock);
+Infinario::BulkFormat Infinario::Infinario::GetBulkFormat() const
+{
+	return this->_requestManager->GetBulkFormat();
+}
 
-		// Remove current request from queue.
-		this->_requestsQueue.pop();
-		
-		s3eThreadLockRelease(this->_internalLock);
+void Infinario::Infinario::SetEndpoints(const std::vector<std::string> &uris)
+{
+	this->_requestManager->SetEndpoints(uris);
+}
 
-		// Continue in the request execution chain.
-		this->Execute();
-		return;
-	}
+std::vector<Infinario::EndpointStatistics> Infinario::Infinario::GetEndpointStatistics() const
+{
+	return this->_requestManager->GetEndpointStatistics();
+}
 
-	s3eThreadLockRelease(this->_internalLock);
+void Infinario::Infinario::SetAttributeValidation(const bool isEnabled)
+{
+	this->_isValidatingAttributes = isEnabled;
 }
 
-const std::string Infinario::Infinario::_requestUri("http://api.infinario.com/bulk");
+void Infinario::Infinario::SetIdempotencyIds(const bool isEnabled)
+{
+	this->_isAttachingCommandIds = isEnabled;
+}
 
-Infinario::Infinario::Infinario(const std::string &projectToken, const std::string &customerId)
-: _requestManager()
-, _projectToken(EscapeJson(projectToken))
-, _customerCookie()
-, _customerId(EscapeJson(customerId))
+void Infinario::Infinario::SetBatchCallback(BatchCallback callback, void *userData)
 {
-	IwRandSeed((int32)s3eTimerGetMs());
+	this->_requestManager->SetBatchCallback(callback, userData);
+}
 
-	std::stringstream sstream;
-	sstream << s3eDeviceGetInt(S3E_DEVICE_PPI_LOGICAL) << " "
-		<< s3eDeviceGetInt(S3E_DEVICE_PPI) << " "
-		<< s3eDeviceGetInt(S3E_DEVICE_SUPPORTS_SUSPEND_RESUME) << " "
-		<< s3eDeviceGetInt(S3E_DEVICE_NUM_CPU_CORES) << " "
-		<< s3eDeviceGetString(S3E_DEVICE_LOCALE) << " "
-		<< s3eDeviceGetInt(S3E_DEVICE_LANGUAGE) << " "
-		<< s3eDeviceGetString(S3E_DEVICE_LANGUAGE) << " "
-		<< s3eDeviceGetInt(S3E_DEVICE_MEM_FREE) << " "
-		<< s3eDeviceGetInt(S3E_DEVICE_MEM_TOTAL) << " "
-		<< s3eDeviceGetInt(S3E_DEVICE_BATTERY_LEVEL) << " "
-		<< s3eDeviceGetInt(S3E_DEVICE_MAINS_POWER) << " "
-		<< s3eDeviceGetString(S3E_DEVICE_CHIPSET) << " "
-		<< s3eDeviceGetString(S3E_DEVICE_IMSI) << " "
-		<< s3eDeviceGetString(S3E_DEVICE_PHONE_NUMBER) << " "
-		<< s3eDeviceGetString(S3E_DEVICE_NAME) << " "
-		<< s3eDeviceGetString(S3E_DEVICE_UNIQUE_ID) << " "
-		<< s3eDeviceGetString(S3E_DEVICE_ID) << " "
-		<< s3eDeviceGetString(S3E_DEVICE_ARCHITECTURE) << " "
-		<< s3eDeviceGetString(S3E_DEVICE_OS_VERSION) << " "
-		<< s3eDeviceGetString(S3E_DEVICE_OS);
+void Infinario::Infinario::ClearBatchCallback()
+{
+	this->_requestManager->ClearBatchCallback();
+}
 
-	std::stringstream hashstream;
-	hashstream << (IwHashString(sstream.str().c_str()) * IwRandMinMax(1, 1000));
-	this->_customerCookie = EscapeJson(hashstream.str());
+Infinario::BatchEstimates Infinario::Infinario::GetBatchEstimates() const
+{
+	return this->_requestManager->GetBatchEstimates();
 }
 
-void Infinario::Infinario::SetProxy(const std::string &proxy)
+Infinario::ConnectionStatistics Infinario::Infinario::GetConnectionStatistics() const
 {
-	this->_requestManager.SetProxy(proxy);
+	return this->_requestManager->GetConnectionStatistics();
 }
 
-void Infinario::Infinario::ClearProxy()
+Infinario::Statistics Infinario::Infinario::GetStats() const
 {
-	this->_requestManager.ClearProxy();
+	return this->_requestManager->GetStats();
 }
 
-void Infinario::Infinario::SetEmptyRequestQueueCallback(EmptyRequestQueueCallback callback, void *userData)
+void Infinario::Infinario::Identify(const std::string &customerId, ResponseCallback callback, void *userData)
 {
-	this->_requestManager.SetEmptyRequestQueueCallback(callback, userData);
+	this->IdentifyWith(customerId, callback, NULL, userData, userData);
 }
 
-void Infinario::Infinario::ClearEmptyRequestQueueCallback()
+void Infinario::Infinario::Identify(const std::string &customerId, ResponseViewHandler callback, void *userData)
 {
-	this->_requestManager.ClearEmptyRequestQueueCallback();
+	this->IdentifyWith(customerId, NULL, callback._callback, userData, userData);
 }
 
-void Infinario::Infinario::Identify(const std::string &customerId, ResponseCallback callback, void *userData)
+void Infinario::Infinario::IdentifyWith(const std::string &customerId, ResponseCallback callback,
+	ResponseViewCallback viewCallback, void *userData, void *tag)
 {
+	INFINARIO_TRACE_SCOPE("Identify");
+
 	std::string escapedCustomerId(EscapeJson(customerId));
 
+	std::string command(
+		"{ "
+			"\"name\": \"crm/customers\", ");
+	const uint32 commandIdOffset = this->AppendCommandId(escapedCustomerId, command);
+
 	std::stringstream bodyStream;
 	bodyStream <<
-		"{ \"commands\": [{ "
-			"\"name\": \"crm/customers\", "
 			"\"data\": { "
 				"\"ids\": {"
 				" \"registered\": \"" << escapedCustomerId << "\","
-				" \"cookie\": \"" << this->_customerCookie << "\" "
+				" \"cookie\": \"" << CustomerCookie::GetInstance().Get() << "\" "
 			"}, "
 			"\"project_id\": \"" << this->_projectToken << "\" "
 			"}"
-		"}]}";
-
-	IndentifyUserData *identifyUserData = new IndentifyUserData(*this, escapedCustomerId, callback, userData);
-	this->_requestManager.Enqueue(Request(Infinario::_requestUri, bodyStream.str(),
-		Infinario::IdentifyCallback, reinterpret_cast<void *>(identifyUserData)));
+		"}";
+	command.append(bodyStream.str());
+
+	IndentifyUserData *identifyUserData = new IndentifyUserData(*this, escapedCustomerId, callback, viewCallback,
+		userData);
+	Request request(Infinario::_requestUri, command, NULL, reinterpret_cast<void *>(identifyUserData),
+		reinterpret_cast<const void *>(this), 0, Infinario::IdentifyCallback);
+	request._tag = tag;
+	request._commandIdOffset = commandIdOffset;
+	this->_requestManager->Enqueue(request);
 }
 
 void Infinario::Infinario::Update(const std::string &customerAttributes, ResponseCallback callback, void *userData)
 {
+	this->UpdateWith(customerAttributes, callback, NULL, userData, userData);
+}
+
+void Infinario::Infinario::Update(const std::string &customerAttributes, ResponseViewHandler callback,
+	void *userData)
+{
+	this->UpdateWith(customerAttributes, NULL, callback._callback, userData, userData);
+}
+
+void Infinario::Infinario::UpdateWith(const std::string &customerAttributes, ResponseCallback callback,
+	ResponseViewCallback viewCallback, void *userData, void *tag)
+{
+	INFINARIO_TRACE_SCOPE("Update");
+
+	if (this->_isValidatingAttributes
+		&& !ValidateJsonObject(customerAttributes.data(), static_cast<uint32>(customerAttributes.size())))
+	{
+		this->_requestManager->Reject(ResponseStatus::InvalidError, callback, viewCallback, userData, tag,
+			reinterpret_cast<const void *>(this));
+		return;
+	}
+
+	std::string command(
+		"{ "
+			"\"name\": \"crm/customers\", ");
+	const uint32 commandIdOffset = this->AppendCommandId(
+		this->_customerId.empty() ? CustomerCookie::GetInstance().Get() : this->_customerId, command);
+
 	std::stringstream bodyStream;
 	bodyStream <<
-		"{ \"commands\": [{ "
-			"\"name\": \"crm/customers\", "
 			"\"data\": { "
 			"\"ids\": { ";
 	if (this->_customerId.empty()) {
-		bodyStream << "\"cookie\": \"" << this->_customerCookie << "\" ";
+		bodyStream << "\"cookie\": \"" << CustomerCookie::GetInstance().Get() << "\" ";
 	} else {
 		bodyStream << "\"registered\": \"" << this->_customerId << "\" ";
 	}
@@ -464,61 +3308,294 @@ void Infinario::Infinario::Update(const std::string &customerAttributes, Respons
 			"\"project_id\": \"" << this->_projectToken << "\", "
 			"\"properties\": " << customerAttributes <<
 			"}"
-		"}]}";
+		"}";
+	command.append(bodyStream.str());
+
+	Request request(Infinario::_requestUri, command, callback, userData, reinterpret_cast<const void *>(this), 0,
+		viewCallback);
+	request._tag = tag;
+	request._commandIdOffset = commandIdOffset;
+	this->_requestManager->Enqueue(request);
+}
 
-	this->_requestManager.Enqueue(Request(Infinario::_requestUri, bodyStream.str(), callback, userData));
+void Infinario::Infinario::Track(const std::string &eventName, const std::string &eventAttributes,
+	ResponseCallback callback, void *userData, const uint32 timeToLive)
+{
+	this->TrackAt(this->_nameTable.Find(eventName), &eventName, eventAttributes, NULL, callback, NULL, userData,
+		userData, timeToLive);
 }
 
 void Infinario::Infinario::Track(const std::string &eventName, const std::string &eventAttributes,
-	ResponseCallback callback, void *userData)
+	const double timestamp, ResponseCallback callback, void *userData, const uint32 timeToLive)
 {
-	this->Track(eventName, eventAttributes, static_cast<double>(s3eTimerGetUTC()) / 1000.0, callback, userData);
+	const int64 eventTimestamp = Infinario::ToMilliseconds(timestamp);
+	this->TrackAt(this->_nameTable.Find(eventName), &eventName, eventAttributes, &eventTimestamp, callback, NULL,
+		userData, userData, timeToLive);
 }
 
 void Infinario::Infinario::Track(const std::string &eventName, const std::string &eventAttributes,
-	const double timestamp, ResponseCallback callback, void *userData)
+	ResponseViewHandler callback, void *userData, const uint32 timeToLive)
 {
-	std::stringstream bodyStream;
-	bodyStream <<
-		"{ \"commands\": [{ "
-			"\"name\": \"crm/events\", "
-			"\"data\": { "
-			"\"customer_ids\": { ";
-	if (this->_customerId.empty()) {
-		bodyStream << "\"cookie\": \"" << this->_customerCookie << "\" ";
-	} else {
-		bodyStream << "\"registered\": \"" << this->_customerId << "\" ";
+	this->TrackAt(this->_nameTable.Find(eventName), &eventName, eventAttributes, NULL, NULL, callback._callback,
+		userData, userData, timeToLive);
+}
+
+void Infinario::Infinario::Track(const std::string &eventName, const std::string &eventAttributes,
+	const double timestamp, ResponseViewHandler callback, void *userData, const uint32 timeToLive)
+{
+	const int64 eventTimestamp = Infinario::ToMilliseconds(timestamp);
+	this->TrackAt(this->_nameTable.Find(eventName), &eventName, eventAttributes, &eventTimestamp, NULL,
+		callback._callback, userData, userData, timeToLive);
+}
+
+Infinario::NameHandle Infinario::Infinario::RegisterName(const std::string &name)
+{
+	return this->_nameTable.Register(name);
+}
+
+const std::string &Infinario::Infinario::GetQuotedName(const NameHandle handle) const
+{
+	return this->_nameTable.Get(handle);
+}
+
+void Infinario::Infinario::Track(const NameHandle eventName, const std::string &eventAttributes,
+	ResponseCallback callback, void *userData, const uint32 timeToLive)
+{
+	this->TrackAt(eventName, NULL, eventAttributes, NULL, callback, NULL, userData, userData, timeToLive);
+}
+
+void Infinario::Infinario::Track(const NameHandle eventName, const std::string &eventAttributes,
+	const double timestamp, ResponseCallback callback, void *userData, const uint32 timeToLive)
+{
+	const int64 eventTimestamp = Infinario::ToMilliseconds(timestamp);
+	this->TrackAt(eventName, NULL, eventAttributes, &eventTimestamp, callback, NULL, userData, userData,
+		timeToLive);
+}
+
+void Infinario::Infinario::Track(const NameHandle eventName, const std::string &eventAttributes,
+	ResponseViewHandler callback, void *userData, const uint32 timeToLive)
+{
+	this->TrackAt(eventName, NULL, eventAttributes, NULL, NULL, callback._callback, userData, userData,
+		timeToLive);
+}
+
+void Infinario::Infinario::Track(const NameHandle eventName, const std::string &eventAttributes,
+	const double timestamp, ResponseViewHandler callback, void *userData, const uint32 timeToLive)
+{
+	const int64 eventTimestamp = Infinario::ToMilliseconds(timestamp);
+	this->TrackAt(eventName, NULL, eventAttributes, &eventTimestamp, NULL, callback._callback, userData, userData,
+		timeToLive);
+}
+
+void Infinario::Infinario::SetEventTimeToLive(const std::string &eventName, const uint32 timeToLive)
+{
+	this->_nameTable.SetTimeToLive(this->_nameTable.Register(eventName), timeToLive);
+}
+
+void Infinario::Infinario::SetEventTimeToLive(const NameHandle eventName, const uint32 timeToLive)
+{
+	this->_nameTable.SetTimeToLive(eventName, timeToLive);
+}
+
+void Infinario::Infinario::SetEventSampling(const std::string &eventName, const uint32 sampleRate)
+{
+	this->_nameTable.SetSampleRate(this->_nameTable.Register(eventName), sampleRate);
+}
+
+void Infinario::Infinario::SetEventSampling(const NameHandle eventName, const uint32 sampleRate)
+{
+	this->_nameTable.SetSampleRate(eventName, sampleRate);
+}
+
+void Infinario::Infinario::SetEventRateLimit(const std::string &eventName, const uint32 eventsPerSecond,
+	const uint32 burst)
+{
+	this->_nameTable.SetRateLimit(this->_nameTable.Register(eventName), eventsPerSecond, burst);
+}
+
+void Infinario::Infinario::SetEventRateLimit(const NameHandle eventName, const uint32 eventsPerSecond,
+	const uint32 burst)
+{
+	this->_nameTable.SetRateLimit(eventName, eventsPerSecond, burst);
+}
+
+int64 Infinario::Infinario::ToMilliseconds(const double timestamp)
+{
+	// Round to whole milliseconds, the precision sent to the Infinario server.
+	const double milliseconds = timestamp * 1000.0;
+	return static_cast<int64>((milliseconds < 0.0) ? (milliseconds - 0.5) : (milliseconds + 0.5));
+}
+
+void Infinario::Infinario::TrackAt(const NameHandle eventName, const std::string *unquotedEventName,
+	const std::string &eventAttributes, const int64 *timestamp, ResponseCallback callback,
+	ResponseViewCallback viewCallback, void *userData, void *tag, const uint32 timeToLive)
+{
+	INFINARIO_TRACE_SCOPE("Track");
+
+	const char *customerIdKey = this->_customerId.empty() ? "\"cookie\": \"" : "\"registered\": \"";
+	const std::string &customerId(this->_customerId.empty() ? CustomerCookie::GetInstance().Get() : this->_customerId);
+
+	// Sampled out and rate limited events are dropped before anything is built.
+	if (!this->_nameTable.Admit(eventName, customerId)) {
+		this->_requestManager->Reject(ResponseStatus::RejectedError, callback, viewCallback, userData, tag,
+			reinterpret_cast<const void *>(this));
+		return;
 	}
-	bodyStream <<
+	if (this->_isValidatingAttributes
+		&& !ValidateJsonObject(eventAttributes.data(), static_cast<uint32>(eventAttributes.size())))
+	{
+		this->_requestManager->Reject(ResponseStatus::InvalidError, callback, viewCallback, userData, tag,
+			reinterpret_cast<const void *>(this));
+		return;
+	}
+
+	// The name is escaped and the time is taken only for admitted events.
+	std::string escapedEventName;
+	if (unquotedEventName != NULL) {
+		escapedEventName.reserve(unquotedEventName->size() + 2);
+		escapedEventName.append("\"").append(EscapeJson(*unquotedEventName)).append("\"");
+	}
+	const std::string &quotedEventName((unquotedEventName != NULL) ? escapedEventName
+		: this->_nameTable.Get(eventName));
+	const int64 eventTimestamp = (timestamp != NULL) ? *timestamp : this->_timestampSource.GetTime();
+
+	const uint32 eventTimeToLive = (timeToLive != 0) ? timeToLive : this->_nameTable.GetTimeToLive(eventName);
+	char formattedTimestamp[TimestampSource::_maxFormattedLength + 1];
+	const uint32 formattedTimestampLength = TimestampSource::Format(eventTimestamp, formattedTimestamp);
+
+	// The command is built by appending to a preallocated string, names are inserted already escaped and quoted.
+	// The positions of its parts are noted, so that the compact envelope can cut the command apart without parsing it.
+	std::string command;
+	command.reserve(160 + customerId.size() + this->_projectToken.size() + quotedEventName.size()
+		+ eventAttributes.size());
+	command.append(
+		"{ "
+			"\"name\": \"crm/events\", ");
+	const uint32 commandIdOffset = this->AppendCommandId(customerId, command);
+	command.append(
+			"\"data\": { ");
+	const uint32 identityOffset = static_cast<uint32>(command.size());
+	command.append(
+			"\"customer_ids\": { ").append(customerIdKey).append(customerId).append("\" "
 			" }, "
-			"\"project_id\": \"" << this->_projectToken << "\", "
-			"\"timestamp\": " << std::setprecision(3) << std::fixed << timestamp << ", "
-			"\"type\": \"" << EscapeJson(eventName) << "\", "
-			"\"properties\": " << eventAttributes <<
+			"\"project_id\": \"").append(this->_projectToken).append("\"");
+	const uint32 identityLength = static_cast<uint32>(command.size()) - identityOffset;
+	command.append(", "
+			"\"timestamp\": ").append(formattedTimestamp, formattedTimestampLength).append(", ");
+	const uint32 eventOffset = static_cast<uint32>(command.size());
+	command.append(
+			"\"type\": ").append(quotedEventName).append(", "
+			"\"properties\": ").append(eventAttributes).append(
 		"}"
-		"}]}";
+		"}");
+
+	Request request(Infinario::_requestUri, command, callback, userData, reinterpret_cast<const void *>(this),
+		eventTimeToLive, viewCallback);
+	request._identityOffset = identityOffset;
+	request._identityLength = identityLength;
+	request._eventOffset = eventOffset;
+	request._timestamp = eventTimestamp;
+	request._tag = tag;
+	request._commandIdOffset = commandIdOffset;
+	this->_requestManager->Enqueue(request);
+}
+
+uint32 Infinario::Infinario::AppendCommandId(const std::string &customerId, std::string &command)
+{
+	if (!this->_isAttachingCommandIds) {
+		return 0;
+	}
+
+	char commandId[CommandIdSource::_length];
+	this->_commandIdSource.Next(customerId, commandId);
+	command.append("\"command_id\": \"");
+	const uint32 commandIdOffset = static_cast<uint32>(command.size());
+	command.append(commandId, CommandIdSource::_length).append("\", ");
+	return commandIdOffset;
+}
+
+Infinario::RequestFuture Infinario::Infinario::IdentifyAsync(const std::string &customerId)
+{
+	// The future's state is internal, the batch callback is not passed it as the command's tag.
+	RequestFuture future(RequestFuturePool::GetInstance().Acquire());
+	this->IdentifyWith(customerId, NULL, RequestFuture::Complete, reinterpret_cast<void *>(future._state), NULL);
+	return future;
+}
+
+Infinario::RequestFuture Infinario::Infinario::UpdateAsync(const std::string &customerAttributes)
+{
+	RequestFuture future(RequestFuturePool::GetInstance().Acquire());
+	this->UpdateWith(customerAttributes, NULL, RequestFuture::Complete, reinterpret_cast<void *>(future._state),
+		NULL);
+	return future;
+}
+
+Infinario::RequestFuture Infinario::Infinario::TrackAsync(const std::string &eventName,
+	const std::string &eventAttributes)
+{
+	RequestFuture future(RequestFuturePool::GetInstance().Acquire());
+	this->TrackAt(this->_nameTable.Find(eventName), &eventName, eventAttributes, NULL, NULL, RequestFuture::Complete,
+		reinterpret_cast<void *>(future._state), NULL, 0);
+	return future;
+}
 
-	this->_requestManager.Enqueue(Request(Infinario::_requestUri, bodyStream.str(), callback, userData));
+Infinario::RequestFuture Infinario::Infinario::TrackAsync(const std::string &eventName,
+	const std::string &eventAttributes, const double timestamp)
+{
+	RequestFuture future(RequestFuturePool::GetInstance().Acquire());
+	const int64 eventTimestamp = Infinario::ToMilliseconds(timestamp);
+	this->TrackAt(this->_nameTable.Find(eventName), &eventName, eventAttributes, &eventTimestamp, NULL,
+		RequestFuture::Complete, reinterpret_cast<void *>(future._state), NULL, 0);
+	return future;
+}
+
+Infinario::RequestFuture Infinario::Infinario::TrackAsync(const NameHandle eventName,
+	const std::string &eventAttributes)
+{
+	RequestFuture future(RequestFuturePool::GetInstance().Acquire());
+	this->TrackAt(eventName, NULL, eventAttributes, NULL, NULL, RequestFuture::Complete,
+		reinterpret_cast<void *>(future._state), NULL, 0);
+	return future;
+}
+
+Infinario::RequestFuture Infinario::Infinario::TrackAsync(const NameHandle eventName,
+	const std::string &eventAttributes, const double timestamp)
+{
+	RequestFuture future(RequestFuturePool::GetInstance().Acquire());
+	const int64 eventTimestamp = Infinario::ToMilliseconds(timestamp);
+	this->TrackAt(eventName, NULL, eventAttributes, &eventTimestamp, NULL, RequestFuture::Complete,
+		reinterpret_cast<void *>(future._state), NULL, 0);
+	return future;
 }
 
 Infinario::Infinario::IndentifyUserData::IndentifyUserData(Infinario &infinario, const std::string &escapedCustomerId,
-	ResponseCallback callback, void *userData)
+	ResponseCallback callback, ResponseViewCallback viewCallback, void *userData)
 : _infinario(infinario)
 , _escapedCustomerId(escapedCustomerId)
 , _callback(callback)
+, _viewCallback(viewCallback)
 , _userData(userData)
 {}
 
-void Infinario::Infinario::IdentifyCallback(const CIwHTTP *httpClient, const std::string &requestBody,
-	const ResponseStatus responseStatus, const std::string &responseBody, void *identifyUserData)
+void Infinario::Infinario::IdentifyCallback(const CIwHTTP *httpClient, const char *requestBody,
+	const uint32 requestBodyLength, const ResponseStatus responseStatus, const char *responseBody,
+	const uint32 responseBodyLength, void *identifyUserData)
 {
 	IndentifyUserData *identifyData = reinterpret_cast<IndentifyUserData *>(identifyUserData);
 
-	if ((responseStatus == ResponseStatus::Success) || (responseBody.find("\"status\": \"ok\"") != std::string::npos)) {
+	static const char okStatus[] = "\"status\": \"ok\"";
+	const char *responseBodyEnd = responseBody + responseBodyLength;
+	if ((responseStatus == ResponseStatus::Success)
+		|| (std::search(responseBody, responseBodyEnd, okStatus, okStatus + sizeof(okStatus) - 1) != responseBodyEnd))
+	{
 		identifyData->_infinario._customerId = identifyData->_escapedCustomerId;
 	}
-	if (identifyData->_callback != NULL) {
-		identifyData->_callback(httpClient, requestBody, responseStatus, responseBody, identifyData->_userData);
+	if (identifyData->_viewCallback != NULL) {
+		identifyData->_viewCallback(httpClient, requestBody, requestBodyLength, responseStatus, responseBody,
+			responseBodyLength, identifyData->_userData);
+	} else if (identifyData->_callback != NULL) {
+		identifyData->_callback(httpClient, std::string(requestBody, requestBodyLength), responseStatus,
+			std::string(responseBody, responseBodyLength), identifyData->_userData);
 	}
 
 	delete identifyData;
@@ -1,110 +1,1143 @@
 #ifndef INFINARIO_INFIANRIO_H
 #define INFINARIO_INFIANRIO_H
 
+#include "InfinarioTransport.h"
+
 #include "IwHTTP.h"
 
-#include "s3eThread.h"
+#include "s3eThread.h"
+
+#include <atomic>
+#include <string>
+#include <sstream>
+#include <deque>
+#include <vector>
+#include <map>
+
+namespace Infinario
+{
+	/**
+	 * Function used to escape special characters in a json string.
+	 */
+	std::string EscapeJson(const std::string &jsonString);
+
+	enum class ResponseStatus : char
+	{
+		Success = 0, // The request was sent and a response was successfully recieved.
+		SendRequestError = 1, // The request wasn't sent.
+		ReceiveHeaderError = 2, // The request was sent, but no response was recieved or an error occured when loading
+								// the recieved data.
+		RecieveBodyError = 3, // The request was sent and a response was recieved, but an error occured when loading
+							  // the recieved data.
+		KilledError = 4, // The Infinario class instance was destroyed before the request can be finalized.
+						 // In some cases the request could have already been sent to the Infinario server.
+		ExpiredError = 5, // The request's time to live passed before it could be sent, it was never sent.
+		TimeoutError = 6, // The request was sent, but the response did not arrive in time. The request may have been
+						  // processed by the Infinario server.
+		RejectedError = 7, // The event was dropped by the rate limit or sampling set for its name, it was never queued.
+		InvalidError = 8 // The attributes were not a valid JSON object, the command was never queued. Only reported if
+						 // attribute validation is enabled.
+	};
+
+	/**
+	 * The number of values of the ResponseStatus enum type.
+	 */
+	const uint32 ResponseStatusCount = 9;
+
+	/**
+	 * The layout of the bulk request bodies sent to the Infinario server.
+	 */
+	enum class BulkFormat : char
+	{
+		Json = 0, // Every command is sent as it was built.
+		Compact = 1, // The project and customer ids are stated once per batch and event timestamps are sent as
+					 // differences from a base time. Requires a server which understands the compact envelope.
+		MessagePack = 2 // The commands are sent as MessagePack (application/x-msgpack) with native timestamps.
+						// Servers answering 415 Unsupported Media Type are sent JSON instead.
+	};
+
+	/**
+	 * Defines the prototype for callback functions, which are used to handle server responses to requests or errors
+	 * that may occur while processing a request.
+	 *
+	 * @param httpClient The CIwHTTP class instance used to send requests. Caution, this will be a NULL pointer if the
+	 *   Infinario class instance was destroyed before the request could be finalized (responseStatus = KilledError)
+	 *   or if a transport not based on CIwHTTP is used.
+	 * @param requestBody The body of the bulk request in which the command was sent. Several commands may share a
+	 *   single bulk request. If the command was never sent, this contains only the command itself.
+	 * @param responseStatus A value indicating the state of the result of the request. For more information refer to
+	 *   the ResponseStatus enum type's definition.
+	 * @param responseBody The body of the response recieved from the Infinario server. If an error occured this may
+	 *   contain either an empty string or an incomplete portion of the body sent by the server.
+	 * @param userData Data passed through the callback method, make sure the data is valid (i.e. not deallocated)
+	 *   before the callback is called.
+	 */
+	typedef void(*ResponseCallback)(const CIwHTTP *httpClient, const std::string &requestBody,
+		const ResponseStatus responseStatus, const std::string &responseBody, void *userData);
+
+	/**
+	 * Defines the prototype for callback functions, which work exactly like ResponseCallback functions, but receive
+	 * the request and response bodies as views into the SDK's buffers instead of strings. The views are not null
+	 * terminated and are only valid during the call, so no copies are made unless the callback makes them.
+	 *
+	 * @param httpClient See ResponseCallback.
+	 * @param requestBody The body of the bulk request in which the command was sent.
+	 * @param requestBodyLength The length of the request body.
+	 * @param responseStatus See ResponseCallback.
+	 * @param responseBody The body of the response recieved from the Infinario server.
+	 * @param responseBodyLength The length of the response body.
+	 * @param userData See ResponseCallback.
+	 */
+	typedef void(*ResponseViewCallback)(const CIwHTTP *httpClient, const char *requestBody,
+		const uint32 requestBodyLength, const ResponseStatus responseStatus, const char *responseBody,
+		const uint32 responseBodyLength, void *userData);
+
+	/**
+	 * Wraps a ResponseViewCallback function when it is passed to the request methods of the Infinario class. The
+	 * conversion is implicit, it only makes passing NULL as a callback unambiguous.
+	 */
+	class ResponseViewHandler
+	{
+	public:
+		ResponseViewHandler(ResponseViewCallback callback);
+
+		ResponseViewCallback _callback;
+	};
+
+	/**
+	 * Defines the prototype for callback functions, which are used to indicate that all the queued requests have been
+	 * finalized.
+	 * 
+	 * @param userData Data passed through the callback method, make sure the data is valid (i.e. not deallocated)
+	 *   before the callback is called.
+	 */
+	typedef void(*EmptyRequestQueueCallback)(void *userData);
+
+	/**
+	 * PoD class describing how a single command was finalized, see BatchCallback.
+	 */
+	class CommandResult
+	{
+	public:
+		void *_tag; // The userData argument supplied when the command was queued, NULL for the *Async methods.
+		ResponseStatus _responseStatus;
+	};
+
+	/**
+	 * Defines the prototype for callback functions, which are called once for all commands finalized together, e.g.
+	 * all commands sent in a single bulk request. This avoids the cost of calling a response callback per command.
+	 *
+	 * @param results The results of the finalized commands in the order in which they were queued. The array is only
+	 *   valid during the call.
+	 * @param resultCount The number of the finalized commands.
+	 * @param responseBody The body of the response recieved from the Infinario server, not null terminated. Empty if
+	 *   the commands were never sent. It is only valid during the call.
+	 * @param responseBodyLength The length of the response body.
+	 * @param userData Data passed through the callback method, make sure the data is valid (i.e. not deallocated)
+	 *   before the callback is called.
+	 */
+	typedef void(*BatchCallback)(const CommandResult *results, const uint32 resultCount, const char *responseBody,
+		const uint32 responseBodyLength, void *userData);
+
+	/**
+	 * Internal class storing the completion of a request observed by RequestFuture instances. States are recycled
+	 * through a process-wide pool, so creating a future does not allocate memory once the pool is warm.
+	 */
+	class RequestFutureState
+	{
+	public:
+		volatile bool _isCompleted;
+		ResponseStatus _responseStatus;
+		uint32 _referenceCount; // The futures observing the state plus one while the request is pending.
+		RequestFutureState *_next; // The next free state in the pool.
+	};
+
+	/**
+	 * Internal class recycling RequestFutureState instances. The states are allocated in blocks and are never freed.
+	 */
+	class RequestFuturePool
+	{
+	public:
+		static RequestFuturePool &GetInstance();
+
+		/**
+		 * Returns a pending state referenced once by a future and once by the request.
+		 */
+		RequestFutureState *Acquire();
+		void AddReference(RequestFutureState *state);
+		void Release(RequestFutureState *state);
+	private:
+		static const uint32 _blockSize = 64;
+
+		RequestFuturePool();
+
+		s3eThreadLock *_lock;
+		RequestFutureState *_freeStates;
+	};
+
+	/**
+	 * A handle to the completion of a request queued by one of the Async methods of the Infinario class. Copies of a
+	 * future observe the same request. It can be polled every frame or waited on, a future can also outlive the
+	 * Infinario class instance which created it.
+	 *
+	 * Waiting yields to the operating system until the request is finalized, so it must only be done on the main
+	 * thread and never from within a callback.
+	 */
+	class RequestFuture
+	{
+	public:
+		/**
+		 * Creates an invalid future, which does not observe any request.
+		 */
+		RequestFuture();
+		RequestFuture(const RequestFuture &other);
+		RequestFuture &operator=(const RequestFuture &other);
+		~RequestFuture();
+
+		bool IsValid() const;
+
+		/**
+		 * Returns true if the request was finalized. Invalid futures are never ready.
+		 */
+		bool IsReady() const;
+
+		/**
+		 * Returns the status the request was finalized with. Must only be called when the future is ready.
+		 */
+		ResponseStatus GetStatus() const;
+
+		/**
+		 * Waits until the request is finalized. Returns false if the application is quitting or the future is invalid.
+		 */
+		bool Wait() const;
+
+		/**
+		 * Waits until all of the requests are finalized. Returns false if the application is quitting or one of the
+		 * futures is invalid.
+		 */
+		static bool WaitAll(const RequestFuture *futures, const uint32 count);
+
+		/**
+		 * Waits until at least one of the requests is finalized and returns its index. Returns count if the application
+		 * is quitting or none of the futures is valid.
+		 */
+		static uint32 WaitAny(const RequestFuture *futures, const uint32 count);
+	private:
+		friend class Infinario;
+
+		explicit RequestFuture(RequestFutureState *state);
+
+		/**
+		 * The response callback finalizing the state passed as the user data.
+		 */
+		static void Complete(const CIwHTTP *httpClient, const char *requestBody, const uint32 requestBodyLength,
+			const ResponseStatus responseStatus, const char *responseBody, const uint32 responseBodyLength,
+			void *state);
+
+		RequestFutureState *_state;
+	};
+
+	/**
+	 * Internal PoD class used to store information about queued requests. Each request holds a single command, queued
+	 * commands sharing the same uri are sent together in one bulk request.
+	 */
+	class Request
+	{
+	public:
+		Request(const std::string &uri, const std::string &command, ResponseCallback callback, void *userData,
+			const void *owner = NULL, const uint32 timeToLive = 0, ResponseViewCallback viewCallback = NULL);
+
+		std::string _uri;
+		std::string _command;
+		ResponseCallback _callback;
+		ResponseViewCallback _viewCallback; // Used instead of _callback if set.
+		void *_userData;
+		void *_tag; // Reported to the batch callback, the caller's userData even if the SDK wraps the callbacks.
+		const void *_owner; // The Infinario class instance which queued the request.
+		uint32 _timeToLive; // Milliseconds after being queued when the request expires, zero if it never does.
+		int64 _enqueueTime;
+
+		// Where the parts of a track command lie within _command, used by the compact envelope. The identity length
+		// is zero for commands which are always sent as they are.
+		uint32 _identityOffset; // The "customer_ids" and "project_id" members.
+		uint32 _identityLength;
+		uint32 _eventOffset; // The "type" and "properties" members up to the end of the command.
+		int64 _timestamp;
+
+		// The position of the idempotency id's first digit within _command, zero if the command has none.
+		uint32 _commandIdOffset;
+	};
+
+	/**
+	 * Internal class storing the queued requests column by column. The fields scanned for every queued request lie in
+	 * contiguous arrays, the commands are stored back to back in a shared byte arena and the uris are interned, so a
+	 * queued request does not allocate memory of its own and costs a few dozen bytes on top of its command.
+	 *
+	 * Requests are removed mostly from the front of the queue, the columns are compacted once at least half of them is
+	 * unused. Positions are relative to the front of the queue and are invalidated by any removal.
+	 */
+	class RequestQueue
+	{
+	public:
+		RequestQueue();
+		~RequestQueue();
+
+		uint32 GetSize() const;
+		bool IsEmpty() const;
+
+		/**
+		 * Returns the size of all queued commands.
+		 */
+		uint64 GetCommandBytes() const;
+
+		void PushBack(const Request &request, const int64 enqueueTime);
+
+		/**
+		 * Removes the given number of requests from the front of the queue.
+		 */
+		void PopFront(const uint32 count);
+
+		/**
+		 * Removes the requests at the given positions, which must be sorted in ascending order. The order of the
+		 * remaining requests is preserved, only the requests in front of the last removed one are moved.
+		 */
+		void Erase(const std::vector<uint32> &positions);
+
+		void Clear();
+
+		/**
+		 * Returns a copy of the request at the given position. The uri and the command are only copied if requested,
+		 * the callbacks do not need them for commands that were sent.
+		 */
+		Request Get(const uint32 position, const bool isCommandCopied = true) const;
+
+		const std::string &GetUri(const uint32 position) const;
+		const char *GetCommand(const uint32 position) const;
+		uint32 GetCommandLength(const uint32 position) const;
+		uint32 GetIdentityOffset(const uint32 position) const;
+		uint32 GetIdentityLength(const uint32 position) const;
+		uint32 GetEventOffset(const uint32 position) const;
+		int64 GetTimestamp(const uint32 position) const;
+		uint32 GetCommandIdOffset(const uint32 position) const;
+		int64 GetEnqueueTime(const uint32 position) const;
+		const void *GetOwner(const uint32 position) const;
+
+		bool IsExpired(const uint32 position, const int64 now) const;
+		bool IsSameUri(const uint32 position, const uint32 otherPosition) const;
+
+		/**
+		 * Clears the response callbacks of the request at the given position, its user data is still reported to the
+		 * batch callback.
+		 */
+		void ClearCallbacks(const uint32 position);
+
+		/**
+		 * Returns the position of the first request within [begin, end) which is expired at the given time, or end
+		 * if there is none. Only the expiration times are read.
+		 */
+		uint32 FindExpired(const uint32 begin, const uint32 end, const int64 now) const;
+
+		/**
+		 * Returns true if all the requests within [begin, end) carry an idempotency id.
+		 */
+		bool HasCommandIds(const uint32 begin, const uint32 end) const;
+
+		/**
+		 * Makes the queue a read-only view of the source's requests within [begin, end). Only their fields are copied,
+		 * the commands stay in the source's arena, which must be pinned for as long as the view is read.
+		 */
+		void AssignView(const RequestQueue &source, const uint32 begin, const uint32 end);
+
+		/**
+		 * While the queue is pinned, the arena blocks of removed commands are neither freed nor reused, so that views
+		 * of it stay valid. Pins nest, the queue must not be cleared while pinned.
+		 */
+		void Pin();
+		void Unpin();
+	private:
+		/**
+		 * The fields only read when a request is finalized.
+		 */
+		class Callbacks
+		{
+		public:
+			ResponseCallback _callback;
+			ResponseViewCallback _viewCallback;
+			void *_userData;
+			void *_tag;
+			const void *_owner;
+		};
+
+		/**
+		 * A block of the arena, the commands are stored in blocks of a fixed size so that a growing queue never copies
+		 * them. A block is freed once all the commands stored in it are removed.
+		 */
+		class ArenaBlock
+		{
+		public:
+			char *_data;
+			uint32 _size;
+			uint32 _capacity;
+			uint32 _commandCount; // The number of queued commands stored in the block.
+		};
+
+		static const uint32 _minCompactedSize;
+		static const uint32 _arenaBlockSize;
+		static const int64 _neverExpires;
+
+		RequestQueue(const RequestQueue &);
+		RequestQueue &operator=(const RequestQueue &);
+
+		uint32 InternUri(const std::string &uri);
+
+		// Copies the command to the last block of the arena and stores its location into the column index.
+		void StoreCommand(const uint32 index, const std::string &command);
+
+		// Frees the arena blocks left without any command after the command at the column index is removed.
+		void ReleaseCommand(const uint32 index);
+
+		// Frees the arena blocks whose commands were all removed while the queue was pinned.
+		void ReleaseEmptyBlocks();
+
+		// Copies the request at one column index to another.
+		void Move(const uint32 sourceIndex, const uint32 targetIndex);
+
+		// Drops the unused front of the columns once it takes at least half of them.
+		void Compact();
+
+		uint32 _head; // The column index of the front of the queue.
+		std::vector<int64> _expireTimes;
+		std::vector<int64> _enqueueTimes;
+		std::vector<int64> _timestamps;
+		std::vector<uint32> _commandBlocks; // The sequence numbers of the arena blocks holding the commands.
+		std::vector<uint32> _commandOffsets; // The positions of the commands in their arena blocks.
+		std::vector<uint32> _commandLengths;
+		std::vector<uint32> _identityOffsets; // Relative to the command, as in Request.
+		std::vector<uint32> _identityLengths;
+		std::vector<uint32> _eventOffsets;
+		std::vector<uint32> _commandIdOffsets;
+		std::vector<uint32> _uriIndices;
+		std::vector<Callbacks> _callbacks;
+		std::deque<ArenaBlock> _arenaBlocks;
+		uint32 _firstArenaBlock; // The sequence number of the first block in _arenaBlocks.
+		uint64 _commandBytes;
+		std::vector<std::string> _uris;
+		uint32 _pinCount;
+		bool _isView; // A view does not own its arena blocks.
+	};
+
+	/**
+	 * Histogram with logarithmically sized buckets, each split into 8 linear sub-buckets (as HdrHistogram does), so
+	 * that recorded values are kept with a relative error of at most 12.5% in constant memory.
+	 */
+	class Histogram
+	{
+	public:
+		Histogram();
+
+		void Record(const uint32 value);
+
+		uint64 GetCount() const;
+		uint32 GetMin() const;
+		uint32 GetMax() const;
+		double GetMean() const;
+
+		/**
+		 * Returns the value below which the given percentage (0 - 100) of the recorded values fall.
+		 */
+		uint32 GetPercentile(const double percentile) const;
+	private:
+		static const uint32 _subBucketBits = 3;
+		static const uint32 _subBucketCount = 1 << _subBucketBits;
+		static const uint32 _bucketCount = _subBucketCount + (32 - _subBucketBits) * _subBucketCount;
+
+		static uint32 GetBucketIndex(const uint32 value);
+		static uint32 GetBucketValue(const uint32 bucketIndex);
+
+		uint32 _buckets[_bucketCount];
+		uint64 _count;
+		uint64 _sum;
+		uint32 _min;
+		uint32 _max;
+	};
+
+	/**
+	 * PoD class containing the request manager's counters. The counters are updated while the manager's lock is held
+	 * anyway, so collecting them does not add any synchronization to the request processing. The histograms are
+	 * recorded after a batch is finalized under a lock of their own, so reading them does not block queueing events.
+	 */
+	class Statistics
+	{
+	public:
+		Statistics();
+
+		uint64 _enqueuedCount; // The number of commands queued.
+		uint64 _sentCount; // The number of commands sent to the Infinario server (including resent commands).
+		uint64 _responseStatusCounts[ResponseStatusCount]; // The number of finalized commands per ResponseStatus.
+
+		uint32 _queueDepth; // The number of commands currently queued (including the batch being sent).
+		uint32 _queueHighWaterMark; // The maximum number of commands that were queued at once.
+		uint64 _queueBytes; // The size of all currently queued commands' bodies.
+		uint32 _oldestQueuedAge; // Milliseconds since the oldest currently queued command was queued.
+
+		uint64 _requestCount; // The number of bulk requests sent.
+		uint64 _requestBytes; // The size of all sent request bodies.
+		uint64 _responseBytes; // The size of all recieved response bodies.
+
+		Histogram _enqueueToAckLatency; // Milliseconds between queueing a command and its successful response.
+		Histogram _roundTripTime; // Milliseconds between sending a bulk request and recieving its header.
+	};
+
+	/**
+	 * PoD class containing the sender's current network estimates and the batching parameters derived from them.
+	 */
+	class BatchEstimates
+	{
+	public:
+		BatchEstimates();
+
+		uint32 _batchSize; // The maximum number of commands sent in a single bulk request.
+		uint32 _lingerTime; // Milliseconds the sender waits for more commands before sending an incomplete batch.
+		uint32 _roundTripTime; // Smoothed milliseconds between sending a request and recieving its header.
+		uint32 _throughput; // Smoothed bytes per second transferred during whole request/response cycles.
+	};
+
+	/**
+	 * PoD class containing statistics about the reuse of persistent (keep-alive) connections.
+	 */
+	class ConnectionStatistics
+	{
+	public:
+		ConnectionStatistics();
+
+		uint32 _requestCount; // The number of bulk requests sent.
+		// Requests sent while the SDK kept the connection of a previous request open. The transport does not report
+		// whether it actually reused the connection, it may have opened a new one if the server closed the old one.
+		uint32 _keptAliveRequestCount;
+		uint32 _newConnectionCount; // Requests sent after the SDK closed its connection, so a new one was opened.
+		uint32 _idleCloseCount; // Connections closed because they were idle for longer than the idle timeout.
+		uint32 _retryCount; // Requests resent over a new connection after failing on a reused one.
+		uint32 _lostResponseRetryCount; // Requests resent because their response was lost, see SetIdempotencyIds.
+		uint32 _failoverCount; // Requests resent to another endpoint after failing to be sent, see SetEndpoints.
+		uint32 _headerTimeoutCount; // Requests canceled because the response header did not arrive in time.
+		uint32 _bodyTimeoutCount; // Requests canceled because the response body stopped arriving.
+		uint64 _stalledTime; // Milliseconds between sending and canceling the timed out requests.
+		uint32 _throttledCount; // Requests rejected by the server with 429 or 503 and queued again.
+		uint64 _pausedTime; // Milliseconds the manager held back requests because the server throttled the SDK.
+	};
+
+	/**
+	 * Internal class adapting the batch size and linger time to the measured network conditions. Both values grow
+	 * additively while requests succeed and are halved when a request fails (AIMD).
+	 */
+	class BatchController
+	{
+	public:
+		BatchController();
+
+		/**
+		 * Updates the estimates after a bulk request was successfully finalized.
+		 *
+		 * @param commandCount The number of commands sent in the bulk request.
+		 * @param byteCount The number of request and response body bytes transferred.
+		 * @param roundTripTime Milliseconds between sending the request and recieving its header.
+		 * @param totalTime Milliseconds between sending the request and recieving the whole response body.
+		 */
+		void OnSuccess(const uint32 commandCount, const uint32 byteCount, const uint32 roundTripTime,
+			const uint32 totalTime);
+
+		/**
+		 * Updates the estimates after a bulk request failed.
+		 */
+		void OnFailure();
+
+		const BatchEstimates &GetEstimates() const;
+
+		/**
+		 * Returns the batch size the controller would reach after the given number of full batches succeeded.
+		 */
+		uint32 GetProjectedBatchSize(const uint32 successCount) const;
+	private:
+		static const uint32 _minBatchSize;
+		static const uint32 _maxBatchSize;
+		static const uint32 _maxLingerTime;
+		static const uint32 _lingerTimeStep;
+
+		BatchEstimates _estimates;
+	};
+
+	/**
+	 * PoD class containing the measurements of a bulk endpoint, see SetEndpoints.
+	 */
+	class EndpointStatistics
+	{
+	public:
+		EndpointStatistics();
+
+		std::string _uri;
+		uint32 _requestCount; // The number of bulk requests sent to the endpoint.
+		uint32 _failureCount; // Requests which failed without the endpoint's response being recieved.
+		uint32 _roundTripTime; // Smoothed milliseconds between sending a request and recieving its header.
+		uint32 _errorRate; // Smoothed per mille of failed requests.
+		bool _isHealthy; // False while the endpoint is avoided after failing.
+	};
+
+	/**
+	 * Internal class choosing the endpoint each bulk request is sent to. Every endpoint is tried once, afterwards the
+	 * one with the lowest round trip time, weighted by its error rate, is chosen. Every 16th request goes to the
+	 * healthy endpoint which was not sent a request for the longest time instead, so that the measurements of the
+	 * others stay current. An endpoint which fails is avoided for a backoff doubling with each consecutive failure, if
+	 * all of them are avoided the one whose backoff ends first is chosen.
+	 */
+	class EndpointSelector
+	{
+	public:
+		/**
+		 * The index of no endpoint.
+		 */
+		static const uint32 _noEndpoint = 0xFFFFFFFF;
+
+		EndpointSelector();
+
+		/**
+		 * Replaces the endpoints, discarding all measurements.
+		 */
+		void SetEndpoints(const std::vector<std::string> &uris);
+
+		/**
+		 * Returns the index of the endpoint the next request is sent to, _noEndpoint if there are no endpoints.
+		 */
+		uint32 Select(const int64 now);
+
+		const std::string &GetUri(const uint32 index) const;
+
+		/**
+		 * Returns true if there is an endpoint other than the given one which is not being avoided.
+		 */
+		bool HasHealthyAlternative(const uint32 index, const int64 now) const;
+
+		void OnSuccess(const uint32 index, const uint32 roundTripTime);
+		void OnFailure(const uint32 index, const int64 now);
+
+		void GetStatistics(const int64 now, std::vector<EndpointStatistics> &statistics) const;
+	private:
+		static const uint32 _probeInterval;
+		static const uint32 _minBackoff;
+		static const uint32 _maxBackoff;
+
+		class Endpoint
+		{
+		public:
+			Endpoint(const std::string &uri);
+
+			EndpointStatistics _statistics;
+			bool _isMeasured;
+			uint32 _consecutiveFailureCount;
+			int64 _avoidedUntil;
+			uint32 _lastSelection; // The number of the last request sent to the endpoint.
+		};
+
+		// The round trip time grows by a quarter for every 10 % of failed requests.
+		static uint64 GetCost(const Endpoint &endpoint);
+
+		std::vector<Endpoint> _endpoints;
+		uint32 _selectionCount;
+	};
+
+	/**
+	 * Internal class pacing the requests of all request managers in the application. When the server rejects a request
+	 * because it is overloaded (429 Too Many Requests or 503 Service Unavailable), sending is paused for the time given
+	 * by the Retry-After header, or for a randomized exponential backoff if there is none. After the pause requests are
+	 * spaced by a minimum interval, which doubles with every rejection and shrinks gradually while requests succeed.
+	 * The state is shared, so one overloaded response slows down every manager instead of only the one recieving it.
+	 */
+	class Pacer
+	{
+	public:
+		static Pacer &GetInstance();
+
+		/**
+		 * Returns the number of milliseconds to wait before the next request may be sent, zero if it may be sent now.
+		 */
+		uint32 GetDelay(const int64 now) const;
+
+		void OnSend(const int64 now);
+		void OnSuccess();
+
+		/**
+		 * Pauses sending after the server rejected a request.
+		 *
+		 * @param retryAfter The value of the response's Retry-After header, empty if it had none.
+		 */
+		void OnThrottled(const int64 now, const std::string &retryAfter);
+
+		/**
+		 * Returns true if the HTTP status code means the server is overloaded and the request should be resent later.
+		 */
+		static bool IsThrottled(const uint32 responseCode);
+	private:
+		static const uint32 _minInterval;
+		static const uint32 _maxInterval;
+		static const uint32 _maxRetryAfter;
+
+		Pacer();
+
+		s3eThreadLock *_lock;
+		int64 _resumeTime;
+		int64 _lastSendTime;
+		uint32 _interval;
+	};
+
+	/**
+	 * Internal class writing the bulk request body of a batch of queued requests in the given format.
+	 */
+	class BulkEncoder
+	{
+	public:
+		static void Encode(const BulkFormat format, const RequestQueue &requests, const uint32 begin,
+			const uint32 count, std::string &body);
+	private:
+		static void EncodeJson(const RequestQueue &requests, const uint32 begin, const uint32 count,
+			std::string &body);
+		static void EncodeCompact(const RequestQueue &requests, const uint32 begin, const uint32 count,
+			std::string &body);
+		static void EncodeMessagePack(const RequestQueue &requests, const uint32 begin, const uint32 count,
+			std::string &body);
+
+		static void AppendInteger(std::string &body, const int64 value);
+	};
+
+	/**
+	 * Internal PoD class storing the bulk request body of a batch built ahead of time while draining a large backlog.
+	 */
+	class PreparedBatch
+	{
+	public:
+		PreparedBatch();
+
+		uint32 _begin; // The position of the batch's first request in the queue, only valid while it is being built.
+		uint32 _count;
+		std::string _body;
+	};
+
+	/**
+	 * Internal class building the bulk request bodies of many batches at once on a pool of worker threads. The calling
+	 * thread builds a share of the batches too, so a pool of a single thread does not start any worker thread.
+	 */
+	class DrainPool
+	{
+	public:
+		/**
+		 * @param threadCount The number of threads building the batches including the calling thread. If zero, the
+		 *   number of the device's CPU cores is used.
+		 */
+		DrainPool(const uint32 threadCount);
+		~DrainPool();
+
+		uint32 GetThreadCount() const;
+
+		/**
+		 * Builds the bodies of the batches from the queued requests and returns once all of them are built. The queue
+		 * must not be modified in the meantime.
+		 */
+		void Build(const BulkFormat format, const RequestQueue &requests, std::vector<PreparedBatch> &batches);
+	private:
+		static const uint32 _maxThreadCount;
+
+		static void *WorkerThread(void *pool);
+
+		// Builds the shares of the batches until none are left.
+		void BuildShares();
+
+		uint32 _threadCount;
+		std::vector<s3eThread *> _threads;
+		s3eThreadLock *_lock;
+		s3eThreadSem *_startSemaphore;
+		s3eThreadSem *_doneSemaphore;
+		volatile bool _isTerminating;
+
+		// The job being built, only valid during Build.
+		BulkFormat _format;
+		const RequestQueue *_requests;
+		std::vector<PreparedBatch> *_batches;
+		uint32 _nextShare;
+	};
+
+	/**
+	 * Class used to schedule and manage requests. Each Infinario class instance creates its own request manager by
+	 * default, but a single request manager can be shared by several instances (e.g. tracking different projects),
+	 * so that their commands are sent together in the same bulk requests over the same connection.
+	 *
+	 * A shared request manager must outlive all the Infinario class instances using it.
+	 */
+	class RequestManager
+	{
+	public:
+		/**
+		 * @param transport The transport used to send requests, the manager takes ownership of it. If a NULL pointer
+		 *   is supplied, requests are sent using CIwHTTP.
+		 */
+		RequestManager(Transport *transport = NULL);
+		~RequestManager();
+
+		void SetProxy(const std::string &proxy);
+		void ClearProxy();
+
+		void SetEmptyRequestQueueCallback(EmptyRequestQueueCallback callback, void *userData = NULL);
+		void ClearEmptyRequestQueueCallback();
+
+		void SetBatchCallback(BatchCallback callback, void *userData = NULL);
+		void ClearBatchCallback();
+
+		void SetTimeouts(const uint32 headerTimeout, const uint32 bodyTimeout);
+
+		void SetParallelDrain(const uint32 threadCount = 0);
+		void ClearParallelDrain();
+
+		void SetBulkFormat(const BulkFormat format);
+		BulkFormat GetBulkFormat() const;
+
+		void SetEndpoints(const std::vector<std::string> &uris);
+
+		BatchEstimates GetBatchEstimates() const;
+		ConnectionStatistics GetConnectionStatistics() const;
+		std::vector<EndpointStatistics> GetEndpointStatistics() const;
+		Statistics GetStats() const;
+
+		void Enqueue(const Request &request);
+
+		/**
+		 * Finalizes a command which was never queued with the given status (RejectedError or InvalidError).
+		 */
+		void Reject(const ResponseStatus responseStatus, ResponseCallback callback, ResponseViewCallback viewCallback,
+			void *userData, void *tag, const void *owner);
+
+		/**
+		 * Finalizes all queued requests of the given owner with the KilledError status. The callbacks of the owner's
+		 * requests which are being sent are called as well and will not be called again when the requests finish.
+		 */
+		void Detach(const void *owner);
+	private:
+		static int32 RecieveHeader(void* systemData, void* userData);
+		static int32 RecieveBody(void* systemData, void* userData);
+		static int32 LingerElapsed(void* systemData, void* userData);
+		static int32 PauseElapsed(void* systemData, void* userData);
+
+		static const uint32 _bufferSize;
+		static const uint32 _connectionIdleTimeout;
+		static const uint32 _defaultHeaderTimeout;
+		static const uint32 _defaultBodyTimeout;
+		static const uint32 _drainThreshold;
+		static const uint32 _maxPreparedBatches;
+		static const uint32 _maxLostResponseRetryCount;
+
+		// Sends the next batch and then prepares the following ones, unless the caller holds the external lock.
+		void Execute(const bool isPreparationAllowed = true);
+		void PrepareBatches();
+		void ClearPreparedBatches();
+		void FinalizeBatch(const ResponseStatus responseStatus);
+		// Queues the sent batch again, the batch controller backs off only if the server throttled it.
+		void RequeueBatch(const bool isThrottled);
+
+		void RemoveExpired(const std::vector<Request> &expiredRequests);
+		void CallExpiredCallbacks(const std::vector<Request> &expiredRequests);
+		void CallResponseCallbacks(const std::vector<Request> &requests, const uint32 sentCount,
+			const CIwHTTP *httpClient, const ResponseStatus responseStatus, const char *responseBody,
+			const uint32 responseBodyLength) const;
+		void CallBatchCallback(const std::vector<Request> &requests, const ResponseStatus responseStatus,
+			const char *responseBody, const uint32 responseBodyLength);
+		static int32 WatchdogElapsed(void *systemData, void *userData);
+
+		void SetWatchdog(const uint32 timeout);
+		void CancelWatchdog();
+		bool ReserveBuffer(const uint32 capacity); // Returns false if the response buffer could not be grown.
+		void CloseConnection();
+
+		Transport *_transport;
+
+		s3eThreadLock *_externalLock;
+		s3eThreadLock *_internalLock;
+
+		EmptyRequestQueueCallback _emptyRequestQueueCallback;
+		void *_emptyRequestQueueUserData;
+		BatchCallback _batchCallback;
+		void *_batchCallbackUserData;
+
+		bool _isRequestBeingProcessed;
+		bool _isLingering;
+		bool _isPaused;
+		int64 _pauseStartTime;
+		RequestQueue _requestsQueue;
+		Statistics _statistics; // The histograms are guarded by the histogram lock, the rest by the internal lock.
+		s3eThreadLock *_histogramLock;
+
+		BatchController _batchController;
+		BulkFormat _bulkFormat;
+		uint32 _batchCount;
+		std::string _batchBody;
+		int64 _batchSendTime;
+		int64 _batchHeaderTime;
+		bool _isBatchRetried;
+		uint32 _lostResponseRetryCount; // How many times the batch was resent after its response was lost.
+		bool _isBatchFailedOver;
+
+		// Batches are sent to the chosen endpoint instead of their requests' uri if any endpoints are set.
+		EndpointSelector _endpointSelector;
+		uint32 _batchEndpoint; // The endpoint the batch was sent to, _noEndpoint if it was sent to the requests' uri.
+		std::string _connectedUri; // The uri the connection kept alive was opened to.
+
+		// While draining a large backlog the bodies of the following batches are built in parallel ahead of time from
+		// a copy of their requests, holding only the drain lock. They are discarded whenever the requests at the front
+		// of the queue change, which also bumps the generation, so that batches being built by then are not published.
+		s3eThreadLock *_drainLock;
+		DrainPool *_drainPool;
+		std::deque<PreparedBatch> _preparedBatches;
+		uint32 _preparedBatchesGeneration;
+
+		// The watchdog cancels requests whose response header or body does not arrive in time.
+		uint32 _headerTimeout;
+		uint32 _bodyTimeout;
+		bool _isWatchdogSet;
+		bool _isReceivingBody;
+
+		bool _isConnectionOpen;
+		bool _isConnectionReused;
+		bool _isConnectionCloseRequested;
+		int64 _lastActivityTime;
+		ConnectionStatistics _connectionStatistics;
+
+		// The response body is read directly into a single buffer, which grows as needed and is reused by all requests.
+		char *_buffer;
+		uint32 _bufferCapacity;
+		uint32 _accumulatedBodyLength; // The length requested from the transport so far.
+		uint32 _receivedBodyLength; // The length actually read into the buffer.
+	};
+
+	/**
+	 * Internal class providing the customerCookie used to identify an anonymous player. A single cookie is shared by
+	 * all Infinario class instances in the application. It is generated only once per device and stored in a file,
+	 * later it is just loaded from that file. Both happen on a worker thread started by the first instance created
+	 * without a customerId, so applications which always supply a customerId never pay for it.
+	 */
+	class CustomerCookie
+	{
+	public:
+		static CustomerCookie &GetInstance();
+
+		/**
+		 * Starts loading or generating the cookie on a worker thread, unless it is known or being prepared already.
+		 */
+		void Prepare();
+
+		/**
+		 * Returns the escaped cookie. The first call waits for the worker started by Prepare, or loads or generates
+		 * the cookie itself if threads are not available. Once the cookie is known no lock is taken.
+		 */
+		const std::string &Get();
+	private:
+		static const char *_filename;
+		static const uint32 _maxLength;
 
-#include <string>
-#include <sstream>
-#include <queue>
+		CustomerCookie();
+		~CustomerCookie();
+		CustomerCookie(const CustomerCookie &);
+		CustomerCookie &operator=(const CustomerCookie &);
+
+		static void *PrepareThread(void *customerCookie);
+
+		bool Load();
+		void Generate();
+		void Store() const;
+
+		s3eThreadLock *_lock;
+		s3eThread *_thread;
+		std::atomic<bool> _isReady; // Stored with release semantics once the value is complete.
+		std::string _value;
+	};
 
-namespace Infinario
-{
 	/**
-	 * Function used to escape special characters in a json string.
+	 * Internal class providing the current time for tracked events. The UTC time is sampled only once and subsequent
+	 * times are derived from the cheaper monotonic system timer. The UTC time is sampled again periodically and
+	 * whenever the application is resumed, since the monotonic timer may not advance while the device is suspended.
 	 */
-	std::string EscapeJson(const std::string &jsonString);
-
-	enum class ResponseStatus : char
+	class TimestampSource
 	{
-		Success = 0, // The request was sent and a response was successfully recieved.
-		SendRequestError = 1, // The request wasn't sent.
-		ReceiveHeaderError = 2, // The request was sent, but no response was recieved or an error occured when loading
-								// the recieved data.
-		RecieveBodyError = 3, // The request was sent and a response was recieved, but an error occured when loading
-							  // the recieved data.
-		KilledError = 4 // The Infinario class instance was destroyed before the request can be finalized.
-						// In some cases the request could have already been sent to the Infinario server.
+	public:
+		/**
+		 * The maximum number of characters written by Format, excluding the terminating zero.
+		 */
+		static const uint32 _maxFormattedLength = 24;
+
+		TimestampSource();
+		~TimestampSource();
+
+		/**
+		 * Returns the current UTC time in milliseconds since 01-Jan-1970. Consecutive calls never return decreasing
+		 * values.
+		 */
+		int64 GetTime();
+
+		/**
+		 * Writes the timestamp as seconds with three decimal places (e.g. "1449008100.123") into the buffer, which
+		 * must be at least _maxFormattedLength + 1 characters long. Returns the number of characters written.
+		 */
+		static uint32 Format(const int64 milliseconds, char *buffer);
+	private:
+		static s3eThreadLock *GetRegistrationLock();
+		static int32 Resumed(void *systemData, void *userData);
+
+		static const int64 _resyncPeriod;
+
+		static uint32 _instanceCount; // Guarded by the registration lock.
+		static volatile uint32 _resumeCount;
+
+		void Resync();
+
+		s3eThreadLock *_lock;
+		int64 _baseUtcTime;
+		int64 _baseSystemTime;
+		int64 _lastTime;
+		uint32 _syncedResumeCount;
 	};
 
 	/**
-	 * Defines the prototype for callback functions, which are used to handle server responses to requests or errors
-	 * that may occur while processing a request.
-	 *
-	 * @param httpClient The CIwHTTP class instance used to send requests. Caution, this will be a NULL pointer if the
-	 *   Infinario class instance was destroyed before the request could be finalized (responseStatus = KilledError).
-	 * @param responseStatus A value indicating the state of the result of the request. For more information refer to
-	 *   the ResponseStatus enum type's definition.
-	 * @param responseBody The body of the response recieved from the Infinario server. If an error occured this may
-	 *   contain either an empty string or an incomplete portion of the body sent by the server.
-	 * @param userData Data passed through the callback method, make sure the data is valid (i.e. not deallocated)
-	 *   before the callback is called.
+	 * Internal class generating the idempotency ids of an Infinario class instance's commands. An id consists of 16
+	 * hexadecimal digits: a hash of the player's identifier, the project and the instance, followed by a sequence
+	 * number counting the instance's commands. A command keeps its id when it is sent again, so that the server can
+	 * drop the copies of commands it has already processed.
 	 */
-	typedef void(*ResponseCallback)(const CIwHTTP *httpClient, const std::string &requestBody,
-		const ResponseStatus responseStatus, const std::string &responseBody, void *userData);
+	class CommandIdSource
+	{
+	public:
+		/**
+		 * The number of characters written by Next.
+		 */
+		static const uint32 _length = 16;
+
+		CommandIdSource(const std::string &projectToken);
+		~CommandIdSource();
+
+		/**
+		 * Writes the id of the player's next command into the buffer, which must be at least _length characters long.
+		 * No terminating zero is written.
+		 */
+		void Next(const std::string &customerId, char *buffer);
+	private:
+		s3eThreadLock *_lock;
+		uint32 _seed; // Differs for every instance, even across application runs.
+		uint32 _sequence;
+	};
 
 	/**
-	 * Defines the prototype for callback functions, which are used to indicate that all the queued requests have been
-	 * finalized.
-	 * 
-	 * @param userData Data passed through the callback method, make sure the data is valid (i.e. not deallocated)
-	 *   before the callback is called.
+	 * Handle of an event name or property key registered in an Infinario class instance's name table.
 	 */
-	typedef void(*EmptyRequestQueueCallback)(void *userData);
+	typedef uint32 NameHandle;
 
 	/**
-	 * Internal PoD class used to store information about queued requests.
+	 * Internal class limiting the rate of events to a sustained number per second with bursts of up to a capacity.
+	 * Tokens are counted in thousandths, so that rates below one event per second refill smoothly.
 	 */
-	class Request
+	class TokenBucket
 	{
 	public:
-		Request(const std::string &uri, const std::string &body, ResponseCallback callback, void *userData);
+		TokenBucket();
 
-		std::string _uri;
-		std::string _body;
-		ResponseCallback _callback;
-		void *_userData;
+		/**
+		 * Sets the rate in events per second and the burst capacity, a zero rate disables the limit. The bucket is
+		 * refilled completely.
+		 */
+		void Set(const uint32 rate, const uint32 capacity, const int64 now);
+
+		bool IsLimited() const;
+
+		/**
+		 * Takes a token if one is available, returns false if the event exceeds the limit.
+		 */
+		bool Take(const int64 now);
+	private:
+		uint32 _rate;
+		uint32 _capacity;
+		uint64 _tokens;
+		int64 _updateTime;
 	};
 
 	/**
-	* Internal class used to schedule and manage requests.
-	*/
-	class RequestManager
+	 * Internal class storing registered event names and property keys, escaped and quoted, so that they are rendered
+	 * only once instead of every time they are used. Lookups do not take any lock, registering takes one.
+	 */
+	class NameTable
 	{
 	public:
-		RequestManager();
-		~RequestManager();
+		static const uint32 _capacity = 256;
 
-		void SetProxy(const std::string &proxy);
-		void ClearProxy();
+		NameTable();
+		~NameTable();
 
-		void SetEmptyRequestQueueCallback(EmptyRequestQueueCallback callback, void *userData = NULL);
-		void ClearEmptyRequestQueueCallback();
+		/**
+		 * Returns the handle of the name, registering it first if necessary. Returns _capacity if the table is full.
+		 */
+		NameHandle Register(const std::string &name);
 
-		void Enqueue(const Request &request);
-	private:
-		static int32 RecieveHeader(void* systemData, void* userData);
-		static int32 RecieveBody(void* systemData, void* userData);
+		/**
+		 * Returns the escaped name including the surrounding quotes. Unknown handles return an empty quoted name.
+		 */
+		const std::string &Get(const NameHandle handle) const;
 
-		static const uint32 _bufferSize;
+		/**
+		 * Sets the time to live in milliseconds of events with the name, zero disables expiration.
+		 */
+		void SetTimeToLive(const NameHandle handle, const uint32 timeToLive);
 
-		void Execute();
+		/**
+		 * Returns the time to live of events with the name, zero if they do not expire.
+		 */
+		uint32 GetTimeToLive(const NameHandle handle) const;
 
-		CIwHTTP *_httpClient;
+		/**
+		 * Sets the percentage (0 - 100) of customers whose events with the name are tracked.
+		 */
+		void SetSampleRate(const NameHandle handle, const uint32 sampleRate);
 
-		s3eThreadLock *_externalLock;
-		s3eThreadLock *_internalLock;
+		/**
+		 * Limits events with the name to a number per second with bursts of up to burst events, a zero rate disables
+		 * the limit.
+		 */
+		void SetRateLimit(const NameHandle handle, const uint32 rate, const uint32 burst);
 
-		EmptyRequestQueueCallback _emptyRequestQueueCallback;
-		void *_emptyRequestQueueUserData;
+		/**
+		 * Decides whether an event with the name is tracked for the customer. Sampling is deterministic, all events of
+		 * a sampled customer are tracked. Takes the lock, but only when the name has a rate limit.
+		 */
+		bool Admit(const NameHandle handle, const std::string &customerId);
 
-		bool _isRequestBeingProcessed;
-		std::queue<Request> _requestsQueue;
+		/**
+		 * Returns the handle of the name, _capacity if it is not registered. Never takes the lock, and returns right
+		 * away unless some time to live, sample rate or rate limit was set.
+		 */
+		NameHandle Find(const std::string &name) const;
+	private:
+		static const uint32 _slotCount = 512; // A power of two, at least twice the capacity so a slot is always empty.
 
-		char *_buffer;
-		uint32 _accumulatedBodyLength;
-		std::stringstream _accumulatedBodyContent;
+		// FNV-1a followed by a finalizer mixing the bits.
+		static uint32 Hash(const std::string &value);
+
+		// Returns the slot holding the name's handle, or the empty slot where it belongs if it is not registered.
+		uint32 FindSlot(const std::string &name) const;
+
+		s3eThreadLock *_lock;
+		volatile uint32 _count;
+		volatile bool _hasPolicies;
+		std::string *_names[_capacity]; // Escaped and quoted.
+		std::string *_unquotedNames[_capacity];
+		volatile uint32 _timesToLive[_capacity];
+		volatile uint32 _sampleRates[_capacity];
+		volatile bool _isRateLimited[_capacity];
+		TokenBucket _buckets[_capacity];
+
+		// Open addressing hash table of the handles plus one, zero marks an empty slot. Slots are only filled, so they
+		// are read without the lock.
+		volatile uint32 _slots[_slotCount];
+		std::string _emptyName;
 	};
 
 	/**
@@ -116,7 +1149,8 @@ namespace Infinario
 	    /**
 		 * When tracking events and updating the player's information, the player needs to be somehow identified.
 		 *
-		 * The constructor generates a customerCookie, which is used to identify an anonymous player.
+		 * The constructor prepares a customerCookie, which is used to identify an anonymous player. The cookie is
+		 * generated when the SDK is first used on a device, stored and reused afterwards.
 		 * A player is considered anonymous if the customerId argument is not supplied to the constructor or if an
 		 * empty string is used as the customerId. The player remains anonymous until the identify method is called and
 		 * a successfull response is recieved from the Infinario server. If a player is not anonymous, the
@@ -129,8 +1163,28 @@ namespace Infinario
 		 *
 		 * @param projectToken A unique identifier for the project, generated by the Infinario server.
 		 * @param customerId A unique identifier for the tracked player.
+		 * @param transport The transport used to send requests, the instance takes ownership of it. If a NULL pointer
+		 *   is supplied, requests are sent to the Infinario server using CIwHTTP.
+		 */
+		Infinario(const std::string &projectToken, const std::string &customerId = std::string(),
+			Transport *transport = NULL);
+
+		/**
+		 * Creates an instance sending its requests through a request manager shared with other instances. Commands of
+		 * all the instances are multiplexed into the same bulk requests, which reduces the number of requests and the
+		 * memory used per instance.
+		 *
+		 * @param projectToken A unique identifier for the project, generated by the Infinario server.
+		 * @param customerId A unique identifier for the tracked player (an empty string for an anonymous player).
+		 * @param requestManager The shared request manager, it must outlive the instance.
+		 */
+		Infinario(const std::string &projectToken, const std::string &customerId, RequestManager &requestManager);
+
+		/**
+		 * Finalizes all of the instance's pending requests with the KilledError status. Requests of other instances
+		 * sharing the same request manager are not affected.
 		 */
-		Infinario(const std::string &projectToken, const std::string &customerId = std::string());
+		~Infinario();
 		
 		/**
 		 * Used to set a proxy through which all requests will be sent to the Infinario server.
@@ -147,7 +1201,8 @@ namespace Infinario
 		/**
 		 * Sets a callback function to be called whenever all pending requests have been finalized. If there is no
 		 * request being currently processed, then the callback will not be called until at least one request is queued
-		 * and then finalized.
+		 * and then finalized. If the request manager is shared, the callback is set for all instances sharing it and
+		 * is called when the requests of all of them have been finalized.
 		 *
 		 * @param callback A function, which is called when all requests in the queue have been finalized.
 		 * @param userData Data, which is sent as an argument to the callback function.
@@ -159,6 +1214,113 @@ namespace Infinario
 		 */
 		void ClearEmptyRequestQueueCallback();
 
+		/**
+		 * Sets a callback function to be called once for all commands finalized together, in addition to their
+		 * response callbacks. Commands can be queued without a response callback, their userData argument is still
+		 * passed to this callback as a tag identifying them. If the request manager is shared, the callback receives
+		 * the commands of all instances sharing it.
+		 *
+		 * @param callback A function, which is called when a group of commands has been finalized.
+		 * @param userData Data, which is sent as an argument to the callback function.
+		 */
+		void SetBatchCallback(BatchCallback callback, void *userData = NULL);
+
+		/**
+		 * Clears the batch callback function.
+		 */
+		void ClearBatchCallback();
+
+		/**
+		 * Sets how long a sent request may wait for the response. If the response header does not arrive within the
+		 * header timeout, or the body stops arriving for longer than the body timeout, the request is canceled, its
+		 * commands are finalized with the TimeoutError status and the queue moves on. By default both timeouts are
+		 * 30 seconds. Zero disables the respective timeout. If the request manager is shared, the timeouts are set for
+		 * all instances sharing it.
+		 *
+		 * @param headerTimeout Milliseconds between sending a request and recieving the response header.
+		 * @param bodyTimeout Milliseconds between recieving two parts of the response body.
+		 */
+		void SetTimeouts(const uint32 headerTimeout, const uint32 bodyTimeout);
+
+		/**
+		 * Enables the parallel drain mode. When many commands are queued at once (for example after a long offline
+		 * period), the bulk request bodies of the following batches are built ahead of time on a pool of worker
+		 * threads and handed to the sender in order. If the request manager is shared, the mode is set for all
+		 * instances sharing it.
+		 *
+		 * @param threadCount The number of threads building the bodies including the thread sending requests. If zero,
+		 *   the number of the device's CPU cores is used.
+		 */
+		void SetParallelDrain(const uint32 threadCount = 0);
+
+		/**
+		 * Disables the parallel drain mode and stops its worker threads.
+		 */
+		void ClearParallelDrain();
+
+		/**
+		 * Sets the layout of the bulk request bodies, BulkFormat::Json by default. The compact envelope states the
+		 * project and customer ids of the batched events only once and sends their timestamps as differences from a
+		 * base time, which cuts short events to less than half their size. Only use it with a server supporting it.
+		 * The MessagePack format is negotiated, if the server does not accept it the request manager switches back to
+		 * JSON for good. If the request manager is shared, the format is set for all instances sharing it.
+		 */
+		void SetBulkFormat(const BulkFormat format);
+
+		/**
+		 * Returns the layout of the bulk request bodies currently sent, see SetBulkFormat.
+		 */
+		BulkFormat GetBulkFormat() const;
+
+		/**
+		 * Sets the bulk endpoints (full uris, e.g. regional ingestion endpoints or a relay) requests are sent to
+		 * instead of the default one. Every endpoint is tried, afterwards batches go to the one with the lowest round
+		 * trip time, weighted by its error rate. An endpoint which fails to deliver a request is avoided for a while
+		 * and a batch which could not be sent at all is resent to another endpoint right away. An empty list restores
+		 * the default endpoint. If the request manager is shared, the endpoints are set for all instances sharing it.
+		 */
+		void SetEndpoints(const std::vector<std::string> &uris);
+
+		/**
+		 * Returns the round trip time, error rate and health of each endpoint set with SetEndpoints.
+		 */
+		std::vector<EndpointStatistics> GetEndpointStatistics() const;
+
+		/**
+		 * Enables checking that the attributes passed to the Track and Update methods are a valid JSON object before
+		 * they are queued. A malformed string would otherwise make the whole bulk request it is sent in invalid.
+		 * Invalid commands are never queued and their callback is called right away with the InvalidError status.
+		 * Validation is disabled by default.
+		 */
+		void SetAttributeValidation(const bool isEnabled);
+
+		/**
+		 * Enables attaching an idempotency id (the "command_id" member) to every command queued afterwards. The server
+		 * drops commands whose id it has already processed, so a bulk request whose response was lost (it timed out or
+		 * the connection broke after it was sent) is safely sent again, up to two more times. Requires a server which
+		 * understands the ids. Disabled by default.
+		 */
+		void SetIdempotencyIds(const bool isEnabled);
+
+		/**
+		 * Returns the sender's current batch size, linger time, round trip time and throughput estimates. Queued
+		 * commands are sent in bulk requests of up to the returned batch size, these values are useful for logging.
+		 */
+		BatchEstimates GetBatchEstimates() const;
+
+		/**
+		 * Returns statistics about how often requests were sent over a persistent connection kept alive after a
+		 * previous request, instead of opening a new one.
+		 */
+		ConnectionStatistics GetConnectionStatistics() const;
+
+		/**
+		 * Returns the SDK's counters: queued, sent and finalized commands (per response status), the current queue
+		 * depth and size, the age of the oldest queued command, transferred bytes and latency histograms. Collecting
+		 * the statistics is cheap, they are always enabled.
+		 */
+		Statistics GetStats() const;
+
 		/**
 		 * Used to set a unique customerId for an anonymous player. The customerId is internally set only after a
 		 * successfull response is recieved from the Infinario server. It is recommended to only call this method once.
@@ -205,9 +1367,11 @@ namespace Infinario
 		 * @param eventAttributes Contains the event's properties. This must be a valid JSON string.
 		 * @param callback A function, which is called when a response is recieved or if an error occurs.
 		 * @param userData Data, which is sent as an argument to the callback function.
+		 * @param timeToLive Milliseconds after which the event is dropped if it was not sent yet. If zero, the value
+		 * set by the SetEventTimeToLive method is used.
 		 */
 		void Track(const std::string &eventName, const std::string &eventAttributes,
-			ResponseCallback callback = NULL, void *userData = NULL);
+			ResponseCallback callback = NULL, void *userData = NULL, const uint32 timeToLive = 0);
 
 		/**
 		 * Used to track an event for the current player. The event's timestamp is set manually.
@@ -223,33 +1387,222 @@ namespace Infinario
 		 * @param timestamp A double UNIX timestamp in seconds (supports second fractions).
 		 * @param callback A function, which is called when a response is recieved or when an error occurs.
 		 * @param userData Data, which is sent as an argument to the callback function.
+		 * @param timeToLive Milliseconds after which the event is dropped if it was not sent yet. If zero, the value
+		 * set by the SetEventTimeToLive method is used.
+		 */
+		void Track(const std::string &eventName, const std::string &eventAttributes, const double timestamp,
+			ResponseCallback callback = NULL, void *userData = NULL, const uint32 timeToLive = 0);
+
+		/**
+		 * Registers an event name or property key, so that it is escaped and rendered only once. Registering a name
+		 * again returns the same handle. Up to 256 names can be registered, if there is no more room the method
+		 * returns NameTable::_capacity, which must not be used as a handle.
+		 *
+		 * @param name The event name or property key.
+		 */
+		NameHandle RegisterName(const std::string &name);
+
+		/**
+		 * Returns a registered name escaped and quoted, ready to be inserted into a JSON string. This can be used to
+		 * build the eventAttributes argument without escaping property keys every time.
+		 *
+		 * @param handle A handle returned by the RegisterName method of this instance.
+		 */
+		const std::string &GetQuotedName(const NameHandle handle) const;
+
+		/**
+		 * Used to track an event with a registered name for the current player. The event's timestamp is set to the
+		 * current time, when the method was called. Works exactly like the Track method accepting the name as a string,
+		 * but the name does not have to be escaped again.
+		 *
+		 * @param eventName A handle returned by the RegisterName method of this instance.
+		 * @param eventAttributes Contains the event's properties. This must be a valid JSON string.
+		 * @param callback A function, which is called when a response is recieved or if an error occurs.
+		 * @param userData Data, which is sent as an argument to the callback function.
+		 * @param timeToLive Milliseconds after which the event is dropped if it was not sent yet. If zero, the value
+		 * set by the SetEventTimeToLive method is used.
+		 */
+		void Track(const NameHandle eventName, const std::string &eventAttributes,
+			ResponseCallback callback = NULL, void *userData = NULL, const uint32 timeToLive = 0);
+
+		/**
+		 * Used to track an event with a registered name for the current player. The event's timestamp is set manually.
+		 *
+		 * @param eventName A handle returned by the RegisterName method of this instance.
+		 * @param eventAttributes Contains the event's properties. This must be a valid JSON string.
+		 * @param timestamp A double UNIX timestamp in seconds (supports second fractions).
+		 * @param callback A function, which is called when a response is recieved or when an error occurs.
+		 * @param userData Data, which is sent as an argument to the callback function.
+		 * @param timeToLive Milliseconds after which the event is dropped if it was not sent yet. If zero, the value
+		 * set by the SetEventTimeToLive method is used.
+		 */
+		void Track(const NameHandle eventName, const std::string &eventAttributes, const double timestamp,
+			ResponseCallback callback = NULL, void *userData = NULL, const uint32 timeToLive = 0);
+
+		/**
+		 * The following methods work exactly like the methods of the same name above, but call a callback receiving
+		 * views of the request and response bodies instead of strings. The views point into the SDK's buffers, so the
+		 * bodies are not copied for every callback.
 		 */
+		void Identify(const std::string &customerId, ResponseViewHandler callback, void *userData = NULL);
+		void Update(const std::string &customerAttributes, ResponseViewHandler callback, void *userData = NULL);
+		void Track(const std::string &eventName, const std::string &eventAttributes,
+			ResponseViewHandler callback, void *userData = NULL, const uint32 timeToLive = 0);
 		void Track(const std::string &eventName, const std::string &eventAttributes, const double timestamp,
-			ResponseCallback callback = NULL, void *userData = NULL);
+			ResponseViewHandler callback, void *userData = NULL, const uint32 timeToLive = 0);
+		void Track(const NameHandle eventName, const std::string &eventAttributes,
+			ResponseViewHandler callback, void *userData = NULL, const uint32 timeToLive = 0);
+		void Track(const NameHandle eventName, const std::string &eventAttributes, const double timestamp,
+			ResponseViewHandler callback, void *userData = NULL, const uint32 timeToLive = 0);
+
+		/**
+		 * Sets how long events with the name may wait in the queue. Events which were not sent in time are dropped
+		 * and their callback is called with the ExpiredError status. Useful for events that are worthless once old,
+		 * so that they do not delay the others after a long outage.
+		 *
+		 * @param eventName The title of the tracked event.
+		 * @param timeToLive Milliseconds after which the events are dropped, zero if they should never be.
+		 */
+		void SetEventTimeToLive(const std::string &eventName, const uint32 timeToLive);
+
+		/**
+		 * Sets how long events with the registered name may wait in the queue.
+		 *
+		 * @param eventName A handle returned by the RegisterName method of this instance.
+		 * @param timeToLive Milliseconds after which the events are dropped, zero if they should never be.
+		 */
+		void SetEventTimeToLive(const NameHandle eventName, const uint32 timeToLive);
+
+		/**
+		 * Tracks events with the name only for a percentage of players. The players are selected by a hash of their
+		 * customerId (or customerCookie if they are anonymous), so a selected player's events are all tracked and an
+		 * other player's are all dropped. Dropped events are never queued and their callback is called right away
+		 * with the RejectedError status.
+		 *
+		 * @param eventName The title of the tracked event.
+		 * @param sampleRate The percentage (0 - 100) of players whose events are tracked, 100 tracks all of them.
+		 */
+		void SetEventSampling(const std::string &eventName, const uint32 sampleRate);
+		void SetEventSampling(const NameHandle eventName, const uint32 sampleRate);
+
+		/**
+		 * Limits how many events with the name are tracked using a token bucket: bursts of up to burst events are
+		 * tracked at once, after that only eventsPerSecond events per second are. Events over the limit are dropped
+		 * like the events of players who are not sampled.
+		 *
+		 * @param eventName The title of the tracked event.
+		 * @param eventsPerSecond The sustained rate of tracked events, zero removes the limit.
+		 * @param burst The number of events that can be tracked at once after a quiet period.
+		 */
+		void SetEventRateLimit(const std::string &eventName, const uint32 eventsPerSecond, const uint32 burst);
+		void SetEventRateLimit(const NameHandle eventName, const uint32 eventsPerSecond, const uint32 burst);
+
+		/**
+		 * Works exactly like the Identify method, but instead of calling a callback it returns a future which becomes
+		 * ready once the request is finalized.
+		 *
+		 * @param customerId The new customerId, which identifies the current player.
+		 */
+		RequestFuture IdentifyAsync(const std::string &customerId);
+
+		/**
+		 * Works exactly like the Update method, but returns a future instead of calling a callback.
+		 *
+		 * @param customerAttributes Contains the player's updated attributes. This must be a valid JSON string.
+		 */
+		RequestFuture UpdateAsync(const std::string &customerAttributes);
+
+		/**
+		 * Works exactly like the Track method, but returns a future instead of calling a callback.
+		 *
+		 * @param eventName The title of the tracked event.
+		 * @param eventAttributes Contains the event's properties. This must be a valid JSON string.
+		 */
+		RequestFuture TrackAsync(const std::string &eventName, const std::string &eventAttributes);
+
+		/**
+		 * Works exactly like the Track method with a timestamp, but returns a future instead of calling a callback.
+		 *
+		 * @param eventName The title of the tracked event.
+		 * @param eventAttributes Contains the event's properties. This must be a valid JSON string.
+		 * @param timestamp A double UNIX timestamp in seconds (supports second fractions).
+		 */
+		RequestFuture TrackAsync(const std::string &eventName, const std::string &eventAttributes,
+			const double timestamp);
+
+		/**
+		 * Works exactly like the Track method with a registered name, but returns a future instead of calling a
+		 * callback.
+		 *
+		 * @param eventName A handle returned by the RegisterName method of this instance.
+		 * @param eventAttributes Contains the event's properties. This must be a valid JSON string.
+		 */
+		RequestFuture TrackAsync(const NameHandle eventName, const std::string &eventAttributes);
+
+		/**
+		 * Works exactly like the Track method with a registered name and a timestamp, but returns a future instead of
+		 * calling a callback.
+		 *
+		 * @param eventName A handle returned by the RegisterName method of this instance.
+		 * @param eventAttributes Contains the event's properties. This must be a valid JSON string.
+		 * @param timestamp A double UNIX timestamp in seconds (supports second fractions).
+		 */
+		RequestFuture TrackAsync(const NameHandle eventName, const std::string &eventAttributes,
+			const double timestamp);
 	private:
+		static int64 ToMilliseconds(const double timestamp);
+
+		// The tag is reported to the batch callback in place of the userData, which may be the SDK's own.
+		void IdentifyWith(const std::string &customerId, ResponseCallback callback, ResponseViewCallback viewCallback,
+			void *userData, void *tag);
+		void UpdateWith(const std::string &customerAttributes, ResponseCallback callback,
+			ResponseViewCallback viewCallback, void *userData, void *tag);
+
+		// Admits the event, then builds and queues its command. The name is escaped only once the event is admitted, if
+		// it is NULL the registered name of the handle is used instead. A NULL timestamp stands for the current time.
+		void TrackAt(const NameHandle eventName, const std::string *unquotedEventName,
+			const std::string &eventAttributes, const int64 *timestamp, ResponseCallback callback,
+			ResponseViewCallback viewCallback, void *userData, void *tag, const uint32 timeToLive);
+
+		// Appends the "command_id" member followed by a comma if idempotency ids are enabled. Returns the position of
+		// the id's first digit, zero if no id was appended.
+		uint32 AppendCommandId(const std::string &customerId, std::string &command);
+
 		class IndentifyUserData
 		{
 		public:
 			IndentifyUserData(Infinario &infinario, const std::string &escapedCustomerId,
-				ResponseCallback callback, void *userData);
+				ResponseCallback callback, ResponseViewCallback viewCallback, void *userData);
 
 			Infinario &_infinario;
 			std::string _escapedCustomerId;
 			ResponseCallback _callback;
+			ResponseViewCallback _viewCallback;
 			void *_userData;
 		};
 	
-		static void IdentifyCallback(const CIwHTTP *httpClient, const std::string &requestBody,
-			const ResponseStatus responseStatus, const std::string &responseBody, void *identifyUserData);
+		Infinario(const Infinario &);
+		Infinario &operator=(const Infinario &);
+
+		static void IdentifyCallback(const CIwHTTP *httpClient, const char *requestBody,
+			const uint32 requestBodyLength, const ResponseStatus responseStatus, const char *responseBody,
+			const uint32 responseBodyLength, void *identifyUserData);
 		
 		static const std::string _requestUri;
 
-		RequestManager _requestManager;
+		RequestManager *_requestManager;
+		const bool _isRequestManagerShared;
 
 		const std::string _projectToken;
 
-		std::string _customerCookie;
 		std::string _customerId;
+
+		TimestampSource _timestampSource;
+		NameTable _nameTable;
+		CommandIdSource _commandIdSource;
+
+		volatile bool _isValidatingAttributes;
+		volatile bool _isAttachingCommandIds;
 	};
 }
 
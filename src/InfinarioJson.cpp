@@ -0,0 +1,249 @@
+#include "InfinarioJson.h"
+
+#include "s3eTypes.h"
+
+#include <cstring>
+
+namespace
+{
+	const uint32 maxDepth = 256;
+
+	const uint64 onesWord = 0x0101010101010101ull;
+	const uint64 highBitsWord = 0x8080808080808080ull;
+
+	// Returns a non-zero value if any byte of the word is zero.
+	inline uint64 HasZeroByte(const uint64 word)
+	{
+		return (word - onesWord) & ~word & highBitsWord;
+	}
+
+	// Returns a non-zero value if any byte of the word is less than the value, which must not be greater than 0x80.
+	inline uint64 HasByteLessThan(const uint64 word, const uint8 value)
+	{
+		return (word - onesWord * value) & ~word & highBitsWord;
+	}
+
+	// Returns a non-zero value if any byte of the word ends a plain run of string contents.
+	inline uint64 HasStringSpecialByte(const uint64 word)
+	{
+		return HasZeroByte(word ^ (onesWord * '"')) | HasZeroByte(word ^ (onesWord * '\\'))
+			| HasByteLessThan(word, 0x20);
+	}
+
+	inline bool IsDigit(const char character)
+	{
+		return (character >= '0') && (character <= '9');
+	}
+
+	inline bool IsHexDigit(const char character)
+	{
+		return IsDigit(character) || ((character >= 'a') && (character <= 'f'))
+			|| ((character >= 'A') && (character <= 'F'));
+	}
+
+	const char *SkipWhitespace(const char *it, const char *end)
+	{
+		while ((it != end) && ((*it == ' ') || (*it == '\n') || (*it == '\r') || (*it == '\t'))) {
+			++it;
+		}
+		return it;
+	}
+
+	// The scanning functions start at the first character of the token and return a pointer past its last character,
+	// or a NULL pointer if the token is malformed.
+	const char *ScanString(const char *it, const char *end)
+	{
+		++it;
+		for (;;) {
+			it = Infinario::FindJsonStringSpecial(it, end);
+			if (it == end) {
+				return NULL;
+			}
+
+			const uint8 character = static_cast<uint8>(*it);
+			if (character == '"') {
+				return it + 1;
+			} else if (character < 0x20) {
+				return NULL;
+			} else if (character == '\\') {
+				if (++it == end) {
+					return NULL;
+				}
+				if (*it == 'u') {
+					if (end - it < 5) {
+						return NULL;
+					}
+					for (uint32 i = 1; i <= 4; ++i) {
+						if (!IsHexDigit(it[i])) {
+							return NULL;
+						}
+					}
+					it += 5;
+				} else if ((*it != 0) && (std::strchr("\"\\/bfnrt", *it) != NULL)) {
+					++it;
+				} else {
+					return NULL;
+				}
+			}
+		}
+	}
+
+	const char *ScanDigits(const char *it, const char *end)
+	{
+		if ((it == end) || !IsDigit(*it)) {
+			return NULL;
+		}
+		while ((it != end) && IsDigit(*it)) {
+			++it;
+		}
+		return it;
+	}
+
+	const char *ScanNumber(const char *it, const char *end)
+	{
+		if (*it == '-') {
+			++it;
+		}
+		if ((it != end) && (*it == '0')) {
+			++it;
+		} else if ((it = ScanDigits(it, end)) == NULL) {
+			return NULL;
+		}
+
+		if ((it != end) && (*it == '.')) {
+			if ((it = ScanDigits(it + 1, end)) == NULL) {
+				return NULL;
+			}
+		}
+		if ((it != end) && ((*it == 'e') || (*it == 'E'))) {
+			++it;
+			if ((it != end) && ((*it == '+') || (*it == '-'))) {
+				++it;
+			}
+			it = ScanDigits(it, end);
+		}
+		return it;
+	}
+
+	const char *ScanLiteral(const char *it, const char *end, const char *literal)
+	{
+		const size_t length = std::strlen(literal);
+		if ((static_cast<size_t>(end - it) < length) || (std::memcmp(it, literal, length) != 0)) {
+			return NULL;
+		}
+		return it + length;
+	}
+
+	// Scans an object member's key and the colon following it.
+	const char *ScanKey(const char *it, const char *end)
+	{
+		it = SkipWhitespace(it, end);
+		if ((it == end) || (*it != '"') || ((it = ScanString(it, end)) == NULL)) {
+			return NULL;
+		}
+		it = SkipWhitespace(it, end);
+		if ((it == end) || (*it != ':')) {
+			return NULL;
+		}
+		return it + 1;
+	}
+}
+
+const char *Infinario::FindJsonStringSpecial(const char *it, const char *end)
+{
+	while (end - it >= 8) {
+		uint64 word;
+		std::memcpy(&word, it, 8);
+		if (HasStringSpecialByte(word) != 0) {
+			break;
+		}
+		it += 8;
+	}
+
+	// The special byte is somewhere in the last word read, or the range ends with fewer than 8 bytes.
+	while ((it != end) && (*it != '"') && (*it != '\\') && (static_cast<uint8>(*it) >= 0x20)) {
+		++it;
+	}
+	return it;
+}
+
+bool Infinario::ValidateJsonObject(const char *json, const uint32 length)
+{
+	const char *it = SkipWhitespace(json, json + length);
+	const char *end = json + length;
+	if ((it == end) || (*it != '{')) {
+		return false;
+	}
+
+	// The open containers are kept on a stack, each iteration scans one value and then closes the containers it ends.
+	char containers[maxDepth];
+	uint32 depth = 0;
+	for (;;) {
+		it = SkipWhitespace(it, end);
+		if (it == end) {
+			return false;
+		}
+
+		const char character = *it;
+		if ((character == '{') || (character == '[')) {
+			if (depth == maxDepth) {
+				return false;
+			}
+			containers[depth++] = character;
+
+			it = SkipWhitespace(it + 1, end);
+			if (it == end) {
+				return false;
+			}
+			if (*it == ((character == '{') ? '}' : ']')) {
+				--depth;
+				++it;
+			} else {
+				if ((character == '{') && ((it = ScanKey(it, end)) == NULL)) {
+					return false;
+				}
+				continue;
+			}
+		} else if (character == '"') {
+			it = ScanString(it, end);
+		} else if ((character == '-') || IsDigit(character)) {
+			it = ScanNumber(it, end);
+		} else if (character == 't') {
+			it = ScanLiteral(it, end, "true");
+		} else if (character == 'f') {
+			it = ScanLiteral(it, end, "false");
+		} else if (character == 'n') {
+			it = ScanLiteral(it, end, "null");
+		} else {
+			return false;
+		}
+		if (it == NULL) {
+			return false;
+		}
+
+		// After a value either the next member follows or the enclosing containers end.
+		for (;;) {
+			it = SkipWhitespace(it, end);
+			if (depth == 0) {
+				return it == end;
+			}
+			if (it == end) {
+				return false;
+			}
+
+			const char container = containers[depth - 1];
+			if (*it == ',') {
+				++it;
+				if ((container == '{') && ((it = ScanKey(it, end)) == NULL)) {
+					return false;
+				}
+				break;
+			} else if (*it == ((container == '{') ? '}' : ']')) {
+				--depth;
+				++it;
+			} else {
+				return false;
+			}
+		}
+	}
+}
@@ -0,0 +1,26 @@
+#ifndef INFINARIO_INFINARIO_JSON_H
+#define INFINARIO_INFINARIO_JSON_H
+
+#include "s3eTypes.h"
+
+namespace Infinario
+{
+	/**
+	 * Checks that the string is a single well formed JSON object, optionally surrounded by whitespace. Only the
+	 * structure is validated, bytes above 0x7f inside strings are accepted without checking that they form valid
+	 * UTF-8. Objects and arrays nested deeper than 256 levels are rejected.
+	 *
+	 * String contents, which make up most of the attributes, are skipped 8 bytes at a time by testing whole words for
+	 * quotes, backslashes and control characters (SWAR), so typical attributes are validated in well under a
+	 * microsecond.
+	 */
+	bool ValidateJsonObject(const char *json, const uint32 length);
+
+	/**
+	 * Returns a pointer to the first quote, backslash or control character in the range, or end if there is none.
+	 * Plain runs of string contents are skipped 8 bytes at a time, as ValidateJsonObject does.
+	 */
+	const char *FindJsonStringSpecial(const char *it, const char *end);
+}
+
+#endif // INFINARIO_INFINARIO_JSON_H
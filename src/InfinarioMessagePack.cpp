@@ -0,0 +1,585 @@
+#include "InfinarioMessagePack.h"
+#include "InfinarioJson.h"
+
+#include "s3eTypes.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+namespace
+{
+	const uint32 maxDepth = 256;
+
+	inline bool IsDigit(const char character)
+	{
+		return (character >= '0') && (character <= '9');
+	}
+
+	const char *SkipWhitespace(const char *it, const char *end)
+	{
+		while ((it != end) && ((*it == ' ') || (*it == '\n') || (*it == '\r') || (*it == '\t'))) {
+			++it;
+		}
+		return it;
+	}
+
+	const char *SkipDigits(const char *it, const char *end)
+	{
+		while ((it != end) && IsDigit(*it)) {
+			++it;
+		}
+		return it;
+	}
+
+	// Parses the four hexadecimal digits of a \u escape sequence.
+	bool ParseHexQuad(const char *it, const char *end, uint32 &value)
+	{
+		if (end - it < 4) {
+			return false;
+		}
+
+		value = 0;
+		for (uint32 i = 0; i < 4; ++i) {
+			const char character = it[i];
+			value <<= 4;
+			if (IsDigit(character)) {
+				value |= static_cast<uint32>(character - '0');
+			} else if ((character >= 'a') && (character <= 'f')) {
+				value |= static_cast<uint32>(character - 'a' + 10);
+			} else if ((character >= 'A') && (character <= 'F')) {
+				value |= static_cast<uint32>(character - 'A' + 10);
+			} else {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void AppendUtf8(std::string &value, const uint32 codePoint)
+	{
+		if (codePoint < 0x80) {
+			value.push_back(static_cast<char>(codePoint));
+		} else if (codePoint < 0x800) {
+			value.push_back(static_cast<char>(0xc0 | (codePoint >> 6)));
+			value.push_back(static_cast<char>(0x80 | (codePoint & 0x3f)));
+		} else if (codePoint < 0x10000) {
+			value.push_back(static_cast<char>(0xe0 | (codePoint >> 12)));
+			value.push_back(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3f)));
+			value.push_back(static_cast<char>(0x80 | (codePoint & 0x3f)));
+		} else {
+			value.push_back(static_cast<char>(0xf0 | (codePoint >> 18)));
+			value.push_back(static_cast<char>(0x80 | ((codePoint >> 12) & 0x3f)));
+			value.push_back(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3f)));
+			value.push_back(static_cast<char>(0x80 | (codePoint & 0x3f)));
+		}
+	}
+}
+
+void Infinario::MessagePackWriter::AppendNil(std::string &messagePack)
+{
+	messagePack.push_back('\xc0');
+}
+
+void Infinario::MessagePackWriter::AppendBoolean(std::string &messagePack, const bool value)
+{
+	messagePack.push_back(value ? '\xc3' : '\xc2');
+}
+
+void Infinario::MessagePackWriter::AppendInteger(std::string &messagePack, const int64 value)
+{
+	if (value >= 0) {
+		if (value < 0x80) {
+			messagePack.push_back(static_cast<char>(value));
+		} else if (value <= 0xff) {
+			messagePack.push_back('\xcc');
+			MessagePackWriter::AppendBigEndian(messagePack, static_cast<uint64>(value), 1);
+		} else if (value <= 0xffff) {
+			messagePack.push_back('\xcd');
+			MessagePackWriter::AppendBigEndian(messagePack, static_cast<uint64>(value), 2);
+		} else if (value <= 0xffffffffll) {
+			messagePack.push_back('\xce');
+			MessagePackWriter::AppendBigEndian(messagePack, static_cast<uint64>(value), 4);
+		} else {
+			messagePack.push_back('\xcf');
+			MessagePackWriter::AppendBigEndian(messagePack, static_cast<uint64>(value), 8);
+		}
+	} else {
+		if (value >= -32) {
+			messagePack.push_back(static_cast<char>(value));
+		} else if (value >= -0x80) {
+			messagePack.push_back('\xd0');
+			MessagePackWriter::AppendBigEndian(messagePack, static_cast<uint64>(value), 1);
+		} else if (value >= -0x8000) {
+			messagePack.push_back('\xd1');
+			MessagePackWriter::AppendBigEndian(messagePack, static_cast<uint64>(value), 2);
+		} else if (value >= -0x80000000ll) {
+			messagePack.push_back('\xd2');
+			MessagePackWriter::AppendBigEndian(messagePack, static_cast<uint64>(value), 4);
+		} else {
+			messagePack.push_back('\xd3');
+			MessagePackWriter::AppendBigEndian(messagePack, static_cast<uint64>(value), 8);
+		}
+	}
+}
+
+void Infinario::MessagePackWriter::AppendDouble(std::string &messagePack, const double value)
+{
+	// Values a float holds exactly (such as 2.5 or -44.25) are written in half the space.
+	const float singleValue = static_cast<float>(value);
+	if (static_cast<double>(singleValue) == value) {
+		uint32 bits;
+		std::memcpy(&bits, &singleValue, 4);
+		messagePack.push_back('\xca');
+		MessagePackWriter::AppendBigEndian(messagePack, bits, 4);
+	} else {
+		uint64 bits;
+		std::memcpy(&bits, &value, 8);
+		messagePack.push_back('\xcb');
+		MessagePackWriter::AppendBigEndian(messagePack, bits, 8);
+	}
+}
+
+void Infinario::MessagePackWriter::AppendString(std::string &messagePack, const char *value, const uint32 length)
+{
+	if (length < 32) {
+		messagePack.push_back(static_cast<char>(0xa0 | length));
+	} else if (length <= 0xff) {
+		messagePack.push_back('\xd9');
+		MessagePackWriter::AppendBigEndian(messagePack, length, 1);
+	} else if (length <= 0xffff) {
+		messagePack.push_back('\xda');
+		MessagePackWriter::AppendBigEndian(messagePack, length, 2);
+	} else {
+		messagePack.push_back('\xdb');
+		MessagePackWriter::AppendBigEndian(messagePack, length, 4);
+	}
+	messagePack.append(value, length);
+}
+
+void Infinario::MessagePackWriter::AppendString(std::string &messagePack, const char *value)
+{
+	MessagePackWriter::AppendString(messagePack, value, static_cast<uint32>(std::strlen(value)));
+}
+
+void Infinario::MessagePackWriter::AppendArrayHeader(std::string &messagePack, const uint32 count)
+{
+	if (count < 16) {
+		messagePack.push_back(static_cast<char>(0x90 | count));
+	} else if (count <= 0xffff) {
+		messagePack.push_back('\xdc');
+		MessagePackWriter::AppendBigEndian(messagePack, count, 2);
+	} else {
+		messagePack.push_back('\xdd');
+		MessagePackWriter::AppendBigEndian(messagePack, count, 4);
+	}
+}
+
+void Infinario::MessagePackWriter::AppendMapHeader(std::string &messagePack, const uint32 count)
+{
+	if (count < 16) {
+		messagePack.push_back(static_cast<char>(0x80 | count));
+	} else if (count <= 0xffff) {
+		messagePack.push_back('\xde');
+		MessagePackWriter::AppendBigEndian(messagePack, count, 2);
+	} else {
+		messagePack.push_back('\xdf');
+		MessagePackWriter::AppendBigEndian(messagePack, count, 4);
+	}
+}
+
+void Infinario::MessagePackWriter::AppendTimestamp(std::string &messagePack, const int64 milliseconds)
+{
+	int64 seconds = milliseconds / 1000;
+	int64 remainder = milliseconds % 1000;
+	if (remainder < 0) {
+		remainder += 1000;
+		--seconds;
+	}
+	const uint64 nanoseconds = static_cast<uint64>(remainder) * 1000000;
+
+	// The 32 bit form holds whole seconds, the 64 bit form seconds up to 2^34 and the 96 bit form everything else.
+	if ((seconds >= 0) && ((seconds >> 34) == 0)) {
+		if ((nanoseconds == 0) && ((seconds >> 32) == 0)) {
+			messagePack.append("\xd6\xff", 2);
+			MessagePackWriter::AppendBigEndian(messagePack, static_cast<uint64>(seconds), 4);
+		} else {
+			messagePack.append("\xd7\xff", 2);
+			MessagePackWriter::AppendBigEndian(messagePack, (nanoseconds << 34) | static_cast<uint64>(seconds), 8);
+		}
+	} else {
+		messagePack.append("\xc7\x0c\xff", 3);
+		MessagePackWriter::AppendBigEndian(messagePack, nanoseconds, 4);
+		MessagePackWriter::AppendBigEndian(messagePack, static_cast<uint64>(seconds), 8);
+	}
+}
+
+bool Infinario::MessagePackWriter::AppendJson(std::string &messagePack, const char *json, const uint32 length)
+{
+	const size_t originalSize = messagePack.size();
+	const char *end = json + length;
+	const char *it = SkipWhitespace(json, end);
+	if ((it == end) || ((it = MessagePackWriter::AppendJsonValue(messagePack, it, end)) == NULL)
+		|| (SkipWhitespace(it, end) != end))
+	{
+		messagePack.resize(originalSize);
+		return false;
+	}
+	return true;
+}
+
+bool Infinario::MessagePackWriter::AppendJsonMembers(std::string &messagePack, const char *json, const uint32 length,
+	uint32 &memberCount)
+{
+	const size_t originalSize = messagePack.size();
+	const char *end = json + length;
+	const char *it = SkipWhitespace(json, end);
+
+	memberCount = 0;
+	while (it != end) {
+		if (((it = MessagePackWriter::AppendJsonKey(messagePack, it, end)) == NULL)
+			|| ((it = SkipWhitespace(it, end)) == end)
+			|| ((it = MessagePackWriter::AppendJsonValue(messagePack, it, end)) == NULL))
+		{
+			messagePack.resize(originalSize);
+			return false;
+		}
+		++memberCount;
+
+		it = SkipWhitespace(it, end);
+		if (it != end) {
+			if ((*it != ',') || ((it = SkipWhitespace(it + 1, end)) == end)) {
+				messagePack.resize(originalSize);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+void Infinario::MessagePackWriter::AppendBigEndian(std::string &messagePack, const uint64 value,
+	const uint32 byteCount)
+{
+	char bytes[8];
+	for (uint32 i = 0; i < byteCount; ++i) {
+		bytes[i] = static_cast<char>(value >> (8 * (byteCount - 1 - i)));
+	}
+	messagePack.append(bytes, byteCount);
+}
+
+const char *Infinario::MessagePackWriter::AppendJsonValue(std::string &messagePack, const char *it, const char *end)
+{
+	// The open containers are kept on a stack, each iteration converts one value and then closes the containers it
+	// ends. A container's element count is only known once it ends, so a single byte is reserved for its header.
+	class OpenContainer
+	{
+	public:
+		size_t _headerPosition;
+		uint32 _count;
+		bool _isMap;
+	};
+	OpenContainer containers[maxDepth];
+	uint32 depth = 0;
+	for (;;) {
+		it = SkipWhitespace(it, end);
+		if (it == end) {
+			return NULL;
+		}
+
+		const char character = *it;
+		if ((character == '{') || (character == '[')) {
+			if (depth == maxDepth) {
+				return NULL;
+			}
+			OpenContainer &container(containers[depth++]);
+			container._headerPosition = messagePack.size();
+			container._count = 0;
+			container._isMap = (character == '{');
+			messagePack.push_back('\0');
+
+			it = SkipWhitespace(it + 1, end);
+			if (it == end) {
+				return NULL;
+			}
+			if (*it == (container._isMap ? '}' : ']')) {
+				MessagePackWriter::PatchHeader(messagePack, container._headerPosition, container._isMap, 0);
+				--depth;
+				++it;
+			} else {
+				container._count = 1;
+				if (container._isMap && ((it = MessagePackWriter::AppendJsonKey(messagePack, it, end)) == NULL)) {
+					return NULL;
+				}
+				continue;
+			}
+		} else if (character == '"') {
+			it = MessagePackWriter::AppendJsonString(messagePack, it, end);
+		} else if ((character == '-') || IsDigit(character)) {
+			it = MessagePackWriter::AppendJsonNumber(messagePack, it, end);
+		} else if ((end - it >= 4) && (std::memcmp(it, "true", 4) == 0)) {
+			MessagePackWriter::AppendBoolean(messagePack, true);
+			it += 4;
+		} else if ((end - it >= 5) && (std::memcmp(it, "false", 5) == 0)) {
+			MessagePackWriter::AppendBoolean(messagePack, false);
+			it += 5;
+		} else if ((end - it >= 4) && (std::memcmp(it, "null", 4) == 0)) {
+			MessagePackWriter::AppendNil(messagePack);
+			it += 4;
+		} else {
+			return NULL;
+		}
+		if (it == NULL) {
+			return NULL;
+		}
+
+		// After a value either the next element follows or the enclosing containers end.
+		for (;;) {
+			if (depth == 0) {
+				return it;
+			}
+			it = SkipWhitespace(it, end);
+			if (it == end) {
+				return NULL;
+			}
+
+			OpenContainer &container(containers[depth - 1]);
+			if (*it == ',') {
+				++it;
+				++container._count;
+				if (container._isMap && ((it = MessagePackWriter::AppendJsonKey(messagePack, it, end)) == NULL)) {
+					return NULL;
+				}
+				break;
+			} else if (*it == (container._isMap ? '}' : ']')) {
+				MessagePackWriter::PatchHeader(messagePack, container._headerPosition, container._isMap,
+					container._count);
+				--depth;
+				++it;
+			} else {
+				return NULL;
+			}
+		}
+	}
+}
+
+const char *Infinario::MessagePackWriter::AppendJsonString(std::string &messagePack, const char *it,
+	const char *end)
+{
+	// Strings without escape sequences, by far the most common ones, are copied as they are.
+	const char *start = ++it;
+	it = FindJsonStringSpecial(it, end);
+	if ((it == end) || (static_cast<uint8>(*it) < 0x20)) {
+		return NULL;
+	}
+	if (*it == '"') {
+		MessagePackWriter::AppendString(messagePack, start, static_cast<uint32>(it - start));
+		return it + 1;
+	}
+
+	std::string value(start, it);
+	while (it != end) {
+		const char character = *it;
+		if (character == '"') {
+			MessagePackWriter::AppendString(messagePack, value.data(), static_cast<uint32>(value.size()));
+			return it + 1;
+		}
+		if (static_cast<uint8>(character) < 0x20) {
+			return NULL;
+		}
+		if (character != '\\') {
+			const char *runEnd = FindJsonStringSpecial(it, end);
+			value.append(it, runEnd);
+			it = runEnd;
+			continue;
+		}
+
+		if (++it == end) {
+			return NULL;
+		}
+		switch (*it) {
+		case '"':
+		case '\\':
+		case '/':
+			value.push_back(*it);
+			break;
+		case 'b':
+			value.push_back('\b');
+			break;
+		case 'f':
+			value.push_back('\f');
+			break;
+		case 'n':
+			value.push_back('\n');
+			break;
+		case 'r':
+			value.push_back('\r');
+			break;
+		case 't':
+			value.push_back('\t');
+			break;
+		case 'u':
+			{
+				uint32 codePoint;
+				if (!ParseHexQuad(it + 1, end, codePoint)) {
+					return NULL;
+				}
+				it += 4;
+
+				// A surrogate pair encodes a single code point, unpaired surrogates are kept as they are.
+				uint32 lowSurrogate;
+				if ((codePoint >= 0xd800) && (codePoint <= 0xdbff) && (end - it >= 7) && (it[1] == '\\')
+					&& (it[2] == 'u') && ParseHexQuad(it + 3, end, lowSurrogate) && (lowSurrogate >= 0xdc00)
+					&& (lowSurrogate <= 0xdfff))
+				{
+					codePoint = 0x10000 + ((codePoint - 0xd800) << 10) + (lowSurrogate - 0xdc00);
+					it += 6;
+				}
+				AppendUtf8(value, codePoint);
+			}
+			break;
+		default:
+			return NULL;
+		}
+		++it;
+	}
+	return NULL;
+}
+
+const char *Infinario::MessagePackWriter::AppendJsonNumber(std::string &messagePack, const char *it,
+	const char *end)
+{
+	const char *start = it;
+	const bool isNegative = (*it == '-');
+	if (isNegative) {
+		++it;
+	}
+	if ((it == end) || !IsDigit(*it)) {
+		return NULL;
+	}
+	it = (*it == '0') ? it + 1 : SkipDigits(it, end);
+	const char *integerEnd = it;
+
+	const char *fractionEnd = it;
+	if ((it != end) && (*it == '.')) {
+		++it;
+		if ((it == end) || !IsDigit(*it)) {
+			return NULL;
+		}
+		it = SkipDigits(it, end);
+		fractionEnd = it;
+	}
+	int32 exponent = 0;
+	bool isExponentLarge = false;
+	if ((it != end) && ((*it == 'e') || (*it == 'E'))) {
+		++it;
+		const bool isExponentNegative = (it != end) && (*it == '-');
+		if ((it != end) && ((*it == '+') || (*it == '-'))) {
+			++it;
+		}
+		if ((it == end) || !IsDigit(*it)) {
+			return NULL;
+		}
+		for (; (it != end) && IsDigit(*it); ++it) {
+			if (exponent < 10000) {
+				exponent = exponent * 10 + (*it - '0');
+			} else {
+				isExponentLarge = true;
+			}
+		}
+		if (isExponentNegative) {
+			exponent = -exponent;
+		}
+	}
+
+	// Integers are converted digit by digit, unless they overflow 64 bits.
+	if (it == integerEnd) {
+		uint64 magnitude = 0;
+		bool isOverflow = false;
+		for (const char *digit = isNegative ? start + 1 : start; digit != integerEnd; ++digit) {
+			const uint64 digitValue = static_cast<uint64>(*digit - '0');
+			if (magnitude > (0xffffffffffffffffull - digitValue) / 10) {
+				isOverflow = true;
+				break;
+			}
+			magnitude = magnitude * 10 + digitValue;
+		}
+
+		if (!isOverflow && !isNegative && (magnitude > 0x7fffffffffffffffull)) {
+			messagePack.push_back('\xcf');
+			MessagePackWriter::AppendBigEndian(messagePack, magnitude, 8);
+			return it;
+		}
+		if (!isOverflow && (!isNegative || (magnitude <= 0x8000000000000000ull))) {
+			MessagePackWriter::AppendInteger(messagePack,
+				isNegative ? static_cast<int64>(0 - magnitude) : static_cast<int64>(magnitude));
+			return it;
+		}
+	}
+
+	// Up to 15 significant digits are held exactly by a double, and so are the powers of ten up to 10^22, so a single
+	// multiplication or division of the two is correctly rounded. Other numbers are left to strtod.
+	if (!isExponentLarge && (fractionEnd - start <= 17)) {
+		static const double powersOfTen[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13,
+			1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+		uint64 mantissa = 0;
+		uint32 digitCount = 0;
+		for (const char *digit = isNegative ? start + 1 : start; digit != fractionEnd; ++digit) {
+			if (*digit == '.') {
+				exponent -= static_cast<int32>(fractionEnd - digit - 1);
+			} else if ((mantissa > 0) || (*digit != '0')) {
+				mantissa = mantissa * 10 + static_cast<uint64>(*digit - '0');
+				++digitCount;
+			}
+		}
+		if ((digitCount <= 15) && (exponent >= -22) && (exponent <= 22)) {
+			double value = static_cast<double>(mantissa);
+			value = (exponent < 0) ? value / powersOfTen[-exponent] : value * powersOfTen[exponent];
+			MessagePackWriter::AppendDouble(messagePack, isNegative ? -value : value);
+			return it;
+		}
+	}
+
+	// strtod needs a terminated copy, numbers rarely exceed the buffer.
+	const size_t length = static_cast<size_t>(it - start);
+	char buffer[64];
+	if (length < sizeof(buffer)) {
+		std::memcpy(buffer, start, length);
+		buffer[length] = 0;
+		MessagePackWriter::AppendDouble(messagePack, std::strtod(buffer, NULL));
+	} else {
+		MessagePackWriter::AppendDouble(messagePack, std::strtod(std::string(start, length).c_str(), NULL));
+	}
+	return it;
+}
+
+const char *Infinario::MessagePackWriter::AppendJsonKey(std::string &messagePack, const char *it, const char *end)
+{
+	it = SkipWhitespace(it, end);
+	if ((it == end) || (*it != '"') || ((it = MessagePackWriter::AppendJsonString(messagePack, it, end)) == NULL)) {
+		return NULL;
+	}
+	it = SkipWhitespace(it, end);
+	if ((it == end) || (*it != ':')) {
+		return NULL;
+	}
+	return it + 1;
+}
+
+void Infinario::MessagePackWriter::PatchHeader(std::string &messagePack, const size_t position, const bool isMap,
+	const uint32 count)
+{
+	if (count < 16) {
+		messagePack[position] = static_cast<char>((isMap ? 0x80 : 0x90) | count);
+		return;
+	}
+
+	// Larger containers are rare, the following bytes are moved to make room for the longer header.
+	std::string header;
+	if (isMap) {
+		MessagePackWriter::AppendMapHeader(header, count);
+	} else {
+		MessagePackWriter::AppendArrayHeader(header, count);
+	}
+	messagePack.replace(position, 1, header);
+}
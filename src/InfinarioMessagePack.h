@@ -0,0 +1,61 @@
+#ifndef INFINARIO_INFINARIO_MESSAGE_PACK_H
+#define INFINARIO_INFINARIO_MESSAGE_PACK_H
+
+#include "s3eTypes.h"
+
+#include <string>
+
+namespace Infinario
+{
+	/**
+	 * Internal class appending MessagePack encoded values to a string. Every value is written in its shortest form.
+	 */
+	class MessagePackWriter
+	{
+	public:
+		static void AppendNil(std::string &messagePack);
+		static void AppendBoolean(std::string &messagePack, const bool value);
+		static void AppendInteger(std::string &messagePack, const int64 value);
+		static void AppendDouble(std::string &messagePack, const double value);
+		static void AppendString(std::string &messagePack, const char *value, const uint32 length);
+		static void AppendString(std::string &messagePack, const char *value);
+		static void AppendArrayHeader(std::string &messagePack, const uint32 count);
+		static void AppendMapHeader(std::string &messagePack, const uint32 count);
+
+		/**
+		 * Appends the timestamp extension type (-1) holding the given number of milliseconds since 01-Jan-1970.
+		 */
+		static void AppendTimestamp(std::string &messagePack, const int64 milliseconds);
+
+		/**
+		 * Appends the JSON value, which may be surrounded by whitespace, converted to MessagePack in a single pass.
+		 * Integers which fit into 64 bits are written as integers, other numbers as doubles, and escape sequences are
+		 * decoded into UTF-8. Returns false and leaves the string as it was if the JSON is malformed or nested deeper
+		 * than 256 levels.
+		 */
+		static bool AppendJson(std::string &messagePack, const char *json, const uint32 length);
+
+		/**
+		 * Works like AppendJson, but converts a comma separated list of JSON object members without the enclosing
+		 * braces. The map header is not written, the number of members is stored into memberCount instead.
+		 */
+		static bool AppendJsonMembers(std::string &messagePack, const char *json, const uint32 length,
+			uint32 &memberCount);
+	private:
+		static void AppendBigEndian(std::string &messagePack, const uint64 value, const uint32 byteCount);
+
+		// The conversion functions start at the first character of the token and return a pointer past its last
+		// character, or a NULL pointer if the token is malformed.
+		static const char *AppendJsonValue(std::string &messagePack, const char *it, const char *end);
+		static const char *AppendJsonString(std::string &messagePack, const char *it, const char *end);
+		static const char *AppendJsonNumber(std::string &messagePack, const char *it, const char *end);
+
+		// Converts an object member's key and skips the colon following it, the key may be preceded by whitespace.
+		static const char *AppendJsonKey(std::string &messagePack, const char *it, const char *end);
+
+		// Writes a container's final header over the single byte reserved for it at the given position.
+		static void PatchHeader(std::string &messagePack, const size_t position, const bool isMap, const uint32 count);
+	};
+}
+
+#endif // INFINARIO_INFINARIO_MESSAGE_PACK_H
@@ -0,0 +1,246 @@
+#include "InfinarioTracing.h"
+
+#include "s3eFile.h"
+#include "s3eMemory.h"
+#include "s3eThread.h"
+#include "s3eTimer.h"
+
+#include <atomic>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+Infinario::Tracer &Infinario::Tracer::GetInstance()
+{
+	// Contains no heap allocated members, so it is safe to construct before the Marmalade initialization functions.
+	static Tracer tracer;
+	return tracer;
+}
+
+uint64 Infinario::Tracer::GetTimestamp()
+{
+	return s3eTimerGetUSTNanoseconds();
+}
+
+Infinario::Tracer::Tracer()
+: _isEnabled(false)
+, _lock(NULL)
+, _ringCount(0)
+, _droppedCount(0)
+{
+	for (uint32 i = 0; i < Tracer::_maxThreadCount; ++i) {
+		this->_rings[i]._isClaimed = false;
+		this->_rings[i]._thread = NULL;
+		this->_rings[i]._writeCount = 0;
+		this->_rings[i]._events = NULL;
+	}
+}
+
+void Infinario::Tracer::SetEnabled(const bool isEnabled)
+{
+	if (isEnabled == this->_isEnabled) {
+		return;
+	}
+
+	if (isEnabled) {
+		this->_lock = s3eThreadLockCreate();
+		for (uint32 i = 0; i < Tracer::_maxThreadCount; ++i) {
+			this->_rings[i]._events = reinterpret_cast<TraceEvent *>(s3eMalloc(Tracer::_ringSize * sizeof(TraceEvent)));
+		}
+		this->_isEnabled = true;
+	} else {
+		this->_isEnabled = false;
+		for (uint32 i = 0; i < Tracer::_maxThreadCount; ++i) {
+			s3eFree(reinterpret_cast<void *>(this->_rings[i]._events));
+			this->_rings[i]._events = NULL;
+			this->_rings[i]._isClaimed = false;
+			this->_rings[i]._thread = NULL;
+			this->_rings[i]._writeCount = 0;
+		}
+		this->_ringCount = 0;
+		this->_droppedCount = 0;
+		s3eThreadLockDestroy(this->_lock);
+		this->_lock = NULL;
+	}
+}
+
+bool Infinario::Tracer::IsEnabled() const
+{
+	return this->_isEnabled;
+}
+
+void Infinario::Tracer::Record(const char *name, const char phase, const uint64 timestamp, const uint64 duration,
+	const uint32 id)
+{
+	if (!this->_isEnabled) {
+		return;
+	}
+
+	Ring *ring = this->GetRing();
+	if (ring == NULL) {
+		return;
+	}
+
+	// Only the owning thread writes to the ring, the write count is published after the event is complete.
+	TraceEvent &event = ring->_events[ring->_writeCount % Tracer::_ringSize];
+	event._name = name;
+	event._timestamp = timestamp;
+	event._duration = duration;
+	event._id = id;
+	event._phase = phase;
+	std::atomic_thread_fence(std::memory_order_release);
+	ring->_writeCount = ring->_writeCount + 1;
+}
+
+void Infinario::Tracer::ReleaseThread()
+{
+	if (!this->_isEnabled) {
+		return;
+	}
+
+	s3eThread *currentThread = s3eThreadGetCurrent();
+
+	s3eThreadLockAcquire(this->_lock);
+
+	for (uint32 i = 0; i < this->_ringCount; ++i) {
+		if (this->_rings[i]._isClaimed && (this->_rings[i]._thread == currentThread)) {
+			this->_rings[i]._isClaimed = false;
+			break;
+		}
+	}
+
+	s3eThreadLockRelease(this->_lock);
+}
+
+std::string Infinario::Tracer::ExportChromeTrace() const
+{
+	std::stringstream traceStream;
+	traceStream << std::fixed << std::setprecision(3) << "{ \"traceEvents\": [";
+
+	bool isFirst = true;
+	uint32 droppedCount = 0;
+	uint32 overwrittenCount = 0;
+	if (this->_isEnabled) {
+		// Rings are not claimed or released during the export, so only those claimed by other threads are written to.
+		s3eThreadLockAcquire(this->_lock);
+
+		s3eThread *currentThread = s3eThreadGetCurrent();
+		std::vector<TraceEvent> events;
+		for (uint32 i = 0; i < this->_ringCount; ++i) {
+			const Ring &ring = this->_rings[i];
+			const bool isWritten = ring._isClaimed && (ring._thread != currentThread);
+			const uint32 writeCount = ring._writeCount;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			const uint32 eventCount = (writeCount < Tracer::_ringSize) ? writeCount : Tracer::_ringSize;
+
+			// Copy the events first, the owner may overwrite the oldest ones meanwhile. Event j's slot is rewritten
+			// by write j + _ringSize, which is in progress or done once the write count reached it, so such events
+			// are skipped instead of being exported torn.
+			const uint32 firstIndex = writeCount - eventCount;
+			events.clear();
+			for (uint32 j = firstIndex; j != writeCount; ++j) {
+				events.push_back(ring._events[j % Tracer::_ringSize]);
+			}
+			std::atomic_thread_fence(std::memory_order_acquire);
+			const uint32 startedWriteCount = ring._writeCount + (isWritten ? 1 : 0);
+			uint32 tornCount = 0;
+			if ((startedWriteCount - firstIndex) > Tracer::_ringSize) {
+				tornCount = startedWriteCount - firstIndex - Tracer::_ringSize;
+				if (tornCount > eventCount) {
+					tornCount = eventCount;
+				}
+			}
+			overwrittenCount += firstIndex + tornCount;
+
+			for (std::vector<TraceEvent>::const_iterator it = events.begin() + tornCount, end = events.end();
+				it != end; ++it)
+			{
+				const TraceEvent &event = *it;
+
+				// Chrome trace timestamps are in microseconds.
+				traceStream << (isFirst ? "\n" : ",\n") <<
+					"{ \"name\": \"" << event._name << "\", \"cat\": \"infinario\", \"ph\": \"" << event._phase
+					<< "\", \"ts\": " << (static_cast<double>(event._timestamp) / 1000.0) << ", \"pid\": 1, \"tid\": "
+					<< (i + 1);
+				if (event._phase == 'X') {
+					traceStream << ", \"dur\": " << (static_cast<double>(event._duration) / 1000.0);
+				} else {
+					traceStream << ", \"id\": " << event._id;
+				}
+				traceStream << " }";
+				isFirst = false;
+			}
+		}
+		droppedCount = this->_droppedCount;
+
+		s3eThreadLockRelease(this->_lock);
+	}
+
+	traceStream << "\n], \"displayTimeUnit\": \"ms\", \"otherData\": { \"dropped_events\": " << droppedCount
+		<< ", \"overwritten_events\": " << overwrittenCount << " } }\n";
+	return traceStream.str();
+}
+
+bool Infinario::Tracer::ExportChromeTrace(const char *filename) const
+{
+	s3eFile* outputFile = s3eFileOpen(filename, "w");
+	if (outputFile == NULL) {
+		return false;
+	}
+
+	std::string outputString(this->ExportChromeTrace());
+	const bool isWritten = s3eFileWrite(reinterpret_cast<const void *>(outputString.c_str()), outputString.size(), 1,
+		outputFile) == 1;
+
+	s3eFileClose(outputFile);
+	return isWritten;
+}
+
+Infinario::Tracer::Ring *Infinario::Tracer::GetRing()
+{
+	s3eThread *currentThread = s3eThreadGetCurrent();
+
+	for (uint32 i = 0, ringCount = this->_ringCount; i < ringCount; ++i) {
+		if (this->_rings[i]._isClaimed && (this->_rings[i]._thread == currentThread)) {
+			return &(this->_rings[i]);
+		}
+	}
+
+	// First event recorded by this thread, claim a ring released by another thread or an unused one.
+	Ring *result = NULL;
+
+	s3eThreadLockAcquire(this->_lock);
+
+	for (uint32 i = 0; (result == NULL) && (i < this->_ringCount); ++i) {
+		if (!this->_rings[i]._isClaimed) {
+			result = &(this->_rings[i]);
+		}
+	}
+	if ((result == NULL) && (this->_ringCount < Tracer::_maxThreadCount)) {
+		result = &(this->_rings[this->_ringCount]);
+		this->_ringCount = this->_ringCount + 1;
+	}
+	if (result != NULL) {
+		result->_thread = currentThread;
+		result->_isClaimed = true;
+	} else {
+		++this->_droppedCount;
+	}
+
+	s3eThreadLockRelease(this->_lock);
+
+	return result;
+}
+
+Infinario::TraceScope::TraceScope(const char *name)
+: _name(name)
+, _start(Tracer::GetInstance().IsEnabled() ? Tracer::GetTimestamp() : 0)
+{}
+
+Infinario::TraceScope::~TraceScope()
+{
+	if (this->_start != 0) {
+		Tracer::GetInstance().Record(this->_name, 'X', this->_start, Tracer::GetTimestamp() - this->_start);
+	}
+}
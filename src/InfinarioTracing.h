@@ -0,0 +1,131 @@
+#ifndef INFINARIO_INFINARIO_TRACING_H
+#define INFINARIO_INFINARIO_TRACING_H
+
+#include "s3eThread.h"
+#include "s3eTypes.h"
+
+#include <string>
+
+/**
+ * Hot path instrumentation is only compiled in if INFINARIO_TRACING is defined, otherwise the macros below expand to
+ * nothing and tracing has no cost at all.
+ */
+#ifdef INFINARIO_TRACING
+#define INFINARIO_TRACE_CONCATENATE_(a, b) a##b
+#define INFINARIO_TRACE_CONCATENATE(a, b) INFINARIO_TRACE_CONCATENATE_(a, b)
+#define INFINARIO_TRACE_SCOPE(name) \
+	::Infinario::TraceScope INFINARIO_TRACE_CONCATENATE(infinarioTraceScope, __LINE__)(name)
+#define INFINARIO_TRACE_ASYNC_BEGIN(name, id) \
+	::Infinario::Tracer::GetInstance().Record(name, 'b', ::Infinario::Tracer::GetTimestamp(), 0, id)
+#define INFINARIO_TRACE_ASYNC_END(name, id) \
+	::Infinario::Tracer::GetInstance().Record(name, 'e', ::Infinario::Tracer::GetTimestamp(), 0, id)
+#define INFINARIO_TRACE_RELEASE_THREAD() ::Infinario::Tracer::GetInstance().ReleaseThread()
+#else
+#define INFINARIO_TRACE_SCOPE(name)
+#define INFINARIO_TRACE_ASYNC_BEGIN(name, id)
+#define INFINARIO_TRACE_ASYNC_END(name, id)
+#define INFINARIO_TRACE_RELEASE_THREAD()
+#endif
+
+namespace Infinario
+{
+	/**
+	 * Internal PoD class storing a single trace event.
+	 */
+	class TraceEvent
+	{
+	public:
+		const char *_name; // Must point to a string literal (or otherwise outlive the tracer's buffers).
+		uint64 _timestamp; // Nanoseconds, see Tracer::GetTimestamp.
+		uint64 _duration; // Nanoseconds, only used by complete events.
+		uint32 _id; // Only used by asynchronous events.
+		char _phase; // Chrome trace event phase: 'X' (complete), 'b' (async begin) or 'e' (async end).
+	};
+
+	/**
+	 * Records trace events into fixed-size ring buffers, one per thread, and exports them in the Chrome trace event
+	 * format, which can be loaded in chrome://tracing or Perfetto. When a ring buffer is full the oldest events are
+	 * overwritten.
+	 *
+	 * Each thread writes only to its own ring buffer, so recording an event does not take any lock. A thread claims a
+	 * ring buffer with its first event and keeps it until it calls ReleaseThread, events of threads which find no free
+	 * ring buffer are dropped. The tracer is disabled by default, the buffers are only allocated while it is enabled.
+	 */
+	class Tracer
+	{
+	public:
+		static Tracer &GetInstance();
+
+		/**
+		 * Returns the current time in nanoseconds based on s3eTimerGetUSTNanoseconds. Use it to record events of the
+		 * application itself (e.g. frames), so they can be overlaid with the SDK's events.
+		 */
+		static uint64 GetTimestamp();
+
+		/**
+		 * Enables or disables recording. Disabling the tracer discards all recorded events, it must not be disabled
+		 * while other threads may be recording.
+		 */
+		void SetEnabled(const bool isEnabled);
+		bool IsEnabled() const;
+
+		void Record(const char *name, const char phase, const uint64 timestamp, const uint64 duration,
+			const uint32 id = 0);
+
+		/**
+		 * Hands the calling thread's ring buffer over to threads started later, its events are kept until they are
+		 * overwritten. Threads which recorded events should call it before they exit, the SDK's own threads do.
+		 */
+		void ReleaseThread();
+
+		/**
+		 * Returns the recorded events as a Chrome trace JSON document. The thread ids are the indices of the ring
+		 * buffers, so threads which reused a ring buffer share a thread id. Events overwritten before or during the
+		 * export and events dropped because all ring buffers were claimed are counted in its otherData.
+		 */
+		std::string ExportChromeTrace() const;
+
+		/**
+		 * Writes the recorded events as a Chrome trace JSON document to a file. Returns false if it could not be
+		 * written.
+		 */
+		bool ExportChromeTrace(const char *filename) const;
+	private:
+		static const uint32 _maxThreadCount = 8;
+		static const uint32 _ringSize = 2048;
+
+		class Ring
+		{
+		public:
+			volatile bool _isClaimed;
+			s3eThread *volatile _thread; // Only valid while the ring is claimed, the main thread's may be NULL.
+			volatile uint32 _writeCount;
+			TraceEvent *_events;
+		};
+
+		Tracer();
+
+		Ring *GetRing();
+
+		volatile bool _isEnabled;
+		s3eThreadLock *_lock;
+		volatile uint32 _ringCount; // The number of rings ever claimed, only those are searched and exported.
+		uint32 _droppedCount;
+		Ring _rings[_maxThreadCount];
+	};
+
+	/**
+	 * Records a complete event spanning the lifetime of the instance.
+	 */
+	class TraceScope
+	{
+	public:
+		TraceScope(const char *name);
+		~TraceScope();
+	private:
+		const char *_name;
+		uint64 _start;
+	};
+}
+
+#endif // INFINARIO_INFINARIO_TRACING_H
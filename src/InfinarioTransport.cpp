@@ -0,0 +1,79 @@
+#include "InfinarioTransport.h"
+
+#include "IwHTTP.h"
+
+#include <string>
+
+Infinario::Transport::~Transport()
+{}
+
+Infinario::IwHttpTransport::IwHttpTransport()
+: _httpClient(new CIwHTTP())
+{}
+
+Infinario::IwHttpTransport::~IwHttpTransport()
+{
+	delete this->_httpClient;
+}
+
+s3eResult Infinario::IwHttpTransport::Post(const char *uri, const char *body, int32 bodyLength, s3eCallback callback,
+	void *userData)
+{
+	return this->_httpClient->Post(uri, body, bodyLength, callback, userData);
+}
+
+int32 Infinario::IwHttpTransport::ReadDataAsync(char *buffer, uint32 bufferLength, uint32 timeout,
+	s3eCallback callback, void *userData)
+{
+	return this->_httpClient->ReadDataAsync(buffer, bufferLength, timeout, callback, userData);
+}
+
+uint32 Infinario::IwHttpTransport::ContentExpected()
+{
+	return this->_httpClient->ContentExpected();
+}
+
+uint32 Infinario::IwHttpTransport::ContentReceived()
+{
+	return this->_httpClient->ContentReceived();
+}
+
+bool Infinario::IwHttpTransport::ContentFinished()
+{
+	return this->_httpClient->ContentFinished();
+}
+
+s3eResult Infinario::IwHttpTransport::GetStatus()
+{
+	return this->_httpClient->GetStatus();
+}
+
+uint32 Infinario::IwHttpTransport::GetResponseCode()
+{
+	return this->_httpClient->GetResponseCode();
+}
+
+void Infinario::IwHttpTransport::SetProxy(const char *proxy)
+{
+	this->_httpClient->SetProxy(proxy);
+}
+
+void Infinario::IwHttpTransport::SetRequestHeader(const char *headerName, const std::string &value)
+{
+	this->_httpClient->SetRequestHeader(headerName, value);
+}
+
+bool Infinario::IwHttpTransport::GetHeader(const char *headerName, std::string &value)
+{
+	return this->_httpClient->GetHeader(headerName, value);
+}
+
+void Infinario::IwHttpTransport::Cancel()
+{
+	this->_httpClient->Cancel();
+}
+
+const CIwHTTP *Infinario::IwHttpTransport::GetHttpClient() const
+{
+	return this->_httpClient;
+}
@@ -0,0 +1,95 @@
+#ifndef INFINARIO_INFINARIO_TRANSPORT_H
+#define INFINARIO_INFINARIO_TRANSPORT_H
+
+#include "IwHTTP.h"
+
+#include "s3eTypes.h"
+
+#include <string>
+
+namespace Infinario
+{
+	/**
+	 * Interface of the HTTP client used to send requests to the Infinario server. It mirrors the subset of the CIwHTTP
+	 * interface used by the SDK, so that other implementations (for example an in-process stand-in server used for
+	 * testing) can replace it.
+	 *
+	 * All callbacks must be called asynchronously, never from within the method that was given the callback.
+	 */
+	class Transport
+	{
+	public:
+		virtual ~Transport();
+
+		/**
+		 * Sends a POST request. The callback is called once the response header was recieved or an error occured.
+		 */
+		virtual s3eResult Post(const char *uri, const char *body, int32 bodyLength, s3eCallback callback,
+			void *userData) = 0;
+
+		/**
+		 * Reads up to bufferLength bytes of the response body into the buffer. The callback is called once the data
+		 * is available or an error occured.
+		 */
+		virtual int32 ReadDataAsync(char *buffer, uint32 bufferLength, uint32 timeout, s3eCallback callback,
+			void *userData) = 0;
+
+		virtual uint32 ContentExpected() = 0;
+		virtual uint32 ContentReceived() = 0;
+		virtual bool ContentFinished() = 0;
+		virtual s3eResult GetStatus() = 0;
+
+		/**
+		 * Returns the HTTP status code of the response whose header was recieved last.
+		 */
+		virtual uint32 GetResponseCode() = 0;
+
+		virtual void SetProxy(const char *proxy) = 0;
+		virtual void SetRequestHeader(const char *headerName, const std::string &value) = 0;
+		virtual bool GetHeader(const char *headerName, std::string &value) = 0;
+
+		/**
+		 * Cancels the request being processed and closes the connection.
+		 */
+		virtual void Cancel() = 0;
+
+		/**
+		 * Returns the underlying CIwHTTP instance passed to response callbacks, or a NULL pointer if the transport is
+		 * not based on CIwHTTP.
+		 */
+		virtual const CIwHTTP *GetHttpClient() const = 0;
+	};
+
+	/**
+	 * The default transport, which sends requests using Marmalade's CIwHTTP.
+	 */
+	class IwHttpTransport : public Transport
+	{
+	public:
+		IwHttpTransport();
+		virtual ~IwHttpTransport();
+
+		virtual s3eResult Post(const char *uri, const char *body, int32 bodyLength, s3eCallback callback,
+			void *userData);
+		virtual int32 ReadDataAsync(char *buffer, uint32 bufferLength, uint32 timeout, s3eCallback callback,
+			void *userData);
+
+		virtual uint32 ContentExpected();
+		virtual uint32 ContentReceived();
+		virtual bool ContentFinished();
+		virtual s3eResult GetStatus();
+		virtual uint32 GetResponseCode();
+
+		virtual void SetProxy(const char *proxy);
+		virtual void SetRequestHeader(const char *headerName, const std::string &value);
+		virtual bool GetHeader(const char *headerName, std::string &value);
+
+		virtual void Cancel();
+
+		virtual const CIwHTTP *GetHttpClient() const;
+	private:
+		CIwHTTP *_httpClient;
+	};
+}
+
+#endif // INFINARIO_INFINARIO_TRANSPORT_H